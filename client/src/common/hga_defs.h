@@ -6,8 +6,196 @@
 
 
 
+#include <linux/jhash.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/types.h>
+#include <linux/vmalloc.h>
+
+
+
 #define PROCNAME_MAXLEN 16
 
+/*
+ * Pages are split across server instances in ranges of
+ * 1 << HGA_SHARD_RANGE_SHIFT pages. Must match the server's
+ * shard_of() (SHARD_RANGE_SHIFT in server/shard/shard.h).
+ */
+#define HGA_SHARD_RANGE_SHIFT 6
+
+static inline int hga_shard_of(pid_t token, unsigned long vaddr, int nr_shards) {
+
+	u32 range = (u32)(vaddr >> (PAGE_SHIFT + HGA_SHARD_RANGE_SHIFT));
+
+	return jhash_2words((u32)token, range, 0) % nr_shards;
+
+}
+
+
+/*
+ * Client holding the current copy of a page when forwarding
+ * page data between peers. Must match struct comm_peer in the
+ * server's comm.h.
+ */
+struct hga_peer {
+	__be32 ip;
+	__be16 port;
+	pid_t pid;
+	pgd_t *pgd;
+} __attribute__((packed));
+
+/*
+ * Hosts the server sends to read pages from this node, sent
+ * with PEER_HOSTS before the FETCH_PEER that sends them here.
+ * peercom serves no other host. Must match struct
+ * comm_peer_hosts in the server's comm.h.
+ */
+#define HGA_PEER_HOSTS_MAX 16
+struct hga_peer_hosts {
+	__u32 count;
+	__be32 ip[HGA_PEER_HOSTS_MAX];
+} __attribute__((packed));
+
+/*
+ * Read lease sent ahead of the page in GRANT_LEASE. The copy
+ * may be read for msecs from its arrival. version is the
+ * version of the copy (see struct hga_version), 0 if unknown.
+ * Must match struct comm_lease in the server's comm.h.
+ */
+struct hga_lease {
+	__u32 msecs;
+	__u64 version;
+} __attribute__((packed));
+
+/*
+ * Version of the contents of a page, bumped by every commit
+ * that changes it. Once a lease runs out the page is asked for
+ * with REVALIDATE and this header, with the version of the copy
+ * we still have. NOT_MODIFIED carries it back instead of the
+ * page if that copy is current, with a new lease of msecs if
+ * not 0; it also ends a LOCK_READ for a write that left the
+ * page as it was. Must match struct comm_version in the
+ * server's comm.h.
+ */
+struct hga_version {
+	__u64 version;
+	__u32 msecs;
+} __attribute__((packed));
+
+/*
+ * Run of changed bytes in a COMMIT_DIFF, followed by len bytes
+ * to put at offset. A run with len 0 ends the diff. Must match
+ * struct comm_diff_run in the server's comm.h.
+ */
+struct hga_diff_run {
+	__u16 offset;
+	__u16 len;
+} __attribute__((packed));
+
+/*
+ * Changed blocks of a page in RESUME_BLOCKS, followed by the
+ * blocks set in changed, in order. The rest of the page is
+ * unchanged. Must match struct comm_blocks in the server's
+ * comm.h.
+ */
+struct hga_blocks {
+	__u16 block_size;
+	__u64 changed;
+} __attribute__((packed));
+
+/* Smallest block, one bit of hga_blocks.changed each */
+#define HGA_MIN_BLOCK (PAGE_SIZE / 64)
+
+/*
+ * Chunk of a huge unit in COMMIT_CHUNK and RESUME_CHUNK,
+ * followed by the PAGE_SIZE bytes at index * PAGE_SIZE. A unit
+ * is sent as count chunks in order, and only the last one is
+ * acknowledged. Must match struct comm_chunk in the server's
+ * comm.h.
+ */
+struct hga_chunk {
+	__u16 index;
+	__u16 count;
+} __attribute__((packed));
+
+/*
+ * Page pushed ahead of our reads in PUSH_PAGE, followed by the
+ * page. It may be read for msecs from its arrival, like a
+ * leased copy. Pages are pushed count at a time, and only the
+ * last one is acknowledged. Must match struct comm_push in the
+ * server's comm.h.
+ */
+struct hga_push {
+	__u32 msecs;
+	__u16 index;
+	__u16 count;
+} __attribute__((packed));
+
+/*
+ * Bulk read of count pages from the message's vaddr on, sent
+ * to every server instance to warm up a range we are about to
+ * go through. Must match struct comm_range in the server's
+ * comm.h.
+ */
+struct hga_range {
+	__u32 count;
+} __attribute__((packed));
+
+/*
+ * Frame of the answer to a bulk read in RESUME_RANGE, about
+ * the 64 pages from the message's vaddr on (one shard range).
+ * Pages with their bit in answered were read, and those also
+ * in present follow in order; the others were never committed.
+ * Each comes with a lease of msecs in lease mode. Frames are
+ * not acknowledged. Must match struct comm_range_batch in the
+ * server's comm.h.
+ */
+struct hga_range_batch {
+	__u32 msecs;
+	__u64 answered;
+	__u64 present;
+} __attribute__((packed));
+
+#define HGA_RANGE_BATCH	16
+
+/*
+ * Regions mapped with 2 MiB pages can be shared in units of
+ * that size (see the huge_pages parameter). Messages about a
+ * unit carry its address with HGA_HUGE_BIT set.
+ */
+#define HGA_HUGE_BIT		1UL
+#define HGA_HUGE_SIZE		PMD_SIZE
+#define HGA_HUGE_CHUNKS		(HGA_HUGE_SIZE / PAGE_SIZE)
+
+static inline unsigned long hga_huge_key(unsigned long addr) {
+
+	return (addr & PMD_MASK) | HGA_HUGE_BIT;
+
+}
+
+/* Bytes shared under a page or huge unit address */
+static inline unsigned long hga_unit_size(unsigned long addr) {
+
+	return (addr & HGA_HUGE_BIT) ? HGA_HUGE_SIZE : PAGE_SIZE;
+
+}
+
+/* Buffer for the data under addr, freed with kvfree() */
+static inline char *hga_unit_alloc(unsigned long addr) {
+
+	if ( addr & HGA_HUGE_BIT )
+		return vmalloc(HGA_HUGE_SIZE);
+
+	return kmalloc(PAGE_SIZE, GFP_KERNEL);
+
+}
+
+/*
+ * Largest diff of a page. Runs closer than a header are joined,
+ * so a diff of the whole page is the largest.
+ */
+#define HGA_DIFF_MAX (PAGE_SIZE + 2 * sizeof(struct hga_diff_run))
+
 
 
 MODULE_LICENSE("Dual BSD/GPL");
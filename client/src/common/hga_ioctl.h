@@ -0,0 +1,45 @@
+
+
+
+#ifndef HGA_IOCTL_H
+#define HGA_IOCTL_H
+
+
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+
+
+/*
+ * Control device of the module, /dev/megavm_hga. Processes are
+ * registered as targets by the PID of any of their threads, as
+ * the caller's PID namespace sees it, and every request names
+ * the process that way. The ranges of its address space to
+ * share are given by [start, end), page aligned. A process with
+ * no ranges registered shares what its NX bits tell, like one
+ * found by name. Registrations last until they are removed or
+ * the process exits. Needs CAP_SYS_ADMIN.
+ */
+#define HGA_IOC_MAGIC 0xB8
+
+struct hga_ioc_range {
+
+	__s32 pid;
+	__u32 reserved;
+	__u64 start;
+	__u64 end;
+
+};
+
+#define HGA_IOC_ADD_TARGET	_IOW(HGA_IOC_MAGIC, 0x01, __s32)
+#define HGA_IOC_DEL_TARGET	_IOW(HGA_IOC_MAGIC, 0x02, __s32)
+#define HGA_IOC_ADD_RANGE	_IOW(HGA_IOC_MAGIC, 0x03, struct hga_ioc_range)
+#define HGA_IOC_DEL_RANGE	_IOW(HGA_IOC_MAGIC, 0x04, struct hga_ioc_range)
+
+
+
+#endif /* HGA_IOCTL_H */
+
+
+
@@ -0,0 +1,120 @@
+
+
+
+/*
+ *
+ * DESCRIPTION:
+ *    Control device, through which processes and the
+ *    ranges they share are registered at run time (see
+ *    hga_ioctl.h). The registrations themselves are kept
+ *    in task_funcs.
+ *
+ */
+
+
+
+#ifndef CONTROL_C
+#define CONTROL_C
+
+
+
+#include <linux/fs.h>
+#include <linux/errno.h>
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/uaccess.h>
+#include <linux/capability.h>
+#include <linux/miscdevice.h>
+
+#include "../control/control.h"
+#include "../task_funcs/task_funcs.h"
+
+
+
+static long control_ioctl(struct file *file, unsigned int cmd,
+	unsigned long arg) {
+
+	void __user *argp = (void __user*)arg;
+	struct hga_ioc_range range;
+	__s32 pid;
+
+	if ( !capable(CAP_SYS_ADMIN) )
+		return -EPERM;
+
+	switch ( cmd ) {
+
+	case HGA_IOC_ADD_TARGET:
+	case HGA_IOC_DEL_TARGET:
+		if ( copy_from_user(&pid, argp, sizeof(pid)) )
+			return -EFAULT;
+		if ( pid <= 0 )
+			return -EINVAL;
+		if ( cmd == HGA_IOC_ADD_TARGET )
+			return task_target_add(pid);
+		return task_target_del(pid);
+
+	case HGA_IOC_ADD_RANGE:
+	case HGA_IOC_DEL_RANGE:
+		if ( copy_from_user(&range, argp, sizeof(range)) )
+			return -EFAULT;
+		if ( range.pid <= 0 || range.end > TASK_SIZE_MAX )
+			return -EINVAL;
+		if ( cmd == HGA_IOC_ADD_RANGE )
+			return task_range_add(range.pid, range.start, range.end);
+		return task_range_del(range.pid, range.start, range.end);
+
+	default:
+		return -ENOTTY;
+
+	}
+
+}
+
+static const struct file_operations control_fops = {
+	.owner		= THIS_MODULE,
+	.unlocked_ioctl	= control_ioctl,
+	.compat_ioctl	= control_ioctl,
+	.llseek		= noop_llseek,
+};
+
+static struct miscdevice control_dev = {
+	.minor	= MISC_DYNAMIC_MINOR,
+	.name	= "megavm_hga",
+	.fops	= &control_fops,
+};
+
+
+
+int control_init(void) {
+
+	int err;
+
+	if ( (err = misc_register(&control_dev)) < 0 ) {
+		printk(KERN_ERR "control: Failed to register /dev/%s",
+			control_dev.name);
+		return -1;
+	}
+
+	return 0;
+
+}
+
+void control_exit(void) {
+
+	misc_deregister(&control_dev);
+
+	return;
+
+}
+
+
+
+MODULE_LICENSE("Dual BSD/GPL");
+
+
+
+#endif /* CONTROL_C */
+
+
+
@@ -0,0 +1,28 @@
+
+
+
+#ifndef CONTROL_H
+#define CONTROL_H
+
+
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+
+#include "../common/hga_ioctl.h"
+
+
+
+int control_init(void);
+void control_exit(void);
+
+
+
+MODULE_LICENSE("Dual BSD/GPL");
+
+
+
+#endif /* CONTROL_H */
+
+
+
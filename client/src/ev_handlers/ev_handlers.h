@@ -28,9 +28,20 @@
 
 
 DECLARE_HANDLER(handle_ev_allow_write);
+DECLARE_HANDLER(handle_ev_allow_shared_write);
 DECLARE_HANDLER(handle_ev_lock_read);
 DECLARE_HANDLER(handle_ev_resume_read);
+DECLARE_HANDLER(handle_ev_resume_blocks);
+DECLARE_HANDLER(handle_ev_resume_chunk);
+DECLARE_HANDLER(handle_ev_resume_range);
 DECLARE_HANDLER(handle_ev_ping_alive);
+DECLARE_HANDLER(handle_ev_fetch_peer);
+DECLARE_HANDLER(handle_ev_peer_hosts);
+DECLARE_HANDLER(handle_ev_grant_lease);
+DECLARE_HANDLER(handle_ev_not_modified);
+DECLARE_HANDLER(handle_ev_push_page);
+DECLARE_HANDLER(handle_ev_keep_home);
+DECLARE_HANDLER(handle_ev_recall_home);
 
 
 
@@ -38,6 +49,14 @@ DECLARE_HANDLER(handle_ev_ping_alive);
 
 
 
+void resume_chunks_exit(void);
+int allow_write_home(unsigned long vaddr, pid_t pid, pgd_t *pgd,
+	struct srvcom_ctx *srvctx);
+int home_write_done(unsigned long vaddr, pgd_t *pgd);
+void home_exit(struct srvcom_ctx *ctx);
+
+
+
 MODULE_LICENSE("Dual BSD/GPL");
 
 
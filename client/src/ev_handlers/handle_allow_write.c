@@ -6,13 +6,17 @@
 
 
 
+#include <linux/pfn_t.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
 
+#include "../lease/lease.h"
 #include "../srvcom/srvcom.h"
+#include "../peercom/peercom.h"
 #include "../pte_funcs/pte_funcs.h"
 #include "../ev_handlers/ev_handlers.h"
 #include "../page_monitor/page_monitor.h"
+#include "../readlock_list/readlock_list.h"
 
 
 
@@ -22,22 +26,141 @@ struct handler_ctx {
 	pgd_t *pgd;
 	unsigned long vaddr;
 	struct srvcom_ctx *srvctx;
+	struct lease_ctx *leasectx;
+
+	/* Shared writes only: the page as it was allowed */
+	char *twin;
+	struct readlock_list *pending_readlocks;
 
 };
 
 
 
+static void free_handler_ctx(struct handler_ctx *ctx) {
+
+	kfree(ctx->twin);
+	kfree(ctx);
+
+}
+
+/*
+ * Encode the bytes of page that differ from twin as runs of
+ * struct hga_diff_run. Runs closer than a run header are
+ * joined, which keeps the diff within HGA_DIFF_MAX.
+ *
+ * @return Length of the diff
+ */
+static int make_diff(const char *twin, const char *page, char *diff) {
+
+	struct hga_diff_run *run = NULL;
+	int len = 0, start, end, i = 0;
+
+	while ( i < PAGE_SIZE ) {
+
+		if ( twin[i] == page[i] ) {
+			i++;
+			continue;
+		}
+
+		start = i;
+		while ( i < PAGE_SIZE && twin[i] != page[i] )
+			i++;
+
+		end = run ? run->offset + run->len : 0;
+		if ( run && start - end <= sizeof(struct hga_diff_run) ) {
+			/* Cheaper to send the gap than a new header */
+			memcpy(diff + len, page + end, i - end);
+			len += i - end;
+			run->len = i - run->offset;
+			continue;
+		}
+
+		run = (struct hga_diff_run*)(diff + len);
+		run->offset = start;
+		run->len = i - start;
+		len += sizeof(struct hga_diff_run);
+		memcpy(diff + len, page + start, i - start);
+		len += i - start;
+
+	}
+
+	run = (struct hga_diff_run*)(diff + len);
+	run->offset = 0;
+	run->len = 0;
+
+	return len + sizeof(struct hga_diff_run);
+
+}
+
+/*
+ * Release of a shared write. The server sends the page back
+ * once every writer's diff is merged, so reads are blocked
+ * until then like on a LOCK_READ.
+ */
+static int commit_shared_write(struct handler_ctx *ctx,
+	char *modified_page) {
+
+	int len, ret_code;
+	char *diff;
+	const pfn_t pfn =
+		{.val = ctx->vaddr>>PAGE_SHIFT};
+
+	if ( !(diff = kmalloc(HGA_DIFF_MAX, GFP_KERNEL)) )
+		return -1;
+
+	len = make_diff(ctx->twin, modified_page, diff);
+
+	for_pte_pgd(ctx->pgd, ctx->vaddr, __hga_readlock);
+	if ( readlock_list_add_pending(ctx->pending_readlocks,
+		ctx->pgd, pfn) < 0 ) {
+		for_pte_pgd(ctx->pgd, ctx->vaddr, __hga_readunlock);
+		kfree(diff);
+		return -1;
+	}
+
+	ret_code = srvcom_commit_diff(ctx->srvctx,
+		ctx->vaddr, ctx->pid, ctx->pgd, diff, len);
+
+	kfree(diff);
+
+	return ret_code;
+
+}
+
 static int resume_writelock(void *cb_data) {
 
-	int ret_code;
+	int ret_code, home = 0;
 	char *modified_page;
 	struct handler_ctx *ctx =
 		(struct handler_ctx*)cb_data;
 
 	printk(KERN_INFO "resume_writelock called");
 
-	if ( !(modified_page = kmalloc(PAGE_SIZE, GFP_KERNEL)) ) {
-		kfree(ctx);
+	/* Forwarding mode keeps the page here, see peercom */
+	if ( ctx->srvctx->peer_port && !ctx->twin
+		&& !(ctx->vaddr & HGA_HUGE_BIT)
+		&& peercom_own(ctx->srvctx->peerctx, ctx->vaddr, ctx->pgd) == 0 ) {
+		if ( for_pte_pgd(ctx->pgd, ctx->vaddr, __hga_writelock) < 0 ) {
+			printk(KERN_ERR "WARNING: Re-locking failed after "
+				"writelock suspension...");
+			free_handler_ctx(ctx);
+			return -1;
+		}
+		ret_code = srvcom_commit_owner(ctx->srvctx,
+			ctx->vaddr, ctx->pid, ctx->pgd);
+		free_handler_ctx(ctx);
+		return ret_code;
+	}
+
+	/* A page left with us stays writable, see handle_home.c */
+	if ( !ctx->twin && !(ctx->vaddr & HGA_HUGE_BIT)
+		&& (home = home_write_done(ctx->vaddr, ctx->pgd)) > 0 ) {
+		free_handler_ctx(ctx);
+		return 0;
+	}
+
+	if ( !(modified_page = hga_unit_alloc(ctx->vaddr)) ) {
+		free_handler_ctx(ctx);
 		return -1;
 	}
 
@@ -46,34 +169,88 @@ static int resume_writelock(void *cb_data) {
 		// Shouldn't happen
 		printk(KERN_ERR "WARNING: Re-locking failed after "
 			"writelock suspension...");
-		kfree(modified_page);
-		kfree(ctx);
+		kvfree(modified_page);
+		free_handler_ctx(ctx);
 		return -1;
 	}
 
 	/* Get the modified page data */
-	if ( get_page_data(ctx->pgd, ctx->vaddr, modified_page) < 0 ) {
+	if ( get_unit_data(ctx->pgd, ctx->vaddr, modified_page) < 0 ) {
 		// Shouldn't happen
 		printk(KERN_ERR "WARNING: Page fetch failed after "
 			"writelock suspension...");
-		kfree(modified_page);
-		kfree(ctx);
+		kvfree(modified_page);
+		free_handler_ctx(ctx);
 		return -1;
 	}
 
+	/* Huge units go to the server in chunks */
+	if ( ctx->vaddr & HGA_HUGE_BIT ) {
+		ret_code = srvcom_commit_chunks(ctx->srvctx,
+			ctx->vaddr, ctx->pid, ctx->pgd, modified_page);
+		kvfree(modified_page);
+		free_handler_ctx(ctx);
+		return ret_code;
+	}
+
+	if ( ctx->twin ) {
+		ret_code = commit_shared_write(ctx, modified_page);
+		kvfree(modified_page);
+		free_handler_ctx(ctx);
+		return ret_code;
+	}
+
 	/* Send it off to the server */
-	ret_code = srvcom_commit_page(ctx->srvctx,
-		ctx->vaddr, ctx->pid, ctx->pgd, modified_page);
+	if ( home < 0 )
+		ret_code = srvcom_return_home(ctx->srvctx,
+			ctx->vaddr, ctx->pid, ctx->pgd, modified_page);
+	else
+		ret_code = srvcom_commit_page(ctx->srvctx,
+			ctx->vaddr, ctx->pid, ctx->pgd, modified_page);
 
-	kfree(modified_page);
-	kfree(ctx);
+	/* The server renews our lease with the commit */
+	if ( ret_code == 0 && ctx->leasectx )
+		lease_resume(ctx->leasectx, ctx->vaddr, ctx->pgd);
+
+	kvfree(modified_page);
+	free_handler_ctx(ctx);
 
 	return ret_code;
 
 }
 
+/*
+ * A writer joining a shared write was read-locked with the
+ * other readers and the server sent it the page just before.
+ * Put that copy in place now, as the fault handler would on
+ * the next read, so that the twin and the write start from it.
+ */
+static int commit_resolved_readlock(unsigned long vaddr, pgd_t *pgd,
+	struct readlock_list *pending_readlocks) {
+
+	const pfn_t pfn =
+		{.val = vaddr>>PAGE_SHIFT};
+	struct readlock *readlocked =
+		readlock_list_find(pending_readlocks, pgd, pfn);
+
+	if ( !readlocked )
+		return 0;
+
+	if ( !readlocked->resolved_page )
+		return -1;
+
+	if ( set_page_data(pgd, vaddr, readlocked->resolved_page) < 0 )
+		return -1;
+	for_pte_pgd(pgd, vaddr, __hga_readunlock);
+	readlock_list_remove(pending_readlocks, pgd, pfn);
+
+	return 0;
+
+}
+
 static int suspend_writelock(unsigned long vaddr, pid_t pid,
-	pgd_t *pgd, char *pagedata, struct srvcom_ctx *srvctx) {
+	pgd_t *pgd, char *pagedata, struct srvcom_ctx *srvctx,
+	struct lease_ctx *leasectx, struct readlock_list *pending_readlocks) {
 
 	int writelocked;
 	struct handler_ctx *ctx;
@@ -85,6 +262,10 @@ static int suspend_writelock(unsigned long vaddr, pid_t pid,
 		/* Already suspended, possible duplicate */
 		return 0;
 
+	if ( pending_readlocks
+		&& commit_resolved_readlock(vaddr, pgd, pending_readlocks) < 0 )
+		return -1;
+
 	printk(KERN_INFO "Unlocking page %p and starting "
 		"page monitor thread...", (void*)vaddr);
 
@@ -94,6 +275,24 @@ static int suspend_writelock(unsigned long vaddr, pid_t pid,
 	ctx->pgd = pgd;
 	ctx->vaddr = vaddr;
 	ctx->srvctx = srvctx;
+	ctx->leasectx = leasectx;
+	ctx->twin = NULL;
+	ctx->pending_readlocks = pending_readlocks;
+
+	/* Shared writes commit what changed since now */
+	if ( pending_readlocks ) {
+		if ( !(ctx->twin = kmalloc(PAGE_SIZE, GFP_KERNEL))
+			|| get_page_data(pgd, vaddr, ctx->twin) < 0 ) {
+			free_handler_ctx(ctx);
+			return -1;
+		}
+	}
+
+	/* Our copy stays readable while we write it, a pushed one is out of date */
+	if ( leasectx ) {
+		lease_suspend(leasectx, vaddr, pgd);
+		prefetch_drop(leasectx->prefetch, vaddr, pgd);
+	}
 
 	if ( for_pte_pgd(pgd, vaddr, __hga_writeunlock) < 0 )
 		return -1;
@@ -105,16 +304,44 @@ static int suspend_writelock(unsigned long vaddr, pid_t pid,
 
 }
 
+/* Write a page the server left with us, see handle_home.c */
+int allow_write_home(unsigned long vaddr, pid_t pid, pgd_t *pgd,
+	struct srvcom_ctx *srvctx) {
+
+	return suspend_writelock(vaddr, pid, pgd, NULL,
+		srvctx, NULL, NULL);
+
+}
+
 srvcom_ackcode_t handle_ev_allow_write(struct srvcom_ctx *srvctx,
 	unsigned long vaddr, pid_t pid, pgd_t *pgd, char *pagedata, void *cb_data) {
 
-	if ( suspend_writelock(vaddr, pid, pgd, pagedata, srvctx) < 0 )
+	struct lease_ctx *leasectx =
+		(struct lease_ctx*)cb_data;
+
+	if ( suspend_writelock(vaddr, pid, pgd, pagedata,
+		srvctx, leasectx, NULL) < 0 )
 		return ACKCODE_OP_FAILURE;
 
 	return ACKCODE_ALLOW_WRITE;
 
 }
 
+/* Write alongside other writers, see struct hga_diff_run */
+srvcom_ackcode_t handle_ev_allow_shared_write(struct srvcom_ctx *srvctx,
+	unsigned long vaddr, pid_t pid, pgd_t *pgd, char *pagedata, void *cb_data) {
+
+	struct readlock_list *pending_readlocks =
+		(struct readlock_list*)cb_data;
+
+	if ( suspend_writelock(vaddr, pid, pgd, pagedata,
+		srvctx, NULL, pending_readlocks) < 0 )
+		return ACKCODE_OP_FAILURE;
+
+	return ACKCODE_ALLOW_SHARED_WRITE;
+
+}
+
 
 
 MODULE_LICENSE("Dual BSD/GPL");
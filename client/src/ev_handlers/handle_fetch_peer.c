@@ -0,0 +1,63 @@
+
+
+
+#ifndef HANDLE_FETCH_PEER_C
+#define HANDLE_FETCH_PEER_C
+
+
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+
+#include "../srvcom/srvcom.h"
+#include "../common/hga_defs.h"
+#include "../peercom/peercom.h"
+#include "../ev_handlers/ev_handlers.h"
+
+
+
+/*
+ * Sent instead of RESUME_READ in forwarding mode. The page is
+ * read from its owner in the background and the readlock is
+ * resolved once it arrives, as RESUME_READ would have done.
+ */
+srvcom_ackcode_t handle_ev_fetch_peer(struct srvcom_ctx *ctx,
+	unsigned long vaddr, pid_t pid, pgd_t *pgd, char *pagedata,
+	void *cb_data) {
+
+	struct peercom_ctx *peerctx =
+		(struct peercom_ctx*)cb_data;
+
+	printk(KERN_INFO "Fetching page %p from a peer", (void*)vaddr);
+
+	if ( peercom_fetch(peerctx, vaddr, pgd, (struct hga_peer*)pagedata) < 0 )
+		return ACKCODE_OP_FAILURE;
+
+	return ACKCODE_FETCH_PEER;
+
+}
+
+/*
+ * Hosts about to be sent here to read our pages, see struct
+ * hga_peer_hosts. Not acknowledged.
+ */
+srvcom_ackcode_t handle_ev_peer_hosts(struct srvcom_ctx *ctx,
+	unsigned long vaddr, pid_t pid, pgd_t *pgd, char *pagedata,
+	void *cb_data) {
+
+	struct peercom_ctx *peerctx =
+		(struct peercom_ctx*)cb_data;
+
+	peercom_allow_hosts(peerctx, (struct hga_peer_hosts*)pagedata);
+
+	return ACKCODE_NO_RESPONSE;
+
+}
+
+
+
+MODULE_LICENSE("Dual BSD/GPL");
+
+
+
+#endif /* HANDLE_FETCH_PEER_C */
@@ -0,0 +1,64 @@
+
+
+
+#ifndef HANDLE_GRANT_LEASE_C
+#define HANDLE_GRANT_LEASE_C
+
+
+
+#include <linux/pfn_t.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+
+#include "../lease/lease.h"
+#include "../srvcom/srvcom.h"
+#include "../common/hga_defs.h"
+#include "../ev_handlers/ev_handlers.h"
+#include "../readlock_list/readlock_list.h"
+
+
+
+/*
+ * Sent instead of RESUME_READ in lease mode. The lease timer
+ * is started before the readlock is resolved, as the page
+ * must not become readable without one. A copy nobody here
+ * waits for is given back so writers need not wait for it.
+ */
+srvcom_ackcode_t handle_ev_grant_lease(struct srvcom_ctx *ctx,
+	unsigned long vaddr, pid_t pid, pgd_t *pgd, char *pagedata,
+	void *cb_data) {
+
+	struct lease_ctx *leasectx =
+		(struct lease_ctx*)cb_data;
+	struct hga_lease *lease =
+		(struct hga_lease*)pagedata;
+	const pfn_t pfn =
+		{.val = vaddr>>PAGE_SHIFT};
+
+	printk(KERN_INFO "Leasing page %p for %u ms",
+		(void*)vaddr, lease->msecs);
+
+	if ( lease_hold(leasectx, vaddr, pid, pgd,
+		lease->msecs, lease->version) < 0 )
+		return ACKCODE_OP_FAILURE;
+
+	if ( readlock_list_resolve(leasectx->pending_readlocks, pgd, pfn,
+		(char*)(lease + 1)) < 0 ) {
+		lease_drop(leasectx, vaddr, pgd);
+		srvcom_return_lease(ctx, vaddr, pid, pgd);
+	}
+
+	return ACKCODE_GRANT_LEASE;
+
+}
+
+
+
+MODULE_LICENSE("Dual BSD/GPL");
+
+
+
+#endif /* HANDLE_GRANT_LEASE_C */
+
+
+
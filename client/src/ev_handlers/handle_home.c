@@ -0,0 +1,237 @@
+
+
+
+
+#ifndef HANDLE_HOME_C
+#define HANDLE_HOME_C
+
+
+
+#include <linux/slab.h>
+#include <linux/hashtable.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+
+#include "../srvcom/srvcom.h"
+#include "../pte_funcs/pte_funcs.h"
+#include "../ev_handlers/ev_handlers.h"
+#include "../page_monitor/page_monitor.h"
+
+
+
+/*
+ * Pages the server left with us: we kept writing them and
+ * nobody else reads them, so the write lock stayed here. A
+ * page is written as it would be after an ALLOW_WRITE, but
+ * stays writable once the write is done instead of being
+ * committed, until the server recalls it.
+ */
+struct home_page {
+
+	struct hlist_node node;
+	pgd_t *pgd;
+	unsigned long vaddr;
+	pid_t pid;
+
+	/* The page monitor still waits out a write */
+	bool writing;
+	/* Give it back as soon as the write is done */
+	bool recalled;
+
+};
+
+static DEFINE_HASHTABLE(home_pages, 6);
+static DEFINE_SPINLOCK(home_lock);
+
+
+
+static inline unsigned long home_key(unsigned long vaddr, pgd_t *pgd) {
+
+	return (vaddr >> PAGE_SHIFT) ^ (unsigned long)pgd;
+
+}
+
+/* Call with home_lock held */
+static struct home_page *__home_find(unsigned long vaddr, pgd_t *pgd) {
+
+	struct home_page *home;
+
+	vaddr &= PAGE_MASK;
+	hash_for_each_possible(home_pages, home, node, home_key(vaddr, pgd)) {
+		if ( home->vaddr == vaddr && home->pgd == pgd )
+			return home;
+	}
+
+	return NULL;
+
+}
+
+/* Lock the page again and send it back to the server */
+static int home_return(struct srvcom_ctx *ctx, struct home_page *home) {
+
+	int ret_code;
+	char *page;
+
+	if ( !(page = kmalloc(PAGE_SIZE, GFP_KERNEL)) )
+		return -1;
+
+	if ( for_pte_pgd(home->pgd, home->vaddr, __hga_writelock) < 0
+		|| get_page_data(home->pgd, home->vaddr, page) < 0 ) {
+		printk(KERN_ERR "home: Failed to take back page %p",
+			(void*)home->vaddr);
+		kfree(page);
+		return -1;
+	}
+
+	ret_code = srvcom_return_home(ctx, home->vaddr,
+		home->pid, home->pgd, page);
+
+	kfree(page);
+
+	return ret_code;
+
+}
+
+
+
+/*
+ * The write lock of a page we just committed stays with us.
+ * The page is written again right away, without asking.
+ */
+srvcom_ackcode_t handle_ev_keep_home(struct srvcom_ctx *ctx,
+	unsigned long vaddr, pid_t pid, pgd_t *pgd, char *pagedata,
+	void *cb_data) {
+
+	struct home_page *home;
+
+	if ( !(home = kmalloc(sizeof(struct home_page), GFP_KERNEL)) )
+		return ACKCODE_OP_FAILURE;
+	home->pgd = pgd;
+	home->vaddr = vaddr & PAGE_MASK;
+	home->pid = pid;
+	home->writing = true;
+	home->recalled = false;
+
+	spin_lock(&home_lock);
+	if ( __home_find(vaddr, pgd) ) {
+		/* Possible duplicate */
+		spin_unlock(&home_lock);
+		kfree(home);
+		return ACKCODE_KEEP_HOME;
+	}
+	hash_add(home_pages, &home->node, home_key(home->vaddr, pgd));
+	spin_unlock(&home_lock);
+
+	if ( allow_write_home(vaddr, pid, pgd, ctx) < 0 ) {
+		spin_lock(&home_lock);
+		hash_del(&home->node);
+		spin_unlock(&home_lock);
+		kfree(home);
+		return ACKCODE_OP_FAILURE;
+	}
+
+	return ACKCODE_KEEP_HOME;
+
+}
+
+/*
+ * Another client wants a page left with us. It goes back
+ * now, or once the write under way is done. The page itself
+ * is the answer, the recall is not acknowledged.
+ */
+srvcom_ackcode_t handle_ev_recall_home(struct srvcom_ctx *ctx,
+	unsigned long vaddr, pid_t pid, pgd_t *pgd, char *pagedata,
+	void *cb_data) {
+
+	struct home_page *home;
+
+	spin_lock(&home_lock);
+	if ( (home = __home_find(vaddr, pgd)) ) {
+		if ( home->writing ) {
+			home->recalled = true;
+			home = NULL;
+		} else
+			hash_del(&home->node);
+	}
+	spin_unlock(&home_lock);
+
+	/* Already on its way back */
+	if ( !home )
+		return ACKCODE_NO_RESPONSE;
+
+	home_return(ctx, home);
+	kfree(home);
+
+	return ACKCODE_NO_RESPONSE;
+
+}
+
+/*
+ * Called by the page monitor once a write is done, with the
+ * page locked again unless it stays with us.
+ *
+ * @return 1 if the page stays writable here, -1 if it has
+ * to go back with srvcom_return_home() and 0 if it is not
+ * ours and is committed as usual
+ */
+int home_write_done(unsigned long vaddr, pgd_t *pgd) {
+
+	struct home_page *home;
+	int ret_code = 0;
+
+	spin_lock(&home_lock);
+	if ( (home = __home_find(vaddr, pgd)) ) {
+		if ( home->recalled ) {
+			hash_del(&home->node);
+			ret_code = -1;
+		} else {
+			home->writing = false;
+			ret_code = 1;
+		}
+	}
+	spin_unlock(&home_lock);
+
+	if ( ret_code < 0 )
+		kfree(home);
+
+	return ret_code;
+
+}
+
+/*
+ * Give every page back before the connection goes. A page
+ * still being written is committed when the write is done.
+ */
+void home_exit(struct srvcom_ctx *ctx) {
+
+	struct home_page *home;
+	struct hlist_node *tmp;
+	HLIST_HEAD(idle);
+	int bkt;
+
+	spin_lock(&home_lock);
+	hash_for_each_safe(home_pages, bkt, tmp, home, node) {
+		hash_del(&home->node);
+		if ( home->writing )
+			kfree(home);
+		else
+			hlist_add_head(&home->node, &idle);
+	}
+	spin_unlock(&home_lock);
+
+	hlist_for_each_entry_safe(home, tmp, &idle, node) {
+		home_return(ctx, home);
+		kfree(home);
+	}
+
+	return;
+
+}
+
+
+
+MODULE_LICENSE("Dual BSD/GPL");
+
+
+
+#endif /* HANDLE_HOME_C */
@@ -0,0 +1,64 @@
+
+
+
+
+#ifndef HANDLE_NOT_MODIFIED_C
+#define HANDLE_NOT_MODIFIED_C
+
+
+
+#include <linux/pfn_t.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+
+#include "../lease/lease.h"
+#include "../srvcom/srvcom.h"
+#include "../common/hga_defs.h"
+#include "../pte_funcs/pte_funcs.h"
+#include "../ev_handlers/ev_handlers.h"
+#include "../readlock_list/readlock_list.h"
+
+
+
+/*
+ * Sent instead of RESUME_READ or GRANT_LEASE when the copy we
+ * still have is current (see struct hga_version). Reads of it
+ * are let through again as they are, after the lease timer is
+ * started if it comes with one.
+ */
+srvcom_ackcode_t handle_ev_not_modified(struct srvcom_ctx *ctx,
+	unsigned long vaddr, pid_t pid, pgd_t *pgd, char *pagedata,
+	void *cb_data) {
+
+	struct lease_ctx *leasectx =
+		(struct lease_ctx*)cb_data;
+	struct hga_version *current_version =
+		(struct hga_version*)pagedata;
+	const pfn_t pfn =
+		{.val = vaddr>>PAGE_SHIFT};
+	struct readlock *readlocked;
+
+	if ( current_version->msecs && lease_hold(leasectx, vaddr, pid, pgd,
+		current_version->msecs, current_version->version) < 0 )
+		return ACKCODE_OP_FAILURE;
+
+	readlocked = readlock_list_find(leasectx->pending_readlocks, pgd, pfn);
+	if ( !readlocked || readlocked->resolved_page )
+		return ACKCODE_NOT_MODIFIED;
+
+	printk(KERN_INFO "Page %p not modified", (void*)vaddr);
+
+	for_pte_pgd(pgd, vaddr, __hga_readunlock);
+	readlock_list_remove(leasectx->pending_readlocks, pgd, pfn);
+
+	return ACKCODE_NOT_MODIFIED;
+
+}
+
+
+
+MODULE_LICENSE("Dual BSD/GPL");
+
+
+
+#endif /* HANDLE_NOT_MODIFIED_C */
@@ -0,0 +1,52 @@
+
+
+
+#ifndef HANDLE_PUSH_PAGE_C
+#define HANDLE_PUSH_PAGE_C
+
+
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+
+#include "../lease/lease.h"
+#include "../srvcom/srvcom.h"
+#include "../prefetch/prefetch.h"
+#include "../common/hga_defs.h"
+#include "../ev_handlers/ev_handlers.h"
+
+
+
+/*
+ * A page the server expects us to read next. It is staged
+ * until a read fault takes it, and the lease it came with is
+ * given back if it cannot be.
+ */
+srvcom_ackcode_t handle_ev_push_page(struct srvcom_ctx *ctx,
+	unsigned long vaddr, pid_t pid, pgd_t *pgd, char *pagedata,
+	void *cb_data) {
+
+	struct lease_ctx *leasectx =
+		(struct lease_ctx*)cb_data;
+	struct hga_push *push =
+		(struct hga_push*)pagedata;
+
+	if ( prefetch_stage(leasectx->prefetch, vaddr, pgd,
+		(char*)(push + 1), push->msecs) < 0 )
+		srvcom_return_lease(ctx, vaddr, pid, pgd);
+
+	/* Only the last page of a push is answered */
+	if ( push->index + 1 < push->count )
+		return ACKCODE_NO_RESPONSE;
+
+	return ACKCODE_PUSH_PAGE;
+
+}
+
+
+
+MODULE_LICENSE("Dual BSD/GPL");
+
+
+
+#endif /* HANDLE_PUSH_PAGE_C */
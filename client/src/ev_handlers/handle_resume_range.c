@@ -0,0 +1,120 @@
+
+
+
+
+#ifndef HANDLE_RESUME_RANGE_C
+#define HANDLE_RESUME_RANGE_C
+
+
+
+#include <linux/pfn_t.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+
+#include "../lease/lease.h"
+#include "../srvcom/srvcom.h"
+#include "../common/hga_defs.h"
+#include "../pte_funcs/pte_funcs.h"
+#include "../ev_handlers/ev_handlers.h"
+#include "../page_monitor/page_monitor.h"
+#include "../readlock_list/readlock_list.h"
+
+
+
+/*
+ * Put a page of a warm-up in place and let it be read. A page
+ * that was never committed keeps our copy. One that is not
+ * mapped any more is left to the fault handler, like after a
+ * RESUME_READ.
+ */
+static void resolve_range_page(struct srvcom_ctx *ctx,
+	struct lease_ctx *leasectx, unsigned long vaddr, pid_t pid,
+	pgd_t *pgd, char *pagedata, unsigned int msecs) {
+
+	const pfn_t pfn =
+		{.val = vaddr>>PAGE_SHIFT};
+	struct readlock *readlocked =
+		readlock_list_find(leasectx->pending_readlocks, pgd, pfn);
+
+	/* Not ours to warm up, e.g. touched before the request */
+	if ( !readlocked || readlocked->resolved_page ) {
+		if ( msecs )
+			srvcom_return_lease(ctx, vaddr, pid, pgd);
+		return;
+	}
+
+	/*
+	 * As on a GRANT_LEASE, never readable without a timer. A
+	 * page we cannot hold a lease on is left as we have it.
+	 */
+	if ( msecs && lease_hold(leasectx, vaddr, pid, pgd, msecs, 0) < 0 ) {
+		srvcom_return_lease(ctx, vaddr, pid, pgd);
+		pagedata = NULL;
+	}
+
+	if ( pagedata && (for_pte_pgd(pgd, vaddr, __hga_present) != 1
+		|| set_page_data(pgd, vaddr, pagedata) < 0) ) {
+		if ( readlock_list_resolve(leasectx->pending_readlocks,
+			pgd, pfn, pagedata) < 0 && msecs ) {
+			lease_drop(leasectx, vaddr, pgd);
+			srvcom_return_lease(ctx, vaddr, pid, pgd);
+		}
+		return;
+	}
+
+	for_pte_pgd(pgd, vaddr, __hga_readunlock);
+	readlock_list_remove(leasectx->pending_readlocks, pgd, pfn);
+
+	return;
+
+}
+
+/*
+ * Frame of the answer to a bulk read we sent to warm up a
+ * range (see struct hga_range_batch). Its pages are put in
+ * place in one pass, instead of on a fault for each.
+ */
+srvcom_ackcode_t handle_ev_resume_range(struct srvcom_ctx *ctx,
+	unsigned long vaddr, pid_t pid, pgd_t *pgd, char *pagedata,
+	void *cb_data) {
+
+	struct lease_ctx *leasectx =
+		(struct lease_ctx*)cb_data;
+	struct hga_range_batch *batch =
+		(struct hga_range_batch*)pagedata;
+	char *page = (char*)(batch + 1);
+	int i;
+
+	/* The pages must fit in the message buffer */
+	if ( (batch->present & ~batch->answered)
+		|| hweight64(batch->present) > HGA_RANGE_BATCH )
+		return ACKCODE_NO_RESPONSE;
+
+	for ( i = 0; i < 64; i++ ) {
+
+		if ( !(batch->answered & (1ULL << i)) )
+			continue;
+
+		if ( !(batch->present & (1ULL << i)) ) {
+			resolve_range_page(ctx, leasectx, vaddr + i * PAGE_SIZE,
+				pid, pgd, NULL, batch->msecs);
+			continue;
+		}
+
+		resolve_range_page(ctx, leasectx, vaddr + i * PAGE_SIZE,
+			pid, pgd, page, batch->msecs);
+		page += PAGE_SIZE;
+
+	}
+
+	return ACKCODE_NO_RESPONSE;
+
+}
+
+
+
+MODULE_LICENSE("Dual BSD/GPL");
+
+
+
+#endif /* HANDLE_RESUME_RANGE_C */
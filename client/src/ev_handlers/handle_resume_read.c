@@ -102,11 +102,14 @@
 
 
 #include <linux/pfn_t.h>
+#include <linux/log2.h>
+#include <linux/list.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <asm/pgtable_types.h>
 
 #include "../srvcom/srvcom.h"
+#include "../pte_funcs/pte_funcs.h"
 #include "../ev_handlers/ev_handlers.h"
 #include "../readlock_list/readlock_list.h"
 
@@ -143,6 +146,197 @@ srvcom_ackcode_t handle_ev_resume_read(struct srvcom_ctx *ctx,
 }
 
 
+/*
+ * Update with only the blocks of the page that changed (see
+ * struct hga_blocks). Our copy, still in place while reads
+ * are blocked, is current in the others.
+ */
+srvcom_ackcode_t handle_ev_resume_blocks(struct srvcom_ctx *ctx,
+	unsigned long vaddr, pid_t pid, pgd_t *pgd, char *pagedata,
+	void *cb_data) {
+
+	char *base;
+	const pfn_t pfn =
+		{.val = vaddr>>PAGE_SHIFT};
+	struct readlock_list *pending_readlocks =
+		(struct readlock_list*)cb_data;
+	struct hga_blocks *blocks =
+		(struct hga_blocks*)pagedata;
+
+	/* The blocks must fit in the message buffer */
+	if ( blocks->block_size < HGA_MIN_BLOCK
+		|| blocks->block_size > PAGE_SIZE
+		|| !is_power_of_2(blocks->block_size)
+		|| hweight64(blocks->changed) * blocks->block_size
+			> SRVCOM_MAX_PAYLOAD - sizeof(struct hga_blocks) )
+		return ACKCODE_OP_FAILURE;
+
+	printk(KERN_INFO "Resolving blocks of page %p", (void*)vaddr);
+
+	/* Not needed if the readlock already holds a page */
+	if ( (base = kmalloc(PAGE_SIZE, GFP_KERNEL))
+		&& get_page_data(pgd, vaddr, base) < 0 ) {
+		kfree(base);
+		base = NULL;
+	}
+
+	if ( readlock_list_resolve_blocks(pending_readlocks, pgd, pfn,
+		base, blocks->block_size, blocks->changed,
+		(char*)(blocks + 1)) < 0 )
+		return ACKCODE_OP_FAILURE;
+
+	return ACKCODE_RESUME_BLOCKS;
+
+}
+
+/*
+ * Huge units being received in RESUME_CHUNKs. A unit's chunks
+ * come back to back from the listener of its shard, which is
+ * the only one to touch its entry; the list is shared by the
+ * listeners of all shards.
+ */
+struct chunked_unit {
+
+	struct list_head list;
+
+	pgd_t *pgd;
+	unsigned long vaddr;
+
+	/* Next chunk expected */
+	unsigned int next;
+	char *data;
+
+};
+
+static LIST_HEAD(chunked_units);
+static DEFINE_SPINLOCK(chunked_lock);
+
+static void __free_chunked_unit(struct chunked_unit *unit) {
+
+	if ( !unit )
+		return;
+
+	kvfree(unit->data);
+	kfree(unit);
+
+}
+
+/* Take the unit being received at vaddr off the list */
+static struct chunked_unit *__unlink_chunked_unit(pgd_t *pgd,
+	unsigned long vaddr) {
+
+	struct chunked_unit *unit;
+
+	spin_lock(&chunked_lock);
+	list_for_each_entry(unit, &chunked_units, list) {
+		if ( unit->pgd == pgd && unit->vaddr == vaddr ) {
+			list_del(&unit->list);
+			spin_unlock(&chunked_lock);
+			return unit;
+		}
+	}
+	spin_unlock(&chunked_lock);
+
+	return NULL;
+
+}
+
+/* A unit starts over on its first chunk, e.g. on a resend */
+static void __start_chunked_unit(pgd_t *pgd, unsigned long vaddr) {
+
+	struct chunked_unit *unit;
+
+	__free_chunked_unit(__unlink_chunked_unit(pgd, vaddr));
+
+	if ( !(unit = kmalloc(sizeof(struct chunked_unit), GFP_KERNEL)) )
+		return;
+	if ( !(unit->data = hga_unit_alloc(vaddr)) ) {
+		kfree(unit);
+		return;
+	}
+	unit->pgd = pgd;
+	unit->vaddr = vaddr;
+	unit->next = 0;
+
+	spin_lock(&chunked_lock);
+	list_add(&unit->list, &chunked_units);
+	spin_unlock(&chunked_lock);
+
+}
+
+/*
+ * Update of a huge unit, in chunks (see struct hga_chunk).
+ * The readlock is resolved with the whole unit once its last
+ * chunk is in, and only that chunk is answered; the server
+ * sends the unit again if the answer is a failure.
+ */
+srvcom_ackcode_t handle_ev_resume_chunk(struct srvcom_ctx *ctx,
+	unsigned long vaddr, pid_t pid, pgd_t *pgd, char *pagedata,
+	void *cb_data) {
+
+	char *data;
+	const pfn_t pfn =
+		{.val = vaddr>>PAGE_SHIFT};
+	struct readlock_list *pending_readlocks =
+		(struct readlock_list*)cb_data;
+	struct hga_chunk *chunk =
+		(struct hga_chunk*)pagedata;
+	struct chunked_unit *unit;
+	bool last;
+
+	if ( !(vaddr & HGA_HUGE_BIT)
+		|| chunk->count != HGA_HUGE_CHUNKS
+		|| chunk->index >= chunk->count )
+		return ACKCODE_OP_FAILURE;
+	last = chunk->index + 1 == chunk->count;
+
+	if ( chunk->index == 0 )
+		__start_chunked_unit(pgd, vaddr);
+
+	/* Only this listener adds or removes the unit's entry */
+	if ( !(unit = __unlink_chunked_unit(pgd, vaddr)) )
+		return last ? ACKCODE_OP_FAILURE : ACKCODE_NO_RESPONSE;
+
+	if ( chunk->index != unit->next ) {
+		/* A chunk was lost, wait for the resend */
+		__free_chunked_unit(unit);
+		return last ? ACKCODE_OP_FAILURE : ACKCODE_NO_RESPONSE;
+	}
+
+	memcpy(unit->data + chunk->index * PAGE_SIZE, chunk + 1, PAGE_SIZE);
+	unit->next++;
+
+	if ( !last ) {
+		spin_lock(&chunked_lock);
+		list_add(&unit->list, &chunked_units);
+		spin_unlock(&chunked_lock);
+		return ACKCODE_NO_RESPONSE;
+	}
+
+	printk(KERN_INFO "Resolving huge unit %p", (void*)vaddr);
+
+	data = unit->data;
+	kfree(unit);
+	if ( readlock_list_resolve_unit(pending_readlocks, pgd, pfn, data) < 0 )
+		return ACKCODE_OP_FAILURE;
+
+	return ACKCODE_RESUME_CHUNK;
+
+}
+
+/* Drop units left half received, once the listeners are stopped */
+void resume_chunks_exit(void) {
+
+	struct chunked_unit *unit, *tmp;
+
+	list_for_each_entry_safe(unit, tmp, &chunked_units, list) {
+		list_del(&unit->list);
+		__free_chunked_unit(unit);
+	}
+
+}
+
+
 
 MODULE_LICENSE("Dual BSD/GPL");
 
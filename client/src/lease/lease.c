@@ -0,0 +1,316 @@
+
+
+
+/*
+
+	DESCRIPTION:
+		Expiry and renewal of read leases
+
+*/
+
+
+
+#ifndef LEASE_C
+#define LEASE_C
+
+
+
+#include <linux/slab.h>
+#include <linux/pfn_t.h>
+#include <linux/jiffies.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+
+#include "../lease/lease.h"
+#include "../srvcom/srvcom.h"
+#include "../pte_funcs/pte_funcs.h"
+#include "../readlock_list/readlock_list.h"
+
+
+
+#define DFT_RENEW_MSECS	1000
+
+
+
+static inline unsigned long lease_key(unsigned long vaddr, pgd_t *pgd) {
+
+	return (vaddr >> PAGE_SHIFT) ^ (unsigned long)pgd;
+
+}
+
+/* Call with ctx->lock held */
+static struct lease_entry *__lease_find(struct lease_ctx *ctx,
+	unsigned long vaddr, pgd_t *pgd) {
+
+	struct lease_entry *entry;
+
+	vaddr &= PAGE_MASK;
+	hash_for_each_possible(ctx->entries, entry, node, lease_key(vaddr, pgd)) {
+		if ( entry->vaddr == vaddr && entry->pgd == pgd )
+			return entry;
+	}
+
+	return NULL;
+
+}
+
+/*
+ * Runs once the lease is out. Reads are blocked the same way
+ * LOCK_READ blocks them, and resolved by the next GRANT_LEASE.
+ */
+static void lease_expire(struct work_struct *work) {
+
+	struct lease_entry *entry =
+		container_of(to_delayed_work(work), struct lease_entry, expiry);
+	struct lease_ctx *ctx = entry->ctx;
+	const pfn_t pfn =
+		{.val = entry->vaddr>>PAGE_SHIFT};
+
+	spin_lock(&ctx->lock);
+	if ( entry->state != LEASE_HELD ) {
+		spin_unlock(&ctx->lock);
+		return;
+	}
+	entry->state = LEASE_EXPIRED;
+	spin_unlock(&ctx->lock);
+
+	/* See handle_lock_read.c for why the readlock is always listed */
+	for_pte_pgd(entry->pgd, entry->vaddr, __hga_readlock);
+	if ( readlock_list_add_pending(ctx->pending_readlocks,
+		entry->pgd, pfn) < 0 )
+		printk(KERN_ERR "lease_expire: Failed to read-lock %p",
+			(void*)entry->vaddr);
+
+	return;
+
+}
+
+
+
+struct lease_ctx *lease_ctx_new(struct srvcom_ctx *srvctx,
+	struct readlock_list *pending_readlocks, struct prefetch_ctx *prefetch) {
+
+	struct lease_ctx *ctx;
+
+	if ( !(ctx = kmalloc(sizeof(struct lease_ctx), GFP_KERNEL)) ) {
+		printk(KERN_ERR "lease: Context allocation failure");
+		return NULL;
+	}
+
+	ctx->srvctx = srvctx;
+	ctx->pending_readlocks = pending_readlocks;
+	ctx->prefetch = prefetch;
+	hash_init(ctx->entries);
+	spin_lock_init(&ctx->lock);
+	ctx->renew_msecs = DFT_RENEW_MSECS;
+	ctx->stopping = false;
+
+	return ctx;
+
+}
+
+/*
+ * Start (or restart) the lease on a page whose copy just came
+ * in with a GRANT_LEASE, of the given version (0 if unknown).
+ * Called before the copy is made readable, so it is never
+ * readable without a timer.
+ *
+ * @return 0 on success, -1 on failure
+ */
+int lease_hold(struct lease_ctx *ctx, unsigned long vaddr,
+	pid_t pid, pgd_t *pgd, unsigned int msecs, u64 version) {
+
+	struct lease_entry *entry, *new_entry;
+
+	/* Usually there already is one, allocated on first use */
+	new_entry = kmalloc(sizeof(struct lease_entry), GFP_KERNEL);
+
+	spin_lock(&ctx->lock);
+
+	if ( ctx->stopping ) {
+		spin_unlock(&ctx->lock);
+		kfree(new_entry);
+		return -1;
+	}
+
+	if ( !(entry = __lease_find(ctx, vaddr, pgd)) ) {
+		if ( !(entry = new_entry) ) {
+			spin_unlock(&ctx->lock);
+			printk(KERN_ERR "lease_hold: Allocation failure");
+			return -1;
+		}
+		new_entry = NULL;
+		entry->ctx = ctx;
+		entry->pgd = pgd;
+		entry->vaddr = vaddr & PAGE_MASK;
+		INIT_DELAYED_WORK(&entry->expiry, lease_expire);
+		hash_add(ctx->entries, &entry->node,
+			lease_key(entry->vaddr, pgd));
+	}
+
+	entry->pid = pid;
+	entry->msecs = msecs;
+	entry->version = version;
+	entry->state = LEASE_HELD;
+	mod_delayed_work(system_wq, &entry->expiry, msecs_to_jiffies(msecs));
+
+	spin_unlock(&ctx->lock);
+
+	kfree(new_entry);
+
+	return 0;
+
+}
+
+/* Forget the lease on a page, e.g. one that could not be resolved */
+void lease_drop(struct lease_ctx *ctx, unsigned long vaddr, pgd_t *pgd) {
+
+	struct lease_entry *entry;
+
+	spin_lock(&ctx->lock);
+	if ( (entry = __lease_find(ctx, vaddr, pgd)) )
+		hash_del(&entry->node);
+	spin_unlock(&ctx->lock);
+
+	if ( !entry )
+		return;
+
+	cancel_delayed_work_sync(&entry->expiry);
+	kfree(entry);
+
+	return;
+
+}
+
+/*
+ * Stop the lease on a page we were allowed to write. The
+ * server does not count it against other writers meanwhile.
+ */
+void lease_suspend(struct lease_ctx *ctx, unsigned long vaddr, pgd_t *pgd) {
+
+	struct lease_entry *entry;
+
+	spin_lock(&ctx->lock);
+	entry = __lease_find(ctx, vaddr, pgd);
+	if ( entry && entry->state == LEASE_HELD ) {
+		/* An expiry already running read-locks the page, which is fine */
+		cancel_delayed_work(&entry->expiry);
+		entry->state = LEASE_WRITING;
+	}
+	/* Our copy is ahead of the version we know */
+	if ( entry )
+		entry->version = 0;
+	spin_unlock(&ctx->lock);
+
+	return;
+
+}
+
+/* Restart the lease on a page once our commit of it is sent */
+void lease_resume(struct lease_ctx *ctx, unsigned long vaddr, pgd_t *pgd) {
+
+	struct lease_entry *entry;
+
+	spin_lock(&ctx->lock);
+	entry = __lease_find(ctx, vaddr, pgd);
+	if ( entry && entry->state == LEASE_WRITING && !ctx->stopping ) {
+		entry->state = LEASE_HELD;
+		mod_delayed_work(system_wq, &entry->expiry,
+			msecs_to_jiffies(entry->msecs));
+	}
+	spin_unlock(&ctx->lock);
+
+	return;
+
+}
+
+/*
+ * Called on read faults of a read-locked page that is not
+ * resolved yet. Asks the server for the page if the lease on
+ * it ran out, unless a recent request is still unanswered.
+ *
+ * @return 1 if the page is leased and renewing, 0 if the
+ * readlock is not ours (e.g. from LOCK_READ), -1 on failure
+ */
+int lease_renew(struct lease_ctx *ctx, unsigned long vaddr,
+	pid_t pid, pgd_t *pgd) {
+
+	struct lease_entry *entry;
+	u64 version;
+
+	spin_lock(&ctx->lock);
+
+	entry = __lease_find(ctx, vaddr, pgd);
+	if ( !entry || entry->state == LEASE_HELD
+		|| entry->state == LEASE_WRITING ) {
+		spin_unlock(&ctx->lock);
+		return 0;
+	}
+	if ( entry->state == LEASE_RENEWING && time_before(jiffies,
+		entry->since + msecs_to_jiffies(ctx->renew_msecs)) ) {
+		spin_unlock(&ctx->lock);
+		return 1;
+	}
+	entry->state = LEASE_RENEWING;
+	entry->since = jiffies;
+	version = entry->version;
+
+	spin_unlock(&ctx->lock);
+
+	/* The copy still in place may be current, see struct hga_version */
+	if ( version ) {
+		if ( srvcom_revalidate(ctx->srvctx, vaddr & PAGE_MASK,
+			pid, pgd, version) < 0 )
+			return -1;
+		return 1;
+	}
+
+	if ( srvcom_initial_read(ctx->srvctx, vaddr & PAGE_MASK, pid, pgd) < 0 )
+		return -1;
+
+	return 1;
+
+}
+
+void lease_ctx_exit(struct lease_ctx *ctx) {
+
+	struct lease_entry *entry;
+	int bkt;
+
+	if ( !ctx )
+		return;
+
+	spin_lock(&ctx->lock);
+	ctx->stopping = true;
+	for (;;) {
+		entry = NULL;
+		hash_for_each(ctx->entries, bkt, entry, node)
+			break;
+		if ( !entry )
+			break;
+		hash_del(&entry->node);
+		spin_unlock(&ctx->lock);
+
+		cancel_delayed_work_sync(&entry->expiry);
+		kfree(entry);
+
+		spin_lock(&ctx->lock);
+	}
+	spin_unlock(&ctx->lock);
+
+	kfree(ctx);
+
+	return;
+
+}
+
+
+
+MODULE_LICENSE("Dual BSD/GPL");
+
+
+
+#endif /* LEASE_C */
+
+
+
@@ -0,0 +1,119 @@
+
+
+
+#ifndef LEASE_H
+#define LEASE_H
+
+
+
+#include <linux/hashtable.h>
+#include <linux/workqueue.h>
+#include <linux/spinlock.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/types.h>
+#include <linux/mm.h>
+
+#include "../srvcom/srvcom.h"
+#include "../prefetch/prefetch.h"
+#include "../readlock_list/readlock_list.h"
+
+
+
+/* Leased pages are hashed in 1 << LEASE_HASH_BITS buckets */
+#define LEASE_HASH_BITS 8
+
+
+
+enum lease_state {
+
+	/* The copy may be read until the expiry timer runs */
+	LEASE_HELD,
+	/* Reads are blocked, the next fault asks for the page */
+	LEASE_EXPIRED,
+	/* INITIAL_READ or REVALIDATE sent, waiting for the answer */
+	LEASE_RENEWING,
+	/* Allowed to write, restarted by our commit */
+	LEASE_WRITING,
+
+};
+
+/*
+ * Page read under a lease (see struct hga_lease). Kept for
+ * the life of the module once the page was first leased.
+ */
+struct lease_entry {
+
+	struct hlist_node node;
+	struct lease_ctx *ctx;
+
+	pgd_t *pgd;
+	unsigned long vaddr;
+	pid_t pid;
+
+	enum lease_state state;
+	/* Length of the last lease granted */
+	unsigned int msecs;
+	/* Version of our copy (see struct hga_version), 0 if unknown */
+	u64 version;
+	/* When INITIAL_READ was sent, while renewing */
+	unsigned long since;
+
+	struct delayed_work expiry;
+
+};
+
+/*
+ * Read leases of this node.
+ *
+ * When the server runs a token in lease mode it sends readers
+ * GRANT_LEASE instead of RESUME_READ and never locks them on
+ * writes. Once a lease runs out the page is read-locked here,
+ * as LOCK_READ would have done, and the next read fault asks
+ * for the current copy with INITIAL_READ, or with REVALIDATE if
+ * we know the version of ours. Copies this node no longer waits
+ * for are given back with RETURN_LEASE.
+ *
+ * A writer keeps reading its own copy: the lease is stopped on
+ * ALLOW_WRITE and restarted once the commit is sent, which is
+ * when the server renews it.
+ */
+struct lease_ctx {
+
+	struct srvcom_ctx *srvctx;
+	struct readlock_list *pending_readlocks;
+	/* Pages pushed under a lease before we asked for them */
+	struct prefetch_ctx *prefetch;
+
+	DECLARE_HASHTABLE(entries, LEASE_HASH_BITS);
+	spinlock_t lock;
+
+	/* A renewal is sent again if unanswered for this long */
+	long renew_msecs;
+	bool stopping;
+
+};
+
+
+
+struct lease_ctx *lease_ctx_new(struct srvcom_ctx *srvctx,
+	struct readlock_list *pending_readlocks, struct prefetch_ctx *prefetch);
+int lease_hold(struct lease_ctx *ctx, unsigned long vaddr,
+	pid_t pid, pgd_t *pgd, unsigned int msecs, u64 version);
+void lease_drop(struct lease_ctx *ctx, unsigned long vaddr, pgd_t *pgd);
+void lease_suspend(struct lease_ctx *ctx, unsigned long vaddr, pgd_t *pgd);
+void lease_resume(struct lease_ctx *ctx, unsigned long vaddr, pgd_t *pgd);
+int lease_renew(struct lease_ctx *ctx, unsigned long vaddr,
+	pid_t pid, pgd_t *pgd);
+void lease_ctx_exit(struct lease_ctx *ctx);
+
+
+
+MODULE_LICENSE("Dual BSD/GPL");
+
+
+
+#endif /* LEASE_H */
+
+
+
@@ -18,6 +18,7 @@
 #include <linux/gfp.h>
 #include <linux/pci.h>
 #include <linux/vmalloc.h>
+#include <linux/log2.h>
 
 #include <asm/processor.h>
 #include <asm/tlbflush.h>
@@ -40,7 +41,11 @@
 #include <linux/sched.h>
 #include <linux/moduleparam.h>
 
+#include "../lease/lease.h"
 #include "../srvcom/srvcom.h"
+#include "../peercom/peercom.h"
+#include "../prefetch/prefetch.h"
+#include "../control/control.h"
 #include "../common/hga_defs.h"
 #include "../symfind/symfind.h"
 #include "../pte_funcs/pte_funcs.h"
@@ -211,17 +216,45 @@ typedef void (*do_page_fault_t)(struct pt_regs*, unsigned long);
 
 
 
+/* One port per server instance (shard), in shard ID order */
+static char *server_ip = SERVER_IP;
+static int server_ports[SRVCOM_MAX_SHARDS] = { SERVER_PORT };
+static int nr_server_ports = 1;
+static int share_token = 0;
+/* Port to serve written pages to peers on, 0 to commit them to the server */
+static int peer_port = 0;
+/* Share regions mapped with 2 MiB pages in units of that size, see struct hga_chunk */
+static bool huge_pages = false;
+/* Pages read in one INITIAL_READ_RANGE on the first read of one of them, 0 to read them one by one */
+static unsigned int warm_pages = 0;
+
+module_param(server_ip, charp, S_IRUGO);
+module_param_array(server_ports, int, &nr_server_ports, S_IRUGO);
+module_param(share_token, int, S_IRUGO);
+module_param(peer_port, int, S_IRUGO);
+module_param(huge_pages, bool, S_IRUGO);
+module_param(warm_pages, uint, S_IRUGO);
+
+
+
 /* Globals */
 static struct srvcom_ctx *srvctx;
+static struct peercom_ctx *peerctx;
+static struct lease_ctx *leasectx;
+static struct prefetch_ctx *prefetchctx;
 static struct readlock_list *pending_readlocks;
 
 
 
 /* Initialization */
+static int __init_peercom(void);
 static int __init_srvcom(void);
 static int __init_readlocks(void);
 static int my_fault_init(void);
 /* Deinitialization */
+static void __exit_leases(void);
+static void __exit_prefetch(void);
+static void __exit_peercom(void);
 static void __exit_srvcom(void);
 static void __exit_readlocks(void);
 static void my_fault_exit(void);
@@ -229,15 +262,19 @@ static void my_fault_exit(void);
 static inline void __handle_usermode_read_violation(pgd_t *pgd,
 	unsigned long pf_vaddr, struct pt_regs* regs, unsigned long error_code);
 static inline void __handle_usermode_read_missingpage(pgd_t *pgd,
-	unsigned long pf_vaddr, struct pt_regs* regs, unsigned long error_code);
+	unsigned long pf_vaddr, struct pt_regs* regs, unsigned long error_code,
+	unsigned long address);
 static void __handle_usermode_read(pgd_t *pgd, unsigned long pf_vaddr,
-	struct pt_regs* regs, unsigned long error_code);
+	struct pt_regs* regs, unsigned long error_code, unsigned long address);
+static inline void __pfault(struct pt_regs* regs, unsigned long error_code,
+	unsigned long address);
+static inline void __hga_pte_intercept(struct hga_pte *pte);
+static char *__take_prefetched(pgd_t *pgd, unsigned long pf_vaddr);
+static int __warm_range(pgd_t *pgd, unsigned long pf_vaddr);
+static int __resolve_prefetched(pgd_t *pgd, unsigned long pf_vaddr, pfn_t pfn);
 
 
 
-#define FOR_PTE(func) \
-	(for_pte_pgd(pgd, pf_vaddr, __hga_##func))
-
 #define ACCESS_VIOLATE	(1 << 0)
 #define WRITE_ATTEMPT	(1 << 1)
 #define USERMODE	(1 << 2)
@@ -253,29 +290,79 @@ void my_do_page_fault(struct pt_regs* regs, unsigned long error_code) {
 
 	int marked, shareable;
 	struct task_struct *task = current;
-	unsigned long pf_vaddr = read_cr2();
+	unsigned long address = read_cr2();
+	unsigned long pf_vaddr = address;
 	do_page_fault_t pfault =
 		(do_page_fault_t)addr_dft_do_page_fault;
 	pid_t pid = task->pid;
-	pgd_t *pgd = task->mm->pgd;
+	struct mm_struct *mm = task->mm;
+	pgd_t *pgd;
+	struct hga_pte pte;
+
+	/* Nothing can be a target, a branch patched in by the static key */
+	if ( !task_targets_active() ) {
+		pfault(regs, error_code);
+		return;
+	}
 
 	if ( task_targeted(task) != 1 ) {
 		/* Error or not a target process */
 		pfault(regs, error_code);
 		return;
 	}
+	pgd = mm->pgd;
+
+	/* Outside the ranges registered for the process */
+	if ( !task_shares(task, pf_vaddr) ) {
+		pfault(regs, error_code);
+		return;
+	}
+
+	/*
+	 * The IDT entry is an interrupt gate, but from here on the fault
+	 * may sleep, wait on the servers and shoot TLBs down on the other
+	 * CPUs of the mm. Interrupts go back on as do_page_fault turns
+	 * them on; __pfault hands over to it as the trap left things.
+	 */
+	if ( regs->flags & X86_EFLAGS_IF )
+		local_irq_enable();
+
+	/*
+	 * Everything the fault needs to know of the entry is read
+	 * with a single walk. -1 on error, 0 if the page is not to
+	 * be shared and 1 otherwise.
+	 */
+	shareable = -1;
+	marked = 0;
+	if ( hga_pte_lock(mm, pf_vaddr, &pte) == 0 ) {
+
+		/*
+		 * A 2 MiB page is locked at its PMD, so it is shared
+		 * as one unit or not at all. From here on the unit's
+		 * key stands for the faulting address.
+		 */
+		if ( pte.huge && !huge_pages ) {
+			hga_pte_unlock(&pte);
+			__pfault(regs, error_code, address);
+			return;
+		}
+		if ( pte.huge )
+			pf_vaddr = hga_huge_key(pf_vaddr);
 
-	/* -1 on error, 0 if the page is not to be shared and 1 otherwise */
-	shareable = FOR_PTE(shareable);
+		shareable = hga_pte_test(&pte, HGA_PTE_SHAREABLE);
+		marked = hga_pte_test(&pte, HGA_PTE_MARKED);
+		hga_pte_unlock(&pte);
+
+	}
 
 	/* TODO: Identify the segment and remove this garbage */
 	if ( shareable == 0 ) {
-		pfault(regs, error_code);
+		__pfault(regs, error_code, address);
 		return;
 	}
 
 	if ( IS_USERMODE_READ(error_code) ) {
-		__handle_usermode_read(pgd, pf_vaddr, regs, error_code);
+		__handle_usermode_read(pgd, pf_vaddr, regs, error_code, address);
 		return;
 	}
 
@@ -289,17 +376,23 @@ void my_do_page_fault(struct pt_regs* regs, unsigned long error_code) {
 	 */
 	/* TODO: Test first and then use the present flag instead */
 	if ( shareable < 0 ) {
-		pfault(regs, error_code);
-		/* Second attempt */
-		if ( (shareable = FOR_PTE(shareable)) <= 0 )
-			return; /* Either still not available or available and not shareable */
+		__pfault(regs, error_code, address);
+		/* Second attempt, which leaves the page as it now is */
+		if ( hga_pte_lock(mm, pf_vaddr, &pte) < 0 )
+			return; /* Still not available */
+		if ( !hga_pte_test(&pte, HGA_PTE_SHAREABLE)
+			|| (pte.huge && !huge_pages) ) {
+			hga_pte_unlock(&pte);
+			return; /* Available and not shareable */
+		}
+		if ( error_code&USERMODE )
+			__hga_pte_intercept(&pte);
+		hga_pte_unlock(&pte);
+		return;
 	}
 
 	/* At this point the page fault is from our target process and involves a shareable page */
 
-	/* TODO: Test for whether we even need this */
-	marked = FOR_PTE(marked);
-
 	/*
 	 * If the fault was not generated by a userspace
 	 * write-access permission violation or originated
@@ -308,10 +401,11 @@ void my_do_page_fault(struct pt_regs* regs, unsigned long error_code) {
 	 * further action.
 	 */
 	if ( !marked || !IS_USERMODE_WRITE_VIOLATION(error_code) ) {
-		pfault(regs, error_code);
-		if ( error_code&USERMODE ) { /* Only deal with usermode requests */
-			FOR_PTE(mark); /* To make sure it is marked next time */
-			FOR_PTE(writelock); /* To make sure it is 7 next time */
+		__pfault(regs, error_code, address);
+		/* Only deal with usermode requests */
+		if ( (error_code&USERMODE) && hga_pte_lock(mm, pf_vaddr, &pte) == 0 ) {
+			__hga_pte_intercept(&pte);
+			hga_pte_unlock(&pte);
 		}
 		return;
 	}
@@ -333,13 +427,41 @@ void my_do_page_fault(struct pt_regs* regs, unsigned long error_code) {
 
 
 
+/*
+ * The default handler, once the HGA path has turned interrupts back on.
+ * do_page_fault reads the address from CR2, which a fault taken since
+ * then may have overwritten, so it is put back with interrupts off.
+ */
+static inline void __pfault(struct pt_regs* regs, unsigned long error_code,
+	unsigned long address) {
+
+	do_page_fault_t pfault =
+		(do_page_fault_t)addr_dft_do_page_fault;
+
+	local_irq_disable();
+	write_cr2(address);
+	pfault(regs, error_code);
+
+}
+
+/*
+ * Mark the page, to make sure it is marked next time, and
+ * write-lock it, to make sure a write is 7 next time.
+ */
+static inline void __hga_pte_intercept(struct hga_pte *pte) {
+
+	hga_pte_update(pte, HGA_PTE_MARKED, HGA_PTE_WRITABLE);
+
+}
+
 static void __handle_usermode_read(pgd_t *pgd, unsigned long pf_vaddr,
-	struct pt_regs* regs, unsigned long error_code) {
+	struct pt_regs* regs, unsigned long error_code, unsigned long address) {
 
 	if ( error_code & ACCESS_VIOLATE )
 		__handle_usermode_read_violation(pgd, pf_vaddr, regs, error_code);
 	else
-		__handle_usermode_read_missingpage(pgd, pf_vaddr, regs, error_code);
+		__handle_usermode_read_missingpage(pgd, pf_vaddr, regs, error_code,
+			address);
 
 	return;
 
@@ -363,12 +485,16 @@ static inline void __handle_usermode_read_violation(pgd_t *pgd,
 		return;
 	}
 
-	if ( !readlocked->resolved_page )
+	if ( !readlocked->resolved_page
+		&& __resolve_prefetched(pgd, pf_vaddr, pfn) < 0 ) {
+		/* Asks for the page again if our lease on it ran out */
+		lease_renew(leasectx, pf_vaddr, current->pid, pgd);
 		return;
+	}
 
 	if ( for_pte_pgd(pgd, pf_vaddr, __hga_readunlock) < 0 )
 		return;
-	if ( set_page_data(pgd, pf_vaddr, readlocked->resolved_page) < 0 )
+	if ( set_unit_data(pgd, pf_vaddr, readlocked->resolved_page) < 0 )
 		/* Shouldn't happen */
 		for_pte_pgd(pgd, pf_vaddr, __hga_readlock);
 	else
@@ -379,13 +505,13 @@ static inline void __handle_usermode_read_violation(pgd_t *pgd,
 }
 
 static inline void __handle_usermode_read_missingpage(pgd_t *pgd,
-	unsigned long pf_vaddr, struct pt_regs* regs, unsigned long error_code) {
+	unsigned long pf_vaddr, struct pt_regs* regs, unsigned long error_code,
+	unsigned long address) {
 
-	do_page_fault_t pfault =
-		(do_page_fault_t)addr_dft_do_page_fault;
 	pfn_t pfn = {.val = pf_vaddr>>PAGE_SHIFT};
 	struct readlock *readlocked =
 		readlock_list_find(pending_readlocks, pgd, pfn);
+	char *page;
 
 	/*
 	 * Remember that it is okay for for_pte_pgd
@@ -393,16 +519,31 @@ static inline void __handle_usermode_read_missingpage(pgd_t *pgd,
 	 * read to trigger another page fault.
 	 */
 
+	/* The read waits for the window it warms up */
+	if ( !readlocked && warm_pages && __warm_range(pgd, pf_vaddr) == 0 )
+		return;
+
 	if ( !readlocked ) {
-		pfault(regs, error_code);
+		__pfault(regs, error_code, address);
+		/* First touch of a page pushed ahead of us */
+		if ( (page = __take_prefetched(pgd, pf_vaddr)) ) {
+			if ( set_unit_data(pgd, pf_vaddr, page) < 0 ) {
+				lease_drop(leasectx, pf_vaddr, pgd);
+				srvcom_return_lease(srvctx, pf_vaddr, current->pid, pgd);
+			}
+			kfree(page);
+		}
 		return;
 	}
 
-	if ( !readlocked->resolved_page )
+	if ( !readlocked->resolved_page
+		&& __resolve_prefetched(pgd, pf_vaddr, pfn) < 0 ) {
+		lease_renew(leasectx, pf_vaddr, current->pid, pgd);
 		return;
+	}
 
-	pfault(regs, error_code);
-	if ( set_page_data(pgd, pf_vaddr, readlocked->resolved_page) < 0 )
+	__pfault(regs, error_code, address);
+	if ( set_unit_data(pgd, pf_vaddr, readlocked->resolved_page) < 0 )
 		/* Shouldn't happen */
 		for_pte_pgd(pgd, pf_vaddr, __hga_readlock);
 	else
@@ -412,6 +553,131 @@ static inline void __handle_usermode_read_missingpage(pgd_t *pgd,
 
 }
 
+/*
+ * Take the copy of a page the server pushed ahead of this read
+ * (see struct hga_push) and start the lease it came with, as a
+ * GRANT_LEASE would.
+ *
+ * @return The copy, to be freed with kfree, or NULL if there
+ * is none
+ */
+static char *__take_prefetched(pgd_t *pgd, unsigned long pf_vaddr) {
+
+	unsigned int msecs;
+	char *page;
+
+	if ( !(page = prefetch_take(prefetchctx, pf_vaddr, pgd, &msecs)) )
+		return NULL;
+
+	if ( lease_hold(leasectx, pf_vaddr, current->pid, pgd, msecs, 0) < 0 ) {
+		kfree(page);
+		return NULL;
+	}
+
+	return page;
+
+}
+
+/*
+ * Resolve a read-locked page with a pushed copy, saving the
+ * INITIAL_READ round-trip.
+ *
+ * @return 0 if the readlock was resolved, -1 otherwise
+ */
+static int __resolve_prefetched(pgd_t *pgd, unsigned long pf_vaddr, pfn_t pfn) {
+
+	char *page;
+	int err;
+
+	if ( !(page = __take_prefetched(pgd, pf_vaddr)) )
+		return -1;
+
+	if ( (err = readlock_list_resolve(pending_readlocks, pgd, pfn, page)) < 0 ) {
+		lease_drop(leasectx, pf_vaddr, pgd);
+		srvcom_return_lease(srvctx, pf_vaddr, current->pid, pgd);
+	}
+	kfree(page);
+
+	return err;
+
+}
+
+/*
+ * Warm up the window of warm_pages pages around a page read
+ * for the first time: map them like on a first write, block
+ * their reads and ask for all of them with one bulk read (see
+ * struct hga_range). The frames that come back put them in
+ * place in one pass (see handle_ev_resume_range), instead of a
+ * fault and a round-trip for each. Pages touched before are
+ * ours already and left alone.
+ *
+ * Takes mmap_sem, faults the window in with get_user_pages
+ * and waits on the server, so it only runs once the handler
+ * has turned interrupts back on (see my_do_page_fault).
+ *
+ * @return 0 if the page at pf_vaddr is read with the window,
+ * -1 if it is to be faulted in as usual
+ */
+static int __warm_range(pgd_t *pgd, unsigned long pf_vaddr) {
+
+	struct mm_struct *mm = current->mm;
+	struct vm_area_struct *vma;
+	struct hga_tlb_batch batch = HGA_TLB_BATCH(pgd);
+	unsigned long window, start, end, addr;
+	pfn_t pfn;
+
+	if ( pf_vaddr & HGA_HUGE_BIT )
+		return -1;
+
+	/* Interrupted with interrupts off, nothing here may sleep */
+	if ( irqs_disabled() )
+		return -1;
+
+	window = rounddown_pow_of_two(warm_pages) << PAGE_SHIFT;
+
+	down_read(&mm->mmap_sem);
+
+	vma = find_vma(mm, pf_vaddr);
+	if ( !vma || vma->vm_start > pf_vaddr ) {
+		up_read(&mm->mmap_sem);
+		return -1;
+	}
+	start = max(pf_vaddr & ~(window - 1), vma->vm_start);
+	end = min((pf_vaddr & ~(window - 1)) + window, vma->vm_end);
+
+	for ( addr = start; addr < end; addr += PAGE_SIZE ) {
+
+		if ( !task_shares(current, addr)
+			|| pte_huge_pgd(pgd, addr) == 1
+			|| for_pte_pgd(pgd, addr, __hga_marked) == 1 )
+			continue;
+
+		if ( get_user_pages(addr, 1, FOLL_WRITE, NULL, NULL) != 1
+			|| for_pte_pgd(pgd, addr, __hga_shareable) != 1 )
+			continue;
+
+		/* Flushed for the whole window at once */
+		pfn.val = addr >> PAGE_SHIFT;
+		for_pte_pgd_batch(pgd, addr, __hga_mark, &batch);
+		for_pte_pgd_batch(pgd, addr, __hga_writelock, &batch);
+		for_pte_pgd_batch(pgd, addr, __hga_readlock, &batch);
+		if ( readlock_list_add_pending(pending_readlocks, pgd, pfn) < 0 )
+			for_pte_pgd(pgd, addr, __hga_readunlock);
+
+	}
+
+	hga_tlb_flush(&batch);
+	up_read(&mm->mmap_sem);
+
+	if ( srvcom_initial_read_range(srvctx, start,
+		(end - start) >> PAGE_SHIFT, current->pid, pgd) < 0 )
+		printk(KERN_INFO "WARNING: Range read request failed");
+
+	pfn.val = pf_vaddr >> PAGE_SHIFT;
+	return readlock_list_find(pending_readlocks, pgd, pfn) ? 0 : -1;
+
+}
+
 #undef IS_USERMODE_READ_MISSINGPAGE
 #undef IS_USERMODE_WRITE_VIOLATION
 #undef IS_USERMODE_READ_VIOLATION
@@ -445,10 +711,23 @@ static int my_fault_init(void) {
 	// get the address of 'adjust_exception_frame' from pv_irq_ops struct
 	addr_adjust_exception_frame = *(unsigned long *)(addr_pv_irq_ops + 0x30);
 
-	if ( __init_srvcom() < 0 )
+	/* Before the first fault asks whether its process is a target */
+	task_funcs_init();
+	if ( pte_funcs_init() < 0 )
 		return -1;
+
+	/* The srvcom handlers take pending_readlocks as callback data */
 	if ( __init_readlocks() < 0 )
 		return -1;
+	/* Pages are served to peers before we can own any */
+	if ( __init_peercom() < 0 )
+		return -1;
+	if ( __init_srvcom() < 0 )
+		return -1;
+
+	/* Targets may be registered from here on */
+	if ( control_init() < 0 )
+		return -1;
 
 	return 0;
 
@@ -456,18 +735,46 @@ static int my_fault_init(void) {
 
 static int __init_srvcom(void) {
 
+	int i;
+
 	if ( !(srvctx = srvcom_ctx_new()) ) {
 		printk(KERN_INFO "__init_srvcom: Failed allocation");
 		return -1;
 	}
 
-	srvcom_set_serv_addr(srvctx, SERVER_IP, SERVER_PORT);
+	for ( i = 0; i < nr_server_ports; i++ )
+		srvcom_add_serv_addr(srvctx, server_ip, server_ports[i]);
+	srvcom_set_token(srvctx, share_token);
+	srvcom_set_peer(srvctx, peerctx);
+
+	/* Used only if the server hands out leases for our token */
+	if ( !(prefetchctx = prefetch_ctx_new()) ) {
+		printk(KERN_INFO "__init_srvcom: Failed prefetch allocation");
+		return -1;
+	}
+	if ( !(leasectx = lease_ctx_new(srvctx, pending_readlocks, prefetchctx)) ) {
+		printk(KERN_INFO "__init_srvcom: Failed lease allocation");
+		return -1;
+	}
 
 	/* srvcom context, opcode, callback, callback data */
-	srvcom_register_handler(srvctx, OPCODE_ALLOW_WRITE, handle_ev_allow_write, NULL);
+	srvcom_register_handler(srvctx, OPCODE_ALLOW_WRITE, handle_ev_allow_write, leasectx);
+	srvcom_register_handler(srvctx, OPCODE_ALLOW_SHARED_WRITE, handle_ev_allow_shared_write, pending_readlocks);
 	srvcom_register_handler(srvctx, OPCODE_LOCK_READ, handle_ev_lock_read, pending_readlocks);
 	srvcom_register_handler(srvctx, OPCODE_RESUME_READ, handle_ev_resume_read, pending_readlocks);
+	srvcom_register_handler(srvctx, OPCODE_RESUME_BLOCKS, handle_ev_resume_blocks, pending_readlocks);
+	srvcom_register_handler(srvctx, OPCODE_RESUME_CHUNK, handle_ev_resume_chunk, pending_readlocks);
+	srvcom_register_handler(srvctx, OPCODE_RESUME_RANGE, handle_ev_resume_range, leasectx);
 	srvcom_register_handler(srvctx, OPCODE_PING_ALIVE, handle_ev_ping_alive, NULL);
+	srvcom_register_handler(srvctx, OPCODE_GRANT_LEASE, handle_ev_grant_lease, leasectx);
+	srvcom_register_handler(srvctx, OPCODE_NOT_MODIFIED, handle_ev_not_modified, leasectx);
+	srvcom_register_handler(srvctx, OPCODE_PUSH_PAGE, handle_ev_push_page, leasectx);
+	srvcom_register_handler(srvctx, OPCODE_KEEP_HOME, handle_ev_keep_home, NULL);
+	srvcom_register_handler(srvctx, OPCODE_RECALL_HOME, handle_ev_recall_home, NULL);
+	if ( peerctx ) {
+		srvcom_register_handler(srvctx, OPCODE_FETCH_PEER, handle_ev_fetch_peer, peerctx);
+		srvcom_register_handler(srvctx, OPCODE_PEER_HOSTS, handle_ev_peer_hosts, peerctx);
+	}
 
 	if ( srvcom_run(srvctx) < 0 ) {
 		printk(KERN_INFO "__init_srvcom: Failed to start srvcom");
@@ -478,10 +785,37 @@ static int __init_srvcom(void) {
 
 }
 
+/* Only in forwarding mode */
+static int __init_peercom(void) {
+
+	if ( !peer_port )
+		return 0;
+
+	if ( !(peerctx = peercom_ctx_new(peer_port,
+		share_token, pending_readlocks)) ) {
+		printk(KERN_INFO "__init_peercom: Failed allocation");
+		return -1;
+	}
+
+	if ( peercom_run(peerctx) < 0 ) {
+		printk(KERN_INFO "__init_peercom: Failed to start peercom");
+		return -1;
+	}
+
+	return 0;
+
+}
+
 static int __init_readlocks(void) {
 
+	if ( readlock_cache_init() < 0 ) {
+		printk(KERN_INFO "__init_readlocks: Failed cache creation");
+		return -1;
+	}
+
 	if ( !(pending_readlocks = readlock_list_new()) ) {
 		printk(KERN_INFO "__init_readlocks: Failed allocation");
+		readlock_cache_exit();
 		return -1;
 	}
 
@@ -493,7 +827,12 @@ static int __init_readlocks(void) {
 
 static void my_fault_exit(void) {
 
+	control_exit();
+	task_funcs_exit();
 	__exit_srvcom();
+	__exit_leases();
+	__exit_prefetch();
+	__exit_peercom();
 	__exit_readlocks();
 
 	return;
@@ -502,7 +841,35 @@ static void my_fault_exit(void) {
 
 static void __exit_srvcom(void) {
 
+	home_exit(srvctx);
 	srvcom_exit(srvctx);
+	resume_chunks_exit();
+
+	return;
+
+}
+
+/* After srvcom, so no grant can restart a lease */
+static void __exit_leases(void) {
+
+	lease_ctx_exit(leasectx);
+
+	return;
+
+}
+
+/* After srvcom, so no page is staged any more */
+static void __exit_prefetch(void) {
+
+	prefetch_ctx_exit(prefetchctx);
+
+	return;
+
+}
+
+static void __exit_peercom(void) {
+
+	peercom_exit(peerctx);
 
 	return;
 
@@ -511,6 +878,7 @@ static void __exit_srvcom(void) {
 static void __exit_readlocks(void) {
 
 	readlock_list_free(pending_readlocks);
+	readlock_cache_exit();
 
 	return;
 
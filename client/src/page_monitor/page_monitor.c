@@ -41,6 +41,7 @@
 #include <linux/semaphore.h>
 #include <linux/moduleparam.h>
 
+#include "../common/hga_defs.h"
 #include "../pte_funcs/pte_funcs.h"
 #include "../page_monitor/page_monitor.h"
 #include "../symfind/symfind.h"
@@ -72,9 +73,9 @@ DEFINE_SPINLOCK(mon_lock);
 
 #ifdef PAGE_MONITOR_FULLCOMPARE
 
-static int pages_equal(char *p1, char *p2) {
+static int pages_equal(char *p1, char *p2, unsigned long size) {
 
-	int retval = (memcmp(p1, p2, PAGE_SIZE) == 0) ? 1 : 0;
+	int retval = (memcmp(p1, p2, size) == 0) ? 1 : 0;
 
 	return retval;
 
@@ -86,8 +87,8 @@ static int pages_equal(char *p1, char *p2) {
 
 /*
  * Page monitor thread:
- *    Wait until the page containing the virtual address
- *    info->addr is no longer being modified, then call
+ *    Wait until the page (or huge unit, see hga_unit_size())
+ *    at info->addr is no longer being modified, then call
  *    info->callback with argument info->cb_data. We are
  *    only concerned with detecting write inactivity and
  *    do not guarantee that the callback reads the same
@@ -101,8 +102,8 @@ static int __waitout_write(void *cb_data) {
 
 #ifdef PAGE_MONITOR_FULLCOMPARE
 #define __EXIT(x) {			\
-	kfree(old_page);		\
-	kfree(new_page);		\
+	kvfree(old_page);		\
+	kvfree(new_page);		\
 	return x;			\
 }
 #else /* PAGE_MONITOR_FULLCOMPARE */
@@ -122,16 +123,17 @@ static int __waitout_write(void *cb_data) {
 
 	char *old_page;
 	char *new_page;
+	unsigned long size = hga_unit_size(info->addr);
 
-	if ( !(old_page = kmalloc(PAGE_SIZE, GFP_KERNEL)) )
+	if ( !(old_page = hga_unit_alloc(info->addr)) )
 		return -1;
 
-	if ( !(new_page = kmalloc(PAGE_SIZE, GFP_KERNEL)) ) {
-		kfree(old_page);
+	if ( !(new_page = hga_unit_alloc(info->addr)) ) {
+		kvfree(old_page);
 		return -1;
 	}
 
-	if ( get_page_data(info->pgd, info->addr, new_page) < 0 ) {
+	if ( get_unit_data(info->pgd, info->addr, new_page) < 0 ) {
 		printk(KERN_ERR "page_monitor: Faulty page table, initial page fetch failed");
 		__ERROR_EXIT;
 	}
@@ -146,7 +148,7 @@ static int __waitout_write(void *cb_data) {
 
 		int page_inactive;
 
-		memcpy(old_page, new_page, PAGE_SIZE);
+		memcpy(old_page, new_page, size);
 
 #else /* PAGE_MONITOR_FULLCOMPARE */
 
@@ -166,13 +168,13 @@ static int __waitout_write(void *cb_data) {
 
 #ifdef PAGE_MONITOR_FULLCOMPARE
 
-		if ( get_page_data(info->pgd, info->addr, new_page) < 0 ) {
+		if ( get_unit_data(info->pgd, info->addr, new_page) < 0 ) {
 			printk(KERN_ERR "page_monitor: Faulty page table, new page fetch failed");
 			__ERROR_EXIT;
 		}
 
 		/* Check if page was modified while we were asleep */
-		page_inactive = pages_equal(old_page, new_page);
+		page_inactive = pages_equal(old_page, new_page, size);
 
 		if ( page_inactive )
 			break; /* Assume the process stopped writing */
@@ -223,7 +225,8 @@ static int __waitout_write(void *cb_data) {
 
 
 
-int get_page_data(pgd_t *pgd, unsigned long addr, char *page_buf) {
+/* Frame mapped at addr, which may be inside a 2 MiB page */
+static struct page *__mapped_page(pgd_t *pgd, unsigned long addr) {
 
 	pgd_t *pgd_entry;
 	pud_t *pud_entry;
@@ -233,57 +236,89 @@ int get_page_data(pgd_t *pgd, unsigned long addr, char *page_buf) {
 
 	pgd_entry = pgd + pgd_index(addr);
 	if ( pgd_none(*pgd_entry) || pgd_bad(*pgd_entry) )
-		return -1;
+		return NULL;
 
 	pud_entry = pud_offset(pgd_entry, addr);
 	if ( pud_none(*pud_entry) || pud_bad(*pud_entry) )
-		return -1;
+		return NULL;
 
 	pmd_entry = pmd_offset(pud_entry, addr);
-	if ( pmd_none(*pmd_entry) || pmd_bad(*pmd_entry) )
-		return -1;
+	if ( pmd_none(*pmd_entry) )
+		return NULL;
+
+	/* The frames of a 2 MiB page are contiguous */
+	if ( pmd_large(*pmd_entry) )
+		return pmd_page(*pmd_entry) + ((addr & ~PMD_MASK) >> PAGE_SHIFT);
+
+	if ( pmd_bad(*pmd_entry) )
+		return NULL;
 
 	pte_entry = pte_offset_kernel(pmd_entry, addr);
 	if ( !pte_entry )
-		return -1;
+		return NULL;
 
 	page = pte_page(*pte_entry);
-	memcpy(page_buf, page_address(page), PAGE_SIZE);
 
 	pte_unmap(pte_entry);
 
-	return 0;
+	return page;
 
 }
 
-int set_page_data(pgd_t *pgd, unsigned long addr, char *page_buf) {
+int get_page_data(pgd_t *pgd, unsigned long addr, char *page_buf) {
 
-	pgd_t *pgd_entry;
-	pud_t *pud_entry;
-	pmd_t *pmd_entry;
-	pte_t *pte_entry;
 	struct page *page;
 
-	pgd_entry = pgd + pgd_index(addr);
-	if ( pgd_none(*pgd_entry) || pgd_bad(*pgd_entry) )
+	if ( !(page = __mapped_page(pgd, addr)) )
 		return -1;
 
-	pud_entry = pud_offset(pgd_entry, addr);
-	if ( pud_none(*pud_entry) || pud_bad(*pud_entry) )
-		return -1;
+	memcpy(page_buf, page_address(page), PAGE_SIZE);
 
-	pmd_entry = pmd_offset(pud_entry, addr);
-	if ( pmd_none(*pmd_entry) || pmd_bad(*pmd_entry) )
-		return -1;
+	return 0;
 
-	pte_entry = pte_offset_kernel(pmd_entry, addr);
-	if ( !pte_entry )
+}
+
+int set_page_data(pgd_t *pgd, unsigned long addr, char *page_buf) {
+
+	struct page *page;
+
+	if ( !(page = __mapped_page(pgd, addr)) )
 		return -1;
 
-	page = pte_page(*pte_entry);
 	memcpy(page_address(page), page_buf, PAGE_SIZE);
 
-	pte_unmap(pte_entry);
+	return 0;
+
+}
+
+/* Copy out the page or huge unit at addr, see hga_unit_size() */
+int get_unit_data(pgd_t *pgd, unsigned long addr, char *buf) {
+
+	unsigned long off;
+
+	if ( !(addr & HGA_HUGE_BIT) )
+		return get_page_data(pgd, addr, buf);
+
+	addr &= PMD_MASK;
+	for ( off = 0; off < HGA_HUGE_SIZE; off += PAGE_SIZE )
+		if ( get_page_data(pgd, addr + off, buf + off) < 0 )
+			return -1;
+
+	return 0;
+
+}
+
+int set_unit_data(pgd_t *pgd, unsigned long addr, char *buf) {
+
+	unsigned long off;
+
+	if ( !(addr & HGA_HUGE_BIT) )
+		return set_page_data(pgd, addr, buf);
+
+	addr &= PMD_MASK;
+	for ( off = 0; off < HGA_HUGE_SIZE; off += PAGE_SIZE )
+		if ( set_page_data(pgd, addr + off, buf + off) < 0 )
+			return -1;
 
 	return 0;
 
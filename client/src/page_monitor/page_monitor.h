@@ -23,6 +23,8 @@ typedef int (*page_monitor_cb_t)(void*);
 
 int get_page_data(pgd_t *pgd, unsigned long addr, char *page_buf);
 int set_page_data(pgd_t *pgd, unsigned long addr, char *page_buf);
+int get_unit_data(pgd_t *pgd, unsigned long addr, char *buf);
+int set_unit_data(pgd_t *pgd, unsigned long addr, char *buf);
 int page_monitor_waitout_write(pgd_t *pgd, unsigned long addr,
 	page_monitor_cb_t callback, void *cb_data);
 
@@ -0,0 +1,562 @@
+
+
+
+/*
+
+	DESCRIPTION:
+		Page transfers between HGA client modules
+		in forwarding mode
+
+*/
+
+
+
+#ifndef PEERCOM_C
+#define PEERCOM_C
+
+
+
+#include <linux/slab.h>
+#include <linux/sched/mm.h>
+#include <linux/delay.h>
+#include <linux/pfn_t.h>
+#include <linux/kthread.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/socket.h>
+#include <linux/net.h>
+#include <linux/in.h>
+#include <net/sock.h>
+
+#include "../ksock/ksock.h"
+#include "../srvcom/srvcom.h"
+#include "../peercom/peercom.h"
+#include "../pte_funcs/pte_funcs.h"
+#include "../page_monitor/page_monitor.h"
+
+
+
+#define DFT_TIMEOUT_MSECS	10
+#define CONN_BACKLOG		16
+/* A page read from a peer takes one round trip on a new connection */
+#define PEER_TIMEOUT_MSECS	200
+#define PEER_FETCH_TRIES	4
+#define PEER_RETRY_MSECS	50
+
+
+
+struct peercom_fetch {
+
+	struct peercom_ctx *ctx;
+
+	unsigned long vaddr;
+	pgd_t *pgd;
+	struct hga_peer owner;
+
+};
+
+
+
+static inline unsigned long peercom_key(unsigned long vaddr, pgd_t *pgd) {
+
+	return (vaddr >> PAGE_SHIFT) ^ (unsigned long)pgd;
+
+}
+
+/* Call with ctx->lock held */
+static struct peercom_page *__peercom_find(struct peercom_ctx *ctx,
+	unsigned long vaddr, pgd_t *pgd) {
+
+	struct peercom_page *page;
+
+	vaddr &= PAGE_MASK;
+	hash_for_each_possible(ctx->owned, page, node, peercom_key(vaddr, pgd)) {
+		if ( page->vaddr == vaddr && page->pgd == pgd )
+			return page;
+	}
+
+	return NULL;
+
+}
+
+/* Call with ctx->lock held */
+static struct peercom_host *__peercom_find_host(struct peercom_ctx *ctx,
+	__be32 ip) {
+
+	struct peercom_host *host;
+
+	hash_for_each_possible(ctx->hosts, host, node, (u32)ip) {
+		if ( host->ip == ip )
+			return host;
+	}
+
+	return NULL;
+
+}
+
+/*
+ * Look up the page a PEER_READ asks for. pgd is only used as a
+ * key. On success the address space is held with mmget() and
+ * the pgd to walk is returned in *pgd_out; release it with
+ * mmput(). A page whose process is gone is forgotten.
+ *
+ * @return The mm of the page, or NULL if it is not served
+ */
+static struct mm_struct *peercom_lookup(struct peercom_ctx *ctx,
+	__be32 ip, unsigned long vaddr, pgd_t *pgd, pgd_t **pgd_out) {
+
+	struct peercom_page *page, *dead = NULL;
+	struct mm_struct *mm = NULL;
+
+	spin_lock(&ctx->lock);
+	if ( __peercom_find_host(ctx, ip)
+		&& (page = __peercom_find(ctx, vaddr, pgd)) ) {
+		if ( mmget_not_zero(page->mm) ) {
+			mm = page->mm;
+			*pgd_out = page->pgd;
+		} else {
+			hash_del(&page->node);
+			dead = page;
+		}
+	}
+	spin_unlock(&ctx->lock);
+
+	if ( dead ) {
+		mmdrop(dead->mm);
+		kfree(dead);
+	}
+
+	return mm;
+
+}
+
+static int peercom_send(struct socket *sock, struct srvcom_msg *msg) {
+
+	return ksock_send(sock, (char*)msg,
+		sizeof(msg->hdr) + msg->hdr.payload_len);
+
+}
+
+static int peercom_timeout_recv(struct socket *sock, struct srvcom_msg *msg,
+	unsigned long msec_timeout) {
+
+	int err_code;
+
+	/* Receive header */
+	err_code = ksock_recv_timeout(sock, (char*)&msg->hdr,
+		sizeof(msg->hdr), msec_timeout);
+	if ( err_code != 0 )
+		return err_code;
+
+	/* Receive payload */
+	if ( msg->hdr.payload_len < 0 || msg->hdr.payload_len > PAGE_SIZE )
+		return -1;
+
+	return ksock_recv(sock, (char*)&msg->data, msg->hdr.payload_len);
+
+}
+
+/*
+ * Answer one PEER_READ from ip. Only pages released by a commit
+ * (write locked again) are served; a page being written is not
+ * stable.
+ */
+static void peercom_serve(struct peercom_ctx *ctx, struct socket *conn_sock,
+	__be32 ip, struct srvcom_msg *msg) {
+
+	unsigned long vaddr;
+	struct mm_struct *mm = NULL;
+	pgd_t *pgd = NULL;
+
+	if ( peercom_timeout_recv(conn_sock, msg, ctx->msec_timeout) != 0 )
+		return;
+
+	vaddr = msg->hdr.vaddr;
+	if (	(msg->hdr.mcode.op.code == OPCODE_PEER_READ.code)
+		&& (msg->hdr.token == ctx->token)
+	)
+		mm = peercom_lookup(ctx, ip, vaddr, msg->hdr.pgd, &pgd);
+
+	if (	!mm
+		|| (for_pte_pgd(pgd, vaddr, __hga_writelocked) != 1)
+		|| (get_page_data(pgd, vaddr, msg->data.payload) < 0)
+	) {
+		msg->hdr.mcode = (srvcom_code_t)ACKCODE_OP_FAILURE;
+		msg->hdr.payload_len = 0;
+	} else {
+		msg->hdr.mcode = (srvcom_code_t)ACKCODE_PEER_READ;
+		msg->hdr.payload_len = PAGE_SIZE;
+	}
+
+	if ( mm )
+		mmput(mm);
+
+	if ( peercom_send(conn_sock, msg) < 0 )
+		printk(KERN_INFO "peercom_serve: Lost connection");
+
+	return;
+
+}
+
+/*
+ * Listener thread
+ *    Started in peercom_run(). Peers connect once per page
+ *    and the request is answered on the listener thread.
+ */
+static int peercom_listener_thread(void *thrdata) {
+
+	struct peercom_ctx *ctx =
+		(struct peercom_ctx*)thrdata;
+	struct srvcom_msg *msg;
+
+	allow_signal(SIGKILL|SIGTERM);
+
+	msg = (struct srvcom_msg*)kmalloc(
+		sizeof(struct srvcom_msg) + PAGE_SIZE, GFP_KERNEL);
+	if ( !msg ) {
+		printk(KERN_INFO "peercom_listener_thread: Allocation failure");
+		goto out;
+	}
+
+	while ( !kthread_should_stop() ) {
+
+		struct socket *conn_sock;
+		struct sockaddr_in peer_addr;
+		int addr_len = sizeof(peer_addr);
+
+		conn_sock = ksock_accept(ctx->listener_sock,
+			(struct sockaddr*)&peer_addr, &addr_len);
+		if ( !conn_sock ) {
+			msleep_interruptible(ctx->msec_timeout);
+			continue;
+		}
+
+		peercom_serve(ctx, conn_sock, peer_addr.sin_addr.s_addr, msg);
+		ksock_socket_destroy(conn_sock);
+
+	}
+
+out:
+	kfree(msg);
+
+	/* Stay around for kthread_stop() in peercom_exit() */
+	while ( !kthread_should_stop() ) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if ( !kthread_should_stop() )
+			schedule();
+		__set_current_state(TASK_RUNNING);
+	}
+
+	return 0;
+
+}
+
+/* @return 0 if the page was read into msg, -1 otherwise */
+static int __peercom_read(struct peercom_fetch *fetch, struct srvcom_msg *msg) {
+
+	int err_code = -1;
+	struct socket *sock;
+	struct sockaddr_in owner_addr;
+
+	if ( !(sock = ksock_socket_create()) )
+		return -1;
+
+	memset(&owner_addr, 0, sizeof(owner_addr));
+	owner_addr.sin_family = PF_INET;
+	owner_addr.sin_port = fetch->owner.port;
+	owner_addr.sin_addr.s_addr = fetch->owner.ip;
+
+	if ( ksock_connect(sock, (struct sockaddr*)&owner_addr,
+		sizeof(owner_addr)) < 0 )
+		goto out;
+
+	/* Addressed to the owner's process, not ours */
+	msg->hdr.mcode = (srvcom_code_t)OPCODE_PEER_READ;
+	msg->hdr.vaddr = fetch->vaddr;
+	msg->hdr.client_pid = fetch->owner.pid;
+	msg->hdr.token = fetch->ctx->token;
+	msg->hdr.pgd = fetch->owner.pgd;
+	msg->hdr.payload_len = 0;
+
+	if ( peercom_send(sock, msg) < 0 )
+		goto out;
+	if ( peercom_timeout_recv(sock, msg, PEER_TIMEOUT_MSECS) != 0 )
+		goto out;
+
+	if (	(msg->hdr.mcode.ack.code == ACKCODE_PEER_READ.code)
+		&& (msg->hdr.vaddr == fetch->vaddr)
+		&& (msg->hdr.payload_len == PAGE_SIZE)
+	)
+		err_code = 0;
+
+out:
+	ksock_socket_destroy(sock);
+	return err_code;
+
+}
+
+/* Fetch thread, started by peercom_fetch() for every page */
+static int peercom_fetch_thread(void *thrdata) {
+
+	struct peercom_fetch *fetch =
+		(struct peercom_fetch*)thrdata;
+	struct peercom_ctx *ctx = fetch->ctx;
+	const pfn_t pfn = {.val = fetch->vaddr>>PAGE_SHIFT};
+	int n_tries_remaining = PEER_FETCH_TRIES;
+	struct srvcom_msg *msg;
+
+	msg = (struct srvcom_msg*)kmalloc(
+		sizeof(struct srvcom_msg) + PAGE_SIZE, GFP_KERNEL);
+	if ( !msg ) {
+		printk(KERN_INFO "peercom_fetch_thread: Allocation failure");
+		goto out;
+	}
+
+	while ( n_tries_remaining --> 0 ) {
+		if ( __peercom_read(fetch, msg) == 0 )
+			break;
+		msleep(PEER_RETRY_MSECS);
+	}
+
+	if ( n_tries_remaining < 0 )
+		printk(KERN_ERR "WARNING: Failed to fetch page %p "
+			"from its owner", (void*)fetch->vaddr);
+	else if ( readlock_list_resolve(ctx->pending_readlocks,
+		fetch->pgd, pfn, msg->data.payload) < 0 )
+		printk(KERN_INFO "peercom_fetch_thread: Nothing to resolve");
+
+out:
+	kfree(msg);
+	kfree(fetch);
+	atomic_dec(&ctx->n_fetches);
+
+	return 0;
+
+}
+
+
+
+struct peercom_ctx *peercom_ctx_new(int port, pid_t token,
+	struct readlock_list *pending_readlocks) {
+
+	struct peercom_ctx *ctx;
+
+	if ( !(ctx = kmalloc(sizeof(struct peercom_ctx), GFP_KERNEL)) ) {
+		printk(KERN_ERR "peercom: Context allocation failure");
+		return NULL;
+	}
+
+	ctx->port = port;
+	ctx->token = token;
+	ctx->msec_timeout = DFT_TIMEOUT_MSECS;
+	ctx->listener_sock = NULL;
+	ctx->listener_thread = NULL;
+	ctx->pending_readlocks = pending_readlocks;
+	atomic_set(&ctx->n_fetches, 0);
+	hash_init(ctx->owned);
+	hash_init(ctx->hosts);
+	spin_lock_init(&ctx->lock);
+
+	return ctx;
+
+}
+
+int peercom_run(struct peercom_ctx *ctx) {
+
+	struct sockaddr_in addr;
+
+	if ( !(ctx->listener_sock = ksock_socket_create()) )
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = PF_INET;
+	addr.sin_port = htons(ctx->port);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+	if ( ksock_bind(ctx->listener_sock,
+		(struct sockaddr*)&addr, sizeof(addr)) < 0 ) {
+		printk(KERN_ERR "peercom_run: Failed to bind port %d", ctx->port);
+		goto err;
+	}
+	if ( ksock_listen(ctx->listener_sock, CONN_BACKLOG) < 0 )
+		goto err;
+
+	ctx->listener_thread = kthread_run(peercom_listener_thread,
+		ctx, "hga_peercom/%d", ctx->port);
+	if ( IS_ERR(ctx->listener_thread) ) {
+		ctx->listener_thread = NULL;
+		goto err;
+	}
+
+	return 0;
+
+err:
+	ksock_socket_destroy(ctx->listener_sock);
+	ctx->listener_sock = NULL;
+	return -1;
+
+}
+
+/*
+ * Read a page from its owner and resolve the pending readlock
+ * with it. Runs in a thread of its own so that the listener
+ * thread can acknowledge FETCH_PEER right away.
+ *
+ * @return 0 if the fetch was started, -1 otherwise
+ */
+int peercom_fetch(struct peercom_ctx *ctx, unsigned long vaddr,
+	pgd_t *pgd, const struct hga_peer *owner) {
+
+	struct peercom_fetch *fetch;
+	struct task_struct *thread;
+
+	if ( !(fetch = kmalloc(sizeof(struct peercom_fetch), GFP_KERNEL)) )
+		return -1;
+
+	fetch->ctx = ctx;
+	fetch->vaddr = vaddr;
+	fetch->pgd = pgd;
+	memcpy(&fetch->owner, owner, sizeof(struct hga_peer));
+
+	atomic_inc(&ctx->n_fetches);
+	thread = kthread_run(peercom_fetch_thread, fetch, "hga_peerfetch");
+	if ( IS_ERR(thread) ) {
+		atomic_dec(&ctx->n_fetches);
+		kfree(fetch);
+		return -1;
+	}
+
+	return 0;
+
+}
+
+/*
+ * List a written page as ours to serve, before it is committed
+ * with COMMIT_OWNER. A page stays listed until a PEER_READ
+ * finds its process gone; while it is written again the write
+ * lock keeps it from being served.
+ *
+ * @return 0 on success, -1 if the page cannot be served
+ */
+int peercom_own(struct peercom_ctx *ctx, unsigned long vaddr, pgd_t *pgd) {
+
+	struct peercom_page *page;
+	struct mm_struct *mm;
+
+	if ( !ctx || !(mm = pgd_mm(pgd)) )
+		return -1;
+
+	/* Usually the page was owned before */
+	spin_lock(&ctx->lock);
+	page = __peercom_find(ctx, vaddr, pgd);
+	spin_unlock(&ctx->lock);
+	if ( page )
+		return 0;
+
+	if ( !(page = kmalloc(sizeof(struct peercom_page), GFP_KERNEL)) )
+		return -1;
+
+	spin_lock(&ctx->lock);
+	if ( __peercom_find(ctx, vaddr, pgd) ) {
+		spin_unlock(&ctx->lock);
+		kfree(page);
+		return 0;
+	}
+	page->vaddr = vaddr & PAGE_MASK;
+	page->pgd = pgd;
+	page->mm = mm;
+	mmgrab(mm);
+	hash_add(ctx->owned, &page->node, peercom_key(page->vaddr, pgd));
+	spin_unlock(&ctx->lock);
+
+	return 0;
+
+}
+
+/*
+ * Allow the hosts the server is about to send here with
+ * FETCH_PEER. Hosts are never dropped: they are the other
+ * nodes of the token, which keep coming back.
+ */
+void peercom_allow_hosts(struct peercom_ctx *ctx,
+	const struct hga_peer_hosts *hosts) {
+
+	u32 i, count = min_t(u32, hosts->count, HGA_PEER_HOSTS_MAX);
+
+	for ( i = 0; i < count; i++ ) {
+
+		struct peercom_host *host;
+
+		if ( !hosts->ip[i] )
+			continue;
+
+		spin_lock(&ctx->lock);
+		host = __peercom_find_host(ctx, hosts->ip[i]);
+		spin_unlock(&ctx->lock);
+		if ( host )
+			continue;
+
+		if ( !(host = kmalloc(sizeof(struct peercom_host), GFP_KERNEL)) ) {
+			printk(KERN_ERR "peercom_allow_hosts: Allocation failure");
+			return;
+		}
+		host->ip = hosts->ip[i];
+
+		/* Another shard's listener may have added it meanwhile */
+		spin_lock(&ctx->lock);
+		if ( __peercom_find_host(ctx, host->ip) ) {
+			spin_unlock(&ctx->lock);
+			kfree(host);
+			continue;
+		}
+		hash_add(ctx->hosts, &host->node, (u32)host->ip);
+		spin_unlock(&ctx->lock);
+
+	}
+
+	return;
+
+}
+
+void peercom_exit(struct peercom_ctx *ctx) {
+
+	struct peercom_page *page;
+	struct peercom_host *host;
+	struct hlist_node *tmp;
+	int bkt;
+
+	if ( !ctx )
+		return;
+
+	if ( ctx->listener_thread )
+		kthread_stop(ctx->listener_thread);
+	if ( ctx->listener_sock )
+		ksock_socket_destroy(ctx->listener_sock);
+
+	/* Fetch threads use the context until they finish */
+	while ( atomic_read(&ctx->n_fetches) > 0 )
+		msleep(PEER_RETRY_MSECS);
+
+	hash_for_each_safe(ctx->owned, bkt, tmp, page, node) {
+		hash_del(&page->node);
+		mmdrop(page->mm);
+		kfree(page);
+	}
+	hash_for_each_safe(ctx->hosts, bkt, tmp, host, node) {
+		hash_del(&host->node);
+		kfree(host);
+	}
+
+	kfree(ctx);
+
+	return;
+
+}
+
+
+
+MODULE_LICENSE("Dual BSD/GPL");
+
+
+
+#endif /* PEERCOM_C */
@@ -0,0 +1,105 @@
+
+
+
+#ifndef PEERCOM_H
+#define PEERCOM_H
+
+
+
+#include <linux/hashtable.h>
+#include <linux/spinlock.h>
+#include <linux/kthread.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/socket.h>
+#include <linux/net.h>
+#include <linux/in.h>
+#include <net/sock.h>
+
+#include "../common/hga_defs.h"
+#include "../readlock_list/readlock_list.h"
+
+
+
+/* Owned pages and hosts are hashed in 1 << PEERCOM_HASH_BITS buckets */
+#define PEERCOM_HASH_BITS 8
+
+
+
+/*
+ * Page committed with COMMIT_OWNER, see peercom_own(). The mm
+ * is held with mmgrab() so that pgd cannot be freed and reused
+ * while it is listed.
+ */
+struct peercom_page {
+
+	struct hlist_node node;
+
+	unsigned long vaddr;
+	pgd_t *pgd;
+	struct mm_struct *mm;
+
+};
+
+/* Host the server sent to read from us, see peercom_allow_hosts() */
+struct peercom_host {
+
+	struct hlist_node node;
+	__be32 ip;
+
+};
+
+/*
+ * Page transfers between HGA client modules (forwarding mode).
+ *
+ * After a write this node keeps the page and the server only
+ * records it as the owner. Readers are sent FETCH_PEER with the
+ * owner's address and read the page from the owner's peercom
+ * listener with a PEER_READ over a connection of their own, so
+ * page data never goes through the server.
+ *
+ * Nothing in a PEER_READ is trusted: only hosts the server
+ * announced with PEER_HOSTS are answered, and only for pages
+ * this node committed with COMMIT_OWNER. The pgd of the request
+ * is just compared with the ones listed, never walked.
+ */
+struct peercom_ctx {
+
+	int port;
+	pid_t token;
+	long msec_timeout;
+
+	struct socket *listener_sock;
+	struct task_struct *listener_thread;
+
+	/* Resolved with the fetched pages */
+	struct readlock_list *pending_readlocks;
+
+	/* Fetch threads still running */
+	atomic_t n_fetches;
+
+	DECLARE_HASHTABLE(owned, PEERCOM_HASH_BITS);
+	DECLARE_HASHTABLE(hosts, PEERCOM_HASH_BITS);
+	spinlock_t lock;
+
+};
+
+
+
+struct peercom_ctx *peercom_ctx_new(int port, pid_t token,
+	struct readlock_list *pending_readlocks);
+int peercom_run(struct peercom_ctx *ctx);
+int peercom_fetch(struct peercom_ctx *ctx, unsigned long vaddr,
+	pgd_t *pgd, const struct hga_peer *owner);
+int peercom_own(struct peercom_ctx *ctx, unsigned long vaddr, pgd_t *pgd);
+void peercom_allow_hosts(struct peercom_ctx *ctx,
+	const struct hga_peer_hosts *hosts);
+void peercom_exit(struct peercom_ctx *ctx);
+
+
+
+MODULE_LICENSE("Dual BSD/GPL");
+
+
+
+#endif /* PEERCOM_H */
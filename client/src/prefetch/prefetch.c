@@ -0,0 +1,228 @@
+/*
+
+	DESCRIPTION:
+		Staging of pages pushed ahead of reads
+
+*/
+
+
+
+#ifndef PREFETCH_C
+#define PREFETCH_C
+
+
+
+#include <linux/slab.h>
+#include <linux/jiffies.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+
+#include "../prefetch/prefetch.h"
+
+
+
+static inline unsigned long prefetch_key(unsigned long vaddr, pgd_t *pgd) {
+
+	return (vaddr >> PAGE_SHIFT) ^ (unsigned long)pgd;
+
+}
+
+/* Call with ctx->lock held */
+static struct prefetch_entry *__prefetch_find(struct prefetch_ctx *ctx,
+	unsigned long vaddr, pgd_t *pgd) {
+
+	struct prefetch_entry *entry;
+
+	vaddr &= PAGE_MASK;
+	hash_for_each_possible(ctx->entries, entry, node, prefetch_key(vaddr, pgd)) {
+		if ( entry->vaddr == vaddr && entry->pgd == pgd )
+			return entry;
+	}
+
+	return NULL;
+
+}
+
+/* Call with ctx->lock held */
+static void __prefetch_unlink(struct prefetch_ctx *ctx,
+	struct prefetch_entry *entry) {
+
+	hash_del(&entry->node);
+	list_del(&entry->list);
+	ctx->nr_staged--;
+
+	return;
+
+}
+
+static void prefetch_free(struct prefetch_entry *entry) {
+
+	if ( !entry )
+		return;
+
+	kfree(entry->data);
+	kfree(entry);
+
+	return;
+
+}
+
+
+
+struct prefetch_ctx *prefetch_ctx_new(void) {
+
+	struct prefetch_ctx *ctx;
+
+	if ( !(ctx = kmalloc(sizeof(struct prefetch_ctx), GFP_KERNEL)) ) {
+		printk(KERN_ERR "prefetch: Context allocation failure");
+		return NULL;
+	}
+
+	hash_init(ctx->entries);
+	INIT_LIST_HEAD(&ctx->staged);
+	ctx->nr_staged = 0;
+	spin_lock_init(&ctx->lock);
+	atomic_long_set(&ctx->nr_hits, 0);
+	atomic_long_set(&ctx->nr_wasted, 0);
+
+	return ctx;
+
+}
+
+/*
+ * Stage a page pushed by the server, replacing an older push
+ * of it. Makes room by dropping the oldest page if needed.
+ *
+ * @return 0 on success, -1 on failure
+ */
+int prefetch_stage(struct prefetch_ctx *ctx, unsigned long vaddr,
+	pgd_t *pgd, const char *page, unsigned int msecs) {
+
+	struct prefetch_entry *entry, *old, *oldest = NULL;
+
+	if ( !(entry = kmalloc(sizeof(struct prefetch_entry), GFP_KERNEL)) )
+		return -1;
+	if ( !(entry->data = kmalloc(PAGE_SIZE, GFP_KERNEL)) ) {
+		kfree(entry);
+		return -1;
+	}
+	memcpy(entry->data, page, PAGE_SIZE);
+	entry->pgd = pgd;
+	entry->vaddr = vaddr & PAGE_MASK;
+	entry->msecs = msecs;
+	entry->since = jiffies;
+
+	spin_lock(&ctx->lock);
+
+	if ( (old = __prefetch_find(ctx, vaddr, pgd)) )
+		__prefetch_unlink(ctx, old);
+	else if ( ctx->nr_staged >= PREFETCH_MAX_PAGES ) {
+		oldest = list_first_entry(&ctx->staged,
+			struct prefetch_entry, list);
+		__prefetch_unlink(ctx, oldest);
+	}
+
+	hash_add(ctx->entries, &entry->node,
+		prefetch_key(entry->vaddr, pgd));
+	list_add_tail(&entry->list, &ctx->staged);
+	ctx->nr_staged++;
+
+	spin_unlock(&ctx->lock);
+
+	if ( old || oldest )
+		atomic_long_inc(&ctx->nr_wasted);
+	prefetch_free(old);
+	prefetch_free(oldest);
+
+	return 0;
+
+}
+
+/*
+ * Take the staged copy of a page, on a read fault. A copy
+ * whose lease ran out is dropped.
+ *
+ * @return The copy, to be freed with kfree, with the time
+ * left on its lease in msecs; NULL if there is none
+ */
+char *prefetch_take(struct prefetch_ctx *ctx, unsigned long vaddr,
+	pgd_t *pgd, unsigned int *msecs) {
+
+	struct prefetch_entry *entry;
+	unsigned int elapsed;
+	char *data;
+
+	spin_lock(&ctx->lock);
+	if ( (entry = __prefetch_find(ctx, vaddr, pgd)) )
+		__prefetch_unlink(ctx, entry);
+	spin_unlock(&ctx->lock);
+
+	if ( !entry )
+		return NULL;
+
+	elapsed = jiffies_to_msecs(jiffies - entry->since);
+	if ( elapsed >= entry->msecs ) {
+		atomic_long_inc(&ctx->nr_wasted);
+		prefetch_free(entry);
+		return NULL;
+	}
+
+	atomic_long_inc(&ctx->nr_hits);
+	*msecs = entry->msecs - elapsed;
+	data = entry->data;
+	kfree(entry);
+
+	return data;
+
+}
+
+/* Drop the staged copy of a page, e.g. one we are about to write */
+void prefetch_drop(struct prefetch_ctx *ctx, unsigned long vaddr, pgd_t *pgd) {
+
+	struct prefetch_entry *entry;
+
+	spin_lock(&ctx->lock);
+	if ( (entry = __prefetch_find(ctx, vaddr, pgd)) )
+		__prefetch_unlink(ctx, entry);
+	spin_unlock(&ctx->lock);
+
+	if ( !entry )
+		return;
+
+	atomic_long_inc(&ctx->nr_wasted);
+	prefetch_free(entry);
+
+	return;
+
+}
+
+void prefetch_ctx_exit(struct prefetch_ctx *ctx) {
+
+	struct prefetch_entry *entry, *next;
+
+	if ( !ctx )
+		return;
+
+	/* Nothing stages pages any more */
+	list_for_each_entry_safe(entry, next, &ctx->staged, list) {
+		atomic_long_inc(&ctx->nr_wasted);
+		prefetch_free(entry);
+	}
+
+	printk(KERN_INFO "prefetch: %ld pages read, %ld dropped unread",
+		atomic_long_read(&ctx->nr_hits),
+		atomic_long_read(&ctx->nr_wasted));
+
+	kfree(ctx);
+
+	return;
+
+}
+
+
+
+MODULE_LICENSE("Dual BSD/GPL");
+
+
+
+#endif /* PREFETCH_C */
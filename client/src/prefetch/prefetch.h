@@ -0,0 +1,83 @@
+
+
+
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+
+
+#include <linux/hashtable.h>
+#include <linux/spinlock.h>
+#include <linux/atomic.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/types.h>
+#include <linux/list.h>
+#include <linux/mm.h>
+
+
+
+/* Staged pages are hashed in 1 << PREFETCH_HASH_BITS buckets */
+#define PREFETCH_HASH_BITS 6
+/* Staged pages kept at most, the oldest is dropped beyond */
+#define PREFETCH_MAX_PAGES 256
+
+
+
+/* Page pushed by the server that was not read yet */
+struct prefetch_entry {
+
+	struct hlist_node node;
+	/* Position in prefetch_ctx.staged, oldest first */
+	struct list_head list;
+
+	pgd_t *pgd;
+	unsigned long vaddr;
+
+	/* Lease the page came with, from when it arrived */
+	unsigned int msecs;
+	unsigned long since;
+
+	char *data;
+
+};
+
+/*
+ * Pages pushed ahead of our reads (see struct hga_push).
+ *
+ * The server pushes the pages after the ones a process reads in
+ * order, each under a lease. They are staged here until a read
+ * fault on the page, which takes the copy instead of sending
+ * INITIAL_READ, or until the lease runs out. Our own write to a
+ * page drops its copy, which it makes out of date.
+ */
+struct prefetch_ctx {
+
+	DECLARE_HASHTABLE(entries, PREFETCH_HASH_BITS);
+	struct list_head staged;
+	unsigned int nr_staged;
+	spinlock_t lock;
+
+	/* Staged pages that were read, and ones dropped unread */
+	atomic_long_t nr_hits;
+	atomic_long_t nr_wasted;
+
+};
+
+
+
+struct prefetch_ctx *prefetch_ctx_new(void);
+int prefetch_stage(struct prefetch_ctx *ctx, unsigned long vaddr,
+	pgd_t *pgd, const char *page, unsigned int msecs);
+char *prefetch_take(struct prefetch_ctx *ctx, unsigned long vaddr,
+	pgd_t *pgd, unsigned int *msecs);
+void prefetch_drop(struct prefetch_ctx *ctx, unsigned long vaddr, pgd_t *pgd);
+void prefetch_ctx_exit(struct prefetch_ctx *ctx);
+
+
+
+MODULE_LICENSE("Dual BSD/GPL");
+
+
+
+#endif /* PREFETCH_H */
@@ -21,60 +21,65 @@
 #include <linux/moduleparam.h>
 #include <linux/vmalloc.h>
 
+#include "../symfind/symfind.h"
 #include "../pte_funcs/pte_funcs.h"
 
 
 
-#define PT_EDIT_MODE(statements) {	\
-	unsigned long __cr0;		\
-	preempt_disable();		\
-	barrier();			\
-	__cr0 = read_cr0();		\
-	write_cr0(__cr0 & ~X86_CR0_WP);	\
-	{statements;}			\
-	write_cr0(__cr0);		\
-	barrier();			\
-	preempt_enable();		\
-	__flush_tlb();			\
+typedef void (*flush_tlb_mm_range_t)(struct mm_struct *mm,
+	unsigned long start, unsigned long end, unsigned long vmflag);
+
+/* Not exported, looked up by pte_funcs_init */
+static flush_tlb_mm_range_t flush_tlb_mm_range_fn;
+
+
+
+/*
+ * Set and clear flags of an entry in one atomic exchange, so
+ * that no accessed or dirty bit the MMU sets meanwhile is lost.
+ * The entry is only written if it changes.
+ *
+ * @return The entry as it was
+ */
+static pteval_t pte_modify_flags(pte_t *pte_entry, pteval_t set, pteval_t clear) {
+
+	pteval_t old, new;
+
+	do {
+		old = READ_ONCE(pte_entry->pte);
+		new = (old | set) & ~clear;
+	} while ( new != old && cmpxchg(&pte_entry->pte, old, new) != old );
+
+	return old;
+
 }
 
 /* Setters/Clearers */
-#define __HGA_MARK(pte_entry) { /* Associate a page with this module */	\
-	PT_EDIT_MODE(							\
-		*(pte_entry) =						\
-			pte_set_flags(*(pte_entry), _PAGE_PCD);		\
-	)								\
-}
-#define __HGA_WRITELOCK(pte_entry) { /* Only write with permission */	\
-	PT_EDIT_MODE(							\
-		*(pte_entry) =						\
-			pte_clear_flags(*(pte_entry), _PAGE_RW);	\
-	)								\
-}
-#define __HGA_WRITEUNLOCK(pte_entry) { /* Free to write */		\
-	PT_EDIT_MODE(							\
-		*(pte_entry) =						\
-			pte_set_flags(*(pte_entry), _PAGE_RW);		\
-	)								\
-}
-#define __HGA_READLOCK(pte_entry) { /* Only read with permission */	\
-	PT_EDIT_MODE(							\
-		*(pte_entry) =						\
-			pte_clear_flags(*(pte_entry), _PAGE_USER);	\
-	)								\
-}
-#define __HGA_READUNLOCK(pte_entry) { /* Free to read */		\
-	PT_EDIT_MODE(							\
-		*(pte_entry) =						\
-			pte_set_flags(*(pte_entry), _PAGE_USER);	\
-	)								\
-}
+#define __HGA_MARK(pte_entry) /* Associate a page with this module */	\
+	pte_modify_flags(pte_entry, _PAGE_PCD, 0)
+#define __HGA_WRITELOCK(pte_entry) /* Only write with permission */	\
+	pte_modify_flags(pte_entry, 0, _PAGE_RW)
+#define __HGA_WRITEUNLOCK(pte_entry) /* Free to write */		\
+	pte_modify_flags(pte_entry, _PAGE_RW, 0)
+#define __HGA_READLOCK(pte_entry) /* Only read with permission */	\
+	pte_modify_flags(pte_entry, 0, _PAGE_USER)
+#define __HGA_READUNLOCK(pte_entry) /* Free to read */		\
+	pte_modify_flags(pte_entry, _PAGE_USER, 0)
+
+/*
+ * Whether the TLBs may hold more than an entry now allows. Only
+ * taking a right away has to be flushed: a stale entry with
+ * fewer rights faults, and a fault drops it from the TLB.
+ */
+#define __HGA_NEEDS_FLUSH(old, new) \
+	((pte_val(old) & ~pte_val(new)) != 0)
 
 /* Testers */
 #define __HGA_MARKED(pte_entry) (pte_flags(*(pte_entry)) & _PAGE_PCD)
 #define __HGA_WRITEUNLOCKED(pte_entry) (pte_flags(*(pte_entry)) & _PAGE_RW)
 #define __HGA_READUNLOCKED(pte_entry) (pte_flags(*(pte_entry)) & _PAGE_USER)
 #define __HGA_SHAREABLE(pte_entry) (pte_flags(*(pte_entry)) & _PAGE_NX)
+#define __HGA_PRESENT(pte_entry) (pte_flags(*(pte_entry)) & _PAGE_PRESENT)
 
 
 
@@ -88,6 +93,7 @@ int __hga_marked(pte_t *pte_entry) {return __HGA_MARKED(pte_entry)?1:0;}
 int __hga_writelocked(pte_t *pte_entry) {return __HGA_WRITEUNLOCKED(pte_entry)?0:1;}
 int __hga_readlocked(pte_t *pte_entry) {return __HGA_READUNLOCKED(pte_entry)?0:1;}
 int __hga_shareable(pte_t *pte_entry) {return __HGA_SHAREABLE(pte_entry)?1:0;}
+int __hga_present(pte_t *pte_entry) {return __HGA_PRESENT(pte_entry)?1:0;}
 int __hga_printflags(pte_t *pte_entry) {
 
 #define FOR_BIT(bitid) printk(KERN_INFO "    Bit _PAGE_" #bitid " is %s...", (flags & ( _PAGE_ ## bitid )) ? "set" : "clear");
@@ -127,14 +133,87 @@ int __hga_printflags(pte_t *pte_entry) {
 
 }
 
-int for_pte_pgd(pgd_t *pgd, unsigned long addr, pte_handler_t pte_handler) {
+int pte_funcs_init(void) {
 
-	int retval;
+	flush_tlb_mm_range_fn = (flush_tlb_mm_range_t)
+		find_sym_address("flush_tlb_mm_range");
+	if ( !flush_tlb_mm_range_fn ) {
+		printk(KERN_ERR "pte_funcs: flush_tlb_mm_range not found");
+		return -1;
+	}
+
+	return 0;
+
+}
+
+/*
+ * The mm a pgd belongs to, which x86-64 keeps in the page of
+ * the pgd (see pgd_set_mm), or NULL if it does not match.
+ */
+struct mm_struct *pgd_mm(pgd_t *pgd) {
+
+	struct mm_struct *mm =
+		(struct mm_struct*)virt_to_page(pgd)->index;
+
+	return mm && mm->pgd == pgd ? mm : NULL;
+
+}
+
+/* Add the unit at addr to the range a batch is to flush */
+void hga_tlb_batch_add(struct hga_tlb_batch *batch, unsigned long addr,
+	bool huge) {
+
+	unsigned long size = huge ? HPAGE_PMD_SIZE : PAGE_SIZE;
+
+	addr &= ~(size - 1);
+	if ( batch->start >= batch->end ) {
+		batch->start = addr;
+		batch->end = addr + size;
+		batch->huge = huge;
+		return;
+	}
+
+	batch->start = min(batch->start, addr);
+	batch->end = max(batch->end, addr + size);
+	batch->huge |= huge;
+
+}
+
+/*
+ * Shoot the range of a batch down on every CPU the mm of its
+ * pgd may be cached on, and start the batch anew. If pgd_mm
+ * cannot tell the mm, the range is flushed everywhere.
+ *
+ * Sends IPIs, so interrupts must be on; the fault handler
+ * turns them back on before it gets here.
+ */
+void hga_tlb_flush(struct hga_tlb_batch *batch) {
+
+	struct mm_struct *mm;
+
+	if ( batch->start >= batch->end )
+		return;
+
+	if ( (mm = pgd_mm(batch->pgd)) )
+		flush_tlb_mm_range_fn(mm, batch->start, batch->end,
+			batch->huge ? VM_HUGETLB : VM_NONE);
+	else
+		flush_tlb_all();
+
+	batch->start = batch->end = 0;
+	batch->huge = false;
+
+}
+
+/*
+ * Whether addr is mapped by a 2 MiB page. Returns 1 if it is,
+ * 0 if it is mapped by a PTE and -1 if it is not mapped.
+ */
+int pte_huge_pgd(pgd_t *pgd, unsigned long addr) {
 
 	pgd_t *pgd_entry;
 	pud_t *pud_entry;
 	pmd_t *pmd_entry;
-	pte_t *pte_entry;
 
 	pgd_entry = pgd + pgd_index(addr);
 	if ( pgd_none(*pgd_entry) || pgd_bad(*pgd_entry) )
@@ -145,24 +224,101 @@ int for_pte_pgd(pgd_t *pgd, unsigned long addr, pte_handler_t pte_handler) {
 		return -1;
 
 	pmd_entry = pmd_offset(pud_entry, addr);
-	if ( pmd_none(*pmd_entry) || pmd_bad(*pmd_entry) )
+	if ( pmd_none(*pmd_entry) )
 		return -1;
 
-	pte_entry = pte_offset_map(pmd_entry, addr);
-	if ( !pte_entry )
+	return pmd_large(*pmd_entry) ? 1 : 0;
+
+}
+
+/*
+ * Walk to the entry of addr in mm and lock it. Returns 0 with
+ * the entry held in pte, to be released with hga_pte_unlock,
+ * or -1 if addr is not mapped.
+ */
+int hga_pte_lock(struct mm_struct *mm, unsigned long addr, struct hga_pte *pte) {
+
+	pgd_t *pgd_entry;
+	pud_t *pud_entry;
+	pmd_t *pmd_entry;
+
+	if ( !mm )
 		return -1;
 
-	retval = pte_handler(pte_entry);
+	pgd_entry = pgd_offset(mm, addr);
+	if ( pgd_none(*pgd_entry) || pgd_bad(*pgd_entry) )
+		return -1;
 
-	pte_unmap(pte_entry);
+	pud_entry = pud_offset(pgd_entry, addr);
+	if ( pud_none(*pud_entry) || pud_bad(*pud_entry) )
+		return -1;
 
-	return retval;
+	pmd_entry = pmd_offset(pud_entry, addr);
+	if ( pmd_none(*pmd_entry) )
+		return -1;
+
+	pte->mm = mm;
+	pte->addr = addr;
+	pte->changed = false;
+
+	/* A 2 MiB page has no PTEs, its PMD has the same flags */
+	if ( pmd_large(*pmd_entry) ) {
+		pte->ptl = pmd_lock(mm, pmd_entry);
+		/* Split while we were getting the lock */
+		if ( !pmd_large(*pmd_entry) ) {
+			spin_unlock(pte->ptl);
+			return -1;
+		}
+		pte->entry = (pte_t*)pmd_entry;
+		pte->huge = true;
+		return 0;
+	}
+
+	if ( pmd_bad(*pmd_entry) )
+		return -1;
+
+	pte->entry = pte_offset_map_lock(mm, pmd_entry, addr, &pte->ptl);
+	if ( !pte->entry )
+		return -1;
+	pte->huge = false;
+
+	return 0;
 
 }
 
-int for_pte(struct mm_struct *mm, unsigned long addr, pte_handler_t pte_handler) {
+/* Set and clear flags of a locked entry */
+void hga_pte_update(struct hga_pte *pte, pteval_t set, pteval_t clear) {
+
+	pte_t old = {.pte = pte_modify_flags(pte->entry, set, clear)};
+
+	if ( __HGA_NEEDS_FLUSH(old, *pte->entry) )
+		pte->changed = true;
+
+}
+
+/* Release an entry taken with hga_pte_lock */
+void hga_pte_unlock(struct hga_pte *pte) {
+
+	struct hga_tlb_batch batch = HGA_TLB_BATCH(pte->mm->pgd);
+
+	if ( pte->huge )
+		spin_unlock(pte->ptl);
+	else
+		pte_unmap_unlock(pte->entry, pte->ptl);
 
-#define _DBG_ printk(KERN_INFO "for_pte[%p]::At %d...", (void*)addr, __LINE__);
+	if ( pte->changed ) {
+		hga_tlb_batch_add(&batch, pte->addr, pte->huge);
+		hga_tlb_flush(&batch);
+	}
+
+}
+
+/*
+ * Run pte_handler on the entry of addr. What it takes away is
+ * added to batch, to be flushed with hga_tlb_flush.
+ */
+int for_pte_pgd_batch(pgd_t *pgd, unsigned long addr,
+	pte_handler_t pte_handler, struct hga_tlb_batch *batch) {
 
 	int retval;
 
@@ -170,11 +326,9 @@ int for_pte(struct mm_struct *mm, unsigned long addr, pte_handler_t pte_handler)
 	pud_t *pud_entry;
 	pmd_t *pmd_entry;
 	pte_t *pte_entry;
+	pte_t old;
 
-	if ( !mm )
-		return -1;
-
-	pgd_entry = pgd_offset(mm, addr);
+	pgd_entry = pgd + pgd_index(addr);
 	if ( pgd_none(*pgd_entry) || pgd_bad(*pgd_entry) )
 		return -1;
 
@@ -183,23 +337,56 @@ int for_pte(struct mm_struct *mm, unsigned long addr, pte_handler_t pte_handler)
 		return -1;
 
 	pmd_entry = pmd_offset(pud_entry, addr);
-	if ( pmd_none(*pmd_entry) || pmd_bad(*pmd_entry) )
+	if ( pmd_none(*pmd_entry) )
+		return -1;
+
+	/* A 2 MiB page has no PTEs, its PMD has the same flags */
+	if ( pmd_large(*pmd_entry) ) {
+		old = *(pte_t*)pmd_entry;
+		retval = pte_handler((pte_t*)pmd_entry);
+		if ( __HGA_NEEDS_FLUSH(old, *(pte_t*)pmd_entry) )
+			hga_tlb_batch_add(batch, addr, true);
+		return retval;
+	}
+
+	if ( pmd_bad(*pmd_entry) )
 		return -1;
 
 	pte_entry = pte_offset_map(pmd_entry, addr);
 	if ( !pte_entry )
 		return -1;
 
+	old = *pte_entry;
 	retval = pte_handler(pte_entry);
+	if ( __HGA_NEEDS_FLUSH(old, *pte_entry) )
+		hga_tlb_batch_add(batch, addr, false);
 
 	pte_unmap(pte_entry);
 
 	return retval;
 
-#undef _DBG_
+}
+
+int for_pte_pgd(pgd_t *pgd, unsigned long addr, pte_handler_t pte_handler) {
+
+	struct hga_tlb_batch batch = HGA_TLB_BATCH(pgd);
+	int retval;
+
+	retval = for_pte_pgd_batch(pgd, addr, pte_handler, &batch);
+	hga_tlb_flush(&batch);
+
+	return retval;
 
 }
 
+int for_pte(struct mm_struct *mm, unsigned long addr, pte_handler_t pte_handler) {
+
+	if ( !mm )
+		return -1;
+
+	return for_pte_pgd(mm->pgd, addr, pte_handler);
+
+}
 
 
 MODULE_LICENSE("Dual BSD/GPL");
@@ -22,6 +22,50 @@
 
 typedef int (*pte_handler_t)(pte_t*);
 
+/* What the flags of an entry stand for, see struct hga_pte */
+#define HGA_PTE_PRESENT		_PAGE_PRESENT
+#define HGA_PTE_SHAREABLE	_PAGE_NX
+#define HGA_PTE_MARKED		_PAGE_PCD
+#define HGA_PTE_WRITABLE	_PAGE_RW
+#define HGA_PTE_READABLE	_PAGE_USER
+
+/*
+ * Entry of an address held under its page table lock, so that
+ * a sequence of tests and changes is made with a single walk
+ * and nothing changes the entry in between. Changes are shot
+ * down once, when the entry is unlocked.
+ */
+struct hga_pte {
+
+	pte_t *entry;
+	spinlock_t *ptl;
+	struct mm_struct *mm;
+	unsigned long addr;
+	/* The entry is the PMD of a 2 MiB page */
+	bool huge;
+	/* Lost a right since it was locked, to be flushed */
+	bool changed;
+
+};
+
+/*
+ * Range of the address space of pgd whose TLB entries are to
+ * be flushed, so that changes to many pages are shot down on
+ * the CPUs using them at once.
+ */
+struct hga_tlb_batch {
+
+	pgd_t *pgd;
+	unsigned long start;
+	unsigned long end;
+	/* Has 2 MiB pages in it */
+	bool huge;
+
+};
+
+#define HGA_TLB_BATCH(pgd_ptr) \
+	{.pgd = (pgd_ptr), .start = 0, .end = 0, .huge = false}
+
 
 
 // PTE handlers - later to be updated
@@ -34,13 +78,35 @@ int __hga_marked(pte_t *pte_entry);
 int __hga_writelocked(pte_t *pte_entry);
 int __hga_readlocked(pte_t *pte_entry);
 int __hga_shareable(pte_t *pte_entry);
+int __hga_present(pte_t *pte_entry);
 int __hga_printflags(pte_t *pte_entry);
 
+int pte_funcs_init(void);
+void hga_tlb_batch_add(struct hga_tlb_batch *batch, unsigned long addr,
+	bool huge);
+void hga_tlb_flush(struct hga_tlb_batch *batch);
+
+int pte_huge_pgd(pgd_t *pgd, unsigned long addr);
+struct mm_struct *pgd_mm(pgd_t *pgd);
+int hga_pte_lock(struct mm_struct *mm, unsigned long addr, struct hga_pte *pte);
+void hga_pte_update(struct hga_pte *pte, pteval_t set, pteval_t clear);
+void hga_pte_unlock(struct hga_pte *pte);
 int for_pte_pgd(pgd_t *pgd, unsigned long addr, pte_handler_t pte_handler);
+int for_pte_pgd_batch(pgd_t *pgd, unsigned long addr,
+	pte_handler_t pte_handler, struct hga_tlb_batch *batch);
 int for_pte(struct mm_struct *mm, unsigned long addr, pte_handler_t pte_handler);
 
 
 
+/* Returns 1 if all of the flags are set in the locked entry and 0 otherwise */
+static inline int hga_pte_test(struct hga_pte *pte, pteval_t flags) {
+
+	return (pte_flags(*pte->entry) & flags) == flags ? 1 : 0;
+
+}
+
+
+
 MODULE_LICENSE("Dual BSD/GPL");
 
 
@@ -41,6 +41,7 @@
 #ifdef __HGA_KERNEL
 
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
 #include <linux/pfn_t.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
@@ -48,7 +49,11 @@
 #include <asm/pgtable_types.h>
 
 #define __RL_ALLOC(n) kmalloc(n, GFP_KERNEL)
-#define __RL_FREE(ptr) kfree(ptr)
+/* Huge units are resolved with vmalloc()ed buffers */
+#define __RL_FREE(ptr) kvfree(ptr)
+/* Nodes are allocated with the list lock held */
+#define __RL_NODE_ALLOC() kmem_cache_alloc(readlock_cache, GFP_ATOMIC)
+#define __RL_NODE_FREE(ptr) kmem_cache_free(readlock_cache, ptr)
 #define __RL_PRINT(str, ...) printk(KERN_INFO str, ##__VA_ARGS__)
 #define __RL_WARN(str, ...) printk(KERN_ERR "WARNING: " str, ##__VA_ARGS__)
 #define __RL_ERROR(str, ...) printk(KERN_ERR "ERROR: " str, ##__VA_ARGS__)
@@ -61,6 +66,8 @@
 
 #define __RL_ALLOC(n) malloc(n)
 #define __RL_FREE(ptr) free(ptr)
+#define __RL_NODE_ALLOC() calloc(1, sizeof(struct readlock))
+#define __RL_NODE_FREE(ptr) free(ptr)
 #define __RL_PRINT(str, ...) printf(str "\n", ##__VA_ARGS__)
 #define __RL_WARN(str, ...) printf("WARNING: " str "\n", ##__VA_ARGS__)
 #define __RL_ERROR(str, ...) printf("ERROR: " str "\n", ##__VA_ARGS__)
@@ -73,10 +80,41 @@
 
 
 
+#ifdef __HGA_KERNEL
+
+/*!
+ * @brief Slab cache for readlock nodes.
+ *
+ * A node is created on every readlock command from the server, so
+ * nodes come from a dedicated cache rather than the generic kmalloc
+ * slabs. Shared by all lists; created by readlock_cache_init.
+ */
+static struct kmem_cache *readlock_cache;
+
+#endif /* __HGA_KERNEL */
+
+
+
 /////////////////////////////////////////////
 ////////////////// HELPERS //////////////////
 /////////////////////////////////////////////
 
+#ifdef __HGA_KERNEL
+
+/*!
+ * @brief Constructor for readlock_cache objects.
+ *
+ * Runs once per slab object, not per allocation. Freed nodes are
+ * returned to the cache in this state (see __free_readlock).
+ */
+static void __readlock_ctor(void *obj) {
+
+	memset(obj, 0, sizeof(struct readlock));
+
+}
+
+#endif /* __HGA_KERNEL */
+
 /*!
  * @brief Allocate memory a readlock list node and initialize
  * with defaults.
@@ -86,15 +124,13 @@
 static struct readlock *__readlock_new(void) {
 
 	struct readlock *readlock =
-		(struct readlock*)__RL_ALLOC(sizeof(struct readlock));
+		(struct readlock*)__RL_NODE_ALLOC();
 
 	if ( !readlock ) {
 		__RL_ERROR("__readlock_new: Memory allocation failure.");
 		return NULL;
 	}
 
-	memset(readlock, 0, sizeof(struct readlock));
-
 	return readlock;
 
 }
@@ -122,7 +158,9 @@ static int __free_readlock(struct readlock *readlock) {
 	if ( readlock->resolved_page )
 		__RL_FREE(readlock->resolved_page);
 
-	__RL_FREE(readlock);
+	/* Hand the node back in its constructed state */
+	memset(readlock, 0, sizeof(struct readlock));
+	__RL_NODE_FREE(readlock);
 
 	return 0;
 
@@ -351,6 +389,47 @@ static int __readlock_list_delete(struct readlock_list *list,
 ////////////////// INTERFACES //////////////////
 ////////////////////////////////////////////////
 
+/*!
+ * @brief Create the slab cache backing readlock nodes.
+ *
+ * Must be called before the first readlock_list_new. Node
+ * usage can be read from /proc/slabinfo as hga_readlock.
+ *
+ * @return 0 on success, or -1 on failure
+ */
+int readlock_cache_init(void) {
+
+#ifdef __HGA_KERNEL
+	readlock_cache = kmem_cache_create("hga_readlock",
+		sizeof(struct readlock), 0, SLAB_HWCACHE_ALIGN,
+		__readlock_ctor);
+	if ( !readlock_cache ) {
+		__RL_ERROR("readlock_cache_init: Cache creation failure.");
+		return -1;
+	}
+#endif /* __HGA_KERNEL */
+
+	return 0;
+
+}
+
+/*!
+ * @brief Destroy the readlock node cache.
+ *
+ * All lists must have been freed with readlock_list_free.
+ */
+void readlock_cache_exit(void) {
+
+#ifdef __HGA_KERNEL
+	if ( readlock_cache )
+		kmem_cache_destroy(readlock_cache);
+	readlock_cache = NULL;
+#endif /* __HGA_KERNEL */
+
+	return;
+
+}
+
 /*!
  * @brief Allocate memory for a readlock_list and initialize
  * with defaults.
@@ -515,6 +594,120 @@ int readlock_list_resolve(struct readlock_list *list, pgd_t *pgd,
 
 }
 
+/*!
+ * @brief Mark a readlock resolved with only the blocks
+ * of the page that changed
+ *
+ * The blocks are patched into the page the readlock was
+ * already resolved with, if there is one. Otherwise they
+ * are patched into base, which becomes the resolved page.
+ *
+ * @param list Pointer to a readlock_list struct
+ * @param pgd Pointer to the PGD
+ * @param pfn Page frame number
+ * @param base Page-sized buffer from __RL_ALLOC holding
+ * the current copy of the page, or NULL if there is none.
+ * The list owns it after the call
+ * @param block_size Size of a block
+ * @param changed Bitmask of the changed blocks
+ * @param blocks The changed blocks, in order
+ *
+ * @return 0 on success, or -1 on failure or if no
+ * readlock matched the given pgd and pfn
+ */
+int readlock_list_resolve_blocks(struct readlock_list *list, pgd_t *pgd,
+	pfn_t pfn, char *base, unsigned int block_size, u64 changed,
+	const char *blocks) {
+
+	int i;
+	char *page;
+	struct readlock *readlock;
+
+	spin_lock(&list->lock);
+
+	readlock = __readlock_list_find(list, __match_readlock,
+		&(struct readlock){.pgd = pgd, .pfn = pfn});
+
+	if ( !readlock ) {
+		/* Shouldn't happen */
+		__RL_WARN("Unable to resolve missing readlock");
+		spin_unlock(&list->lock);
+		__RL_FREE(base);
+		return -1;
+	}
+
+	/* An earlier update is not in the page yet */
+	if ( readlock->resolved_page ) {
+		page = readlock->resolved_page;
+		__RL_FREE(base);
+	} else if ( base ) {
+		page = readlock->resolved_page = base;
+	} else {
+		spin_unlock(&list->lock);
+		return -1;
+	}
+
+	for ( i = 0; i < PAGE_SIZE / block_size; i++ ) {
+		if ( !(changed & (1ULL << i)) )
+			continue;
+		memcpy(page + i * block_size, blocks, block_size);
+		blocks += block_size;
+	}
+
+	spin_unlock(&list->lock);
+
+	return 0;
+
+}
+
+/*!
+ * @brief Mark the readlock of a huge unit resolved with the
+ * unit's data
+ *
+ * Unlike readlock_list_resolve(), the data is not copied: the
+ * unit is too large to be held twice.
+ *
+ * @param list Pointer to a readlock_list struct
+ * @param pgd Pointer to the PGD
+ * @param pfn Page frame number of the unit's first page
+ * @param unit Buffer of hga_unit_alloc() with the unit's data.
+ * The list owns it after the call
+ *
+ * @return 0 on success, or -1 if no readlock matched the
+ * given pgd and pfn
+ */
+int readlock_list_resolve_unit(struct readlock_list *list, pgd_t *pgd,
+	pfn_t pfn, char *unit) {
+
+	char *old;
+	struct readlock *readlock;
+
+	spin_lock(&list->lock);
+
+	readlock = __readlock_list_find(list, __match_readlock,
+		&(struct readlock){.pgd = pgd, .pfn = pfn});
+
+	if ( !readlock ) {
+		/* Shouldn't happen */
+		__RL_WARN("Unable to resolve missing readlock");
+		spin_unlock(&list->lock);
+		__RL_FREE(unit);
+		return -1;
+	}
+
+	/* A newer unit replaces one not put in place yet */
+	old = readlock->resolved_page;
+	readlock->resolved_page = unit;
+
+	spin_unlock(&list->lock);
+
+	if ( old )
+		__RL_FREE(old);
+
+	return 0;
+
+}
+
 /*!
  * @brief Find a readlock node with a specific pgd and pfn
  *
@@ -24,6 +24,9 @@
 
 /*!
  * @brief Node in the readlock_list structure.
+ *
+ * Kept to half a cache line; the list walk only touches
+ * next, pgd and pfn.
  */
 struct readlock {
 
@@ -79,9 +82,15 @@ typedef int (*readlock_callback_nocbdata)(struct readlock*);
 
 
 
+int readlock_cache_init(void);
+void readlock_cache_exit(void);
 struct readlock_list *readlock_list_new(void);
 int readlock_list_add_pending(struct readlock_list *list, pgd_t *pgd, pfn_t pfn);
 int readlock_list_resolve(struct readlock_list *list, pgd_t *pgd, pfn_t pfn, char *page);
+int readlock_list_resolve_blocks(struct readlock_list *list, pgd_t *pgd, pfn_t pfn,
+	char *base, unsigned int block_size, u64 changed, const char *blocks);
+int readlock_list_resolve_unit(struct readlock_list *list, pgd_t *pgd, pfn_t pfn,
+	char *unit);
 struct readlock *readlock_list_find(struct readlock_list *list, pgd_t *pgd, pfn_t pfn);
 int readlock_list_remove(struct readlock_list *list, pgd_t *pgd, pfn_t pfn);
 void readlock_list_print(struct readlock_list *list);
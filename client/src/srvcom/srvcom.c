@@ -16,6 +16,8 @@
 
 
 
+#include <linux/hash.h>
+#include <linux/jiffies.h>
 #include <linux/semaphore.h>
 #include <linux/kthread.h>
 #include <linux/kernel.h>
@@ -28,74 +30,122 @@
 
 #include "../ksock/ksock.h"
 #include "../srvcom/srvcom.h"
+#include "../peercom/peercom.h"
 #include "../common/hga_defs.h"
 
 
 
-#define TRIES_PER_REQUEST	64
 #define DFT_TIMEOUT_MSECS	10
+#define DFT_PENDING_MSECS	1000
 
 #define ISNUM(c) ('0' <= (c) && (c) <= '9')
 #define TONUM(c) ((int)(c - '0'))
 
 
 
-struct srvcom_msg_hdr {
+static int str2ip(const char *ipstr) {
 
-	srvcom_code_t mcode;
+	int ip, i;
 
-	unsigned long vaddr;
-	pid_t pid;
-	pgd_t *pgd;
+	--ipstr;
 
-	int payload_len;
+	for ( i = 0; i < 4; i++ ) {
+		int byte = 0;
+		while ( ISNUM(*++ipstr) )
+			byte = 10*byte + TONUM(*ipstr);
+		ip <<= 8;
+		ip += byte;
+	}
 
-} __attribute__((packed));
+	return ip;
 
-struct srvcom_msg_data {
+}
 
-	char payload[0];
+/* Send a message on behalf of the listener thread of a shard */
+static int srvcom_listener_inject(struct srvcom_shard *shard, struct srvcom_msg *msg) {
 
-} __attribute__((packed));
+	int err_code = -1;
 
-struct srvcom_msg {
+	spin_lock(&shard->inject_lock);
+	if ( shard->sock )
+		err_code = ksock_send(shard->sock, (char*)msg,
+			sizeof(msg->hdr) + msg->hdr.payload_len);
+	spin_unlock(&shard->inject_lock);
 
-	struct srvcom_msg_hdr hdr;
-	struct srvcom_msg_data data;
+	return err_code;
 
-} __attribute__((packed));
+}
 
+/* Shard of the server instance owning the page containing addr */
+static struct srvcom_shard *srvcom_route(struct srvcom_ctx *ctx, unsigned long addr) {
 
+	return &ctx->shards[hga_shard_of(ctx->token, addr, ctx->nr_shards)];
 
-static int str2ip(const char *ipstr) {
+}
 
-	int ip, i;
+static inline int srvcom_pending_slot(unsigned long addr) {
 
-	--ipstr;
+	return hash_long(addr >> PAGE_SHIFT, SRVCOM_PENDING_BITS);
 
-	for ( i = 0; i < 4; i++ ) {
-		int byte = 0;
-		while ( ISNUM(*++ipstr) )
-			byte = 10*byte + TONUM(*ipstr);
-		ip <<= 8;
-		ip += byte;
+}
+
+/* @return 1 if a write request for the page is out, 0 after marking it so */
+static int srvcom_pending_test_set(struct srvcom_ctx *ctx, unsigned long addr) {
+
+	int slot = srvcom_pending_slot(addr);
+	unsigned long page = addr & PAGE_MASK;
+	int pending;
+
+	spin_lock(&ctx->pending_lock);
+	pending = (ctx->pending_writes[slot] == page)
+		&& time_before(jiffies, ctx->pending_since[slot]
+			+ msecs_to_jiffies(ctx->pending_msecs));
+	if ( !pending ) {
+		/* Takes over the slot, a displaced request is just resent */
+		ctx->pending_writes[slot] = page;
+		ctx->pending_since[slot] = jiffies;
 	}
+	spin_unlock(&ctx->pending_lock);
 
-	return ip;
+	return pending;
 
 }
 
-/* Send a message on behalf of the listener thread */
-static int srvcom_listener_inject(struct srvcom_ctx *ctx, struct srvcom_msg *msg) {
+static void srvcom_pending_clear(struct srvcom_ctx *ctx, unsigned long addr) {
 
-	int err_code;
+	int slot = srvcom_pending_slot(addr);
 
-	spin_lock(&ctx->listener_inject_lock);
-	err_code = ksock_send(ctx->listener_sock, (char*)msg,
-		sizeof(msg->hdr) + msg->hdr.payload_len);
-	spin_unlock(&ctx->listener_inject_lock);
+	spin_lock(&ctx->pending_lock);
+	if ( ctx->pending_writes[slot] == (addr & PAGE_MASK) )
+		ctx->pending_writes[slot] = 0;
+	spin_unlock(&ctx->pending_lock);
 
-	return err_code;
+	return;
+
+}
+
+/* Called by the listener thread once its connection is gone */
+static void srvcom_shard_disconnect(struct srvcom_shard *shard) {
+
+	struct socket *sock;
+
+	spin_lock(&shard->inject_lock);
+	sock = shard->sock;
+	shard->sock = NULL;
+	spin_unlock(&shard->inject_lock);
+
+	if ( sock )
+		ksock_socket_destroy(sock);
+
+	/* Stay around for kthread_stop() in srvcom_exit() */
+	while ( !kthread_should_stop() ) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if ( !kthread_should_stop() )
+			schedule();
+		__set_current_state(TASK_RUNNING);
+	}
+
+	return;
 
 }
 
@@ -141,6 +191,11 @@ static int srvcom_timeout_recv(struct socket *sock, struct srvcom_msg *msg,
 	}
 
 	/* Receive payload */
+	if ( msg->hdr.payload_len < 0
+		|| msg->hdr.payload_len > SRVCOM_MAX_PAYLOAD ) {
+		printk(KERN_INFO "srvcom_timeout_recv: Bad payload length");
+		return -1;
+	}
 	err_code = ksock_recv(sock, (char*)&msg->data, msg->hdr.payload_len);
 
 	return err_code;
@@ -149,45 +204,50 @@ static int srvcom_timeout_recv(struct socket *sock, struct srvcom_msg *msg,
 
 /*
  * Listener thread
- *    Started in srvcom_run() after the context is initialized.
- *    The thread will listen for incoming data from the central
- *    server and call the designated handler registered in ctx
- *    with the received message, so if a message response is to
- *    be processed by a handler then send the message on behalf
- *    of this thread through srvcom_listener_inject() to direct
- *    the response to the listener socket.
+ *    Started in srvcom_run() for every shard after the context
+ *    is initialized. The thread will listen for incoming data
+ *    from its server instance and call the designated handler
+ *    registered in ctx with the received message, so if a
+ *    message response is to be processed by a handler then send
+ *    the message on behalf of this thread through
+ *    srvcom_listener_inject() to direct the response to the
+ *    listener socket.
  */
 static int srvcom_listener_thread(void *thrdata) {
 
 	int err_code;
 	struct srvcom_msg *msg;
-	struct srvcom_ctx *ctx =
-		(struct srvcom_ctx*)thrdata;
+	struct srvcom_shard *shard =
+		(struct srvcom_shard*)thrdata;
+	struct srvcom_ctx *ctx = shard->ctx;
+	struct socket *sock;
 
 	allow_signal(SIGKILL|SIGTERM);
 
 	msg = (struct srvcom_msg*)kmalloc(
-		sizeof(struct srvcom_msg) + PAGE_SIZE, GFP_KERNEL);
+		sizeof(struct srvcom_msg) + SRVCOM_MAX_PAYLOAD, GFP_KERNEL);
 	if ( !msg ) {
 		printk(KERN_INFO "srvcom_listener_thread: Allocation failure");
-		return -1;
+		goto out;
 	}
 
-	if ( !(ctx->listener_sock = ksock_socket_create()) ) {
+	if ( !(sock = ksock_socket_create()) ) {
 		printk(KERN_INFO "srvcom_listener_thread: Failed to create socket");
-		kfree(msg);
-		return -1;
+		goto out;
 	}
 
-	err_code = ksock_connect(ctx->listener_sock,
-		(struct sockaddr*)&ctx->serv_addr, sizeof(ctx->serv_addr));
+	err_code = ksock_connect(sock,
+		(struct sockaddr*)&shard->serv_addr, sizeof(shard->serv_addr));
 	if ( err_code < 0 ) {
 		printk(KERN_INFO "srvcom_listener_thread: Failed to connect to server");
-		ksock_socket_destroy(ctx->listener_sock);
-		kfree(msg);
-		return -1;
+		ksock_socket_destroy(sock);
+		goto out;
 	}
 
+	spin_lock(&shard->inject_lock);
+	shard->sock = sock;
+	spin_unlock(&shard->inject_lock);
+
 	while ( !kthread_should_stop() ) {
 
 		int err_code;
@@ -198,17 +258,15 @@ static int srvcom_listener_thread(void *thrdata) {
 
 		unsigned mcode;
 		unsigned long msg_vaddr;
-		pid_t msg_pid;
+		pid_t msg_pid, msg_token;
 		pgd_t *msg_pgd;
 		char *msg_page;
 
 		/* Receive message */
-		err_code = srvcom_timeout_recv(ctx->listener_sock, msg, ctx->msec_timeout);
+		err_code = srvcom_timeout_recv(sock, msg, ctx->msec_timeout);
 		if ( err_code < 0 ) {
 			printk(KERN_INFO "srvcom_listener_thread: Lost connection");
-			ksock_socket_destroy(ctx->listener_sock);
-			kfree(msg);
-			return -1;
+			goto out;
 		} else if ( err_code > 0 ) {
 			printk(KERN_INFO "srvcom_listener_thread: Timed out");
 			continue;
@@ -216,12 +274,15 @@ static int srvcom_listener_thread(void *thrdata) {
 
 		/* Get appropriate handler */
 		mcode = (unsigned)(msg->hdr.mcode.op.code);
+		if ( mcode >= SRVCOM_MAX_HNDLRS )
+			continue;
 		msg_handler = ctx->handlers[mcode];
 		handler_cb_data = ctx->handler_cb_data[mcode];
 
-		/* If permission was granted then reset the try count */
-		if ( msg->hdr.mcode.op.code == OPCODE_ALLOW_WRITE.code )
-			ctx->write_try_count = 0;
+		/* The request was answered, or refused */
+		if ( msg->hdr.mcode.op.code == OPCODE_ALLOW_WRITE.code
+			|| msg->hdr.mcode.ack.code == ACKCODE_OP_FAILURE.code )
+			srvcom_pending_clear(ctx, msg->hdr.vaddr);
 
 		if ( !msg_handler )
 			continue;
@@ -229,7 +290,8 @@ static int srvcom_listener_thread(void *thrdata) {
 		/* Run handler and get response code */
 		msg_vaddr = msg->hdr.vaddr;
 		msg_page = msg->data.payload;
-		msg_pid = msg->hdr.pid;
+		msg_pid = msg->hdr.client_pid;
+		msg_token = msg->hdr.token;
 		msg_pgd = msg->hdr.pgd;
 		ack_code = msg_handler(ctx, msg_vaddr,
 			msg_pid, msg_pgd, msg_page, handler_cb_data);
@@ -240,22 +302,23 @@ static int srvcom_listener_thread(void *thrdata) {
 		/* Send off acknowledgement */
 		ack.hdr.mcode = (srvcom_code_t)ack_code;
 		ack.hdr.vaddr = msg_vaddr;
-		ack.hdr.pid = msg_pid;
+		ack.hdr.client_pid = msg_pid;
+		ack.hdr.token = msg_token;
 		ack.hdr.pgd = msg_pgd;
 		ack.hdr.payload_len = 0;
-		spin_lock(&ctx->listener_inject_lock);
-		err_code = srvcom_send(ctx->listener_sock, &ack);
-		spin_unlock(&ctx->listener_inject_lock);
+		spin_lock(&shard->inject_lock);
+		err_code = srvcom_send(sock, &ack);
+		spin_unlock(&shard->inject_lock);
 		if ( err_code < 0 ) {
 			printk(KERN_INFO "srvcom_listener_thread: Lost connection");
-			ksock_socket_destroy(ctx->listener_sock);
-			kfree(msg);
-			return -1;
+			goto out;
 		}
 
 	}
 
+out:
 	kfree(msg);
+	srvcom_shard_disconnect(shard);
 
 	return 0;
 
@@ -273,24 +336,61 @@ struct srvcom_ctx *srvcom_ctx_new(void) {
 	}
 
 	// Defaults
-	ctx->listener_sock = NULL;
-	memset(&(ctx->serv_addr), 0, sizeof(ctx->serv_addr));
+	memset(ctx->shards, 0, sizeof(ctx->shards));
+	ctx->nr_shards = 0;
+	ctx->token = 0;
 	ctx->msec_timeout = DFT_TIMEOUT_MSECS;
-	ctx->listener_thread = NULL;
 	memset(ctx->handlers, 0, sizeof(ctx->handlers));
 	memset(ctx->handler_cb_data, 0, sizeof(ctx->handler_cb_data));
+	memset(ctx->pending_writes, 0, sizeof(ctx->pending_writes));
+	spin_lock_init(&ctx->pending_lock);
+	ctx->pending_msecs = DFT_PENDING_MSECS;
+	ctx->peer_port = 0;
+	ctx->peerctx = NULL;
 
 	return ctx;
 
 }
 
+/* Use a single server instance for all pages */
 void srvcom_set_serv_addr(struct srvcom_ctx *ctx,
 	const char *ip, int port) {
 
-	memset(&(ctx->serv_addr), 0, sizeof(ctx->serv_addr));
-	ctx->serv_addr.sin_family = PF_INET;
-	ctx->serv_addr.sin_port = htons(port);
-	ctx->serv_addr.sin_addr.s_addr = htonl(str2ip(ip));
+	ctx->nr_shards = 0;
+	srvcom_add_serv_addr(ctx, ip, port);
+
+	return;
+
+}
+
+/*
+ * Add the server instance of the next shard. Shards must be
+ * added in the order of their IDs on the servers.
+ *
+ * @return The shard ID, or -1 if there are too many shards
+ */
+int srvcom_add_serv_addr(struct srvcom_ctx *ctx,
+	const char *ip, int port) {
+
+	struct srvcom_shard *shard;
+
+	if ( ctx->nr_shards >= SRVCOM_MAX_SHARDS )
+		return -1;
+
+	shard = &ctx->shards[ctx->nr_shards];
+	shard->ctx = ctx;
+	memset(&(shard->serv_addr), 0, sizeof(shard->serv_addr));
+	shard->serv_addr.sin_family = PF_INET;
+	shard->serv_addr.sin_port = htons(port);
+	shard->serv_addr.sin_addr.s_addr = htonl(str2ip(ip));
+
+	return ctx->nr_shards++;
+
+}
+
+void srvcom_set_token(struct srvcom_ctx *ctx, pid_t token) {
+
+	ctx->token = token;
 
 	return;
 
@@ -304,6 +404,16 @@ void srvcom_set_timeout(struct srvcom_ctx *ctx, long msecs) {
 
 }
 
+/* Commit with COMMIT_OWNER and serve the pages with peerctx */
+void srvcom_set_peer(struct srvcom_ctx *ctx, struct peercom_ctx *peerctx) {
+
+	ctx->peerctx = peerctx;
+	ctx->peer_port = peerctx ? peerctx->port : 0;
+
+	return;
+
+}
+
 void srvcom_register_handler(struct srvcom_ctx *ctx,
 	srvcom_opcode_t opcode, srvcom_handler_t handler, void *cb_data) {
 
@@ -318,16 +428,27 @@ void srvcom_register_handler(struct srvcom_ctx *ctx,
 
 int srvcom_run(struct srvcom_ctx *ctx) {
 
-	spin_lock_init(&ctx->listener_inject_lock);
-	spin_unlock(&ctx->listener_inject_lock);
-
-	ctx->write_try_count = 0;
+	int i;
 
-	ctx->listener_thread =
-		kthread_run(srvcom_listener_thread, ctx, "Listener thread");
-	if ( !ctx->listener_thread )
+	if ( ctx->nr_shards == 0 )
 		return -1;
 
+	for ( i = 0; i < ctx->nr_shards; i++ ) {
+
+		struct srvcom_shard *shard = &ctx->shards[i];
+
+		spin_lock_init(&shard->inject_lock);
+		shard->sock = NULL;
+
+		shard->listener_thread = kthread_run(srvcom_listener_thread,
+			shard, "hga_srvcom/%d", i);
+		if ( IS_ERR(shard->listener_thread) ) {
+			shard->listener_thread = NULL;
+			return -1;
+		}
+
+	}
+
 	return 0;
 
 }
@@ -339,29 +460,26 @@ int srvcom_run(struct srvcom_ctx *ctx) {
 int srvcom_request_write(struct srvcom_ctx *ctx, unsigned long addr,
 	pid_t pid, pgd_t *pgd) {
 
-	int try_count;
 	struct srvcom_msg msg;
 
 	/*
 	 * Many unnecessary page faults for the same page will
 	 * generate requests before the handler for ALLOW_WRITE
-	 * is triggered. Limit these requests to once per every
-	 * TRIES_PER_REQUEST tries.
+	 * is triggered. Only the first one is sent.
 	 */
-	try_count = ctx->write_try_count;
-	if ( ++(ctx->write_try_count) >= TRIES_PER_REQUEST )
-		ctx->write_try_count = 0;
-	if ( try_count > 0 )
+	if ( srvcom_pending_test_set(ctx, addr) )
 		return 0;
 
 	msg.hdr.mcode = (srvcom_code_t)OPCODE_REQUEST_WRITE;
 	msg.hdr.vaddr = addr;
-	msg.hdr.pid = pid;
+	msg.hdr.client_pid = pid;
+	msg.hdr.token = ctx->token;
 	msg.hdr.pgd = pgd;
 	msg.hdr.payload_len = 0;
 
-	if ( srvcom_listener_inject(ctx, &msg) < 0 ) {
+	if ( srvcom_listener_inject(srvcom_route(ctx, addr), &msg) < 0 ) {
 		printk(KERN_INFO "srvcom_request_write: Injection failure");
+		srvcom_pending_clear(ctx, addr);
 		return -1;
 	}
 
@@ -392,12 +510,13 @@ int srvcom_commit_page(struct srvcom_ctx *ctx, unsigned long addr,
 
 	msg->hdr.mcode = (srvcom_code_t)OPCODE_COMMIT_PAGE;
 	msg->hdr.vaddr = addr;
-	msg->hdr.pid = pid;
+	msg->hdr.client_pid = pid;
+	msg->hdr.token = ctx->token;
 	msg->hdr.pgd = pgd;
 	msg->hdr.payload_len = PAGE_SIZE;
 	memcpy(msg->data.payload, pagedata, PAGE_SIZE);
 
-	if ( srvcom_listener_inject(ctx, msg) < 0 ) {
+	if ( srvcom_listener_inject(srvcom_route(ctx, addr), msg) < 0 ) {
 		printk(KERN_INFO "srvcom_commit_page: Injection failure");
 		kfree(msg);
 		return -1;
@@ -409,6 +528,297 @@ int srvcom_commit_page(struct srvcom_ctx *ctx, unsigned long addr,
 
 }
 
+/*
+ * Release a written page in forwarding mode. The page data
+ * stays here and is served to the readers by peercom, the
+ * server is only told where to send them. The page must have
+ * been handed to peercom_own() first.
+ */
+int srvcom_commit_owner(struct srvcom_ctx *ctx, unsigned long addr,
+	pid_t pid, pgd_t *pgd) {
+
+	struct srvcom_msg *msg;
+	struct hga_peer *peer;
+
+	msg = (struct srvcom_msg*)kmalloc(
+		sizeof(struct srvcom_msg) + sizeof(struct hga_peer), GFP_KERNEL);
+	if ( !msg ) {
+		printk(KERN_INFO "srvcom_commit_owner: Allocation failure");
+		return -1;
+	}
+
+	msg->hdr.mcode = (srvcom_code_t)OPCODE_COMMIT_OWNER;
+	msg->hdr.vaddr = addr;
+	msg->hdr.client_pid = pid;
+	msg->hdr.token = ctx->token;
+	msg->hdr.pgd = pgd;
+	msg->hdr.payload_len = sizeof(struct hga_peer);
+
+	/* The server fills in the address it sees us at */
+	peer = (struct hga_peer*)msg->data.payload;
+	memset(peer, 0, sizeof(struct hga_peer));
+	peer->port = htons(ctx->peer_port);
+
+	if ( srvcom_listener_inject(srvcom_route(ctx, addr), msg) < 0 ) {
+		printk(KERN_INFO "srvcom_commit_owner: Injection failure");
+		kfree(msg);
+		return -1;
+	}
+
+	kfree(msg);
+
+	return 0;
+
+}
+
+/*
+ * Release a page written alongside other writers. Only the
+ * changed bytes are sent, encoded as in struct hga_diff_run,
+ * and the server merges them with the other writers' diffs.
+ */
+int srvcom_commit_diff(struct srvcom_ctx *ctx, unsigned long addr,
+	pid_t pid, pgd_t *pgd, char *diff, int len) {
+
+	struct srvcom_msg *msg;
+
+	msg = (struct srvcom_msg*)kmalloc(
+		sizeof(struct srvcom_msg) + len, GFP_KERNEL);
+	if ( !msg ) {
+		printk(KERN_INFO "srvcom_commit_diff: Allocation failure");
+		return -1;
+	}
+
+	msg->hdr.mcode = (srvcom_code_t)OPCODE_COMMIT_DIFF;
+	msg->hdr.vaddr = addr;
+	msg->hdr.client_pid = pid;
+	msg->hdr.token = ctx->token;
+	msg->hdr.pgd = pgd;
+	msg->hdr.payload_len = len;
+	memcpy(msg->data.payload, diff, len);
+
+	if ( srvcom_listener_inject(srvcom_route(ctx, addr), msg) < 0 ) {
+		printk(KERN_INFO "srvcom_commit_diff: Injection failure");
+		kfree(msg);
+		return -1;
+	}
+
+	kfree(msg);
+
+	return 0;
+
+}
+
+/*
+ * Send a written huge unit to the server as HGA_HUGE_CHUNKS
+ * chunks (see struct hga_chunk). The chunks are injected one
+ * by one, so other requests may go out between them.
+ */
+int srvcom_commit_chunks(struct srvcom_ctx *ctx, unsigned long addr,
+	pid_t pid, pgd_t *pgd, const char *unit) {
+
+	int i;
+	struct srvcom_msg *msg;
+	struct hga_chunk *chunk;
+
+	msg = (struct srvcom_msg*)kmalloc(sizeof(struct srvcom_msg)
+		+ sizeof(struct hga_chunk) + PAGE_SIZE, GFP_KERNEL);
+	if ( !msg ) {
+		printk(KERN_INFO "srvcom_commit_chunks: Allocation failure");
+		return -1;
+	}
+	chunk = (struct hga_chunk*)msg->data.payload;
+
+	msg->hdr.mcode = (srvcom_code_t)OPCODE_COMMIT_CHUNK;
+	msg->hdr.vaddr = addr;
+	msg->hdr.client_pid = pid;
+	msg->hdr.token = ctx->token;
+	msg->hdr.pgd = pgd;
+	msg->hdr.payload_len = sizeof(struct hga_chunk) + PAGE_SIZE;
+	chunk->count = HGA_HUGE_CHUNKS;
+
+	for ( i = 0; i < HGA_HUGE_CHUNKS; i++ ) {
+		chunk->index = i;
+		memcpy(chunk + 1, unit + i * PAGE_SIZE, PAGE_SIZE);
+		if ( srvcom_listener_inject(srvcom_route(ctx, addr), msg) < 0 ) {
+			printk(KERN_INFO "srvcom_commit_chunks: Injection failure");
+			kfree(msg);
+			return -1;
+		}
+	}
+
+	kfree(msg);
+
+	return 0;
+
+}
+
+/*
+ * Ask for the current copy of a page, whose lease ran out.
+ * It comes back with a GRANT_LEASE.
+ */
+int srvcom_initial_read(struct srvcom_ctx *ctx, unsigned long addr,
+	pid_t pid, pgd_t *pgd) {
+
+	struct srvcom_msg msg;
+
+	msg.hdr.mcode = (srvcom_code_t)OPCODE_INITIAL_READ;
+	msg.hdr.vaddr = addr;
+	msg.hdr.client_pid = pid;
+	msg.hdr.token = ctx->token;
+	msg.hdr.pgd = pgd;
+	msg.hdr.payload_len = 0;
+
+	if ( srvcom_listener_inject(srvcom_route(ctx, addr), &msg) < 0 ) {
+		printk(KERN_INFO "srvcom_initial_read: Injection failure");
+		return -1;
+	}
+
+	return 0;
+
+}
+
+/*
+ * Ask for the count pages from addr on at once, to warm them
+ * up (see struct hga_range). Every server instance answers
+ * for the pages it owns, with RESUME_RANGE frames.
+ *
+ * @return 0 if every instance was asked, -1 otherwise
+ */
+int srvcom_initial_read_range(struct srvcom_ctx *ctx, unsigned long addr,
+	unsigned int count, pid_t pid, pgd_t *pgd) {
+
+	struct srvcom_msg *msg;
+	struct hga_range *range;
+	int i, ret_code = 0;
+
+	msg = (struct srvcom_msg*)kmalloc(
+		sizeof(struct srvcom_msg) + sizeof(struct hga_range), GFP_KERNEL);
+	if ( !msg ) {
+		printk(KERN_INFO "srvcom_initial_read_range: Allocation failure");
+		return -1;
+	}
+
+	msg->hdr.mcode = (srvcom_code_t)OPCODE_INITIAL_READ_RANGE;
+	msg->hdr.vaddr = addr & PAGE_MASK;
+	msg->hdr.client_pid = pid;
+	msg->hdr.token = ctx->token;
+	msg->hdr.pgd = pgd;
+	msg->hdr.payload_len = sizeof(struct hga_range);
+	range = (struct hga_range*)msg->data.payload;
+	range->count = count;
+
+	for ( i = 0; i < ctx->nr_shards; i++ ) {
+		if ( srvcom_listener_inject(&ctx->shards[i], msg) < 0 ) {
+			printk(KERN_INFO "srvcom_initial_read_range: Injection failure");
+			ret_code = -1;
+		}
+	}
+
+	kfree(msg);
+
+	return ret_code;
+
+}
+
+/*
+ * Ask for the current copy of a page whose lease ran out, while
+ * we still have the given version of it (see struct
+ * hga_version). A NOT_MODIFIED answers if that copy is current,
+ * a GRANT_LEASE otherwise.
+ */
+int srvcom_revalidate(struct srvcom_ctx *ctx, unsigned long addr,
+	pid_t pid, pgd_t *pgd, u64 version) {
+
+	struct srvcom_msg *msg;
+	struct hga_version *held;
+
+	msg = (struct srvcom_msg*)kmalloc(
+		sizeof(struct srvcom_msg) + sizeof(struct hga_version), GFP_KERNEL);
+	if ( !msg ) {
+		printk(KERN_INFO "srvcom_revalidate: Allocation failure");
+		return -1;
+	}
+
+	msg->hdr.mcode = (srvcom_code_t)OPCODE_REVALIDATE;
+	msg->hdr.vaddr = addr;
+	msg->hdr.client_pid = pid;
+	msg->hdr.token = ctx->token;
+	msg->hdr.pgd = pgd;
+	msg->hdr.payload_len = sizeof(struct hga_version);
+	held = (struct hga_version*)msg->data.payload;
+	held->version = version;
+	held->msecs = 0;
+
+	if ( srvcom_listener_inject(srvcom_route(ctx, addr), msg) < 0 ) {
+		printk(KERN_INFO "srvcom_revalidate: Injection failure");
+		kfree(msg);
+		return -1;
+	}
+
+	kfree(msg);
+
+	return 0;
+
+}
+
+/* Give a lease back before it runs out so writers need not wait */
+int srvcom_return_lease(struct srvcom_ctx *ctx, unsigned long addr,
+	pid_t pid, pgd_t *pgd) {
+
+	struct srvcom_msg msg;
+
+	msg.hdr.mcode = (srvcom_code_t)OPCODE_RETURN_LEASE;
+	msg.hdr.vaddr = addr;
+	msg.hdr.client_pid = pid;
+	msg.hdr.token = ctx->token;
+	msg.hdr.pgd = pgd;
+	msg.hdr.payload_len = 0;
+
+	if ( srvcom_listener_inject(srvcom_route(ctx, addr), &msg) < 0 ) {
+		printk(KERN_INFO "srvcom_return_lease: Injection failure");
+		return -1;
+	}
+
+	return 0;
+
+}
+
+/*
+ * Give back a page the server left with us (see handle_home.c),
+ * with its contents. Like a commit, but it ends our hold on it.
+ */
+int srvcom_return_home(struct srvcom_ctx *ctx, unsigned long addr,
+	pid_t pid, pgd_t *pgd, char *pagedata) {
+
+	struct srvcom_msg *msg;
+
+	msg = (struct srvcom_msg*)kmalloc(
+		sizeof(struct srvcom_msg) + PAGE_SIZE, GFP_KERNEL);
+	if ( !msg ) {
+		printk(KERN_INFO "srvcom_return_home: Allocation failure");
+		return -1;
+	}
+
+	msg->hdr.mcode = (srvcom_code_t)OPCODE_RETURN_HOME;
+	msg->hdr.vaddr = addr;
+	msg->hdr.client_pid = pid;
+	msg->hdr.token = ctx->token;
+	msg->hdr.pgd = pgd;
+	msg->hdr.payload_len = PAGE_SIZE;
+	memcpy(msg->data.payload, pagedata, PAGE_SIZE);
+
+	if ( srvcom_listener_inject(srvcom_route(ctx, addr), msg) < 0 ) {
+		printk(KERN_INFO "srvcom_return_home: Injection failure");
+		kfree(msg);
+		return -1;
+	}
+
+	kfree(msg);
+
+	return 0;
+
+}
+
 #if 0
 /*
  * TODO:
@@ -443,7 +853,7 @@ int srvcom_commit_page(struct srvcom_ctx *ctx, unsigned long addr,
 		return -1;
 	}
 
-	if ( ksock_connect(sock, (struct sockaddr*)&ctx->serv_addr, sizeof(ctx->serv_addr)) < 0 ) {
+	if ( ksock_connect(sock, (struct sockaddr*)&ctx->shards[0].serv_addr, sizeof(ctx->shards[0].serv_addr)) < 0 ) {
 		printk(KERN_INFO "srvcom_commit_page: Failed to connect to server");
 		ksock_socket_destroy(sock);
 		kfree(msg);
@@ -452,7 +862,7 @@ int srvcom_commit_page(struct srvcom_ctx *ctx, unsigned long addr,
 
 	msg->hdr.mcode = (srvcom_code_t)OPCODE_COMMIT_PAGE;
 	msg->hdr.vaddr = addr;
-	msg->hdr.pid = pid;
+	msg->hdr.client_pid = pid;
 	msg->hdr.pgd = pgd;
 	msg->hdr.payload_len = PAGE_SIZE;
 	memcpy(msg->data.payload, pagedata, PAGE_SIZE);
@@ -483,14 +893,14 @@ int srvcom_commit_page(struct srvcom_ctx *ctx, unsigned long addr,
 		if (	/* Check if the reply has anything unexpected */
 			(msg->hdr.mcode.ack.code != ACKCODE_COMMIT_PAGE.code)
 			|| (msg->hdr.vaddr != addr)
-			|| (msg->hdr.pid != pid)
+			|| (msg->hdr.client_pid != pid)
 			|| (msg->hdr.pgd != pgd)
 			|| (msg->hdr.payload_len != 0)
 		) {
 			/* Reset the message data */
 			msg->hdr.mcode = (srvcom_code_t)OPCODE_COMMIT_PAGE;
 			msg->hdr.vaddr = addr;
-			msg->hdr.pid = pid;
+			msg->hdr.client_pid = pid;
 			msg->hdr.pgd = pgd;
 			msg->hdr.payload_len = PAGE_SIZE;
 			memcpy(msg->data.payload, pagedata, PAGE_SIZE);
@@ -511,13 +921,16 @@ int srvcom_commit_page(struct srvcom_ctx *ctx, unsigned long addr,
 
 void srvcom_exit(struct srvcom_ctx *ctx) {
 
+	int i;
+
 	if ( !ctx )
 		return;
 
-	if ( ctx->listener_sock )
-		ksock_socket_destroy(ctx->listener_sock);
-	if ( ctx->listener_thread )
-		kthread_stop(ctx->listener_thread);
+	/* The listener threads close their own sockets */
+	for ( i = 0; i < ctx->nr_shards; i++ ) {
+		if ( ctx->shards[i].listener_thread )
+			kthread_stop(ctx->shards[i].listener_thread);
+	}
 
 	kfree(ctx);
 
@@ -16,9 +16,19 @@
 #include <linux/in.h>
 #include <net/sock.h>
 
+#include "../common/hga_defs.h"
 
 
-#define SRVCOM_MAX_HNDLRS 16
+
+#define SRVCOM_MAX_HNDLRS 64
+/* Server instances the page space can be split across */
+#define SRVCOM_MAX_SHARDS 16
+/* Write requests remembered as pending is 1 << SRVCOM_PENDING_BITS */
+#define SRVCOM_PENDING_BITS 8
+/* Largest message body from the server, a full RESUME_RANGE frame */
+#define SRVCOM_MAX_PAYLOAD max(max3(sizeof(struct hga_lease), \
+	sizeof(struct hga_chunk), sizeof(struct hga_push)) + PAGE_SIZE, \
+	sizeof(struct hga_range_batch) + HGA_RANGE_BATCH * PAGE_SIZE)
 
 
 
@@ -26,26 +36,74 @@
 typedef struct {unsigned char code;} srvcom_opcode_t;
 typedef struct {unsigned char code;} srvcom_ackcode_t;
 
-/* Requests */
+/* Requests, numbered as in the server's comm.h */
 #define OPCODE_REQUEST_WRITE	((srvcom_opcode_t){.code = 0x00})
 #define OPCODE_ALLOW_WRITE	((srvcom_opcode_t){.code = 0x01})
 #define OPCODE_COMMIT_PAGE	((srvcom_opcode_t){.code = 0x02})
 #define OPCODE_LOCK_READ	((srvcom_opcode_t){.code = 0x03})
 #define OPCODE_RESUME_READ	((srvcom_opcode_t){.code = 0x04})
-#define OPCODE_PING_ALIVE	((srvcom_opcode_t){.code = 0x05})
+#define OPCODE_INITIAL_READ	((srvcom_opcode_t){.code = 0x05})
+#define OPCODE_PING_ALIVE	((srvcom_opcode_t){.code = 0x06})
+/* Forwarding mode, see struct hga_peer */
+#define OPCODE_COMMIT_OWNER	((srvcom_opcode_t){.code = 0x10})
+#define OPCODE_FETCH_PEER	((srvcom_opcode_t){.code = 0x11})
+#define OPCODE_PEER_READ	((srvcom_opcode_t){.code = 0x12})
+/* Lease mode, see struct hga_lease */
+#define OPCODE_GRANT_LEASE	((srvcom_opcode_t){.code = 0x13})
+#define OPCODE_RETURN_LEASE	((srvcom_opcode_t){.code = 0x14})
+/* Multiple-writer mode, see struct hga_diff_run */
+#define OPCODE_COMMIT_DIFF	((srvcom_opcode_t){.code = 0x15})
+#define OPCODE_ALLOW_SHARED_WRITE ((srvcom_opcode_t){.code = 0x16})
+/* Sub-page blocks, see struct hga_blocks */
+#define OPCODE_RESUME_BLOCKS	((srvcom_opcode_t){.code = 0x17})
+/* Huge units, see struct hga_chunk */
+#define OPCODE_COMMIT_CHUNK	((srvcom_opcode_t){.code = 0x20})
+#define OPCODE_RESUME_CHUNK	((srvcom_opcode_t){.code = 0x21})
+/* Read-ahead, see struct hga_push */
+#define OPCODE_PUSH_PAGE	((srvcom_opcode_t){.code = 0x22})
+/* Home migration, see handle_home.c */
+#define OPCODE_KEEP_HOME	((srvcom_opcode_t){.code = 0x23})
+#define OPCODE_RECALL_HOME	((srvcom_opcode_t){.code = 0x24})
+#define OPCODE_RETURN_HOME	((srvcom_opcode_t){.code = 0x25})
+/* Bulk reads, see struct hga_range */
+#define OPCODE_INITIAL_READ_RANGE ((srvcom_opcode_t){.code = 0x26})
+#define OPCODE_RESUME_RANGE	((srvcom_opcode_t){.code = 0x27})
+/* Page versions, see struct hga_version */
+#define OPCODE_REVALIDATE	((srvcom_opcode_t){.code = 0x30})
+#define OPCODE_NOT_MODIFIED	((srvcom_opcode_t){.code = 0x31})
+/* Forwarding mode, not acknowledged, see struct hga_peer_hosts */
+#define OPCODE_PEER_HOSTS	((srvcom_opcode_t){.code = 0x32})
 /* Responses */
-#define ACKCODE_REQUEST_WRITE	((srvcom_ackcode_t){.code = 0x06})
-#define ACKCODE_ALLOW_WRITE	((srvcom_ackcode_t){.code = 0x07})
-#define ACKCODE_COMMIT_PAGE	((srvcom_ackcode_t){.code = 0x08})
-#define ACKCODE_LOCK_READ	((srvcom_ackcode_t){.code = 0x09})
-#define ACKCODE_RESUME_READ	((srvcom_ackcode_t){.code = 0x0A})
-#define ACKCODE_PING_ALIVE	((srvcom_ackcode_t){.code = 0x0B})
-#define ACKCODE_NO_RESPONSE	((srvcom_ackcode_t){.code = 0x0C})
-#define ACKCODE_OP_FAILURE	((srvcom_ackcode_t){.code = 0x0D})
+#define ACKCODE_REQUEST_WRITE	((srvcom_ackcode_t){.code = 0x07})
+#define ACKCODE_ALLOW_WRITE	((srvcom_ackcode_t){.code = 0x08})
+#define ACKCODE_COMMIT_PAGE	((srvcom_ackcode_t){.code = 0x09})
+#define ACKCODE_LOCK_READ	((srvcom_ackcode_t){.code = 0x0A})
+#define ACKCODE_RESUME_READ	((srvcom_ackcode_t){.code = 0x0B})
+#define ACKCODE_INITIAL_READ	((srvcom_ackcode_t){.code = 0x0C})
+#define ACKCODE_PING_ALIVE	((srvcom_ackcode_t){.code = 0x0D})
+#define ACKCODE_NO_RESPONSE	((srvcom_ackcode_t){.code = 0x0E})
+#define ACKCODE_OP_FAILURE	((srvcom_ackcode_t){.code = 0x0F})
+#define ACKCODE_COMMIT_OWNER	((srvcom_ackcode_t){.code = 0x18})
+#define ACKCODE_FETCH_PEER	((srvcom_ackcode_t){.code = 0x19})
+#define ACKCODE_PEER_READ	((srvcom_ackcode_t){.code = 0x1A})
+#define ACKCODE_GRANT_LEASE	((srvcom_ackcode_t){.code = 0x1B})
+#define ACKCODE_RETURN_LEASE	((srvcom_ackcode_t){.code = 0x1C})
+#define ACKCODE_COMMIT_DIFF	((srvcom_ackcode_t){.code = 0x1D})
+#define ACKCODE_ALLOW_SHARED_WRITE ((srvcom_ackcode_t){.code = 0x1E})
+#define ACKCODE_RESUME_BLOCKS	((srvcom_ackcode_t){.code = 0x1F})
+#define ACKCODE_COMMIT_CHUNK	((srvcom_ackcode_t){.code = 0x28})
+#define ACKCODE_RESUME_CHUNK	((srvcom_ackcode_t){.code = 0x29})
+#define ACKCODE_PUSH_PAGE	((srvcom_ackcode_t){.code = 0x2A})
+#define ACKCODE_KEEP_HOME	((srvcom_ackcode_t){.code = 0x2B})
+#define ACKCODE_RETURN_HOME	((srvcom_ackcode_t){.code = 0x2D})
+#define ACKCODE_INITIAL_READ_RANGE ((srvcom_ackcode_t){.code = 0x2E})
+#define ACKCODE_REVALIDATE	((srvcom_ackcode_t){.code = 0x38})
+#define ACKCODE_NOT_MODIFIED	((srvcom_ackcode_t){.code = 0x39})
 
 
 
 struct srvcom_ctx;
+struct peercom_ctx;
 
 typedef union {
 	srvcom_opcode_t op;
@@ -53,12 +111,57 @@ typedef union {
 	unsigned char code;
 } srvcom_code_t;
 
+
+/* Wire format, also used between peers (see peercom) */
+struct srvcom_msg_hdr {
+
+	srvcom_code_t mcode;
+
+	unsigned long vaddr;
+	pid_t client_pid;
+	pid_t token;
+	pgd_t *pgd;
+
+	int payload_len;
+
+} __attribute__((packed));
+
+struct srvcom_msg_data {
+
+	char payload[0];
+
+} __attribute__((packed));
+
+struct srvcom_msg {
+
+	struct srvcom_msg_hdr hdr;
+	struct srvcom_msg_data data;
+
+} __attribute__((packed));
+
 /* Return the appropriate response code */
 typedef srvcom_ackcode_t (*srvcom_handler_t)(struct srvcom_ctx *ctx,
 	unsigned long vaddr, pid_t pid, pgd_t *pgd, char *pagedata, void *cb_data);
 
 
 
+/*
+ * Connection to one server instance. Every shard has its own
+ * listener thread; requests are injected on the socket of the
+ * shard owning the page (see hga_shard_of()).
+ */
+struct srvcom_shard {
+
+	struct srvcom_ctx *ctx;
+
+	struct socket *sock;
+	struct sockaddr_in serv_addr;
+
+	struct task_struct *listener_thread;
+	spinlock_t inject_lock;
+
+};
+
 /*
  * TODO:
  *    - Implement sequence numbers before moving
@@ -66,17 +169,32 @@ typedef srvcom_ackcode_t (*srvcom_handler_t)(struct srvcom_ctx *ctx,
  */
 struct srvcom_ctx {
 
-	struct socket *listener_sock;
-	struct sockaddr_in serv_addr;
+	struct srvcom_shard shards[SRVCOM_MAX_SHARDS];
+	int nr_shards;
+
+	/* Shared region this node takes part in */
+	pid_t token;
 
 	long msec_timeout;
 
-	struct task_struct *listener_thread;
-	spinlock_t listener_inject_lock;
 	srvcom_handler_t handlers[SRVCOM_MAX_HNDLRS];
 	void *handler_cb_data[SRVCOM_MAX_HNDLRS];
 
-	int write_try_count;
+	/*
+	 * Pages with a write request out, so the faults that keep
+	 * coming until ALLOW_WRITE do not send it again. The server
+	 * queues requests for locked pages; a request is only resent
+	 * once it has been pending for pending_msecs.
+	 */
+	unsigned long pending_writes[1 << SRVCOM_PENDING_BITS];
+	unsigned long pending_since[1 << SRVCOM_PENDING_BITS];
+	spinlock_t pending_lock;
+	long pending_msecs;
+
+	/* Port pages are served to peers on, 0 unless forwarding */
+	int peer_port;
+	/* Serves them, NULL unless forwarding */
+	struct peercom_ctx *peerctx;
 
 };
 
@@ -85,7 +203,11 @@ struct srvcom_ctx {
 struct srvcom_ctx *srvcom_ctx_new(void);
 void srvcom_set_serv_addr(struct srvcom_ctx *ctx,
 	const char *ip, int port);
+int srvcom_add_serv_addr(struct srvcom_ctx *ctx,
+	const char *ip, int port);
+void srvcom_set_token(struct srvcom_ctx *ctx, pid_t token);
 void srvcom_set_timeout(struct srvcom_ctx *ctx, long msecs);
+void srvcom_set_peer(struct srvcom_ctx *ctx, struct peercom_ctx *peerctx);
 void srvcom_register_handler(struct srvcom_ctx *ctx,
 	srvcom_opcode_t opcode, srvcom_handler_t handler, void *cb_data);
 int srvcom_run(struct srvcom_ctx *ctx);
@@ -93,6 +215,22 @@ int srvcom_request_write(struct srvcom_ctx *ctx, unsigned long addr,
 	pid_t pid, pgd_t *pgd);
 int srvcom_commit_page(struct srvcom_ctx *ctx, unsigned long addr,
 	pid_t pid, pgd_t *pgd, char *pagedata);
+int srvcom_commit_owner(struct srvcom_ctx *ctx, unsigned long addr,
+	pid_t pid, pgd_t *pgd);
+int srvcom_commit_diff(struct srvcom_ctx *ctx, unsigned long addr,
+	pid_t pid, pgd_t *pgd, char *diff, int len);
+int srvcom_commit_chunks(struct srvcom_ctx *ctx, unsigned long addr,
+	pid_t pid, pgd_t *pgd, const char *unit);
+int srvcom_initial_read(struct srvcom_ctx *ctx, unsigned long addr,
+	pid_t pid, pgd_t *pgd);
+int srvcom_initial_read_range(struct srvcom_ctx *ctx, unsigned long addr,
+	unsigned int count, pid_t pid, pgd_t *pgd);
+int srvcom_revalidate(struct srvcom_ctx *ctx, unsigned long addr,
+	pid_t pid, pgd_t *pgd, u64 version);
+int srvcom_return_lease(struct srvcom_ctx *ctx, unsigned long addr,
+	pid_t pid, pgd_t *pgd);
+int srvcom_return_home(struct srvcom_ctx *ctx, unsigned long addr,
+	pid_t pid, pgd_t *pgd, char *pagedata);
 void srvcom_exit(struct srvcom_ctx *ctx);
 
 
@@ -34,6 +34,14 @@
 #include <linux/kernel.h>
 #include <linux/uaccess.h>
 #include <linux/highmem.h>
+#include <linux/hash.h>
+#include <linux/mutex.h>
+#include <linux/seqlock.h>
+#include <linux/hashtable.h>
+#include <linux/workqueue.h>
+#include <linux/pid_namespace.h>
+#include <linux/rculist.h>
+#include <linux/jump_label.h>
 #include <linux/bootmem.h>
 #include <linux/debugfs.h>
 #include <linux/vmalloc.h>
@@ -63,6 +71,104 @@ static char *target_procnames[] = {
 	"fptrtest",
 };
 
+/* Off to take targets only from the control device */
+static bool match_procnames = true;
+module_param(match_procnames, bool, S_IRUGO);
+MODULE_PARM_DESC(match_procnames, "Target processes named in target_procnames");
+
+/*
+ * On while there may be a target: always when matching names,
+ * otherwise while a process is registered. Faults skip all of
+ * the HGA path while it is off, see task_targets_active.
+ */
+DEFINE_STATIC_KEY_FALSE(hga_targets_active);
+
+
+
+/*
+ * Verdicts of task_targeted, so that a fault of a process we
+ * do not care about is let through without looking up its
+ * binary name. Slots are picked by mm and overwritten on a
+ * collision. The binary an mm runs is part of the key, as an
+ * mm of a new process may be allocated where an old one was.
+ */
+#define TARGET_CACHE_BITS 8
+
+struct target_verdict {
+
+	seqcount_t seq;
+	spinlock_t lock;
+	struct mm_struct *mm;
+	struct file *exe_file;
+	struct dentry *exe_dentry;
+	int targeted;
+
+};
+
+static struct target_verdict target_cache[1 << TARGET_CACHE_BITS];
+
+/*
+ * Processes registered at run time through the control device
+ * (see hga_ioctl.h), by thread group. A registered process is a
+ * target whatever its name, and once ranges are registered for
+ * it only its faults inside them are shared. Faults look it up
+ * under RCU, so an entry is never changed but replaced by a
+ * copy, under target_mutex.
+ */
+struct target_range {
+
+	unsigned long start;
+	unsigned long end;
+
+};
+
+struct target_entry {
+
+	struct hlist_node node;
+	struct rcu_head rcu;
+	pid_t tgid;
+	/* Of the thread group leader, tells a reused tgid apart */
+	u64 start_time;
+	unsigned int nr_ranges;
+	/* Sorted and disjoint */
+	struct target_range ranges[];
+
+};
+
+static DEFINE_HASHTABLE(target_entries, 6);
+static DEFINE_MUTEX(target_mutex);
+/* Spares the lookup while nothing is registered */
+static atomic_t nr_target_entries = ATOMIC_INIT(0);
+/* Bumped on every registration, so no hint outlives one */
+static atomic_t target_gen = ATOMIC_INIT(0);
+
+/*
+ * Entries of processes that exit without being removed are
+ * dropped by target_reap, which runs every TARGET_REAP_MSECS
+ * while anything is registered. Otherwise such an entry would
+ * hold hga_targets_active on for good.
+ */
+#define TARGET_REAP_MSECS 1000
+
+static void target_reap(struct work_struct *work);
+static DECLARE_DELAYED_WORK(target_reaper, target_reap);
+
+/*
+ * Last process found not to be a target on this CPU, so that a
+ * run of its faults is let through with a few loads. Keyed like
+ * target_cache, and only valid in generation gen.
+ */
+struct untargeted_hint {
+
+	struct mm_struct *mm;
+	struct file *exe_file;
+	struct dentry *exe_dentry;
+	int gen;
+
+};
+
+static DEFINE_PER_CPU(struct untargeted_hint, untargeted_hint);
+
 
 
 static char *last_chunk(char *str, char delim);
@@ -70,11 +176,437 @@ static int get_process_binary_name(struct mm_struct *mm, char namebuf[]);
 
 
 
+void task_funcs_init(void) {
+
+	int i;
+
+	for ( i = 0; i < ARRAY_SIZE(target_cache); i++ ) {
+		seqcount_init(&target_cache[i].seq);
+		spin_lock_init(&target_cache[i].lock);
+		target_cache[i].mm = NULL;
+	}
+
+	if ( match_procnames )
+		static_branch_inc(&hga_targets_active);
+
+}
+
+/* Returns the cached verdict for mm running exe_file, or -1 if there is none */
+static int target_cache_find(struct mm_struct *mm, struct file *exe_file) {
+
+	struct target_verdict *slot =
+		&target_cache[hash_ptr(mm, TARGET_CACHE_BITS)];
+	unsigned int seq;
+	int targeted;
+
+	do {
+		seq = read_seqcount_begin(&slot->seq);
+		targeted = -1;
+		if ( slot->mm == mm && slot->exe_file == exe_file
+			&& slot->exe_dentry == exe_file->f_path.dentry )
+			targeted = slot->targeted;
+	} while ( read_seqcount_retry(&slot->seq, seq) );
+
+	return targeted;
+
+}
+
+/* Never waits: a slot being written by someone else is left as it is */
+static void target_cache_add(struct mm_struct *mm, struct file *exe_file,
+	int targeted) {
+
+	struct target_verdict *slot =
+		&target_cache[hash_ptr(mm, TARGET_CACHE_BITS)];
+	unsigned long flags;
+
+	local_irq_save(flags);
+	if ( spin_trylock(&slot->lock) ) {
+		write_seqcount_begin(&slot->seq);
+		slot->mm = mm;
+		slot->exe_file = exe_file;
+		slot->exe_dentry = exe_file->f_path.dentry;
+		slot->targeted = targeted;
+		write_seqcount_end(&slot->seq);
+		spin_unlock(&slot->lock);
+	}
+	local_irq_restore(flags);
+
+}
+
+/* Call under rcu_read_lock or with target_mutex held */
+static struct target_entry *target_entry_find(pid_t tgid) {
+
+	struct target_entry *entry;
+
+	hash_for_each_possible_rcu(target_entries, entry, node, tgid) {
+		if ( entry->tgid == tgid )
+			return entry;
+	}
+
+	return NULL;
+
+}
+
+/* Call under rcu_read_lock */
+static struct target_entry *target_entry_of(struct task_struct *task) {
+
+	struct target_entry *entry = target_entry_find(task->tgid);
+
+	if ( !entry || entry->start_time != task->group_leader->start_time )
+		return NULL;
+
+	return entry;
+
+}
+
+/*
+ * Global id of the thread group of the process pid names in the
+ * pid namespace of the caller, and the start time of its leader.
+ * Any thread of the process will do. Returns 0 or -ESRCH.
+ */
+static int target_resolve(pid_t pid, pid_t *tgid, u64 *start_time) {
+
+	struct task_struct *task;
+
+	rcu_read_lock();
+	if ( !(task = pid_task(find_vpid(pid), PIDTYPE_PID)) ) {
+		rcu_read_unlock();
+		return -ESRCH;
+	}
+	*tgid = task->tgid;
+	*start_time = task->group_leader->start_time;
+	rcu_read_unlock();
+
+	return 0;
+
+}
+
+/* Entry of the process pid names, see target_resolve. Call with target_mutex held */
+static struct target_entry *target_entry_by_pid(pid_t pid) {
+
+	struct target_entry *entry;
+	u64 start_time;
+	pid_t tgid;
+
+	if ( target_resolve(pid, &tgid, &start_time) < 0 )
+		return NULL;
+
+	entry = target_entry_find(tgid);
+	if ( !entry || entry->start_time != start_time )
+		return NULL;
+
+	return entry;
+
+}
+
+/*
+ * Whether the process of entry has exited, or its tgid is now
+ * another process. Call under rcu_read_lock.
+ */
+static bool target_entry_dead(struct target_entry *entry) {
+
+	struct task_struct *task;
+
+	task = pid_task(find_pid_ns(entry->tgid, &init_pid_ns), PIDTYPE_PID);
+
+	return !task || task->start_time != entry->start_time
+		|| !atomic_read(&task->signal->live);
+
+}
+
+/* Drops the entries of processes gone. Call with target_mutex held */
+static void target_reap_locked(void) {
+
+	struct target_entry *entry;
+	struct hlist_node *tmp;
+	bool dead;
+	int bkt;
+
+	hash_for_each_safe(target_entries, bkt, tmp, entry, node) {
+		rcu_read_lock();
+		dead = target_entry_dead(entry);
+		rcu_read_unlock();
+		if ( !dead )
+			continue;
+		hash_del_rcu(&entry->node);
+		atomic_dec(&nr_target_entries);
+		static_branch_dec(&hga_targets_active);
+		kfree_rcu(entry, rcu);
+	}
+
+}
+
+static void target_reap(struct work_struct *work) {
+
+	mutex_lock(&target_mutex);
+	target_reap_locked();
+	if ( atomic_read(&nr_target_entries) )
+		queue_delayed_work(system_wq, &target_reaper,
+			msecs_to_jiffies(TARGET_REAP_MSECS));
+	mutex_unlock(&target_mutex);
+
+}
+
+/* A copy of entry with room for nr_ranges ranges */
+static struct target_entry *target_entry_copy(struct target_entry *entry,
+	unsigned int nr_ranges) {
+
+	struct target_entry *copy;
+
+	copy = kmalloc(sizeof(*copy) + nr_ranges * sizeof(struct target_range),
+		GFP_KERNEL);
+	if ( !copy )
+		return NULL;
+
+	copy->tgid = entry->tgid;
+	copy->start_time = entry->start_time;
+	copy->nr_ranges = nr_ranges;
+
+	return copy;
+
+}
+
+/* Returns 0, -ESRCH if there is no such process or -EEXIST */
+int task_target_add(pid_t pid) {
+
+	struct target_entry *entry;
+	pid_t tgid;
+	u64 start_time;
+	int err;
+
+	if ( (err = target_resolve(pid, &tgid, &start_time)) < 0 )
+		return err;
+
+	if ( !(entry = kmalloc(sizeof(*entry), GFP_KERNEL)) )
+		return -ENOMEM;
+	entry->tgid = tgid;
+	entry->start_time = start_time;
+	entry->nr_ranges = 0;
+
+	mutex_lock(&target_mutex);
+	/* An entry left by an earlier process of this tgid must not be in the way */
+	target_reap_locked();
+	if ( target_entry_find(tgid) ) {
+		mutex_unlock(&target_mutex);
+		kfree(entry);
+		return -EEXIST;
+	}
+	hash_add_rcu(target_entries, &entry->node, tgid);
+	atomic_inc(&nr_target_entries);
+	atomic_inc(&target_gen);
+	static_branch_inc(&hga_targets_active);
+	queue_delayed_work(system_wq, &target_reaper,
+		msecs_to_jiffies(TARGET_REAP_MSECS));
+	mutex_unlock(&target_mutex);
+
+	return 0;
+
+}
+
+/* Returns 0 or -ENOENT */
+int task_target_del(pid_t pid) {
+
+	struct target_entry *entry;
+
+	mutex_lock(&target_mutex);
+	if ( !(entry = target_entry_by_pid(pid)) ) {
+		mutex_unlock(&target_mutex);
+		return -ENOENT;
+	}
+	hash_del_rcu(&entry->node);
+	atomic_dec(&nr_target_entries);
+	static_branch_dec(&hga_targets_active);
+	mutex_unlock(&target_mutex);
+
+	kfree_rcu(entry, rcu);
+
+	return 0;
+
+}
+
+/* Returns 0, -EINVAL if the range overlaps another, -ENOENT or -ENOMEM */
+int task_range_add(pid_t pid, unsigned long start, unsigned long end) {
+
+	struct target_entry *entry, *copy;
+	unsigned int i, at;
+
+	if ( start >= end || (start | end) & ~PAGE_MASK )
+		return -EINVAL;
+
+	mutex_lock(&target_mutex);
+	if ( !(entry = target_entry_by_pid(pid)) ) {
+		mutex_unlock(&target_mutex);
+		return -ENOENT;
+	}
+
+	for ( at = 0; at < entry->nr_ranges; at++ )
+		if ( entry->ranges[at].start >= start )
+			break;
+	if ( (at < entry->nr_ranges && entry->ranges[at].start < end)
+		|| (at > 0 && entry->ranges[at - 1].end > start) ) {
+		mutex_unlock(&target_mutex);
+		return -EINVAL;
+	}
+
+	if ( !(copy = target_entry_copy(entry, entry->nr_ranges + 1)) ) {
+		mutex_unlock(&target_mutex);
+		return -ENOMEM;
+	}
+	for ( i = 0; i < at; i++ )
+		copy->ranges[i] = entry->ranges[i];
+	copy->ranges[at].start = start;
+	copy->ranges[at].end = end;
+	for ( i = at; i < entry->nr_ranges; i++ )
+		copy->ranges[i + 1] = entry->ranges[i];
+
+	hlist_replace_rcu(&entry->node, &copy->node);
+	mutex_unlock(&target_mutex);
+
+	kfree_rcu(entry, rcu);
+
+	return 0;
+
+}
+
+/* Returns 0, or -ENOENT if the range was not registered as such */
+int task_range_del(pid_t pid, unsigned long start, unsigned long end) {
+
+	struct target_entry *entry, *copy;
+	unsigned int i, at;
+
+	mutex_lock(&target_mutex);
+	if ( !(entry = target_entry_by_pid(pid)) ) {
+		mutex_unlock(&target_mutex);
+		return -ENOENT;
+	}
+
+	for ( at = 0; at < entry->nr_ranges; at++ )
+		if ( entry->ranges[at].start == start
+			&& entry->ranges[at].end == end )
+			break;
+	if ( at == entry->nr_ranges ) {
+		mutex_unlock(&target_mutex);
+		return -ENOENT;
+	}
+
+	if ( !(copy = target_entry_copy(entry, entry->nr_ranges - 1)) ) {
+		mutex_unlock(&target_mutex);
+		return -ENOMEM;
+	}
+	for ( i = 0; i < at; i++ )
+		copy->ranges[i] = entry->ranges[i];
+	for ( i = at + 1; i < entry->nr_ranges; i++ )
+		copy->ranges[i - 1] = entry->ranges[i];
+
+	hlist_replace_rcu(&entry->node, &copy->node);
+	mutex_unlock(&target_mutex);
+
+	kfree_rcu(entry, rcu);
+
+	return 0;
+
+}
+
+/*
+ * Returns 1 if a fault of task at addr may be shared and 0 if
+ * it lies outside the ranges registered for the process.
+ */
+int task_shares(struct task_struct *task, unsigned long addr) {
+
+	struct target_entry *entry;
+	unsigned int lo, hi, mid;
+	int shares = 1;
+
+	if ( !atomic_read(&nr_target_entries) )
+		return 1;
+
+	rcu_read_lock();
+	entry = target_entry_of(task);
+	if ( entry && entry->nr_ranges ) {
+		shares = 0;
+		lo = 0;
+		hi = entry->nr_ranges;
+		while ( lo < hi ) {
+			mid = lo + (hi - lo) / 2;
+			if ( addr < entry->ranges[mid].start )
+				hi = mid;
+			else if ( addr >= entry->ranges[mid].end )
+				lo = mid + 1;
+			else {
+				shares = 1;
+				break;
+			}
+		}
+	}
+	rcu_read_unlock();
+
+	return shares;
+
+}
+
+void task_funcs_exit(void) {
+
+	struct target_entry *entry;
+	struct hlist_node *tmp;
+	int bkt;
+
+	cancel_delayed_work_sync(&target_reaper);
+
+	mutex_lock(&target_mutex);
+	hash_for_each_safe(target_entries, bkt, tmp, entry, node) {
+		hash_del_rcu(&entry->node);
+		static_branch_dec(&hga_targets_active);
+		kfree_rcu(entry, rcu);
+	}
+	atomic_set(&nr_target_entries, 0);
+	mutex_unlock(&target_mutex);
+
+	if ( match_procnames )
+		static_branch_dec(&hga_targets_active);
+
+}
+
 /* Returns 1 if the process belonged to the targeted list, 0 if not and -1 on error */
 int task_targeted(struct task_struct *task) {
 
 	char proc_name[PROCNAME_MAXLEN];
 	int i, name_matched, n_targetprocs;
+	struct mm_struct *mm = task->mm;
+	struct untargeted_hint *hint;
+	struct file *exe_file;
+	bool hinted;
+	int gen;
+
+	/* The mm holds on to its binary, which only exec changes */
+	if ( !mm || !(exe_file = READ_ONCE(mm->exe_file)) )
+		return -1;
+
+	gen = atomic_read(&target_gen);
+	hint = get_cpu_ptr(&untargeted_hint);
+	hinted = hint->mm == mm && hint->exe_file == exe_file
+		&& hint->exe_dentry == exe_file->f_path.dentry
+		&& hint->gen == gen;
+	put_cpu_ptr(&untargeted_hint);
+	if ( hinted )
+		return 0;
+
+	/* Registered at run time, whatever its name */
+	if ( atomic_read(&nr_target_entries) ) {
+		rcu_read_lock();
+		name_matched = target_entry_of(task) ? 1 : 0;
+		rcu_read_unlock();
+		if ( name_matched )
+			return 1;
+	}
+
+	if ( !match_procnames ) {
+		name_matched = 0;
+		goto out;
+	}
+
+	name_matched = target_cache_find(mm, exe_file);
+	if ( name_matched >= 0 )
+		goto out;
 
 	n_targetprocs = sizeof(target_procnames) / sizeof(*target_procnames);
 
@@ -91,6 +623,18 @@ int task_targeted(struct task_struct *task) {
 		}
 	}
 
+	target_cache_add(mm, exe_file, name_matched);
+
+out:
+	if ( !name_matched ) {
+		hint = get_cpu_ptr(&untargeted_hint);
+		hint->mm = mm;
+		hint->exe_file = exe_file;
+		hint->exe_dentry = exe_file->f_path.dentry;
+		hint->gen = gen;
+		put_cpu_ptr(&untargeted_hint);
+	}
+
 	return name_matched;
 
 }
@@ -10,13 +10,30 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/semaphore.h>
+#include <linux/jump_label.h>
 #include <asm/pgtable_types.h>
 
 #include "../common/hga_defs.h"
 
 
 
+void task_funcs_init(void);
+void task_funcs_exit(void);
+DECLARE_STATIC_KEY_FALSE(hga_targets_active);
+
+/* False while no process can be a target, faults are not ours then */
+static inline bool task_targets_active(void) {
+
+	return static_branch_unlikely(&hga_targets_active);
+
+}
+
 int task_targeted(struct task_struct *task);
+int task_shares(struct task_struct *task, unsigned long addr);
+int task_target_add(pid_t pid);
+int task_target_del(pid_t pid);
+int task_range_add(pid_t pid, unsigned long start, unsigned long end);
+int task_range_del(pid_t pid, unsigned long start, unsigned long end);
 int task_get_name(struct task_struct *task, char *name);
 
 
@@ -7,6 +7,9 @@
 
 
 #include <linux/semaphore.h>
+#include <linux/llist.h>
+#include <linux/mutex.h>
+#include <linux/delay.h>
 #include <linux/kthread.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
@@ -23,6 +26,7 @@
 
 #define DFT_TIMEOUT_MSECS	10
 #define CONN_BACKLOG		16
+#define LINK_RETRY_MSECS	1000
 
 #define ISNUM(c) ('0' <= (c) && (c) <= '9')
 #define TONUM(c) ((int)(c - '0'))
@@ -55,6 +59,14 @@ struct comm_msg {
 
 } __attribute__((packed));
 
+struct comm_deferred {
+
+	struct llist_node node;
+	comm_deferred_t fn;
+	void *data;
+
+};
+
 
 
 ///////////////////////////////////////////////////
@@ -95,6 +107,10 @@ static int comm_recv(struct socket *sock, struct comm_msg *msg) {
 	}
 
 	/* Receive payload */
+	if ( msg->hdr.payload_len < 0 || msg->hdr.payload_len > COMM_MAX_PAYLOAD ) {
+		printk(KERN_INFO "comm_recv: Bad payload length");
+		return -1;
+	}
 	if ( ksock_recv(sock, (char*)&msg->data, msg->hdr.payload_len) < 0 ) {
 		printk(KERN_INFO "comm_recv: ksock_recv failed");
 		return -1;
@@ -121,12 +137,86 @@ static int comm_timeout_recv(struct socket *sock, struct comm_msg *msg,
 	}
 
 	/* Receive payload */
+	if ( msg->hdr.payload_len < 0 || msg->hdr.payload_len > COMM_MAX_PAYLOAD ) {
+		printk(KERN_INFO "comm_timeout_recv: Bad payload length");
+		return -1;
+	}
 	err_code = ksock_recv(sock, (char*)&msg->data, msg->hdr.payload_len);
 
 	return err_code;
 
 }
 
+/*
+ * Node IDs are kept in the socket's sk_user_data (as ID + 1) so that
+ * handlers can map a connection to its ID without a search.
+ *
+ * IDs are unique across all contexts of the module: a client connected
+ * to several local shards gets a different ID on each, so state keyed by
+ * node ID alone never mixes up two connections.
+ */
+static DECLARE_BITMAP(node_ids, COMM_MAX_NODES);
+static DEFINE_SPINLOCK(node_ids_lock);
+
+static int __node_attach(struct comm_ctx *ctx, struct socket *conn_sock) {
+
+	int node;
+
+	spin_lock(&node_ids_lock);
+	node = find_first_zero_bit(node_ids, COMM_MAX_NODES);
+	if ( node < COMM_MAX_NODES )
+		set_bit(node, node_ids);
+	spin_unlock(&node_ids_lock);
+
+	if ( node >= COMM_MAX_NODES )
+		return -1;
+
+	ctx->nodes[node] = conn_sock;
+	conn_sock->sk->sk_user_data = (void*)(unsigned long)(node + 1);
+
+	return node;
+
+}
+
+static void __node_release(int node) {
+
+	spin_lock(&node_ids_lock);
+	clear_bit(node, node_ids);
+	spin_unlock(&node_ids_lock);
+
+	return;
+
+}
+
+static void __node_detach(struct comm_ctx *ctx, struct socket *conn_sock) {
+
+	int node = comm_node_id(ctx, conn_sock);
+
+	if ( node < 0 )
+		return;
+
+	if ( ctx->disconnect_handler )
+		ctx->disconnect_handler(ctx, node);
+
+	ctx->nodes[node] = NULL;
+	conn_sock->sk->sk_user_data = NULL;
+	__node_release(node);
+
+	return;
+
+}
+
+/* Forget a connection and release its socket */
+static void __drop_conn(struct comm_ctx *ctx, struct socket *conn_sock) {
+
+	__node_detach(ctx, conn_sock);
+	ksock_remove(ctx->conn_socks, conn_sock);
+	ksock_socket_destroy(conn_sock);
+
+	return;
+
+}
+
 //////////////////////////////////////////////////////////
 ///////////////////// MAIN FUNCTIONS /////////////////////
 //////////////////////////////////////////////////////////
@@ -150,6 +240,13 @@ static int __handle_accept(struct socket *acceptor_sock, struct comm_ctx *ctx) {
 		return -1;
 	}
 
+	if ( __node_attach(ctx, conn_sock) < 0 ) {
+		printk(KERN_ERR "__handle_accept: Node limit full");
+		ksock_remove(ctx->conn_socks, conn_sock);
+		ksock_socket_destroy(conn_sock);
+		return -1;
+	}
+
 	return 0;
 
 }
@@ -169,7 +266,7 @@ static int __handle_recv(struct socket *conn_sock, struct comm_ctx *ctx) {
 
 	/* Message buffer */
 	msg = (struct comm_msg*)kmalloc(
-		sizeof(struct comm_msg) + PAGE_SIZE, GFP_KERNEL);
+		sizeof(struct comm_msg) + COMM_MAX_PAYLOAD, GFP_KERNEL);
 	if ( !msg ) {
 		printk(KERN_ERR "__handle_recv: Allocation failure");
 		return -1;
@@ -184,6 +281,8 @@ static int __handle_recv(struct socket *conn_sock, struct comm_ctx *ctx) {
 
 	/* Get appropriate handler */
 	mcode = (unsigned)(msg->hdr.mcode.op.code);
+	if ( mcode >= COMM_MAX_HNDLRS )
+		goto out;
 	msg_handler = ctx->handlers[mcode];
 	handler_cb_data = ctx->handler_cb_data[mcode];
 
@@ -196,8 +295,8 @@ static int __handle_recv(struct socket *conn_sock, struct comm_ctx *ctx) {
 	msg_cpid = msg->hdr.client_pid;
 	msg_spid = msg->hdr.server_pid;
 	msg_pgd = msg->hdr.pgd;
-	ack_code = msg_handler(ctx, msg_vaddr, msg_cpid,
-		msg_spid, msg_pgd, msg_page, handler_cb_data, conn_sock);
+	ack_code = msg_handler(ctx, msg_vaddr, msg_cpid, msg_spid, msg_pgd,
+		msg_page, msg->hdr.payload_len, handler_cb_data, conn_sock);
 
 	if ( ack_code.code == ACKCODE_NO_RESPONSE.code )
 		goto out;
@@ -220,13 +319,32 @@ out:
 	return 0;
 
 err:
-	ksock_socket_destroy(conn_sock);
-	ksock_remove(ctx->conn_socks, conn_sock);
+	__drop_conn(ctx, conn_sock);
 	kfree(msg);
 	return -1;
 
 }
 
+/* Run the work other threads queued with comm_defer(), oldest first */
+static void __run_deferred(struct comm_ctx *ctx) {
+
+	struct llist_node *list;
+	struct comm_deferred *work, *tmp;
+
+	list = llist_del_all(&ctx->deferred);
+	if ( !list )
+		return;
+
+	list = llist_reverse_order(list);
+	llist_for_each_entry_safe(work, tmp, list, node) {
+		work->fn(ctx, work->data);
+		kfree(work);
+	}
+
+	return;
+
+}
+
 /*
  * Main server loop
  *    Started in comm_run() after the context is initialized.
@@ -262,6 +380,8 @@ static int __server_loop_run(void *thrdata) {
 		int n_sockets_selected;
 		int accept_count, recv_count, i;
 
+		__run_deferred(ctx);
+
 		ksock_clear(accept_set);
 		ksock_clear(recv_set);
 
@@ -291,6 +411,8 @@ static int __server_loop_run(void *thrdata) {
 	ksock_set_destroy(accept_set);
 	ksock_set_destroy(recv_set);
 
+	__run_deferred(ctx);
+
 	return 0;
 
 }
@@ -318,6 +440,9 @@ struct comm_ctx *comm_ctx_new(void) {
 	ctx->msec_timeout = DFT_TIMEOUT_MSECS;
 	memset(ctx->handlers, 0, sizeof(ctx->handlers));
 	memset(ctx->handler_cb_data, 0, sizeof(ctx->handler_cb_data));
+	memset(ctx->nodes, 0, sizeof(ctx->nodes));
+	ctx->disconnect_handler = NULL;
+	init_llist_head(&ctx->deferred);
 	ctx->srv_thread = NULL;
 
 	return ctx;
@@ -356,6 +481,67 @@ void comm_register_handler(struct comm_ctx *ctx,
 
 }
 
+void comm_register_disconnect(struct comm_ctx *ctx,
+	comm_disconnect_t handler) {
+
+	ctx->disconnect_handler = handler;
+
+	return;
+
+}
+
+/*
+ * @brief Run a function on the server thread
+ *
+ * Connections are only ever used from the server thread. Work that
+ * finishes elsewhere (workqueues, timers) hands its reply back through
+ * this; fn runs before the next select.
+ *
+ * @return 0 on success, -1 on allocation failure
+ */
+int comm_defer(struct comm_ctx *ctx, comm_deferred_t fn, void *data, gfp_t gfp) {
+
+	struct comm_deferred *work;
+
+	if ( !(work = kmalloc(sizeof(struct comm_deferred), gfp)) ) {
+		printk(KERN_ERR "comm_defer: Allocation failure");
+		return -1;
+	}
+
+	work->fn = fn;
+	work->data = data;
+	llist_add(&work->node, &ctx->deferred);
+
+	return 0;
+
+}
+
+/* Returns the node ID of a connection, or -1 if it has none */
+int comm_node_id(struct comm_ctx *ctx, struct socket *conn_sock) {
+
+	unsigned long id;
+
+	if ( !conn_sock || !conn_sock->sk )
+		return -1;
+
+	id = (unsigned long)conn_sock->sk->sk_user_data;
+	if ( id == 0 || id > COMM_MAX_NODES )
+		return -1;
+
+	return (int)(id - 1);
+
+}
+
+/* Returns the connection of a node, or NULL if it is not connected */
+struct socket *comm_node_socket(struct comm_ctx *ctx, int node) {
+
+	if ( node < 0 || node >= COMM_MAX_NODES )
+		return NULL;
+
+	return ctx->nodes[node];
+
+}
+
 /* Start the main server loop */
 int comm_run(struct comm_ctx *ctx) {
 
@@ -384,9 +570,11 @@ int comm_run(struct comm_ctx *ctx) {
 	}
 
 	ctx->srv_thread =
-		kthread_run(__server_loop_run, ctx, "Main server thread");
-	if ( !ctx->srv_thread ) {
+		kthread_run(__server_loop_run, ctx, "megavm_srv/%d",
+			ntohs(ctx->serv_addr.sin_port));
+	if ( IS_ERR(ctx->srv_thread) ) {
 		printk(KERN_ERR "comm_run: Failed to run main server thread");
+		ctx->srv_thread = NULL;
 		ksock_socket_destroy(ctx->acceptor_sock);
 		ctx->acceptor_sock = NULL;
 		return -1;
@@ -396,22 +584,9 @@ int comm_run(struct comm_ctx *ctx) {
 
 }
 
-/*
- * @brief Command a client to allow writing on a page
- *
- * @param ctx Server context
- * @param conn_sock Socket with which the client connected
- * @param vaddr Virtual address of the page to unlock
- * @param client_pid PID of the process running on the
- * target machine
- * @param pgd Pointer to the PGD table of the page to
- * be unlocked
- *
- * @return 1 if the request was sent AND acknowledged,
- * -1 on error and 0 otherwise
- */
-int comm_allow_write(struct comm_ctx *ctx, struct socket *conn_sock,
-	unsigned long vaddr, pid_t client_pid, pgd_t *pgd) {
+static int __allow_write(struct comm_ctx *ctx, struct socket *conn_sock,
+	unsigned long vaddr, pid_t client_pid, pid_t token, pgd_t *pgd,
+	comm_opcode_t opcode, comm_ackcode_t ackcode) {
 
 	int n_tries_remaining = 8;
 
@@ -419,9 +594,10 @@ int comm_allow_write(struct comm_ctx *ctx, struct socket *conn_sock,
 
 		int err_code;
 		struct comm_msg msg = { .hdr = {
-			.mcode = (comm_code_t)OPCODE_ALLOW_WRITE,
+			.mcode = (comm_code_t)opcode,
 			.vaddr = vaddr,
 			.client_pid = client_pid,
+			.server_pid = token,
 			.pgd = pgd,
 			.payload_len = 0,
 		}};
@@ -445,7 +621,7 @@ int comm_allow_write(struct comm_ctx *ctx, struct socket *conn_sock,
 
 		/* Should not happen but handle this case anyway */
 		if (	/* Check if the reply has anything unexpected */
-			(msg.hdr.mcode.ack.code != ACKCODE_ALLOW_WRITE.code)
+			(msg.hdr.mcode.ack.code != ackcode.code)
 			|| (msg.hdr.vaddr != vaddr)
 			|| (msg.hdr.client_pid != client_pid)
 			|| (msg.hdr.pgd != pgd)
@@ -462,12 +638,94 @@ int comm_allow_write(struct comm_ctx *ctx, struct socket *conn_sock,
 	return (n_tries_remaining < 0) ? 0 : 1;
 
 err:
-	ksock_remove(ctx->conn_socks, conn_sock);
-	ksock_socket_destroy(conn_sock);
+	__drop_conn(ctx, conn_sock);
 	return -1;
 
 }
 
+/*
+ * @brief Command a client to allow writing on a page
+ *
+ * @param ctx Server context
+ * @param conn_sock Socket with which the client connected
+ * @param vaddr Virtual address of the page to unlock
+ * @param client_pid PID of the process running on the
+ * target machine
+ * @param pgd Pointer to the PGD table of the page to
+ * be unlocked
+ *
+ * @return 1 if the request was sent AND acknowledged,
+ * -1 on error and 0 otherwise
+ */
+int comm_allow_write(struct comm_ctx *ctx, struct socket *conn_sock,
+	unsigned long vaddr, pid_t client_pid, pid_t token, pgd_t *pgd) {
+
+	return __allow_write(ctx, conn_sock, vaddr, client_pid, token, pgd,
+		OPCODE_ALLOW_WRITE, ACKCODE_ALLOW_WRITE);
+
+}
+
+/*
+ * @brief Allow a client to write a page alongside other writers,
+ * committing a diff on release (see struct comm_diff_run)
+ *
+ * Same parameters and return values as comm_allow_write()
+ */
+int comm_allow_shared_write(struct comm_ctx *ctx, struct socket *conn_sock,
+	unsigned long vaddr, pid_t client_pid, pid_t token, pgd_t *pgd) {
+
+	return __allow_write(ctx, conn_sock, vaddr, client_pid, token, pgd,
+		OPCODE_ALLOW_SHARED_WRITE, ACKCODE_ALLOW_SHARED_WRITE);
+
+}
+
+/*
+ * @brief Leave the write lock of a page the client just committed
+ * with it, see OPCODE_KEEP_HOME
+ *
+ * Same parameters and return values as comm_allow_write()
+ */
+int comm_keep_home(struct comm_ctx *ctx, struct socket *conn_sock,
+	unsigned long vaddr, pid_t client_pid, pid_t token, pgd_t *pgd) {
+
+	return __allow_write(ctx, conn_sock, vaddr, client_pid, token, pgd,
+		OPCODE_KEEP_HOME, ACKCODE_KEEP_HOME);
+
+}
+
+/*
+ * @brief Ask the client a page was left with by comm_keep_home()
+ * to return it
+ *
+ * Not acknowledged: the client answers with RETURN_HOME once the
+ * page is back in its hands, which could otherwise be taken for
+ * the acknowledgement and lost.
+ *
+ * @return 1 if the request was sent, -1 on error
+ */
+int comm_recall_home(struct comm_ctx *ctx, struct socket *conn_sock,
+	unsigned long vaddr, pid_t client_pid, pid_t token, pgd_t *pgd) {
+
+	struct comm_msg msg = { .hdr = {
+		.mcode = (comm_code_t)OPCODE_RECALL_HOME,
+		.vaddr = vaddr,
+		.client_pid = client_pid,
+		.server_pid = token,
+		.pgd = pgd,
+		.payload_len = 0,
+	}};
+
+	if ( comm_send(conn_sock, &msg) < 0 ) {
+		printk(KERN_INFO "comm_recall_home: Lost connection "
+			"with the client");
+		__drop_conn(ctx, conn_sock);
+		return -1;
+	}
+
+	return 1;
+
+}
+
 /*
  * @brief Command a client to block reads on a page
  *
@@ -483,7 +741,7 @@ err:
  * -1 on error and 0 otherwise
  */
 int comm_lock_read(struct comm_ctx *ctx, struct socket *conn_sock,
-	unsigned long vaddr, pid_t client_pid, pgd_t *pgd) {
+	unsigned long vaddr, pid_t client_pid, pid_t token, pgd_t *pgd) {
 
 	int n_tries_remaining = 8;
 
@@ -494,6 +752,7 @@ int comm_lock_read(struct comm_ctx *ctx, struct socket *conn_sock,
 			.mcode = (comm_code_t)OPCODE_LOCK_READ,
 			.vaddr = vaddr,
 			.client_pid = client_pid,
+			.server_pid = token,
 			.pgd = pgd,
 			.payload_len = 0,
 		}};
@@ -534,8 +793,7 @@ int comm_lock_read(struct comm_ctx *ctx, struct socket *conn_sock,
 	return (n_tries_remaining < 0) ? 0 : 1;
 
 err:
-	ksock_remove(ctx->conn_socks, conn_sock);
-	ksock_socket_destroy(conn_sock);
+	__drop_conn(ctx, conn_sock);
 	return -1;
 
 }
@@ -557,13 +815,13 @@ err:
  * -1 on error and 0 otherwise
  */
 int comm_resume_read(struct comm_ctx *ctx, struct socket *conn_sock,
-	unsigned long vaddr, pid_t client_pid, pgd_t *pgd, char *pagedata) {
+	unsigned long vaddr, pid_t client_pid, pid_t token, pgd_t *pgd, char *pagedata) {
 
 	int n_tries_remaining = 8;
 	struct comm_msg *msg;
 
 	msg = (struct comm_msg*)kmalloc(
-		sizeof(struct comm_msg) + PAGE_SIZE, GFP_KERNEL);
+		sizeof(struct comm_msg) + COMM_MAX_PAYLOAD, GFP_KERNEL);
 	if ( !msg ) {
 		printk(KERN_ERR "comm_resume_read: Allocation failure");
 		return -1;
@@ -572,6 +830,7 @@ int comm_resume_read(struct comm_ctx *ctx, struct socket *conn_sock,
 	msg->hdr.mcode = (comm_code_t)OPCODE_RESUME_READ;
 	msg->hdr.vaddr = vaddr;
 	msg->hdr.client_pid = client_pid;
+	msg->hdr.server_pid = token;
 	msg->hdr.pgd = pgd;
     if (pagedata) {
 	    msg->hdr.payload_len = PAGE_SIZE;
@@ -613,6 +872,7 @@ int comm_resume_read(struct comm_ctx *ctx, struct socket *conn_sock,
 			msg->hdr.mcode = (comm_code_t)OPCODE_RESUME_READ;
 			msg->hdr.vaddr = vaddr;
 			msg->hdr.client_pid = client_pid;
+			msg->hdr.server_pid = token;
 			msg->hdr.pgd = pgd;
 			msg->hdr.payload_len = PAGE_SIZE;
 			memcpy(msg->data.payload, pagedata, PAGE_SIZE);
@@ -629,19 +889,939 @@ int comm_resume_read(struct comm_ctx *ctx, struct socket *conn_sock,
 
 err:
 	kfree(msg);
-	ksock_remove(ctx->conn_socks, conn_sock);
-	ksock_socket_destroy(conn_sock);
+	__drop_conn(ctx, conn_sock);
 	return -1;
 
 }
 
-void comm_exit(struct comm_ctx *ctx) {
+/*
+ * @brief Tell a client to read a page from the peer
+ * holding its current copy (forwarding mode)
+ *
+ * @param ctx Server context
+ * @param conn_sock Socket with which the client connected
+ * @param vaddr Virtual address of the page
+ * @param client_pid PID of the process running on the
+ * target machine
+ * @param pgd Pointer to the PGD table of the page
+ * @param owner Address of the owner and its process
+ *
+ * @return 1 if the request was sent AND acknowledged,
+ * -1 on error and 0 otherwise
+ */
+int comm_fetch_peer(struct comm_ctx *ctx, struct socket *conn_sock,
+	unsigned long vaddr, pid_t client_pid, pid_t token, pgd_t *pgd,
+	const struct comm_peer *owner) {
 
-	if ( !ctx )
-		return;
+	int n_tries_remaining = 8;
+	struct comm_msg *msg;
 
-	if ( ctx->srv_thread )
-		kthread_stop(ctx->srv_thread);
+	msg = (struct comm_msg*)kmalloc(
+		sizeof(struct comm_msg) + COMM_MAX_PAYLOAD, GFP_KERNEL);
+	if ( !msg ) {
+		printk(KERN_ERR "comm_fetch_peer: Allocation failure");
+		return -1;
+	}
+
+	while ( n_tries_remaining --> 0 ) {
+
+		int err_code;
+
+		/* The reply is received into the same buffer */
+		msg->hdr.mcode = (comm_code_t)OPCODE_FETCH_PEER;
+		msg->hdr.vaddr = vaddr;
+		msg->hdr.client_pid = client_pid;
+		msg->hdr.server_pid = token;
+		msg->hdr.pgd = pgd;
+		msg->hdr.payload_len = sizeof(struct comm_peer);
+		memcpy(msg->data.payload, owner, sizeof(struct comm_peer));
+
+		if ( comm_send(conn_sock, msg) < 0 ) {
+			printk(KERN_INFO "comm_fetch_peer: Lost connection "
+				"with the client");
+			goto err;
+		}
+
+		err_code = comm_timeout_recv(conn_sock, msg,
+			ctx->msec_timeout);
+		if ( err_code < 0 ) {
+			printk(KERN_INFO "comm_fetch_peer: Lost connection "
+				"with the client");
+			goto err;
+		} else if ( err_code > 0 ) {
+			printk(KERN_INFO "comm_fetch_peer: Client timed out");
+			continue;
+		}
+
+		/* Should not happen but handle this case anyway */
+		if (	/* Check if the reply has anything unexpected */
+			(msg->hdr.mcode.ack.code != ACKCODE_FETCH_PEER.code)
+			|| (msg->hdr.vaddr != vaddr)
+			|| (msg->hdr.client_pid != client_pid)
+			|| (msg->hdr.pgd != pgd)
+			|| (msg->hdr.payload_len != 0)
+		) {
+			printk(KERN_ERR "WARNING: Unexpected acknowledgement");
+			continue;
+		}
+
+		break;
+
+	}
+
+	kfree(msg);
+	return (n_tries_remaining < 0) ? 0 : 1;
+
+err:
+	kfree(msg);
+	__drop_conn(ctx, conn_sock);
+	return -1;
+
+}
+
+/*
+ * @brief Send a reader its copy of a page under a lease
+ *
+ * @param ctx Server context
+ * @param conn_sock Socket with which the client connected
+ * @param vaddr Virtual address of the page
+ * @param client_pid PID of the process running on the
+ * target machine
+ * @param pgd Pointer to the PGD table of the page
+ * @param pagedata Page contents, NULL for a zero page
+ * @param msecs Length of the lease
+ * @param version Version of pagedata, 0 if unknown
+ *
+ * @return 1 if the request was sent AND acknowledged,
+ * -1 on error and 0 otherwise
+ */
+int comm_grant_lease(struct comm_ctx *ctx, struct socket *conn_sock,
+	unsigned long vaddr, pid_t client_pid, pid_t token, pgd_t *pgd,
+	char *pagedata, unsigned int msecs, u64 version) {
+
+	int n_tries_remaining = 8;
+	struct comm_msg *msg;
+	struct comm_lease *lease;
+
+	/* Larger than anything a peer sends us */
+	msg = (struct comm_msg*)kmalloc(sizeof(struct comm_msg)
+		+ sizeof(struct comm_lease) + PAGE_SIZE, GFP_KERNEL);
+	if ( !msg ) {
+		printk(KERN_ERR "comm_grant_lease: Allocation failure");
+		return -1;
+	}
+	lease = (struct comm_lease*)msg->data.payload;
+
+	while ( n_tries_remaining --> 0 ) {
+
+		int err_code;
+
+		/* The reply is received into the same buffer */
+		msg->hdr.mcode = (comm_code_t)OPCODE_GRANT_LEASE;
+		msg->hdr.vaddr = vaddr;
+		msg->hdr.client_pid = client_pid;
+		msg->hdr.server_pid = token;
+		msg->hdr.pgd = pgd;
+		msg->hdr.payload_len = sizeof(struct comm_lease) + PAGE_SIZE;
+		lease->msecs = msecs;
+		lease->version = version;
+		if ( pagedata )
+			memcpy(lease + 1, pagedata, PAGE_SIZE);
+		else
+			memset(lease + 1, 0, PAGE_SIZE);
+
+		if ( comm_send(conn_sock, msg) < 0 ) {
+			printk(KERN_INFO "comm_grant_lease: Lost connection "
+				"with the client");
+			goto err;
+		}
+
+		err_code = comm_timeout_recv(conn_sock, msg,
+			ctx->msec_timeout);
+		if ( err_code < 0 ) {
+			printk(KERN_INFO "comm_grant_lease: Lost connection "
+				"with the client");
+			goto err;
+		} else if ( err_code > 0 ) {
+			printk(KERN_INFO "comm_grant_lease: Client timed out");
+			continue;
+		}
+
+		/* Should not happen but handle this case anyway */
+		if (	/* Check if the reply has anything unexpected */
+			(msg->hdr.mcode.ack.code != ACKCODE_GRANT_LEASE.code)
+			|| (msg->hdr.vaddr != vaddr)
+			|| (msg->hdr.client_pid != client_pid)
+			|| (msg->hdr.pgd != pgd)
+			|| (msg->hdr.payload_len != 0)
+		) {
+			printk(KERN_ERR "WARNING: Unexpected acknowledgement");
+			continue;
+		}
+
+		break;
+
+	}
+
+	kfree(msg);
+	return (n_tries_remaining < 0) ? 0 : 1;
+
+err:
+	kfree(msg);
+	__drop_conn(ctx, conn_sock);
+	return -1;
+
+}
+
+/*
+ * @brief Tell a reader its copy of a page is current, instead
+ * of sending the page (see struct comm_version)
+ *
+ * @param ctx Server context
+ * @param conn_sock Socket with which the client connected
+ * @param vaddr Virtual address of the page
+ * @param client_pid PID of the process running on the
+ * target machine
+ * @param pgd Pointer to the PGD table of the page
+ * @param version Version of the page
+ * @param msecs Length of the new lease, 0 for none
+ *
+ * @return 1 if the request was sent AND acknowledged,
+ * -1 on error and 0 otherwise
+ */
+int comm_not_modified(struct comm_ctx *ctx, struct socket *conn_sock,
+	unsigned long vaddr, pid_t client_pid, pid_t token, pgd_t *pgd,
+	u64 version, unsigned int msecs) {
+
+	int n_tries_remaining = 8;
+	struct comm_msg *msg;
+	struct comm_version *current_version;
+
+	msg = (struct comm_msg*)kmalloc(
+		sizeof(struct comm_msg) + COMM_MAX_PAYLOAD, GFP_KERNEL);
+	if ( !msg ) {
+		printk(KERN_ERR "comm_not_modified: Allocation failure");
+		return -1;
+	}
+	current_version = (struct comm_version*)msg->data.payload;
+
+	while ( n_tries_remaining --> 0 ) {
+
+		int err_code;
+
+		/* The reply is received into the same buffer */
+		msg->hdr.mcode = (comm_code_t)OPCODE_NOT_MODIFIED;
+		msg->hdr.vaddr = vaddr;
+		msg->hdr.client_pid = client_pid;
+		msg->hdr.server_pid = token;
+		msg->hdr.pgd = pgd;
+		msg->hdr.payload_len = sizeof(struct comm_version);
+		current_version->version = version;
+		current_version->msecs = msecs;
+
+		if ( comm_send(conn_sock, msg) < 0 ) {
+			printk(KERN_INFO "comm_not_modified: Lost connection "
+				"with the client");
+			goto err;
+		}
+
+		err_code = comm_timeout_recv(conn_sock, msg,
+			ctx->msec_timeout);
+		if ( err_code < 0 ) {
+			printk(KERN_INFO "comm_not_modified: Lost connection "
+				"with the client");
+			goto err;
+		} else if ( err_code > 0 ) {
+			printk(KERN_INFO "comm_not_modified: Client timed out");
+			continue;
+		}
+
+		/* Should not happen but handle this case anyway */
+		if (	/* Check if the reply has anything unexpected */
+			(msg->hdr.mcode.ack.code != ACKCODE_NOT_MODIFIED.code)
+			|| (msg->hdr.vaddr != vaddr)
+			|| (msg->hdr.client_pid != client_pid)
+			|| (msg->hdr.pgd != pgd)
+			|| (msg->hdr.payload_len != 0)
+		) {
+			printk(KERN_ERR "WARNING: Unexpected acknowledgement");
+			continue;
+		}
+
+		break;
+
+	}
+
+	kfree(msg);
+	return (n_tries_remaining < 0) ? 0 : 1;
+
+err:
+	kfree(msg);
+	__drop_conn(ctx, conn_sock);
+	return -1;
+
+}
+
+/*
+ * @brief Unblock reads on a page and send only the blocks
+ * of it that changed (see struct comm_blocks)
+ *
+ * @param ctx Server context
+ * @param conn_sock Socket with which the client connected
+ * @param vaddr Virtual address of the page
+ * @param client_pid PID of the process running on the
+ * target machine
+ * @param pgd Pointer to the PGD table of the page
+ * @param pagedata Page contents
+ * @param block_size Size of a block, at least COMM_MIN_BLOCK
+ * @param changed Bitmask of the blocks to send
+ *
+ * @return 1 if the request was sent AND acknowledged,
+ * -1 on error and 0 otherwise
+ */
+int comm_resume_blocks(struct comm_ctx *ctx, struct socket *conn_sock,
+	unsigned long vaddr, pid_t client_pid, pid_t token, pgd_t *pgd, char *pagedata,
+	unsigned int block_size, u64 changed) {
+
+	int n_tries_remaining = 8;
+	struct comm_msg *msg;
+	struct comm_blocks *blocks;
+
+	msg = (struct comm_msg*)kmalloc(
+		sizeof(struct comm_msg) + COMM_MAX_PAYLOAD, GFP_KERNEL);
+	if ( !msg ) {
+		printk(KERN_ERR "comm_resume_blocks: Allocation failure");
+		return -1;
+	}
+	blocks = (struct comm_blocks*)msg->data.payload;
+
+	while ( n_tries_remaining --> 0 ) {
+
+		int err_code, i;
+		char *block;
+
+		/* The reply is received into the same buffer */
+		msg->hdr.mcode = (comm_code_t)OPCODE_RESUME_BLOCKS;
+		msg->hdr.vaddr = vaddr;
+		msg->hdr.client_pid = client_pid;
+		msg->hdr.server_pid = token;
+		msg->hdr.pgd = pgd;
+		blocks->block_size = block_size;
+		blocks->changed = changed;
+		block = (char*)(blocks + 1);
+		for ( i = 0; i < PAGE_SIZE / block_size; i++ ) {
+			if ( !(changed & (1ULL << i)) )
+				continue;
+			memcpy(block, pagedata + i * block_size, block_size);
+			block += block_size;
+		}
+		msg->hdr.payload_len = block - msg->data.payload;
+
+		if ( comm_send(conn_sock, msg) < 0 ) {
+			printk(KERN_INFO "comm_resume_blocks: Lost connection "
+				"with the client");
+			goto err;
+		}
+
+		err_code = comm_timeout_recv(conn_sock, msg,
+			ctx->msec_timeout);
+		if ( err_code < 0 ) {
+			printk(KERN_INFO "comm_resume_blocks: Lost connection "
+				"with the client");
+			goto err;
+		} else if ( err_code > 0 ) {
+			printk(KERN_INFO "comm_resume_blocks: Client timed out");
+			continue;
+		}
+
+		/* Should not happen but handle this case anyway */
+		if (	/* Check if the reply has anything unexpected */
+			(msg->hdr.mcode.ack.code != ACKCODE_RESUME_BLOCKS.code)
+			|| (msg->hdr.vaddr != vaddr)
+			|| (msg->hdr.client_pid != client_pid)
+			|| (msg->hdr.pgd != pgd)
+			|| (msg->hdr.payload_len != 0)
+		) {
+			printk(KERN_ERR "WARNING: Unexpected acknowledgement");
+			continue;
+		}
+
+		break;
+
+	}
+
+	kfree(msg);
+	return (n_tries_remaining < 0) ? 0 : 1;
+
+err:
+	kfree(msg);
+	__drop_conn(ctx, conn_sock);
+	return -1;
+
+}
+
+/*
+ * @brief Unblock reads on a huge unit and send its data in
+ * chunks (see struct comm_chunk)
+ *
+ * All the chunks go out before the acknowledgement of the
+ * last one is waited for, and a retry sends them all again.
+ *
+ * @param ctx Server context
+ * @param conn_sock Socket with which the client connected
+ * @param vaddr Key of the unit, with COMM_HUGE_BIT set
+ * @param client_pid PID of the process running on the
+ * target machine
+ * @param pgd Pointer to the PGD table of the unit
+ * @param unit Unit contents, count pages
+ * @param count Number of chunks
+ *
+ * @return 1 if the chunks were sent AND acknowledged,
+ * -1 on error and 0 otherwise
+ */
+int comm_resume_chunks(struct comm_ctx *ctx, struct socket *conn_sock,
+	unsigned long vaddr, pid_t client_pid, pid_t token, pgd_t *pgd,
+	const char *unit, unsigned int count) {
+
+	int n_tries_remaining = 8;
+	struct comm_msg *msg;
+	struct comm_chunk *chunk;
+
+	msg = (struct comm_msg*)kmalloc(
+		sizeof(struct comm_msg) + COMM_MAX_PAYLOAD, GFP_KERNEL);
+	if ( !msg ) {
+		printk(KERN_ERR "comm_resume_chunks: Allocation failure");
+		return -1;
+	}
+	chunk = (struct comm_chunk*)msg->data.payload;
+
+	while ( n_tries_remaining --> 0 ) {
+
+		int err_code, i;
+
+		for ( i = 0; i < count; i++ ) {
+			/* The reply is received into the same buffer */
+			msg->hdr.mcode = (comm_code_t)OPCODE_RESUME_CHUNK;
+			msg->hdr.vaddr = vaddr;
+			msg->hdr.client_pid = client_pid;
+			msg->hdr.server_pid = token;
+			msg->hdr.pgd = pgd;
+			msg->hdr.payload_len = sizeof(*chunk) + PAGE_SIZE;
+			chunk->index = i;
+			chunk->count = count;
+			memcpy(chunk + 1, unit + i * PAGE_SIZE, PAGE_SIZE);
+
+			if ( comm_send(conn_sock, msg) < 0 ) {
+				printk(KERN_INFO "comm_resume_chunks: Lost connection "
+					"with the client");
+				goto err;
+			}
+		}
+
+		err_code = comm_timeout_recv(conn_sock, msg,
+			ctx->msec_timeout);
+		if ( err_code < 0 ) {
+			printk(KERN_INFO "comm_resume_chunks: Lost connection "
+				"with the client");
+			goto err;
+		} else if ( err_code > 0 ) {
+			printk(KERN_INFO "comm_resume_chunks: Client timed out");
+			continue;
+		}
+
+		/* Should not happen but handle this case anyway */
+		if (	/* Check if the reply has anything unexpected */
+			(msg->hdr.mcode.ack.code != ACKCODE_RESUME_CHUNK.code)
+			|| (msg->hdr.vaddr != vaddr)
+			|| (msg->hdr.client_pid != client_pid)
+			|| (msg->hdr.pgd != pgd)
+			|| (msg->hdr.payload_len != 0)
+		) {
+			printk(KERN_ERR "WARNING: Unexpected acknowledgement");
+			continue;
+		}
+
+		break;
+
+	}
+
+	kfree(msg);
+	return (n_tries_remaining < 0) ? 0 : 1;
+
+err:
+	kfree(msg);
+	__drop_conn(ctx, conn_sock);
+	return -1;
+
+}
+
+/*
+ * @brief Send pages a reader is expected to read next, ahead
+ * of its INITIAL_READ (see struct comm_push)
+ *
+ * Like comm_resume_chunks, all the pages go out before the
+ * acknowledgement of the last one is waited for.
+ *
+ * @param ctx Server context
+ * @param conn_sock Socket with which the client connected
+ * @param vaddr Virtual address of the first page
+ * @param stride Distance between the pages, in bytes
+ * @param client_pid PID of the process running on the
+ * target machine
+ * @param pgd Pointer to the PGD table of the pages
+ * @param pages Contents of the count pages from vaddr on,
+ * NULL for a zero page
+ * @param count Number of pages
+ * @param msecs Length of the lease on each page
+ *
+ * @return 1 if the pages were sent AND acknowledged,
+ * -1 on error and 0 otherwise
+ */
+int comm_push_pages(struct comm_ctx *ctx, struct socket *conn_sock,
+	unsigned long vaddr, long stride, pid_t client_pid, pid_t token, pgd_t *pgd,
+	char **pages, unsigned int count, unsigned int msecs) {
+
+	int n_tries_remaining = 8;
+	unsigned long last = vaddr + (count - 1) * stride;
+	struct comm_msg *msg;
+	struct comm_push *push;
+
+	msg = (struct comm_msg*)kmalloc(
+		sizeof(struct comm_msg) + COMM_MAX_PAYLOAD, GFP_KERNEL);
+	if ( !msg ) {
+		printk(KERN_ERR "comm_push_pages: Allocation failure");
+		return -1;
+	}
+	push = (struct comm_push*)msg->data.payload;
+
+	while ( n_tries_remaining --> 0 ) {
+
+		int err_code, i;
+
+		for ( i = 0; i < count; i++ ) {
+			/* The reply is received into the same buffer */
+			msg->hdr.mcode = (comm_code_t)OPCODE_PUSH_PAGE;
+			msg->hdr.vaddr = vaddr + i * stride;
+			msg->hdr.client_pid = client_pid;
+			msg->hdr.server_pid = token;
+			msg->hdr.pgd = pgd;
+			msg->hdr.payload_len = sizeof(*push) + PAGE_SIZE;
+			push->msecs = msecs;
+			push->index = i;
+			push->count = count;
+			if ( pages[i] )
+				memcpy(push + 1, pages[i], PAGE_SIZE);
+			else
+				memset(push + 1, 0, PAGE_SIZE);
+
+			if ( comm_send(conn_sock, msg) < 0 ) {
+				printk(KERN_INFO "comm_push_pages: Lost connection "
+					"with the client");
+				goto err;
+			}
+		}
+
+		err_code = comm_timeout_recv(conn_sock, msg,
+			ctx->msec_timeout);
+		if ( err_code < 0 ) {
+			printk(KERN_INFO "comm_push_pages: Lost connection "
+				"with the client");
+			goto err;
+		} else if ( err_code > 0 ) {
+			printk(KERN_INFO "comm_push_pages: Client timed out");
+			continue;
+		}
+
+		/* Should not happen but handle this case anyway */
+		if (	/* Check if the reply has anything unexpected */
+			(msg->hdr.mcode.ack.code != ACKCODE_PUSH_PAGE.code)
+			|| (msg->hdr.vaddr != last)
+			|| (msg->hdr.client_pid != client_pid)
+			|| (msg->hdr.pgd != pgd)
+			|| (msg->hdr.payload_len != 0)
+		) {
+			printk(KERN_ERR "WARNING: Unexpected acknowledgement");
+			continue;
+		}
+
+		break;
+
+	}
+
+	kfree(msg);
+	return (n_tries_remaining < 0) ? 0 : 1;
+
+err:
+	kfree(msg);
+	__drop_conn(ctx, conn_sock);
+	return -1;
+
+}
+
+/*
+ * @brief Send a frame of the answer to a bulk read (see
+ * struct comm_range_batch). Not acknowledged.
+ *
+ * @param ctx Server context
+ * @param conn_sock Socket with which the client connected
+ * @param vaddr Virtual address of the first page of the range
+ * @param client_pid PID of the process running on the
+ * target machine
+ * @param pgd Pointer to the PGD table of the pages
+ * @param answered Pages of the range the frame answers for
+ * @param present Pages among them that have contents
+ * @param pages Contents of the pages in present, in order
+ * @param msecs Length of the lease on each page, 0 for none
+ *
+ * @return 0 if the frame was sent, -1 on error
+ */
+int comm_resume_range(struct comm_ctx *ctx, struct socket *conn_sock,
+	unsigned long vaddr, pid_t client_pid, pid_t token, pgd_t *pgd,
+	u64 answered, u64 present, char **pages, unsigned int msecs) {
+
+	int i, count = hweight64(present);
+	struct comm_msg *msg;
+	struct comm_range_batch *batch;
+
+	msg = (struct comm_msg*)kmalloc(sizeof(struct comm_msg)
+		+ sizeof(struct comm_range_batch) + count * PAGE_SIZE, GFP_KERNEL);
+	if ( !msg ) {
+		printk(KERN_ERR "comm_resume_range: Allocation failure");
+		return -1;
+	}
+	batch = (struct comm_range_batch*)msg->data.payload;
+
+	msg->hdr.mcode = (comm_code_t)OPCODE_RESUME_RANGE;
+	msg->hdr.vaddr = vaddr;
+	msg->hdr.client_pid = client_pid;
+	msg->hdr.server_pid = token;
+	msg->hdr.pgd = pgd;
+	msg->hdr.payload_len = sizeof(struct comm_range_batch) + count * PAGE_SIZE;
+	batch->msecs = msecs;
+	batch->answered = answered;
+	batch->present = present;
+	for ( i = 0; i < count; i++ )
+		memcpy((char*)(batch + 1) + i * PAGE_SIZE, pages[i], PAGE_SIZE);
+
+	if ( comm_send(conn_sock, msg) < 0 ) {
+		printk(KERN_INFO "comm_resume_range: Lost connection "
+			"with the client");
+		kfree(msg);
+		__drop_conn(ctx, conn_sock);
+		return -1;
+	}
+
+	kfree(msg);
+	return 0;
+
+}
+
+/*
+ * @brief Tell the owner of a page which hosts are about to read
+ * it with PEER_READ (forwarding mode)
+ *
+ * Not acknowledged, like comm_recall_home(): it is sent while
+ * another node's request is handled, and the acknowledgement
+ * would come in on a connection read by the owner's handler.
+ *
+ * @param hosts Addresses of the readers
+ *
+ * Other parameters as in comm_fetch_peer()
+ *
+ * @return 1 if the request was sent, -1 on error
+ */
+int comm_peer_hosts(struct comm_ctx *ctx, struct socket *conn_sock,
+	unsigned long vaddr, pid_t client_pid, pid_t token, pgd_t *pgd,
+	const struct comm_peer_hosts *hosts) {
+
+	struct comm_msg *msg;
+
+	msg = (struct comm_msg*)kmalloc(
+		sizeof(struct comm_msg) + sizeof(struct comm_peer_hosts), GFP_KERNEL);
+	if ( !msg ) {
+		printk(KERN_ERR "comm_peer_hosts: Allocation failure");
+		return -1;
+	}
+
+	msg->hdr.mcode = (comm_code_t)OPCODE_PEER_HOSTS;
+	msg->hdr.vaddr = vaddr;
+	msg->hdr.client_pid = client_pid;
+	msg->hdr.server_pid = token;
+	msg->hdr.pgd = pgd;
+	msg->hdr.payload_len = sizeof(struct comm_peer_hosts);
+	memcpy(msg->data.payload, hosts, sizeof(struct comm_peer_hosts));
+
+	if ( comm_send(conn_sock, msg) < 0 ) {
+		printk(KERN_INFO "comm_peer_hosts: Lost connection "
+			"with the client");
+		kfree(msg);
+		__drop_conn(ctx, conn_sock);
+		return -1;
+	}
+
+	kfree(msg);
+	return 1;
+
+}
+
+/* Address a client connected from, 0 if it cannot be found */
+__be32 comm_peer_ip(struct socket *conn_sock) {
+
+	struct sockaddr_in addr;
+	int addr_len = sizeof(addr);
+
+	if ( kernel_getpeername(conn_sock,
+		(struct sockaddr*)&addr, &addr_len) < 0 )
+		return 0;
+
+	return addr.sin_addr.s_addr;
+
+}
+
+/////////////////////////////////////////////////////////
+///////////////////// SERVER LINKS //////////////////////
+/////////////////////////////////////////////////////////
+
+static void __link_set_sock(struct comm_link *link, struct socket *sock) {
+
+	struct socket *old;
+
+	mutex_lock(&link->send_lock);
+	old = link->sock;
+	link->sock = sock;
+	mutex_unlock(&link->send_lock);
+
+	if ( old )
+		ksock_socket_destroy(old);
+
+	return;
+
+}
+
+static struct socket *__link_connect(struct comm_link *link) {
+
+	struct socket *sock;
+
+	while ( !kthread_should_stop() ) {
+
+		if ( (sock = ksock_socket_create()) ) {
+			if ( ksock_connect(sock, (struct sockaddr*)&link->serv_addr,
+				sizeof(link->serv_addr)) >= 0 )
+				return sock;
+			ksock_socket_destroy(sock);
+		}
+
+		printk(KERN_INFO "comm_link: Failed to connect, retrying");
+		msleep_interruptible(LINK_RETRY_MSECS);
+
+	}
+
+	return NULL;
+
+}
+
+static int __link_run(void *thrdata) {
+
+	struct comm_link *link = (struct comm_link*)thrdata;
+	struct comm_msg *msg;
+	struct socket *sock = NULL;
+
+	allow_signal(SIGKILL|SIGTERM);
+
+	msg = (struct comm_msg*)kmalloc(
+		sizeof(struct comm_msg) + COMM_MAX_PAYLOAD, GFP_KERNEL);
+	if ( !msg ) {
+		printk(KERN_ERR "comm_link: Allocation failure");
+		goto out;
+	}
+
+	while ( !kthread_should_stop() ) {
+
+		int err_code;
+		comm_ackcode_t ack_code;
+
+		if ( !sock ) {
+			if ( !(sock = __link_connect(link)) )
+				break;
+			__link_set_sock(link, sock);
+		}
+
+		err_code = comm_timeout_recv(sock, msg, link->ctx->msec_timeout);
+		if ( err_code > 0 )
+			continue;
+		if ( err_code < 0 ) {
+			printk(KERN_INFO "comm_link: Lost connection "
+				"with the server");
+			__link_set_sock(link, NULL);
+			sock = NULL;
+			continue;
+		}
+
+		ack_code = link->handler(link, msg->hdr.mcode, msg->hdr.vaddr,
+			msg->hdr.client_pid, msg->hdr.server_pid, msg->hdr.pgd,
+			msg->hdr.payload_len ? msg->data.payload : NULL,
+			link->handler_cb_data);
+
+		if ( ack_code.code == ACKCODE_NO_RESPONSE.code )
+			continue;
+
+		comm_link_ack(link, ack_code, msg->hdr.vaddr,
+			msg->hdr.client_pid, msg->hdr.server_pid, msg->hdr.pgd);
+
+	}
+
+out:
+	kfree(msg);
+	__link_set_sock(link, NULL);
+
+	/* Stay around for kthread_stop() in comm_link_exit() */
+	while ( !kthread_should_stop() )
+		msleep_interruptible(LINK_RETRY_MSECS);
+
+	return 0;
+
+}
+
+static int __link_send(struct comm_link *link, comm_code_t mcode,
+	unsigned long vaddr, pid_t client_pid, pid_t token, pgd_t *pgd,
+	char *pagedata) {
+
+	int err_code = -1;
+	struct comm_msg *msg;
+
+	msg = (struct comm_msg*)kmalloc(sizeof(struct comm_msg)
+		+ (pagedata ? PAGE_SIZE : 0), GFP_KERNEL);
+	if ( !msg ) {
+		printk(KERN_ERR "comm_link: Allocation failure");
+		return -1;
+	}
+
+	msg->hdr.mcode = mcode;
+	msg->hdr.vaddr = vaddr;
+	msg->hdr.client_pid = client_pid;
+	msg->hdr.server_pid = token;
+	msg->hdr.pgd = pgd;
+	msg->hdr.payload_len = pagedata ? PAGE_SIZE : 0;
+	if ( pagedata )
+		memcpy(msg->data.payload, pagedata, PAGE_SIZE);
+
+	mutex_lock(&link->send_lock);
+	if ( link->sock )
+		err_code = comm_send(link->sock, msg);
+	mutex_unlock(&link->send_lock);
+
+	kfree(msg);
+
+	return (err_code < 0) ? -1 : 0;
+
+}
+
+/*
+ * @brief Open a link to the server at ip:port
+ *
+ * Messages from that server are passed to handler on the link
+ * thread. The link connects in the background and reconnects
+ * after losing the connection.
+ *
+ * @return The link, or NULL on failure
+ */
+struct comm_link *comm_link_new(struct comm_ctx *ctx, const char *ip, int port,
+	comm_link_handler_t handler, void *cb_data) {
+
+	struct comm_link *link;
+
+	if ( !(link = kmalloc(sizeof(struct comm_link), GFP_KERNEL)) ) {
+		printk(KERN_ERR "comm_link_new: Allocation failure");
+		return NULL;
+	}
+
+	link->ctx = ctx;
+	memset(&(link->serv_addr), 0, sizeof(link->serv_addr));
+	link->serv_addr.sin_family = PF_INET;
+	link->serv_addr.sin_port = htons(port);
+	link->serv_addr.sin_addr.s_addr = htonl(str2ip(ip));
+	link->sock = NULL;
+	mutex_init(&link->send_lock);
+	link->handler = handler;
+	link->handler_cb_data = cb_data;
+
+	link->thread = kthread_run(__link_run, link, "megavm_link/%d", port);
+	if ( IS_ERR(link->thread) ) {
+		printk(KERN_ERR "comm_link_new: Failed to run link thread");
+		kfree(link);
+		return NULL;
+	}
+
+	return link;
+
+}
+
+/*
+ * Send a request over a link. Replies arrive at the link handler.
+ *
+ * @return 0 if the request was sent, -1 otherwise
+ */
+int comm_link_request(struct comm_link *link, comm_opcode_t opcode,
+	unsigned long vaddr, pid_t client_pid, pid_t token, pgd_t *pgd, char *pagedata) {
+
+	return __link_send(link, (comm_code_t)opcode, vaddr,
+		client_pid, token, pgd, pagedata);
+
+}
+
+/* Acknowledge a request the link handler answered ACKCODE_NO_RESPONSE to */
+int comm_link_ack(struct comm_link *link, comm_ackcode_t ackcode,
+	unsigned long vaddr, pid_t client_pid, pid_t token, pgd_t *pgd) {
+
+	return __link_send(link, (comm_code_t)ackcode, vaddr,
+		client_pid, token, pgd, NULL);
+
+}
+
+/*
+ * Stop receiving on a link. No handler runs after this returns and
+ * later sends fail, but the link stays valid for threads that may
+ * still use it until comm_link_exit().
+ */
+void comm_link_stop(struct comm_link *link) {
+
+	if ( !link || !link->thread )
+		return;
+
+	kthread_stop(link->thread);
+	link->thread = NULL;
+
+	return;
+
+}
+
+void comm_link_exit(struct comm_link *link) {
+
+	if ( !link )
+		return;
+
+	comm_link_stop(link);
+	kfree(link);
+
+	return;
+
+}
+
+void comm_exit(struct comm_ctx *ctx) {
+
+	int node;
+
+	if ( !ctx )
+		return;
+
+	if ( ctx->srv_thread )
+		kthread_stop(ctx->srv_thread);
+	/* Queued work holds references it only drops when run */
+	__run_deferred(ctx);
+	for ( node = 0; node < COMM_MAX_NODES; node++ ) {
+		if ( ctx->nodes[node] )
+			__node_release(node);
+	}
 	if ( ctx->acceptor_sock )
 		ksock_socket_destroy(ctx->acceptor_sock);
 	if ( ctx->conn_socks )
@@ -7,6 +7,8 @@
 
 
 #include <linux/semaphore.h>
+#include <linux/llist.h>
+#include <linux/mutex.h>
 #include <linux/kthread.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
@@ -20,7 +22,13 @@
 
 
 
-#define COMM_MAX_HNDLRS 16
+#define COMM_MAX_HNDLRS 64
+/*
+ * Every accepted connection gets a dense node ID in [0, COMM_MAX_NODES)
+ * for compact per-page bookkeeping. The ksock sets currently cap the
+ * number of live connections at KSOCK_MAX_SETSZ.
+ */
+#define COMM_MAX_NODES 256
 
 
 
@@ -36,6 +44,42 @@ typedef struct {unsigned char code;} comm_ackcode_t;
 #define OPCODE_RESUME_READ	((comm_opcode_t){.code = 0x04})
 #define OPCODE_INITIAL_READ	((comm_opcode_t){.code = 0x05})
 #define OPCODE_PING_ALIVE	((comm_opcode_t){.code = 0x06})
+/* Forwarding mode, see struct comm_peer */
+#define OPCODE_COMMIT_OWNER	((comm_opcode_t){.code = 0x10})
+#define OPCODE_FETCH_PEER	((comm_opcode_t){.code = 0x11})
+#define OPCODE_PEER_READ	((comm_opcode_t){.code = 0x12})
+/* Lease mode, see struct comm_lease */
+#define OPCODE_GRANT_LEASE	((comm_opcode_t){.code = 0x13})
+#define OPCODE_RETURN_LEASE	((comm_opcode_t){.code = 0x14})
+/* Multiple-writer mode, see struct comm_diff_run */
+#define OPCODE_COMMIT_DIFF	((comm_opcode_t){.code = 0x15})
+#define OPCODE_ALLOW_SHARED_WRITE ((comm_opcode_t){.code = 0x16})
+/* Sub-page blocks, see struct comm_blocks */
+#define OPCODE_RESUME_BLOCKS	((comm_opcode_t){.code = 0x17})
+/* Huge units, see struct comm_chunk */
+#define OPCODE_COMMIT_CHUNK	((comm_opcode_t){.code = 0x20})
+#define OPCODE_RESUME_CHUNK	((comm_opcode_t){.code = 0x21})
+/* Read-ahead, see struct comm_push */
+#define OPCODE_PUSH_PAGE	((comm_opcode_t){.code = 0x22})
+/*
+ * Home migration. KEEP_HOME leaves the write lock of a page with
+ * the writer that just committed it, which writes it again without
+ * asking. RECALL_HOME asks for it back and is not acknowledged:
+ * RETURN_HOME carries the page back to the server like a
+ * COMMIT_PAGE and releases the lock. None of them has a payload
+ * but RETURN_HOME's page.
+ */
+#define OPCODE_KEEP_HOME	((comm_opcode_t){.code = 0x23})
+#define OPCODE_RECALL_HOME	((comm_opcode_t){.code = 0x24})
+#define OPCODE_RETURN_HOME	((comm_opcode_t){.code = 0x25})
+/* Bulk reads, see struct comm_range */
+#define OPCODE_INITIAL_READ_RANGE ((comm_opcode_t){.code = 0x26})
+#define OPCODE_RESUME_RANGE	((comm_opcode_t){.code = 0x27})
+/* Page versions, see struct comm_version */
+#define OPCODE_REVALIDATE	((comm_opcode_t){.code = 0x30})
+#define OPCODE_NOT_MODIFIED	((comm_opcode_t){.code = 0x31})
+/* Forwarding mode, not acknowledged, see struct comm_peer_hosts */
+#define OPCODE_PEER_HOSTS	((comm_opcode_t){.code = 0x32})
 
 /* Request codes */
 #define OPCODE_REQUEST_WRITE_CODE (0x00)
@@ -45,6 +89,25 @@ typedef struct {unsigned char code;} comm_ackcode_t;
 #define OPCODE_RESUME_READ_CODE	(0x04)
 #define OPCODE_INITIAL_READ_CODE (0x05)
 #define OPCODE_PING_ALIVE_CODE	(0x06)
+#define OPCODE_COMMIT_OWNER_CODE (0x10)
+#define OPCODE_FETCH_PEER_CODE	(0x11)
+#define OPCODE_PEER_READ_CODE	(0x12)
+#define OPCODE_GRANT_LEASE_CODE	(0x13)
+#define OPCODE_RETURN_LEASE_CODE (0x14)
+#define OPCODE_COMMIT_DIFF_CODE	(0x15)
+#define OPCODE_ALLOW_SHARED_WRITE_CODE (0x16)
+#define OPCODE_RESUME_BLOCKS_CODE (0x17)
+#define OPCODE_COMMIT_CHUNK_CODE (0x20)
+#define OPCODE_RESUME_CHUNK_CODE (0x21)
+#define OPCODE_PUSH_PAGE_CODE	(0x22)
+#define OPCODE_KEEP_HOME_CODE	(0x23)
+#define OPCODE_RECALL_HOME_CODE	(0x24)
+#define OPCODE_RETURN_HOME_CODE	(0x25)
+#define OPCODE_INITIAL_READ_RANGE_CODE (0x26)
+#define OPCODE_RESUME_RANGE_CODE (0x27)
+#define OPCODE_REVALIDATE_CODE	(0x30)
+#define OPCODE_NOT_MODIFIED_CODE (0x31)
+#define OPCODE_PEER_HOSTS_CODE	(0x32)
 
 /* Responses */
 #define ACKCODE_REQUEST_WRITE	((comm_ackcode_t){.code = 0x07})
@@ -56,6 +119,227 @@ typedef struct {unsigned char code;} comm_ackcode_t;
 #define ACKCODE_PING_ALIVE	((comm_ackcode_t){.code = 0x0D})
 #define ACKCODE_NO_RESPONSE	((comm_ackcode_t){.code = 0x0E})
 #define ACKCODE_OP_FAILURE	((comm_ackcode_t){.code = 0x0F})
+#define ACKCODE_COMMIT_OWNER	((comm_ackcode_t){.code = 0x18})
+#define ACKCODE_FETCH_PEER	((comm_ackcode_t){.code = 0x19})
+#define ACKCODE_PEER_READ	((comm_ackcode_t){.code = 0x1A})
+#define ACKCODE_GRANT_LEASE	((comm_ackcode_t){.code = 0x1B})
+#define ACKCODE_RETURN_LEASE	((comm_ackcode_t){.code = 0x1C})
+#define ACKCODE_COMMIT_DIFF	((comm_ackcode_t){.code = 0x1D})
+#define ACKCODE_ALLOW_SHARED_WRITE ((comm_ackcode_t){.code = 0x1E})
+#define ACKCODE_RESUME_BLOCKS	((comm_ackcode_t){.code = 0x1F})
+#define ACKCODE_COMMIT_CHUNK	((comm_ackcode_t){.code = 0x28})
+#define ACKCODE_RESUME_CHUNK	((comm_ackcode_t){.code = 0x29})
+#define ACKCODE_PUSH_PAGE	((comm_ackcode_t){.code = 0x2A})
+#define ACKCODE_KEEP_HOME	((comm_ackcode_t){.code = 0x2B})
+#define ACKCODE_RETURN_HOME	((comm_ackcode_t){.code = 0x2D})
+#define ACKCODE_INITIAL_READ_RANGE ((comm_ackcode_t){.code = 0x2E})
+#define ACKCODE_REVALIDATE	((comm_ackcode_t){.code = 0x38})
+#define ACKCODE_NOT_MODIFIED	((comm_ackcode_t){.code = 0x39})
+
+
+
+/*
+ * Client holding the current copy of a page in forwarding mode.
+ *
+ * A client with a peer port commits with COMMIT_OWNER instead of
+ * COMMIT_PAGE: the page stays with the writer and the payload only
+ * carries the port its HGA module serves pages on. The server then
+ * sends FETCH_PEER with the owner's address to the readers, and they
+ * get the page from the owner directly with PEER_READ, addressed to
+ * the owner's pid and pgd. Must match struct hga_peer in the client's
+ * hga_defs.h.
+ */
+struct comm_peer {
+	__be32 ip;
+	__be16 port;
+	pid_t pid;
+	pgd_t *pgd;
+} __attribute__((packed));
+
+/*
+ * Hosts an owner is to serve, sent with PEER_HOSTS before the
+ * FETCH_PEER that sends them to it. The owner answers no other
+ * host's PEER_READ. Must match struct hga_peer_hosts in the
+ * client's hga_defs.h.
+ */
+#define COMM_PEER_HOSTS_MAX 16
+struct comm_peer_hosts {
+	__u32 count;
+	__be32 ip[COMM_PEER_HOSTS_MAX];
+} __attribute__((packed));
+
+/*
+ * Read lease, for tokens with a lease_ms (see tokens.h).
+ *
+ * Readers of such a token are sent GRANT_LEASE instead of
+ * RESUME_READ: the payload is this header followed by the page.
+ * The reader may use its copy for msecs from the moment it
+ * arrives, then blocks reads on its own and asks for the page
+ * again with INITIAL_READ on the next fault. A write waits for
+ * the leases to run out instead of sending LOCK_READ. Readers
+ * give a lease back early with RETURN_LEASE. version is the
+ * version of the page carried (see struct comm_version), 0 if
+ * unknown. Must match struct hga_lease in the client's
+ * hga_defs.h.
+ */
+struct comm_lease {
+	__u32 msecs;
+	__u64 version;
+} __attribute__((packed));
+
+/*
+ * Version of the contents of a page.
+ *
+ * Every commit that changes a page bumps its version, which is 0
+ * for a page never committed. A reader whose lease ran out asks
+ * for the page with REVALIDATE instead of INITIAL_READ, carrying
+ * this header with the version of the copy it still has (msecs
+ * is not used). If that copy is current the answer is
+ * NOT_MODIFIED with this header and no page: the reader keeps its
+ * copy, under a new lease of msecs if not 0. Readers locked for a
+ * write that left the page as it was are sent NOT_MODIFIED
+ * instead of RESUME_READ as well. Must match struct hga_version
+ * in the client's hga_defs.h.
+ */
+struct comm_version {
+	__u64 version;
+	__u32 msecs;
+} __attribute__((packed));
+
+/*
+ * Changed bytes of a page, for tokens in multiple-writer mode
+ * (see tokens.h).
+ *
+ * Several clients may write such a page at once: the first is
+ * sent ALLOW_SHARED_WRITE after the other readers are locked, and
+ * later ones join the write with RESUME_READ and
+ * ALLOW_SHARED_WRITE. Each writer keeps a copy of the page as it
+ * was allowed, and on release commits only what it changed with
+ * COMMIT_DIFF: the payload is a list of runs, each this header
+ * followed by len bytes to put at offset, ended by a run with len
+ * 0. The writer blocks its own reads when it commits. The server
+ * merges the diffs into its copy and, after the last writer's
+ * commit, sends the merged page to every reader. Bytes written by
+ * two writers keep the later commit. Must match struct
+ * hga_diff_run in the client's hga_defs.h.
+ */
+struct comm_diff_run {
+	__u16 offset;
+	__u16 len;
+} __attribute__((packed));
+
+/*
+ * Changed blocks of a page, for tokens with a block_size (see
+ * tokens.h).
+ *
+ * Coherence of such a page is tracked in blocks of block_size
+ * bytes. A write still locks the readers of the whole page, since
+ * page tables cannot block reads of a part of it, but the update
+ * sent on its commit is RESUME_BLOCKS instead of RESUME_READ: this
+ * header followed by the blocks set in changed, in order. The
+ * reader patches them into its own copy, which is current in every
+ * other block. Must match struct hga_blocks in the client's
+ * hga_defs.h.
+ */
+struct comm_blocks {
+	__u16 block_size;
+	__u64 changed;
+} __attribute__((packed));
+
+/* Smallest block, one bit of comm_blocks.changed each */
+#define COMM_MIN_BLOCK (PAGE_SIZE / 64)
+
+/*
+ * Chunk of a huge unit, for clients sharing regions mapped with
+ * 2 MiB pages.
+ *
+ * Such a region is shared in units of COMM_HUGE_SIZE rather than
+ * pages: the vaddr of every message about a unit is its address
+ * with COMM_HUGE_BIT set, and the unit is locked and updated as a
+ * whole. Its data does not fit in a message, so COMMIT_PAGE and
+ * RESUME_READ are replaced by COMMIT_CHUNK and RESUME_CHUNK: count
+ * messages sent in order, each this header followed by the
+ * PAGE_SIZE bytes at index * PAGE_SIZE. Only the last chunk is
+ * acknowledged, and a resend starts over from chunk 0. Must match
+ * struct hga_chunk in the client's hga_defs.h.
+ */
+struct comm_chunk {
+	__u16 index;
+	__u16 count;
+} __attribute__((packed));
+
+/*
+ * Page pushed ahead of a read, for readers walking through a
+ * token's pages in a pattern.
+ *
+ * After a request that continues such a stream the server sends
+ * the pages it expects next with PUSH_PAGE: count messages for
+ * pages a stride apart, each this header followed by the page. The
+ * reader is added to the readers of each page and given a lease
+ * of msecs on it, as if it had asked for it, and stages the page
+ * until it faults on it instead of sending INITIAL_READ. Only
+ * the last push is acknowledged. Must match struct hga_push in
+ * the client's hga_defs.h.
+ */
+struct comm_push {
+	__u32 msecs;
+	__u16 index;
+	__u16 count;
+} __attribute__((packed));
+
+/*
+ * Bulk read of count pages from vaddr on, to warm up a reader
+ * that is about to go through them.
+ *
+ * INITIAL_READ_RANGE carries this header and goes to every
+ * server instance, each answering for the pages it owns as if it
+ * had got an INITIAL_READ for each. Pages that cannot be answered
+ * right away (locked, spilled, ...) are answered on their own
+ * later, the others come in RESUME_RANGE frames of struct
+ * comm_range_batch.
+ */
+struct comm_range {
+	__u32 count;
+} __attribute__((packed));
+
+/*
+ * Frame of a bulk read answer, about the range of 64 pages (one
+ * shard range) whose first page is the frame's vaddr. Pages with
+ * their bit in answered were read, and those also in present
+ * follow this header, in order; the others were never committed
+ * and the reader keeps its copy. Each page comes with a lease of
+ * msecs in lease mode. A frame has at most COMM_RANGE_BATCH
+ * pages and is not acknowledged, the INITIAL_READ_RANGE is once
+ * all its frames are sent. Must match struct hga_range_batch in
+ * the client's hga_defs.h.
+ */
+struct comm_range_batch {
+	__u32 msecs;
+	__u64 answered;
+	__u64 present;
+} __attribute__((packed));
+
+#define COMM_RANGE_BATCH	16
+
+#define COMM_HUGE_BIT		1UL
+#define COMM_HUGE_SIZE		PMD_SIZE
+#define COMM_HUGE_CHUNKS	(COMM_HUGE_SIZE / PAGE_SIZE)
+
+/* Directory key of the page or huge unit a message is about */
+static inline unsigned long comm_page_key(unsigned long vaddr) {
+
+	if ( vaddr & COMM_HUGE_BIT )
+		return (vaddr & PMD_MASK) | COMM_HUGE_BIT;
+
+	return vaddr & PAGE_MASK;
+
+}
+
+/*
+ * Largest payload a peer may send. Runs closer than a header are
+ * merged, so a diff of the whole page is the largest.
+ */
+#define COMM_MAX_PAYLOAD (PAGE_SIZE + 2 * sizeof(struct comm_diff_run))
 
 
 
@@ -70,7 +354,22 @@ typedef union {
 
 /* Returns the appropriate response code */
 typedef comm_ackcode_t (*comm_handler_t)(struct comm_ctx *ctx, unsigned long vaddr,
-	pid_t client_pid, pid_t server_pid, pgd_t *pgd, char *pagedata, void *cb_data, struct socket *sock);
+	pid_t client_pid, pid_t server_pid, pgd_t *pgd, char *pagedata, int payload_len,
+	void *cb_data, struct socket *sock);
+/* Called before a node ID is released on connection loss */
+typedef void (*comm_disconnect_t)(struct comm_ctx *ctx, int node);
+/* Work handed back to the server thread with comm_defer() */
+typedef void (*comm_deferred_t)(struct comm_ctx *ctx, void *data);
+
+struct comm_link;
+/*
+ * Called on the link thread for every message received on a link,
+ * requests and acknowledgements alike. Returns the acknowledgement
+ * to send back, or ACKCODE_NO_RESPONSE.
+ */
+typedef comm_ackcode_t (*comm_link_handler_t)(struct comm_link *link,
+	comm_code_t mcode, unsigned long vaddr, pid_t client_pid, pid_t token,
+	pgd_t *pgd, char *pagedata, void *data);
 
 /*
  * TODO:
@@ -88,11 +387,37 @@ struct comm_ctx {
 	comm_handler_t handlers[COMM_MAX_HNDLRS];
 	void *handler_cb_data[COMM_MAX_HNDLRS];
 
+	struct socket *nodes[COMM_MAX_NODES];
+	comm_disconnect_t disconnect_handler;
+
+	struct llist_head deferred;
+
 	struct task_struct *srv_thread;
 
 };
 
 
+/*
+ * Outgoing connection to another server, over which this server
+ * acts as a client. The link thread (re)connects as needed and
+ * passes everything it receives to the link handler.
+ */
+struct comm_link {
+
+	struct comm_ctx *ctx;
+	struct sockaddr_in serv_addr;
+
+	struct socket *sock;
+	struct mutex send_lock;
+
+	comm_link_handler_t handler;
+	void *handler_cb_data;
+
+	struct task_struct *thread;
+
+};
+
+
 
 struct comm_ctx *comm_ctx_new(void);
 void comm_bind_addr(struct comm_ctx *ctx,
@@ -100,14 +425,58 @@ void comm_bind_addr(struct comm_ctx *ctx,
 void comm_set_timeout(struct comm_ctx *ctx, long msecs);
 void comm_register_handler(struct comm_ctx *ctx,
 	comm_opcode_t opcode, comm_handler_t handler, void *cb_data);
+void comm_register_disconnect(struct comm_ctx *ctx,
+	comm_disconnect_t handler);
 int comm_run(struct comm_ctx *ctx);
+int comm_defer(struct comm_ctx *ctx, comm_deferred_t fn, void *data, gfp_t gfp);
+int comm_node_id(struct comm_ctx *ctx, struct socket *conn_sock);
+struct socket *comm_node_socket(struct comm_ctx *ctx, int node);
 int comm_allow_write(struct comm_ctx *ctx, struct socket *conn_sock,
-	unsigned long vaddr, pid_t client_pid, pgd_t *pgd);
+	unsigned long vaddr, pid_t client_pid, pid_t token, pgd_t *pgd);
+int comm_allow_shared_write(struct comm_ctx *ctx, struct socket *conn_sock,
+	unsigned long vaddr, pid_t client_pid, pid_t token, pgd_t *pgd);
 int comm_lock_read(struct comm_ctx *ctx, struct socket *conn_sock,
-	unsigned long vaddr, pid_t client_pid, pgd_t *pgd);
+	unsigned long vaddr, pid_t client_pid, pid_t token, pgd_t *pgd);
+int comm_keep_home(struct comm_ctx *ctx, struct socket *conn_sock,
+	unsigned long vaddr, pid_t client_pid, pid_t token, pgd_t *pgd);
+int comm_recall_home(struct comm_ctx *ctx, struct socket *conn_sock,
+	unsigned long vaddr, pid_t client_pid, pid_t token, pgd_t *pgd);
 int comm_resume_read(struct comm_ctx *ctx, struct socket *conn_sock,
-	unsigned long vaddr, pid_t client_pid, pgd_t *pgd, char *pagedata);
+	unsigned long vaddr, pid_t client_pid, pid_t token, pgd_t *pgd, char *pagedata);
+int comm_resume_blocks(struct comm_ctx *ctx, struct socket *conn_sock,
+	unsigned long vaddr, pid_t client_pid, pid_t token, pgd_t *pgd, char *pagedata,
+	unsigned int block_size, u64 changed);
+int comm_resume_chunks(struct comm_ctx *ctx, struct socket *conn_sock,
+	unsigned long vaddr, pid_t client_pid, pid_t token, pgd_t *pgd,
+	const char *unit, unsigned int count);
+int comm_push_pages(struct comm_ctx *ctx, struct socket *conn_sock,
+	unsigned long vaddr, long stride, pid_t client_pid, pid_t token, pgd_t *pgd,
+	char **pages, unsigned int count, unsigned int msecs);
+int comm_resume_range(struct comm_ctx *ctx, struct socket *conn_sock,
+	unsigned long vaddr, pid_t client_pid, pid_t token, pgd_t *pgd,
+	u64 answered, u64 present, char **pages, unsigned int msecs);
+int comm_fetch_peer(struct comm_ctx *ctx, struct socket *conn_sock,
+	unsigned long vaddr, pid_t client_pid, pid_t token, pgd_t *pgd,
+	const struct comm_peer *owner);
+int comm_grant_lease(struct comm_ctx *ctx, struct socket *conn_sock,
+	unsigned long vaddr, pid_t client_pid, pid_t token, pgd_t *pgd,
+	char *pagedata, unsigned int msecs, u64 version);
+int comm_not_modified(struct comm_ctx *ctx, struct socket *conn_sock,
+	unsigned long vaddr, pid_t client_pid, pid_t token, pgd_t *pgd,
+	u64 version, unsigned int msecs);
+int comm_peer_hosts(struct comm_ctx *ctx, struct socket *conn_sock,
+	unsigned long vaddr, pid_t client_pid, pid_t token, pgd_t *pgd,
+	const struct comm_peer_hosts *hosts);
+__be32 comm_peer_ip(struct socket *conn_sock);
 void comm_exit(struct comm_ctx *ctx);
+struct comm_link *comm_link_new(struct comm_ctx *ctx, const char *ip, int port,
+	comm_link_handler_t handler, void *cb_data);
+int comm_link_request(struct comm_link *link, comm_opcode_t opcode,
+	unsigned long vaddr, pid_t client_pid, pid_t token, pgd_t *pgd, char *pagedata);
+int comm_link_ack(struct comm_link *link, comm_ackcode_t ackcode,
+	unsigned long vaddr, pid_t client_pid, pid_t token, pgd_t *pgd);
+void comm_link_stop(struct comm_link *link);
+void comm_link_exit(struct comm_link *link);
 
 
 
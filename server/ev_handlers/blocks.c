@@ -0,0 +1,121 @@
+#include <linux/module.h>
+#include "ev_handlers.h"
+#include "../stats/stats.h"
+
+/*
+ * Sub-page coherence blocks.
+ *
+ * Pages of a token with a block_size are tracked in blocks of that size
+ * (see struct comm_blocks). An exclusive writer's commit is compared with
+ * the stored copy block by block, and a shared writer's diff marks the
+ * blocks it covers in mapped_page_ext.dirty_blocks. The update that ends the
+ * write then carries only those blocks, so a hot field costs its block
+ * rather than the page on every reader.
+ *
+ * Updates with a lease carry the whole page, and proxies, whose copies
+ * may trail the home server's, do not split pages.
+ */
+#define BLOCKS_ALL (~0ULL)
+
+static atomic_long_t nr_updates;
+static atomic_long_t nr_blocks_sent;
+static atomic_long_t nr_blocks_kept; //left out of updates as unchanged
+
+static int blocks_stats_show(struct seq_file *m, void *data) {
+    seq_printf(m, "updates %ld\n", atomic_long_read(&nr_updates));
+    seq_printf(m, "blocks_sent %ld\n", atomic_long_read(&nr_blocks_sent));
+    seq_printf(m, "blocks_kept %ld\n", atomic_long_read(&nr_blocks_kept));
+    return 0;
+}
+
+void blocks_init(void) {
+    stats_create_file("blocks", blocks_stats_show, NULL);
+}
+
+/* Block size of token's pages, PAGE_SIZE if they are not split */
+unsigned int blocks_size(pid_t token) {
+    if (proxy_enabled())
+        return PAGE_SIZE;
+    return token_block_size(token_find(token));
+}
+
+/*
+ * Blocks a commit of page changes, with pf_entry->lock held and before
+ * the page is stored. A page that was never committed is a zero page.
+ */
+u64 blocks_of_commit(struct mapped_page *pf_entry, const char *page,
+        unsigned int block_size) {
+    const char *old = NULL;
+    u64 changed = 0;
+    int i;
+
+    if (pf_entry->store && !(old = pgstore_get(pf_entry->store)))
+        return BLOCKS_ALL; //spilled, nothing to compare with
+
+    for (i = 0; i < PAGE_SIZE / block_size; i++) {
+        const char *block = page + i * block_size;
+
+        if (old ? memcmp(old + i * block_size, block, block_size)
+                : memchr_inv(block, 0, block_size) != NULL)
+            changed |= 1ULL << i;
+    }
+
+    if (old)
+        pgstore_put(pf_entry->store);
+    return changed;
+}
+
+/* Blocks covered by a diff already checked by mwrite_merge() */
+u64 blocks_of_diff(const char *diff, unsigned int block_size) {
+    const struct comm_diff_run *run;
+    u64 changed = 0;
+    int i;
+
+    if (block_size >= PAGE_SIZE)
+        return BLOCKS_ALL;
+
+    for (run = (const struct comm_diff_run*)diff; run->len;
+            run = (const struct comm_diff_run*)((const char*)(run + 1) + run->len)) {
+        for (i = run->offset / block_size;
+                i <= (run->offset + run->len - 1) / block_size; i++)
+            changed |= 1ULL << i;
+    }
+    return changed;
+}
+
+/*
+ * Unlock the readers of a page after a write that changed the given
+ * blocks: RESUME_BLOCKS with only those blocks, or fanout_resume_read()
+ * when the page goes whole. Called while the page is still locked.
+ */
+void blocks_resume_read(struct comm_ctx *ctx, struct mapped_page *pf_entry,
+        pid_t token, unsigned long vaddr, char *page, u64 changed, int skip) {
+    unsigned int block_size = blocks_size(token);
+    unsigned int nr_blocks = PAGE_SIZE / block_size;
+    u64 all = nr_blocks >= 64 ? BLOCKS_ALL : (1ULL << nr_blocks) - 1;
+    int reader;
+
+    if (block_size >= PAGE_SIZE || !page || lease_msecs(token)
+            || (changed & all) == all) {
+        fanout_resume_read(ctx, pf_entry, token, vaddr, page, skip);
+        return;
+    }
+    changed &= all;
+    atomic_long_inc(&nr_updates);
+
+    reader_set_for_each(reader, &(pf_entry->readers)) {
+        struct socket *reader_sock;
+        pid_t reader_pid;
+        pgd_t *reader_pgd;
+
+        if (reader == skip)
+            continue;
+        reader_sock = comm_node_socket(ctx, reader);
+        if (!reader_sock || !lookup_client_entry(token, reader, &reader_pid, &reader_pgd))
+            continue;
+        comm_resume_blocks(ctx, reader_sock, vaddr, reader_pid, token, reader_pgd,
+                page, block_size, changed);
+        atomic_long_add(hweight64(changed), &nr_blocks_sent);
+        atomic_long_add(nr_blocks - hweight64(changed), &nr_blocks_kept);
+    }
+}
@@ -1,20 +1,146 @@
 #include "../comm/comm.h"
 #include "../hashtable/hashtable.h"
-
-struct vaddr_arg {
-        unsigned long pfn;
-        pid_t token;
-};
+#include "../shard/shard.h"
+#include "../proxy/proxy.h"
 
 comm_ackcode_t handle_request_write(struct comm_ctx *ctx, unsigned long vaddr,
-        pid_t client_pid, pid_t server_pid, pgd_t *pgd, char *pagedata, void *cb_data, struct socket *conn_sock);
+        pid_t client_pid, pid_t server_pid, pgd_t *pgd, char *pagedata, int payload_len, void *cb_data, struct socket *conn_sock);
 
 comm_ackcode_t handle_initial_read(struct comm_ctx *ctx, unsigned long vaddr,
-        pid_t client_pid, pid_t server_pid, pgd_t *pgd, char *pagedata, void *cb_data, struct socket *conn_sock);
+        pid_t client_pid, pid_t server_pid, pgd_t *pgd, char *pagedata, int payload_len, void *cb_data, struct socket *conn_sock);
+
+comm_ackcode_t handle_initial_read_range(struct comm_ctx *ctx, unsigned long vaddr,
+        pid_t client_pid, pid_t server_pid, pgd_t *pgd, char *pagedata, int payload_len, void *cb_data, struct socket *conn_sock);
+
+comm_ackcode_t handle_revalidate(struct comm_ctx *ctx, unsigned long vaddr,
+        pid_t client_pid, pid_t server_pid, pgd_t *pgd, char *pagedata, int payload_len, void *cb_data, struct socket *conn_sock);
 
 comm_ackcode_t handle_commit_page(struct comm_ctx *ctx, unsigned long vaddr,
-        pid_t client_pid, pid_t server_pid, pgd_t *pgd, char *pagedata, void *cb_data, struct socket *conn_sock);
+        pid_t client_pid, pid_t server_pid, pgd_t *pgd, char *pagedata, int payload_len, void *cb_data, struct socket *conn_sock);
+
+comm_ackcode_t handle_commit_owner(struct comm_ctx *ctx, unsigned long vaddr,
+        pid_t client_pid, pid_t server_pid, pgd_t *pgd, char *pagedata, int payload_len, void *cb_data, struct socket *conn_sock);
+
+comm_ackcode_t handle_commit_diff(struct comm_ctx *ctx, unsigned long vaddr,
+        pid_t client_pid, pid_t server_pid, pgd_t *pgd, char *pagedata, int payload_len, void *cb_data, struct socket *conn_sock);
+
+comm_ackcode_t handle_commit_chunk(struct comm_ctx *ctx, unsigned long vaddr,
+        pid_t client_pid, pid_t server_pid, pgd_t *pgd, char *pagedata, int payload_len, void *cb_data, struct socket *conn_sock);
+
+comm_ackcode_t handle_return_home(struct comm_ctx *ctx, unsigned long vaddr,
+        pid_t client_pid, pid_t server_pid, pgd_t *pgd, char *pagedata, int payload_len, void *cb_data, struct socket *conn_sock);
+
+comm_ackcode_t handle_return_lease(struct comm_ctx *ctx, unsigned long vaddr,
+        pid_t client_pid, pid_t server_pid, pgd_t *pgd, char *pagedata, int payload_len, void *cb_data, struct socket *conn_sock);
+
+int fanout_lock_read(struct comm_ctx *ctx, struct mapped_page *pf_entry,
+        pid_t token, unsigned long vaddr, int skip);
+
+void fanout_resume_read(struct comm_ctx *ctx, struct mapped_page *pf_entry,
+        pid_t token, unsigned long vaddr, char *page, int skip);
+
+void fanout_fetch_peer(struct comm_ctx *ctx, struct mapped_page *pf_entry,
+        pid_t token, unsigned long vaddr, const struct comm_peer *owner, int skip);
+
+int fanout_owner_peer(pid_t token, int node, struct comm_peer *owner);
+
+void fanout_peer_hosts(struct comm_ctx *ctx, pid_t token, unsigned long vaddr,
+        int node, const struct comm_peer *owner, struct comm_peer_hosts *hosts);
+
+int initial_read_reply(struct comm_ctx *ctx, struct hga_shard *shard,
+        struct mapped_page *pf_entry, pid_t token, unsigned long vaddr, int node);
+
+int request_write_grant(struct comm_ctx *ctx, struct hga_shard *shard,
+        struct mapped_page *pf_entry, pid_t token, unsigned long vaddr, int node);
+
+void waitq_init(void);
+
+int waitq_add(struct mapped_page *pf_entry, int node, bool write);
+
+void waitq_serve(struct comm_ctx *ctx, struct hga_shard *shard,
+        struct mapped_page *pf_entry, pid_t token, unsigned long vaddr);
+
+int lease_init(void);
+
+void lease_stop(void);
+
+unsigned int lease_msecs(pid_t token);
+
+int lease_note(struct mapped_page *pf_entry, int node, unsigned int msecs);
+
+int lease_write(struct comm_ctx *ctx, struct hga_shard *shard,
+        struct mapped_page *pf_entry, pid_t token, unsigned long vaddr, int node);
+
+void lease_serve(struct comm_ctx *ctx, struct hga_shard *shard,
+        struct mapped_page *pf_entry, pid_t token, unsigned long vaddr);
+
+void lease_return(struct comm_ctx *ctx, struct hga_shard *shard,
+        struct mapped_page *pf_entry, pid_t token, unsigned long vaddr, int node);
+
+void blocks_init(void);
+
+unsigned int blocks_size(pid_t token);
+
+u64 blocks_of_commit(struct mapped_page *pf_entry, const char *page,
+        unsigned int block_size);
+
+u64 blocks_of_diff(const char *diff, unsigned int block_size);
+
+void blocks_resume_read(struct comm_ctx *ctx, struct mapped_page *pf_entry,
+        pid_t token, unsigned long vaddr, char *page, u64 changed, int skip);
+
+void mwrite_init(void);
+
+bool mwrite_enabled(pid_t token);
+
+int mwrite_request(struct comm_ctx *ctx, struct hga_shard *shard,
+        struct mapped_page *pf_entry, pid_t token, unsigned long vaddr, int node);
+
+int mwrite_merge(struct mapped_page *pf_entry, struct hga_token *tok,
+        const char *diff, int diff_len, char *scratch);
+
+void mwrite_release(struct comm_ctx *ctx, struct hga_shard *shard,
+        struct mapped_page *pf_entry, pid_t token, unsigned long vaddr, int node);
+
+void huge_init(void);
+
+bool huge_allowed(pid_t token);
+
+int huge_stage_chunk(struct mapped_page *pf_entry, struct hga_token *tok,
+        int node, const struct comm_chunk *chunk);
+
+void huge_resume_read(struct comm_ctx *ctx, struct mapped_page *pf_entry,
+        pid_t token, unsigned long vaddr, int skip);
+
+int huge_initial_read(struct comm_ctx *ctx, struct mapped_page *pf_entry,
+        pid_t token, unsigned long vaddr, int node);
+
+void readahead_init(void);
+
+void readahead_exit(void);
+
+void readahead_forget(struct hga_shard *shard, int node);
+
+void readahead_access(struct comm_ctx *ctx, struct hga_shard *shard,
+        pid_t token, unsigned long vaddr, int node, bool write);
+
+void home_init(void);
+
+bool home_commit(struct mapped_page *pf_entry, pid_t token, int node);
+
+int home_keep(struct comm_ctx *ctx, struct mapped_page *pf_entry,
+        pid_t token, unsigned long vaddr, int node);
+
+void home_recall(struct comm_ctx *ctx, struct mapped_page *pf_entry,
+        pid_t token, unsigned long vaddr);
+
+int home_return(struct mapped_page *pf_entry, int node);
+
+void version_init(void);
 
+int version_revalidate(struct comm_ctx *ctx, struct socket *conn_sock,
+        pid_t token, unsigned long vaddr, pid_t client_pid, pgd_t *pgd,
+        int node, u64 version);
 
-void find_mapped_machines(pid_t token, unsigned long vaddr, struct mapped_page* entry);
-void mapped_page_lookup_callback(void* current_entry, void* entry, void* arg);
+void version_resume_read(struct comm_ctx *ctx, struct mapped_page *pf_entry,
+        pid_t token, unsigned long vaddr, int skip);
@@ -0,0 +1,126 @@
+#include "ev_handlers.h"
+
+/*
+ * Fan-out of invalidations and updates to the readers of a page.
+ *
+ * Readers only join an unlocked page, so the reader set is stable while
+ * the caller holds the lock bit and can be walked without the spinlock.
+ * skip is a node left out of the fan-out (usually the writer), or -1.
+ */
+
+/* Returns 0, or -1 if a reader was lost mid-request */
+int fanout_lock_read(struct comm_ctx *ctx, struct mapped_page *pf_entry,
+        pid_t token, unsigned long vaddr, int skip) {
+    int reader;
+
+    reader_set_for_each(reader, &(pf_entry->readers)) {
+        struct socket *reader_sock;
+        pid_t reader_pid;
+        pgd_t *reader_pgd;
+
+        if (reader == skip)
+            continue;
+        reader_sock = comm_node_socket(ctx, reader);
+        if (!reader_sock || !lookup_client_entry(token, reader, &reader_pid, &reader_pgd))
+            continue;
+        if (comm_lock_read(ctx, reader_sock, vaddr, reader_pid, token, reader_pgd) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+/* In lease mode the update comes with a fresh lease */
+void fanout_resume_read(struct comm_ctx *ctx, struct mapped_page *pf_entry,
+        pid_t token, unsigned long vaddr, char *page, int skip) {
+    unsigned int lease = lease_msecs(token);
+    int reader, err;
+
+    reader_set_for_each(reader, &(pf_entry->readers)) {
+        struct socket *reader_sock;
+        pid_t reader_pid;
+        pgd_t *reader_pgd;
+
+        if (reader == skip)
+            continue;
+        reader_sock = comm_node_socket(ctx, reader);
+        if (!reader_sock || !lookup_client_entry(token, reader, &reader_pid, &reader_pgd))
+            continue;
+        if (!lease) {
+            comm_resume_read(ctx, reader_sock, vaddr, reader_pid, token, reader_pgd, page);
+            continue;
+        }
+
+        spin_lock(&pf_entry->lock);
+        err = lease_note(pf_entry, reader, lease);
+        spin_unlock(&pf_entry->lock);
+        if (err == 0)
+            comm_grant_lease(ctx, reader_sock, vaddr, reader_pid, token, reader_pgd,
+                    page, lease, pf_entry->version);
+    }
+}
+
+/* Adds ip to hosts unless it is there already. Returns 0, or -1 if hosts is full */
+static int fanout_add_host(struct comm_peer_hosts *hosts, __be32 ip) {
+    u32 i;
+
+    for (i = 0; i < hosts->count; i++)
+        if (hosts->ip[i] == ip)
+            return 0;
+    if (hosts->count == COMM_PEER_HOSTS_MAX)
+        return -1;
+    hosts->ip[hosts->count++] = ip;
+    return 0;
+}
+
+/* The owner serves only the hosts it was told about, see comm_peer_hosts() */
+void fanout_peer_hosts(struct comm_ctx *ctx, pid_t token, unsigned long vaddr,
+        int node, const struct comm_peer *owner, struct comm_peer_hosts *hosts) {
+    struct socket *owner_sock;
+
+    owner_sock = comm_node_socket(ctx, node);
+    if (owner_sock && hosts->count)
+        comm_peer_hosts(ctx, owner_sock, vaddr, owner->pid, token, owner->pgd, hosts);
+    hosts->count = 0;
+}
+
+/* skip is the owner, which is told the readers' addresses first */
+void fanout_fetch_peer(struct comm_ctx *ctx, struct mapped_page *pf_entry,
+        pid_t token, unsigned long vaddr, const struct comm_peer *owner, int skip) {
+    struct comm_peer_hosts hosts = { .count = 0 };
+    int reader;
+
+    reader_set_for_each(reader, &(pf_entry->readers)) {
+        struct socket *reader_sock;
+        __be32 ip;
+
+        if (reader == skip)
+            continue;
+        reader_sock = comm_node_socket(ctx, reader);
+        if (!reader_sock || !(ip = comm_peer_ip(reader_sock)))
+            continue;
+        if (fanout_add_host(&hosts, ip) < 0) {
+            fanout_peer_hosts(ctx, token, vaddr, skip, owner, &hosts);
+            fanout_add_host(&hosts, ip);
+        }
+    }
+    fanout_peer_hosts(ctx, token, vaddr, skip, owner, &hosts);
+
+    reader_set_for_each(reader, &(pf_entry->readers)) {
+        struct socket *reader_sock;
+        pid_t reader_pid;
+        pgd_t *reader_pgd;
+
+        if (reader == skip)
+            continue;
+        reader_sock = comm_node_socket(ctx, reader);
+        if (!reader_sock || !lookup_client_entry(token, reader, &reader_pid, &reader_pgd))
+            continue;
+        comm_fetch_peer(ctx, reader_sock, vaddr, reader_pid, token, reader_pgd, owner);
+    }
+}
+
+/* Address of node's copy of its pages of token. Returns 1, or 0 if unknown */
+int fanout_owner_peer(pid_t token, int node, struct comm_peer *owner) {
+    return lookup_client_peer(token, node, &owner->ip, &owner->port)
+        && lookup_client_entry(token, node, &owner->pid, &owner->pgd);
+}
@@ -0,0 +1,58 @@
+#include "ev_handlers.h"
+
+/*
+ * Release of a write on a huge unit, one chunk at a time. The last chunk
+ * commits the unit, sends it to the readers and is the only one answered.
+ */
+comm_ackcode_t handle_commit_chunk(struct comm_ctx *ctx, unsigned long vaddr,
+        pid_t client_pid, pid_t token, pgd_t *pgd, char *pagedata, int payload_len, void *cb_data, struct socket *conn_sock) {
+    struct comm_chunk *chunk = (struct comm_chunk*)pagedata;
+    struct mapped_page *pf_entry;
+    struct hga_token *tok;
+    int node, err;
+
+    if (!shard_check(cb_data, token, vaddr))
+        return ACKCODE_OP_FAILURE;
+
+    //a chunk carries its header and a page
+    if (payload_len != (int)(sizeof(*chunk) + PAGE_SIZE))
+        return ACKCODE_OP_FAILURE;
+
+    if (!(vaddr & COMM_HUGE_BIT) || chunk->count != COMM_HUGE_CHUNKS
+            || chunk->index >= chunk->count)
+        return ACKCODE_OP_FAILURE;
+
+    node = comm_node_id(ctx, conn_sock);
+
+    tok = token_get(token, GFP_KERNEL);
+    if (!tok)
+        return ACKCODE_OP_FAILURE;
+
+    pf_entry = find_mapped_page(token, comm_page_key(vaddr));
+    if (!pf_entry) {
+        printk(KERN_ERR "commit mapped page not found");
+        return ACKCODE_OP_FAILURE;
+    }
+
+    err = huge_stage_chunk(pf_entry, tok, node, chunk);
+    if (err <= 0) {
+        put_mapped_page(pf_entry);
+        //a failed commit is answered on its last chunk
+        if (err == 0 || chunk->index + 1 < chunk->count)
+            return ACKCODE_NO_RESPONSE;
+        return ACKCODE_OP_FAILURE;
+    }
+
+    //send the unit while it is still locked
+    huge_resume_read(ctx, pf_entry, token, vaddr, node);
+
+    spin_lock(&pf_entry->lock);
+    pf_entry->locked = false;
+    pf_entry->writer = -1;
+    pf_entry->owner = -1;
+    spin_unlock(&pf_entry->lock);
+
+    waitq_serve(ctx, cb_data, pf_entry, token, vaddr);
+    put_mapped_page(pf_entry);
+    return ACKCODE_COMMIT_CHUNK;
+}
@@ -0,0 +1,55 @@
+#include "ev_handlers.h"
+
+/*
+ * Release of a shared write in multiple-writer mode. The writer's diff is
+ * merged into the stored page, and the last writer's commit sends the
+ * result to the readers.
+ */
+comm_ackcode_t handle_commit_diff(struct comm_ctx *ctx, unsigned long vaddr,
+        pid_t client_pid, pid_t token, pgd_t *pgd, char *pagedata, int payload_len, void *cb_data, struct socket *conn_sock) {
+    unsigned long pfn;
+    struct mapped_page *pf_entry;
+    struct hga_token *tok;
+    char *scratch;
+    int node, err;
+
+    if (!shard_check(cb_data, token, vaddr) || (vaddr & COMM_HUGE_BIT))
+        return ACKCODE_OP_FAILURE;
+
+    pfn = comm_page_key(vaddr);
+    node = comm_node_id(ctx, conn_sock);
+
+    tok = token_get(token, GFP_KERNEL);
+    if (!tok)
+        return ACKCODE_OP_FAILURE;
+
+    pf_entry = find_mapped_page(token, pfn);
+    if (!pf_entry) {
+        printk(KERN_ERR "commit mapped page not found");
+        return ACKCODE_OP_FAILURE;
+    }
+
+    scratch = kmalloc(PAGE_SIZE, GFP_KERNEL);
+    if (!scratch) {
+        put_mapped_page(pf_entry);
+        return ACKCODE_OP_FAILURE;
+    }
+
+    spin_lock(&pf_entry->lock);
+    if (!pf_entry->locked || !pf_entry->ext || !reader_set_test(&(pf_entry->ext->writers), node))
+        err = -1;
+    else
+        err = mwrite_merge(pf_entry, tok, pagedata, payload_len, scratch);
+    spin_unlock(&pf_entry->lock);
+    kfree(scratch);
+
+    if (err < 0) {
+        put_mapped_page(pf_entry);
+        return ACKCODE_OP_FAILURE;
+    }
+
+    mwrite_release(ctx, cb_data, pf_entry, token, vaddr, node);
+
+    put_mapped_page(pf_entry);
+    return ACKCODE_COMMIT_DIFF;
+}
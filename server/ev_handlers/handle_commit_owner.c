@@ -0,0 +1,75 @@
+#include "ev_handlers.h"
+
+/*
+ * Commit in forwarding mode. The writer keeps the page and the server only
+ * records it as the owner; readers are sent to fetch the page from it.
+ */
+comm_ackcode_t handle_commit_owner(struct comm_ctx *ctx, unsigned long vaddr,
+        pid_t client_pid, pid_t token, pgd_t *pgd, char *pagedata, int payload_len, void *cb_data, struct socket *conn_sock) {
+    unsigned long pfn;
+    struct mapped_page *pf_entry;
+    struct comm_peer owner;
+    int node;
+
+    if (!shard_check(cb_data, token, vaddr))
+        return ACKCODE_OP_FAILURE;
+
+    //a proxy passes page contents on, it has no peers to point readers at
+    if (proxy_enabled())
+        return ACKCODE_OP_FAILURE;
+
+    //leases come with the page, which an owner would not pass through here
+    if (lease_msecs(token))
+        return ACKCODE_OP_FAILURE;
+
+    //shared writes are merged here, not left with one writer
+    if (mwrite_enabled(token))
+        return ACKCODE_OP_FAILURE;
+
+    //huge units are committed in chunks
+    if (vaddr & COMM_HUGE_BIT)
+        return ACKCODE_OP_FAILURE;
+
+    pfn = comm_page_key(vaddr);
+    node = comm_node_id(ctx, conn_sock);
+    if (node < 0)
+        return ACKCODE_OP_FAILURE;
+
+    //the payload carries only the port; the address is the connection's
+    owner.port = ((struct comm_peer*)pagedata)->port;
+    owner.ip = comm_peer_ip(conn_sock);
+    if (!owner.port || !owner.ip || !set_client_peer(token, node, owner.ip, owner.port))
+        return ACKCODE_OP_FAILURE;
+    owner.pid = client_pid;
+    owner.pgd = pgd;
+
+    pf_entry = find_mapped_page(token, pfn);
+    if (!pf_entry) {
+        printk(KERN_ERR "commit mapped page not found");
+        return ACKCODE_OP_FAILURE;
+    }
+
+    spin_lock(&pf_entry->lock);
+    //only the writer commits, once it was allowed to write
+    if (!pf_entry->locked || pf_entry->writer != node || mapped_page_lease_wait(pf_entry)) {
+        spin_unlock(&pf_entry->lock);
+        put_mapped_page(pf_entry);
+        return ACKCODE_OP_FAILURE;
+    }
+    pf_entry->owner = node;
+    //the server's copy is no longer the current one
+    pf_entry->version++;
+    spin_unlock(&pf_entry->lock);
+
+    //send the readers to the owner while the page is still locked
+    fanout_fetch_peer(ctx, pf_entry, token, vaddr, &owner, node);
+
+    spin_lock(&pf_entry->lock);
+    pf_entry->locked = false;
+    pf_entry->writer = -1;
+    spin_unlock(&pf_entry->lock);
+
+    waitq_serve(ctx, cb_data, pf_entry, token, vaddr);
+    put_mapped_page(pf_entry);
+    return ACKCODE_COMMIT_OWNER;
+}
@@ -1,40 +1,104 @@
 #include "ev_handlers.h"
 
 comm_ackcode_t handle_commit_page(struct comm_ctx *ctx, unsigned long vaddr,
-        pid_t client_pid, pid_t token, pgd_t *pgd, char *pagedata, void *cb_data, struct socket *conn_sock) {
+        pid_t client_pid, pid_t token, pgd_t *pgd, char *pagedata, int payload_len, void *cb_data, struct socket *conn_sock) {
     unsigned long pfn;
     struct mapped_page *pf_entry;
-    struct client_entry *client;
+    struct hga_token *tok;
+    char *new_page;
+    unsigned int lease, block_size;
+    u64 changed;
+    bool home;
+    int node;
 
-    pfn = PAGE_MASK & vaddr;
+    if (!shard_check(cb_data, token, vaddr))
+        return ACKCODE_OP_FAILURE;
+
+    //huge units are committed in chunks
+    if (vaddr & COMM_HUGE_BIT)
+        return ACKCODE_OP_FAILURE;
+
+    //a short commit would store whatever the receive buffer held before
+    if (payload_len != (int)PAGE_SIZE)
+        return ACKCODE_OP_FAILURE;
+
+    pfn = comm_page_key(vaddr);
+    node = comm_node_id(ctx, conn_sock);
+
+    tok = token_get(token, GFP_KERNEL);
+    if (!tok)
+        return ACKCODE_OP_FAILURE;
 
-    pf_entry = NULL;
     //find hashtable entry
-    find_mapped_machines(token, pfn, pf_entry);
+    pf_entry = find_mapped_page(token, pfn);
 
     if (!pf_entry) {
         printk(KERN_ERR "commit mapped page not found");
         return ACKCODE_OP_FAILURE;
     }
-    
-    if (!pf_entry->locked)
+
+    spin_lock(&pf_entry->lock);
+    //a writer still waiting for leases has not been allowed to write yet
+    if (!pf_entry->locked || pf_entry->writer != node || mapped_page_lease_wait(pf_entry)) {
+        spin_unlock(&pf_entry->lock);
+        put_mapped_page(pf_entry);
         return ACKCODE_OP_FAILURE;
+    }
 
-    if (pf_entry->page_addr)
-        kfree(pf_entry->page_addr);
+    //a page left as it was keeps its version, see version.c
+    block_size = blocks_size(token);
+    changed = blocks_of_commit(pf_entry, pagedata, block_size);
 
-    pf_entry->page_addr = kmalloc(PAGE_SIZE, GFP_KERNEL);
+    /*
+     * Overwrites the stored page in place. If the store is over its limit
+     * the page stays locked and the writer has to commit again.
+     */
+    if (pgstore_write(&(pf_entry->store), tok, pagedata) < 0) {
+        spin_unlock(&pf_entry->lock);
+        put_mapped_page(pf_entry);
+        return ACKCODE_OP_FAILURE;
+    }
+    //only once stored, a commit that has to be sent again keeps the old one
+    if (changed)
+        pf_entry->version++;
+    //pinned, so it cannot be spilled during the fan-out
+    new_page = pgstore_get(pf_entry->store);
+    spin_unlock(&pf_entry->lock);
 
-    memcpy(pf_entry->page_addr, pagedata, PAGE_SIZE);
+    if (proxy_enabled()) {
+        //the home server passes the commit on to the other proxies
+        proxy_forward(cb_data, OPCODE_COMMIT_PAGE, token, vaddr,
+                new_page ? new_page : pagedata);
+    }
+
+    //send resume read requests while the page is still locked
+    if (changed)
+        blocks_resume_read(ctx, pf_entry, token, vaddr, new_page, changed, node);
+    else
+        version_resume_read(ctx, pf_entry, token, vaddr, node);
+    pgstore_put(pf_entry->store);
 
-    pf_entry->locked = false;
+    lease = lease_msecs(token);
 
-    //send resume read requests
-    list_for_each_entry(client, &(pf_entry->clients->list), list) {
-        if (client->socket == conn_sock)
-            continue;
-        comm_resume_read(ctx, conn_sock, vaddr, client_pid, pgd, pf_entry->page_addr);
+    spin_lock(&pf_entry->lock);
+    //the writer's client restarts its lease when it sends the commit
+    if (lease && lease_note(pf_entry, node, lease) < 0)
+        printk(KERN_ERR "commit: failed to record the writer's lease");
+    //a dominant writer keeps the lock, see home.c
+    home = home_commit(pf_entry, token, node);
+    if (!home) {
+        pf_entry->locked = false;
+        pf_entry->writer = -1;
     }
+    pf_entry->owner = -1;
+    pf_entry->proxy_state = PROXY_VALID;
+    spin_unlock(&pf_entry->lock);
 
+    if (home && !home_keep(ctx, pf_entry, token, vaddr, node)) {
+        put_mapped_page(pf_entry);
+        return ACKCODE_COMMIT_PAGE;
+    }
+    waitq_serve(ctx, cb_data, pf_entry, token, vaddr);
+    put_mapped_page(pf_entry);
     return ACKCODE_COMMIT_PAGE;
 }
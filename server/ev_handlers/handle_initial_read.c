@@ -1,46 +1,266 @@
 #include "ev_handlers.h"
 
+/* Times a spilled page is read back before the reader is given up on */
+#define INITIAL_READ_FETCH_TRIES 3
+
+/*
+ * Initial read of a page that was spilled. The page is read back on a
+ * workqueue and the data sent from the server thread, like any other reply.
+ */
+struct initial_read_req {
+    struct comm_ctx *ctx;
+    struct mapped_page *pf_entry; //referenced
+    unsigned long vaddr;
+    pid_t client_pid;
+    pid_t token;
+    pgd_t *pgd;
+    int node;
+    int tries;
+};
+
+static void initial_read_fetched(struct pgstore_slot *slot, int err, void *data);
+
+static void initial_read_complete(struct comm_ctx *ctx, void *data) {
+    struct initial_read_req *req = data;
+    struct socket *conn_sock;
+    unsigned int lease;
+    u64 version = 0;
+    char *page;
+
+    page = pgstore_get(req->pf_entry->store);
+    if (!page) {
+        //spilled again before we got to it
+        if (++req->tries < INITIAL_READ_FETCH_TRIES
+                && !pgstore_fetch(req->pf_entry->store, initial_read_fetched, req))
+            return;
+        printk(KERN_ERR "initial read: gave up reading back spilled page");
+        goto out;
+    }
+
+    //the node may have disconnected while the page was read
+    conn_sock = comm_node_socket(ctx, req->node);
+    lease = lease_msecs(req->token);
+    if (conn_sock && lease) {
+        //no lease on a page locked for a writer meanwhile, wait for its commit
+        spin_lock(&req->pf_entry->lock);
+        if (req->pf_entry->locked) {
+            waitq_add(req->pf_entry, req->node, false);
+            conn_sock = NULL;
+        } else if (lease_note(req->pf_entry, req->node, lease) < 0) {
+            conn_sock = NULL;
+        }
+        version = req->pf_entry->version;
+        spin_unlock(&req->pf_entry->lock);
+    }
+    if (conn_sock && lease)
+        comm_grant_lease(ctx, conn_sock, req->vaddr, req->client_pid,
+                req->token, req->pgd, page, lease, version);
+    else if (conn_sock)
+        comm_resume_read(ctx, conn_sock, req->vaddr, req->client_pid,
+                req->token, req->pgd, page);
+    pgstore_put(req->pf_entry->store);
+
+out:
+    put_mapped_page(req->pf_entry);
+    kfree(req);
+}
+
+static void initial_read_fetched(struct pgstore_slot *slot, int err, void *data) {
+    struct initial_read_req *req = data;
+
+    if (!comm_defer(req->ctx, initial_read_complete, req, GFP_KERNEL))
+        return;
+
+    put_mapped_page(req->pf_entry);
+    kfree(req);
+}
+
+static int initial_read_defer(struct comm_ctx *ctx, struct mapped_page *pf_entry,
+        unsigned long vaddr, pid_t client_pid, pid_t token, pgd_t *pgd, int node) {
+    struct initial_read_req *req = kmalloc(sizeof(*req), GFP_KERNEL);
+
+    if (!req)
+        return -ENOMEM;
+
+    req->ctx = ctx;
+    req->pf_entry = pf_entry;
+    req->vaddr = vaddr;
+    req->client_pid = client_pid;
+    req->token = token;
+    req->pgd = pgd;
+    req->node = node;
+    req->tries = 0;
+
+    if (pgstore_fetch(pf_entry->store, initial_read_fetched, req) < 0) {
+        kfree(req);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+/*
+ * Send node its first copy of the page. Called with pf_entry->lock held
+ * and node already among the readers; drops the lock. Returns 0, or -1 if
+ * nothing could be sent.
+ */
+int initial_read_reply(struct comm_ctx *ctx, struct hga_shard *shard,
+        struct mapped_page *pf_entry, pid_t token, unsigned long vaddr, int node) {
+    struct socket *conn_sock;
+    pid_t client_pid;
+    pgd_t *pgd;
+    char *page = NULL;
+    unsigned int lease;
+    u64 version;
+    bool spilled, fetch;
+    int owner;
+
+    if (vaddr & COMM_HUGE_BIT)
+        return huge_initial_read(ctx, pf_entry, token, vaddr, node);
+
+    if (proxy_enabled() && pf_entry->proxy_state != PROXY_VALID) {
+        //the data comes with the home server's RESUME_READ to all readers
+        fetch = pf_entry->proxy_state == PROXY_NONE;
+        if (fetch)
+            pf_entry->proxy_state = PROXY_FETCHING;
+        spin_unlock(&pf_entry->lock);
+
+        if (fetch && !proxy_forward(shard, OPCODE_INITIAL_READ, token, vaddr, NULL)) {
+            spin_lock(&pf_entry->lock);
+            pf_entry->proxy_state = PROXY_NONE;
+            spin_unlock(&pf_entry->lock);
+            return -1;
+        }
+        return 0;
+    }
+    if (proxy_enabled())
+        proxy_note_hit();
+
+    conn_sock = comm_node_socket(ctx, node);
+    if (!conn_sock || !lookup_client_entry(token, node, &client_pid, &pgd)) {
+        spin_unlock(&pf_entry->lock);
+        return -1;
+    }
+
+    owner = pf_entry->owner;
+    if (owner >= 0 && owner != node) {
+        struct comm_peer peer;
+
+        spin_unlock(&pf_entry->lock);
+        if (fanout_owner_peer(token, owner, &peer)) {
+            struct comm_peer_hosts hosts = { .count = 1, .ip = { comm_peer_ip(conn_sock) } };
+
+            fanout_peer_hosts(ctx, token, vaddr, owner, &peer, &hosts);
+            comm_fetch_peer(ctx, conn_sock, vaddr, client_pid, token, pgd, &peer);
+            return 0;
+        }
+        //the owner is going away, fall back to the server's copy
+        spin_lock(&pf_entry->lock);
+    }
+
+    if (pf_entry->store)
+        page = pgstore_get(pf_entry->store);
+    spilled = pf_entry->store && !page;
+    lease = lease_msecs(token);
+    if (!spilled && lease && lease_note(pf_entry, node, lease) < 0) {
+        spin_unlock(&pf_entry->lock);
+        if (page)
+            pgstore_put(pf_entry->store);
+        return -1;
+    }
+    version = pf_entry->version;
+    spin_unlock(&pf_entry->lock);
+
+    if (spilled) {
+        //the reply is sent once the page is back in memory
+        get_mapped_page(pf_entry);
+        if (initial_read_defer(ctx, pf_entry, vaddr, client_pid, token, pgd, node) < 0) {
+            put_mapped_page(pf_entry);
+            return -1;
+        }
+        return 0;
+    }
+
+    if (lease)
+        comm_grant_lease(ctx, conn_sock, vaddr, client_pid, token, pgd, page, lease, version);
+    else
+        comm_resume_read(ctx, conn_sock, vaddr, client_pid, token, pgd, page);
+    if (page)
+        pgstore_put(pf_entry->store);
+    return 0;
+}
+
 /*
  * Initial request to read page
  */
 comm_ackcode_t handle_initial_read(struct comm_ctx *ctx, unsigned long vaddr,
-        pid_t client_pid, pid_t token, pgd_t *pgd, char *pagedata, void *cb_data, struct socket *conn_sock) {
+        pid_t client_pid, pid_t token, pgd_t *pgd, char *pagedata, int payload_len, void *cb_data, struct socket *conn_sock) {
 
-    //TODO handle if page already locked
     unsigned long pfn;
     struct mapped_page* pf_entry;
-    struct client_entry *client;
+    int node, err;
+    bool home;
 
-    pfn = PAGE_MASK & vaddr;
-    pf_entry = NULL;
+    if (!shard_check(cb_data, token, vaddr))
+        return ACKCODE_OP_FAILURE;
 
-    find_mapped_machines(token, pfn, pf_entry);
+    if ((vaddr & COMM_HUGE_BIT) && !huge_allowed(token))
+        return ACKCODE_OP_FAILURE;
 
-    client = make_client_entry(conn_sock, pgd, client_pid);
+    pfn = comm_page_key(vaddr);
 
-    if(!client)
+    node = comm_node_id(ctx, conn_sock);
+    if (node < 0)
         return ACKCODE_OP_FAILURE;
 
+    if (!update_client_entry(token, node, client_pid, pgd))
+        return ACKCODE_OP_FAILURE;
+
+    pf_entry = find_mapped_page(token, pfn);
+
     if (!pf_entry) {
         //first request for page. No updated page to send
-        pf_entry = make_mapped_page(pfn, token, false, NULL); 
+        struct mapped_page *new_entry = make_mapped_page(pfn, token, false);
 
-        if (!pf_entry)
+        if (!new_entry)
             return ACKCODE_OP_FAILURE;
 
-        pf_entry->clients = client;
-        add_mapped_page(pf_entry);
-    }else {
-        // add to list of reading
-        if (pf_entry->locked) {
-            kfree(client);
-            return ACKCODE_OP_FAILURE;
-        }
+        //another reader may have raced us to the insert
+        pf_entry = add_mapped_page(new_entry);
+        if (pf_entry != new_entry)
+            free_mapped_page(new_entry);
+    }
 
-        add_client_entry(client, pf_entry->clients);
+    spin_lock(&pf_entry->lock);
+    if (pf_entry->dead) {
+        spin_unlock(&pf_entry->lock);
+        put_mapped_page(pf_entry);
+        return ACKCODE_OP_FAILURE;
     }
 
-    comm_resume_read(ctx, conn_sock, vaddr, client_pid, pgd, pf_entry->page_addr);
+    //the reader set must not change under a writer, wait for its commit
+    if (pf_entry->locked) {
+        err = waitq_add(pf_entry, node, false);
+        home = mapped_page_home_elsewhere(pf_entry, node);
+        spin_unlock(&pf_entry->lock);
+        //a page kept by its home is only given up on request
+        if (!err && home)
+            home_recall(ctx, pf_entry, token, vaddr);
+        put_mapped_page(pf_entry);
+        return err < 0 ? ACKCODE_OP_FAILURE : ACKCODE_INITIAL_READ;
+    }
+
+    // add to set of readers
+    if (add_page_reader(pf_entry, node) < 0) {
+        spin_unlock(&pf_entry->lock);
+        put_mapped_page(pf_entry);
+        return ACKCODE_OP_FAILURE;
+    }
+
+    err = initial_read_reply(ctx, cb_data, pf_entry, token, vaddr, node);
+    put_mapped_page(pf_entry);
+    if (err < 0)
+        return ACKCODE_OP_FAILURE;
+
+    readahead_access(ctx, cb_data, token, vaddr, node, false);
     return ACKCODE_INITIAL_READ;
 }
-
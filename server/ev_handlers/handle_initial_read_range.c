@@ -0,0 +1,194 @@
+#include "ev_handlers.h"
+
+/* Pages of one shard range, which a frame is about */
+#define RANGE_PAGES (1UL << SHARD_RANGE_SHIFT)
+
+static unsigned int range_max_pages = 1024;
+module_param(range_max_pages, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(range_max_pages, "Pages one bulk read may ask for, larger ones are refused");
+
+/* Frame of a bulk read being put together, see struct comm_range_batch */
+struct range_frame {
+    unsigned long base;
+    u64 answered;
+    u64 present;
+    unsigned int count;
+    struct mapped_page *entries[COMM_RANGE_BATCH]; //referenced
+    char *pages[COMM_RANGE_BATCH]; //pinned
+};
+
+/* Send the frame if it answers for anything, and start the next one empty */
+static int range_flush(struct comm_ctx *ctx, struct socket *conn_sock,
+        struct range_frame *frame, pid_t client_pid, pid_t token, pgd_t *pgd,
+        unsigned int lease) {
+    unsigned int i;
+    int err = 0;
+
+    if (frame->answered)
+        err = comm_resume_range(ctx, conn_sock, frame->base, client_pid, token, pgd,
+                frame->answered, frame->present, frame->pages, lease);
+
+    for (i = 0; i < frame->count; i++) {
+        pgstore_put(frame->entries[i]->store);
+        put_mapped_page(frame->entries[i]);
+    }
+    frame->answered = 0;
+    frame->present = 0;
+    frame->count = 0;
+    return err;
+}
+
+/*
+ * Make node a reader of the page at vaddr, as an INITIAL_READ would.
+ * Returns 1 if the page goes in the frame, with its entry referenced in
+ * *entry and its contents pinned in *page (NULL if it was never
+ * committed); 0 if it is answered on its own, now or once it is unlocked;
+ * or -1 if it cannot be read.
+ */
+static int range_read_page(struct comm_ctx *ctx, struct hga_shard *shard,
+        pid_t token, unsigned long vaddr, int node, unsigned int lease,
+        struct mapped_page **entry, char **page) {
+    struct mapped_page *pf_entry;
+    bool home;
+    int err;
+
+    pf_entry = find_mapped_page(token, vaddr);
+    if (!pf_entry) {
+        struct mapped_page *new_entry = make_mapped_page(vaddr, token, false);
+
+        if (!new_entry)
+            return -1;
+        pf_entry = add_mapped_page(new_entry);
+        if (pf_entry != new_entry)
+            free_mapped_page(new_entry);
+    }
+
+    *page = NULL;
+    spin_lock(&pf_entry->lock);
+    if (pf_entry->dead) {
+        spin_unlock(&pf_entry->lock);
+        put_mapped_page(pf_entry);
+        return -1;
+    }
+
+    if (pf_entry->locked) {
+        err = waitq_add(pf_entry, node, false);
+        home = mapped_page_home_elsewhere(pf_entry, node);
+        spin_unlock(&pf_entry->lock);
+        if (!err && home)
+            home_recall(ctx, pf_entry, token, vaddr);
+        put_mapped_page(pf_entry);
+        return err < 0 ? -1 : 0;
+    }
+
+    if (add_page_reader(pf_entry, node) < 0) {
+        spin_unlock(&pf_entry->lock);
+        put_mapped_page(pf_entry);
+        return -1;
+    }
+
+    //proxies, forwarding and spilled pages are rare here, leave them to the usual reply
+    if (proxy_enabled() || pf_entry->owner >= 0
+            || (pf_entry->store && !(*page = pgstore_get(pf_entry->store)))) {
+        err = initial_read_reply(ctx, shard, pf_entry, token, vaddr, node);
+        put_mapped_page(pf_entry);
+        return err < 0 ? -1 : 0;
+    }
+
+    if (lease && lease_note(pf_entry, node, lease) < 0) {
+        spin_unlock(&pf_entry->lock);
+        if (*page)
+            pgstore_put(pf_entry->store);
+        put_mapped_page(pf_entry);
+        return -1;
+    }
+    spin_unlock(&pf_entry->lock);
+
+    *entry = pf_entry;
+    return 1;
+}
+
+/*
+ * Bulk read to warm up a reader (see struct comm_range). Sent to every
+ * shard, each answers for its own pages, a shard range at a time.
+ */
+comm_ackcode_t handle_initial_read_range(struct comm_ctx *ctx, unsigned long vaddr,
+        pid_t client_pid, pid_t token, pgd_t *pgd, char *pagedata, int payload_len, void *cb_data, struct socket *conn_sock) {
+    struct comm_range *range = (struct comm_range*)pagedata;
+    struct hga_shard *shard = cb_data;
+    struct range_frame *frame;
+    struct socket *sock;
+    unsigned long addr, end;
+    unsigned int lease;
+    int node, err = 0;
+
+    BUILD_BUG_ON(RANGE_PAGES > 64);
+    atomic_long_inc(&shard->nr_requests);
+
+    if (payload_len < (int)sizeof(*range))
+        return ACKCODE_OP_FAILURE;
+    if ((vaddr & ~PAGE_MASK) || !range->count || range->count > READ_ONCE(range_max_pages))
+        return ACKCODE_OP_FAILURE;
+    end = vaddr + (unsigned long)range->count * PAGE_SIZE;
+    if (end < vaddr)
+        return ACKCODE_OP_FAILURE;
+
+    node = comm_node_id(ctx, conn_sock);
+    if (node < 0)
+        return ACKCODE_OP_FAILURE;
+
+    if (!update_client_entry(token, node, client_pid, pgd))
+        return ACKCODE_OP_FAILURE;
+
+    //the frames go out on the same socket as the usual replies
+    sock = comm_node_socket(ctx, node);
+    if (!sock || !(frame = kmalloc(sizeof(*frame), GFP_KERNEL)))
+        return ACKCODE_OP_FAILURE;
+    frame->answered = 0;
+    frame->present = 0;
+    frame->count = 0;
+    lease = lease_msecs(token);
+
+    for (addr = vaddr; addr < end && !err; ) {
+        unsigned long next = min((addr | (RANGE_PAGES * PAGE_SIZE - 1)) + 1, end);
+
+        if (!shard_owns(shard, token, addr)) {
+            addr = next;
+            continue;
+        }
+
+        frame->base = addr & ~(RANGE_PAGES * PAGE_SIZE - 1);
+        for (; addr < next && !err; addr += PAGE_SIZE) {
+            unsigned int bit = (addr - frame->base) >> PAGE_SHIFT;
+            struct mapped_page *pf_entry;
+            char *page;
+            int read;
+
+            read = range_read_page(ctx, shard, token, addr, node, lease, &pf_entry, &page);
+            if (!read)
+                continue;
+
+            //a page that cannot be read is left as the reader has it
+            frame->answered |= 1ULL << bit;
+            if (read < 0)
+                continue;
+            if (page) {
+                frame->present |= 1ULL << bit;
+                frame->pages[frame->count] = page;
+                frame->entries[frame->count++] = pf_entry;
+            } else {
+                put_mapped_page(pf_entry);
+            }
+            if (frame->count == COMM_RANGE_BATCH)
+                err = range_flush(ctx, sock, frame, client_pid, token, pgd, lease);
+        }
+        if (!err)
+            err = range_flush(ctx, sock, frame, client_pid, token, pgd, lease);
+    }
+
+    //the pages left in a frame that could not be sent
+    frame->answered = 0;
+    range_flush(ctx, NULL, frame, client_pid, token, pgd, lease);
+    kfree(frame);
+    return err < 0 ? ACKCODE_OP_FAILURE : ACKCODE_INITIAL_READ_RANGE;
+}
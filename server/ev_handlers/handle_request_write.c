@@ -1,51 +1,126 @@
 #include "ev_handlers.h"
 
+/*
+ * Give node the write lock already taken for it: block the other readers
+ * (or, in lease mode, wait for their leases) and allow the write. Returns
+ * 0, or -1 if a client was lost on the way; the caller then releases the
+ * lock.
+ */
+int request_write_grant(struct comm_ctx *ctx, struct hga_shard *shard,
+        struct mapped_page *pf_entry, pid_t token, unsigned long vaddr, int node) {
+    struct socket *conn_sock;
+    pid_t client_pid;
+    pgd_t *pgd;
+    int err;
+
+    conn_sock = comm_node_socket(ctx, node);
+    if (!conn_sock || !lookup_client_entry(token, node, &client_pid, &pgd))
+        return -1;
+
+    if (lease_msecs(token)) {
+        //ALLOW_WRITE is sent by lease_serve() once the leases are gone
+        if ((err = lease_write(ctx, shard, pf_entry, token, vaddr, node)) <= 0)
+            return err;
+    } else {
+        /*
+         * Readers only join an unlocked page, so the reader set is stable
+         * while we hold the lock bit and can be walked without the spinlock.
+         */
+        if (fanout_lock_read(ctx, pf_entry, token, vaddr, node) == -1)
+            return -1;
+    }
+
+    if (comm_allow_write(ctx, conn_sock, vaddr, client_pid, token, pgd) == -1)
+        return -1;
+
+    return 0;
+}
+
 comm_ackcode_t handle_request_write(struct comm_ctx *ctx, unsigned long vaddr, 
-        pid_t client_pid, pid_t token, pgd_t *pgd, char *pagedata, void *cb_data, struct socket *conn_sock)
+        pid_t client_pid, pid_t token, pgd_t *pgd, char *pagedata, int payload_len, void *cb_data, struct socket *conn_sock)
  {
-    //TODO handle locked page
     unsigned long pfn;
     struct mapped_page *pf_entry;
-    struct client_entry *client;
+    int node, err;
+    bool home;
      
-    pfn = PAGE_MASK & vaddr;
+    if (!shard_check(cb_data, token, vaddr))
+        return ACKCODE_OP_FAILURE;
+
+    if ((vaddr & COMM_HUGE_BIT) && !huge_allowed(token))
+        return ACKCODE_OP_FAILURE;
 
-    pf_entry = NULL;
-    find_mapped_machines(token, pfn, pf_entry); 
+    pfn = comm_page_key(vaddr);
+
+    node = comm_node_id(ctx, conn_sock);
+
+    pf_entry = find_mapped_page(token, pfn);
 
     if(!pf_entry) {
         //must make initial read first
         return ACKCODE_OP_FAILURE;
-    } else {
-        struct client_entry *temp_client;
-        if(pf_entry->locked)
-            return ACKCODE_OP_FAILURE;
-
-        client = NULL;
-
-        list_for_each_entry(temp_client, &(pf_entry->list), list) {
-            if (temp_client->socket == conn_sock) {
-                client = temp_client;
-                break;
-            }
-        }
     }
 
-    if(!client)
+    spin_lock(&pf_entry->lock);
+    if(pf_entry->dead || !reader_set_test(&(pf_entry->readers), node)) {
+        spin_unlock(&pf_entry->lock);
+        put_mapped_page(pf_entry);
         return ACKCODE_OP_FAILURE;
+    }
+
+    if (mwrite_enabled(token)) {
+        //drops the lock
+        err = mwrite_request(ctx, cb_data, pf_entry, token, vaddr, node);
+        put_mapped_page(pf_entry);
+        return err < 0 ? ACKCODE_OP_FAILURE : ACKCODE_REQUEST_WRITE;
+    }
+
+    if (pf_entry->locked) {
+        /*
+         * Repeats from the current writer are answered, writes behind
+         * another writer are queued and granted on its commit. A proxy
+         * cannot queue, the home server decides the order.
+         */
+        if (pf_entry->writer == node)
+            err = 0;
+        else if (proxy_enabled())
+            err = -1;
+        else
+            err = waitq_add(pf_entry, node, true);
+        home = mapped_page_home_elsewhere(pf_entry, node);
+        spin_unlock(&pf_entry->lock);
+        if (!err && home)
+            home_recall(ctx, pf_entry, token, vaddr);
+        put_mapped_page(pf_entry);
+        return err < 0 ? ACKCODE_OP_FAILURE : ACKCODE_REQUEST_WRITE;
+    }
 
     //mark page as locked
     pf_entry->locked = true; 
+    pf_entry->writer = node;
+    spin_unlock(&pf_entry->lock);
 
-    list_for_each_entry(client, &(client->list), list) {
-        if (client->socket == conn_sock)
-            continue;
-        if(comm_lock_read(ctx, client->socket, vaddr, client_pid, pgd) == -1)
-            return ACKCODE_OP_FAILURE;
+    if (proxy_enabled()) {
+        //readers are locked once the home server allows the write
+        if (!proxy_forward(cb_data, OPCODE_REQUEST_WRITE, token, vaddr, NULL))
+            goto fail;
+        put_mapped_page(pf_entry);
+        return ACKCODE_REQUEST_WRITE;
     }
 
-    if(comm_allow_write(ctx, conn_sock, vaddr, client_pid, pgd) == -1)
-        return ACKCODE_OP_FAILURE;
+    if (request_write_grant(ctx, cb_data, pf_entry, token, vaddr, node) < 0)
+        goto fail;
 
+    put_mapped_page(pf_entry);
+    readahead_access(ctx, cb_data, token, vaddr, node, true);
     return ACKCODE_REQUEST_WRITE;
+
+fail:
+    spin_lock(&pf_entry->lock);
+    pf_entry->locked = false;
+    pf_entry->writer = -1;
+    spin_unlock(&pf_entry->lock);
+    waitq_serve(ctx, cb_data, pf_entry, token, vaddr);
+    put_mapped_page(pf_entry);
+    return ACKCODE_OP_FAILURE;
 }
@@ -0,0 +1,59 @@
+#include "ev_handlers.h"
+
+/*
+ * A page given back by the node it migrated to, on RECALL_HOME or on its
+ * own, with its copy. The copy is committed and the requests queued
+ * behind the home are served. Nobody else reads a page while it is away,
+ * so there is no one to send the copy to.
+ */
+comm_ackcode_t handle_return_home(struct comm_ctx *ctx, unsigned long vaddr,
+        pid_t client_pid, pid_t token, pgd_t *pgd, char *pagedata, int payload_len, void *cb_data, struct socket *conn_sock) {
+    struct mapped_page *pf_entry;
+    struct hga_token *tok;
+    int node, err;
+
+    if (!shard_check(cb_data, token, vaddr))
+        return ACKCODE_OP_FAILURE;
+
+    if (vaddr & COMM_HUGE_BIT)
+        return ACKCODE_OP_FAILURE;
+
+    //the copy home is a whole page
+    if (payload_len != (int)PAGE_SIZE)
+        return ACKCODE_OP_FAILURE;
+
+    node = comm_node_id(ctx, conn_sock);
+
+    tok = token_get(token, GFP_KERNEL);
+    if (!tok)
+        return ACKCODE_OP_FAILURE;
+
+    pf_entry = find_mapped_page(token, comm_page_key(vaddr));
+    if (!pf_entry) {
+        printk(KERN_ERR "return home: mapped page not found");
+        return ACKCODE_OP_FAILURE;
+    }
+
+    spin_lock(&pf_entry->lock);
+    if (mapped_page_home(pf_entry) != node) {
+        spin_unlock(&pf_entry->lock);
+        put_mapped_page(pf_entry);
+        return ACKCODE_OP_FAILURE;
+    }
+
+    /*
+     * The home has let go of the page and cannot commit it again. If the
+     * store is over its limit the last commit is all that is left.
+     */
+    if (pgstore_write(&(pf_entry->store), tok, pagedata) < 0)
+        printk(KERN_ERR "return home: store full, page reverted to its last commit");
+    else
+        pf_entry->version++;
+    err = home_return(pf_entry, node);
+    spin_unlock(&pf_entry->lock);
+
+    if (!err)
+        waitq_serve(ctx, cb_data, pf_entry, token, vaddr);
+    put_mapped_page(pf_entry);
+    return err < 0 ? ACKCODE_OP_FAILURE : ACKCODE_RETURN_HOME;
+}
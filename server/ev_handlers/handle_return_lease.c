@@ -0,0 +1,29 @@
+#include "ev_handlers.h"
+
+/*
+ * A reader gives its lease on a page back before it runs out, e.g. for a
+ * copy it no longer maps. A write waiting on the lease is granted early.
+ */
+comm_ackcode_t handle_return_lease(struct comm_ctx *ctx, unsigned long vaddr,
+        pid_t client_pid, pid_t token, pgd_t *pgd, char *pagedata, int payload_len, void *cb_data, struct socket *conn_sock) {
+    unsigned long pfn;
+    struct mapped_page *pf_entry;
+    int node;
+
+    if (!shard_check(cb_data, token, vaddr))
+        return ACKCODE_OP_FAILURE;
+
+    pfn = comm_page_key(vaddr);
+    node = comm_node_id(ctx, conn_sock);
+    if (node < 0)
+        return ACKCODE_OP_FAILURE;
+
+    pf_entry = find_mapped_page(token, pfn);
+    if (!pf_entry)
+        return ACKCODE_OP_FAILURE;
+
+    lease_return(ctx, cb_data, pf_entry, token, vaddr, node);
+
+    put_mapped_page(pf_entry);
+    return ACKCODE_RETURN_LEASE;
+}
@@ -0,0 +1,38 @@
+#include "ev_handlers.h"
+
+/*
+ * Read of a page by a reader that still has a copy of it (see struct
+ * comm_version). The copy is kept if it is current, otherwise this is an
+ * INITIAL_READ.
+ */
+comm_ackcode_t handle_revalidate(struct comm_ctx *ctx, unsigned long vaddr,
+        pid_t client_pid, pid_t token, pgd_t *pgd, char *pagedata, int payload_len, void *cb_data, struct socket *conn_sock) {
+    struct comm_version *held = (struct comm_version*)pagedata;
+    int node, err;
+
+    if (!shard_check(cb_data, token, vaddr))
+        return ACKCODE_OP_FAILURE;
+
+    if (payload_len < (int)sizeof(*held))
+        return ACKCODE_OP_FAILURE;
+
+    node = comm_node_id(ctx, conn_sock);
+    if (node < 0)
+        return ACKCODE_OP_FAILURE;
+
+    if (!update_client_entry(token, node, client_pid, pgd))
+        return ACKCODE_OP_FAILURE;
+
+    err = version_revalidate(ctx, conn_sock, token, vaddr, client_pid, pgd, node, held->version);
+    if (err < 0)
+        return ACKCODE_OP_FAILURE;
+    if (!err) {
+        if (handle_initial_read(ctx, vaddr, client_pid, token, pgd, NULL, 0,
+                    cb_data, conn_sock).code != ACKCODE_INITIAL_READ.code)
+            return ACKCODE_OP_FAILURE;
+        return ACKCODE_REVALIDATE;
+    }
+
+    readahead_access(ctx, cb_data, token, vaddr, node, false);
+    return ACKCODE_REVALIDATE;
+}
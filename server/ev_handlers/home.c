@@ -0,0 +1,165 @@
+#include <linux/module.h>
+#include "ev_handlers.h"
+#include "../stats/stats.h"
+
+/*
+ * Home migration.
+ *
+ * A page written over and over by the same node costs that node a
+ * REQUEST_WRITE round-trip per write. Every commit is counted against the
+ * node that made it, and once one node committed a page home_writes times
+ * in a row, with no other node reading it, the write lock stays with it:
+ * the commit is answered with KEEP_HOME instead of unlocking the page, and
+ * the node writes the page again without asking, keeping it to itself.
+ *
+ * The page stays locked meanwhile, so a request from any other node is
+ * queued as usual and recalls the page with RECALL_HOME. The home gives it
+ * back with RETURN_HOME, carrying its copy, and the queue is served. A
+ * home may also give a page back on its own, or commit it like any writer.
+ *
+ * Each recall doubles the streak the page needs to migrate again, up to
+ * HOME_MAX_BACKOFF times, so a page passed back and forth stays put.
+ *
+ * Only tokens in the plain locking mode migrate: not on proxies, nor with
+ * leases or multiple writers, nor huge units.
+ */
+#define HOME_MAX_BACKOFF 6
+
+static unsigned int home_writes = 8;
+module_param(home_writes, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(home_writes, "Commits in a row by one node that migrate a page to it, 0 to disable");
+
+static atomic_long_t nr_migrated;
+static atomic_long_t nr_recalled;
+static atomic_long_t nr_returned; //by the home, recalled or not
+
+static int home_stats_show(struct seq_file *m, void *data) {
+    seq_printf(m, "migrated %ld\n", atomic_long_read(&nr_migrated));
+    seq_printf(m, "recalled %ld\n", atomic_long_read(&nr_recalled));
+    seq_printf(m, "returned %ld\n", atomic_long_read(&nr_returned));
+    return 0;
+}
+
+void home_init(void) {
+    stats_create_file("home", home_stats_show, NULL);
+}
+
+/*
+ * Count a commit of node, with pf_entry->lock held and the page still
+ * locked for it. Returns whether the lock stays with node, as its home.
+ */
+bool home_commit(struct mapped_page *pf_entry, pid_t token, int node) {
+    struct mapped_page_ext *ext = pf_entry->ext;
+    bool readers_other;
+
+    //streaks are only counted on pages whose lock may migrate
+    if (!home_writes || (pf_entry->pfn & COMM_HUGE_BIT) || proxy_enabled()
+            || lease_msecs(token) || mwrite_enabled(token))
+        goto release;
+    if (!(ext = mapped_page_ext_get(pf_entry, GFP_ATOMIC)))
+        return false;
+
+    if (ext->last_writer != node) {
+        ext->last_writer = node;
+        ext->write_streak = 0;
+    }
+    if (ext->write_streak < UINT_MAX)
+        ext->write_streak++;
+
+    //a commit from the home itself ends its stay, unless it is still wanted
+    readers_other = reader_set_weight(&(pf_entry->readers))
+            > (reader_set_test(&(pf_entry->readers), node) ? 1 : 0);
+    if (ext->home_recalled || pf_entry->nr_waiters || readers_other
+            || ext->write_streak < home_writes << min(ext->home_backoff,
+                    (unsigned int)HOME_MAX_BACKOFF))
+        goto release;
+
+    if (ext->home != node)
+        atomic_long_inc(&nr_migrated);
+    ext->home = node;
+    return true;
+
+release:
+    if (ext) {
+        ext->home = -1;
+        ext->home_recalled = false;
+    }
+    return false;
+}
+
+/*
+ * Tell node the page it committed is kept with it. Returns 0, or -1 if it
+ * could not be told; the page is then unlocked and the caller serves the
+ * queue.
+ */
+int home_keep(struct comm_ctx *ctx, struct mapped_page *pf_entry,
+        pid_t token, unsigned long vaddr, int node) {
+    struct socket *conn_sock;
+    pid_t client_pid;
+    pgd_t *pgd;
+
+    conn_sock = comm_node_socket(ctx, node);
+    if (conn_sock && lookup_client_entry(token, node, &client_pid, &pgd)
+            && comm_keep_home(ctx, conn_sock, vaddr, client_pid, token, pgd) == 1)
+        return 0;
+
+    spin_lock(&pf_entry->lock);
+    if (mapped_page_home(pf_entry) == node) {
+        pf_entry->locked = false;
+        pf_entry->writer = -1;
+        pf_entry->ext->home = -1;
+        pf_entry->ext->home_recalled = false;
+    }
+    spin_unlock(&pf_entry->lock);
+    return -1;
+}
+
+/*
+ * Ask the home of a page for it back, for a request that was just queued
+ * behind it. Called without pf_entry->lock held.
+ */
+void home_recall(struct comm_ctx *ctx, struct mapped_page *pf_entry,
+        pid_t token, unsigned long vaddr) {
+    struct socket *conn_sock;
+    pid_t client_pid;
+    struct mapped_page_ext *ext;
+    pgd_t *pgd;
+    int home;
+
+    spin_lock(&pf_entry->lock);
+    ext = pf_entry->ext;
+    home = !ext || ext->home_recalled ? -1 : ext->home;
+    if (home >= 0) {
+        ext->home_recalled = true;
+        ext->write_streak = 0;
+        if (ext->home_backoff < HOME_MAX_BACKOFF)
+            ext->home_backoff++;
+    }
+    spin_unlock(&pf_entry->lock);
+
+    if (home < 0)
+        return;
+    atomic_long_inc(&nr_recalled);
+
+    //a home that went away is dropped, and its lock with it
+    conn_sock = comm_node_socket(ctx, home);
+    if (conn_sock && lookup_client_entry(token, home, &client_pid, &pgd))
+        comm_recall_home(ctx, conn_sock, vaddr, client_pid, token, pgd);
+}
+
+/*
+ * Take back the page of a home that returned it, with pf_entry->lock held.
+ * Returns 0, or -1 if node is not the page's home.
+ */
+int home_return(struct mapped_page *pf_entry, int node) {
+    if (mapped_page_home(pf_entry) != node || !pf_entry->locked || pf_entry->writer != node)
+        return -1;
+
+    pf_entry->locked = false;
+    pf_entry->writer = -1;
+    pf_entry->ext->home = -1;
+    pf_entry->ext->home_recalled = false;
+    pf_entry->ext->write_streak = 0;
+    atomic_long_inc(&nr_returned);
+    return 0;
+}
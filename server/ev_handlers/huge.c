@@ -0,0 +1,155 @@
+#include <linux/module.h>
+#include <linux/vmalloc.h>
+#include "ev_handlers.h"
+#include "../stats/stats.h"
+
+/*
+ * Huge units.
+ *
+ * Clients can share a region mapped with 2 MiB pages in units of that size
+ * (see struct comm_chunk), so a reader streaming through a large array
+ * takes one lock and one update per unit instead of one per page. A unit
+ * has a directory entry keyed by comm_page_key() and is locked like a
+ * page. Its data is kept in memory outside the page store, charged to the
+ * token like the pages it spans, and only changes on the server thread of
+ * its shard.
+ *
+ * Units are only shared by tokens in the plain locking mode: not on
+ * proxies, nor with leases or multiple writers.
+ */
+static atomic_long_t nr_units;
+static atomic_long_t nr_commits;
+static atomic_long_t nr_chunks_in;
+static atomic_long_t nr_chunks_out;
+
+static int huge_stats_show(struct seq_file *m, void *data) {
+    seq_printf(m, "units %ld\n", atomic_long_read(&nr_units));
+    seq_printf(m, "commits %ld\n", atomic_long_read(&nr_commits));
+    seq_printf(m, "chunks_in %ld\n", atomic_long_read(&nr_chunks_in));
+    seq_printf(m, "chunks_out %ld\n", atomic_long_read(&nr_chunks_out));
+    return 0;
+}
+
+void huge_init(void) {
+    stats_create_file("huge", huge_stats_show, NULL);
+}
+
+/* Whether token's pages can be shared in huge units */
+bool huge_allowed(pid_t token) {
+    if (proxy_enabled())
+        return false;
+    return !lease_msecs(token) && !mwrite_enabled(token);
+}
+
+/* Charge a unit's first commit to tok, unless its limit is hit */
+static bool huge_charge(struct hga_token *tok) {
+    long tok_max = token_max_pages(tok);
+
+    if (atomic_long_add_return(COMM_HUGE_CHUNKS, &tok->nr_pages) > tok_max && tok_max) {
+        atomic_long_sub(COMM_HUGE_CHUNKS, &tok->nr_pages);
+        return false;
+    }
+    atomic_long_inc(&nr_units);
+    return true;
+}
+
+/*
+ * Stage a chunk of node's commit of a unit. Returns 1 once the last chunk
+ * made the staged data the unit's, 0 while chunks are missing, or -1 if
+ * node does not hold the write lock, a chunk was lost or the token is
+ * over its limit; the writer then has to commit the unit again.
+ */
+int huge_stage_chunk(struct mapped_page *pf_entry, struct hga_token *tok,
+        int node, const struct comm_chunk *chunk) {
+    struct mapped_page_ext *ext;
+    char *stage = NULL, *old = NULL;
+    int ret = -1;
+
+    //a commit starts over with its first chunk
+    if (chunk->index == 0 && !(stage = vmalloc(COMM_HUGE_SIZE)))
+        return -1;
+
+    spin_lock(&pf_entry->lock);
+    if (!pf_entry->locked || pf_entry->writer != node)
+        goto out;
+
+    ext = stage ? mapped_page_ext_get(pf_entry, GFP_ATOMIC) : pf_entry->ext;
+    if (!ext)
+        goto out;
+    if (stage) {
+        old = ext->unit_stage;
+        ext->unit_stage = stage;
+        ext->unit_next = 0;
+        stage = NULL;
+    }
+    if (!ext->unit_stage || chunk->index != ext->unit_next)
+        goto out;
+
+    memcpy(ext->unit_stage + chunk->index * PAGE_SIZE, chunk + 1, PAGE_SIZE);
+    atomic_long_inc(&nr_chunks_in);
+    if (++ext->unit_next < COMM_HUGE_CHUNKS) {
+        ret = 0;
+        goto out;
+    }
+
+    if (!ext->unit && !huge_charge(tok))
+        goto out;
+    old = ext->unit;
+    ext->unit = ext->unit_stage;
+    ext->unit_stage = NULL;
+    atomic_long_inc(&nr_commits);
+    ret = 1;
+
+out:
+    spin_unlock(&pf_entry->lock);
+    vfree(stage);
+    vfree(old);
+    return ret;
+}
+
+/* Send the committed unit to its readers, while it is still locked */
+void huge_resume_read(struct comm_ctx *ctx, struct mapped_page *pf_entry,
+        pid_t token, unsigned long vaddr, int skip) {
+    int reader;
+
+    reader_set_for_each(reader, &(pf_entry->readers)) {
+        struct socket *reader_sock;
+        pid_t reader_pid;
+        pgd_t *reader_pgd;
+
+        if (reader == skip)
+            continue;
+        reader_sock = comm_node_socket(ctx, reader);
+        if (!reader_sock || !lookup_client_entry(token, reader, &reader_pid, &reader_pgd))
+            continue;
+        comm_resume_chunks(ctx, reader_sock, vaddr, reader_pid, token, reader_pgd,
+                pf_entry->ext->unit, COMM_HUGE_CHUNKS);
+        atomic_long_add(COMM_HUGE_CHUNKS, &nr_chunks_out);
+    }
+}
+
+/*
+ * Part of initial_read_reply() for a unit, with pf_entry->lock held and
+ * node already among the readers; drops the lock. A unit that was never
+ * committed is read as the client has it, like a page without a store.
+ */
+int huge_initial_read(struct comm_ctx *ctx, struct mapped_page *pf_entry,
+        pid_t token, unsigned long vaddr, int node) {
+    struct socket *conn_sock;
+    pid_t client_pid;
+    pgd_t *pgd;
+    char *unit = pf_entry->ext ? pf_entry->ext->unit : NULL;
+
+    spin_unlock(&pf_entry->lock);
+
+    conn_sock = comm_node_socket(ctx, node);
+    if (!conn_sock || !lookup_client_entry(token, node, &client_pid, &pgd))
+        return -1;
+
+    if (!unit)
+        return 0;
+    comm_resume_chunks(ctx, conn_sock, vaddr, client_pid, token, pgd,
+            unit, COMM_HUGE_CHUNKS);
+    atomic_long_add(COMM_HUGE_CHUNKS, &nr_chunks_out);
+    return 0;
+}
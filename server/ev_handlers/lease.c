@@ -0,0 +1,301 @@
+#include <linux/module.h>
+#include <linux/workqueue.h>
+#include "ev_handlers.h"
+#include "../stats/stats.h"
+
+/*
+ * Read leases.
+ *
+ * Readers of a token with a lease_ms get their copy under a lease (see
+ * struct comm_lease) and block reads on their own once it runs out, so a
+ * write no longer needs a LOCK_READ round-trip to every reader. The write
+ * lock is taken as usual, and ALLOW_WRITE is sent as soon as no other
+ * reader holds an unexpired lease. Until then the write waits on a timer
+ * set for the last expiry; a RETURN_LEASE can grant it earlier. The
+ * writer holds its copy on through the write, and its commit renews its
+ * lease.
+ *
+ * The server counts a lease from just before it is sent and the reader
+ * from when it arrives, so the server's view is extended by
+ * LEASE_GRACE_MSECS to cover the delivery, retries included.
+ *
+ * Proxies forward writes to the home server and do not hand out leases.
+ */
+#define LEASE_GRACE_MSECS 100
+
+/* Write waiting for the leases of a page to run out */
+struct lease_wait {
+    struct list_head list;
+    struct delayed_work dwork;
+    struct comm_ctx *ctx;
+    struct hga_shard *shard;
+    struct mapped_page *pf_entry; //referenced
+    pid_t token;
+    unsigned long vaddr;
+};
+
+static LIST_HEAD(lease_waits);
+static DEFINE_SPINLOCK(lease_waits_lock);
+static bool lease_stopping;
+/*
+ * Runs the timers of waiting writes, so that lease_stop() can wait out
+ * one that is already off lease_waits but has not deferred to its
+ * context yet.
+ */
+static struct workqueue_struct *lease_wq;
+
+static atomic_long_t nr_granted;
+static atomic_long_t nr_returned;
+static atomic_long_t nr_writes_free; //no other reader held a lease
+static atomic_long_t nr_writes_waited;
+
+static int lease_stats_show(struct seq_file *m, void *data) {
+    seq_printf(m, "granted %ld\n", atomic_long_read(&nr_granted));
+    seq_printf(m, "returned %ld\n", atomic_long_read(&nr_returned));
+    seq_printf(m, "writes_free %ld\n", atomic_long_read(&nr_writes_free));
+    seq_printf(m, "writes_waited %ld\n", atomic_long_read(&nr_writes_waited));
+    return 0;
+}
+
+/* Returns 1, or 0 if the timer workqueue cannot be allocated */
+int lease_init(void) {
+    lease_stopping = false;
+    lease_wq = alloc_workqueue("hga_lease", 0, 0);
+    if (!lease_wq)
+        return 0;
+    stats_create_file("leases", lease_stats_show, NULL);
+    return 1;
+}
+
+/* Lease length for readers of token, 0 if they are locked on writes instead */
+unsigned int lease_msecs(pid_t token) {
+    struct hga_token *tok;
+
+    if (proxy_enabled())
+        return 0;
+    tok = token_find(token);
+    //a write joined by other writers needs its readers locked
+    return token_multi_writer(tok) ? 0 : token_lease_ms(tok);
+}
+
+/*
+ * Record a lease of node on an unlocked page (or one its writer is
+ * committing), with pf_entry->lock held. Called right before the lease is
+ * sent. Returns 0, or -1 if the lease cannot be recorded and must not be
+ * handed out.
+ */
+int lease_note(struct mapped_page *pf_entry, int node, unsigned int msecs) {
+    unsigned long until = jiffies + msecs_to_jiffies(msecs + LEASE_GRACE_MSECS);
+    struct mapped_page_ext *ext = mapped_page_ext_get(pf_entry, GFP_ATOMIC);
+
+    if (!ext || reader_set_add(&(ext->leases), node, GFP_ATOMIC) < 0)
+        return -1;
+    if (time_after(until, ext->lease_until))
+        ext->lease_until = until;
+
+    atomic_long_inc(&nr_granted);
+    return 0;
+}
+
+/*
+ * Whether writer can be allowed to write: no other reader holds a live
+ * lease. Remembers on the page if the write has to wait.
+ */
+static bool lease_writable(struct mapped_page *pf_entry, int writer) {
+    struct mapped_page_ext *ext;
+    bool writable;
+
+    spin_lock(&pf_entry->lock);
+    //a page never leased has nothing to wait for
+    ext = pf_entry->ext;
+    if (!ext) {
+        spin_unlock(&pf_entry->lock);
+        return true;
+    }
+    if (!time_before(jiffies, ext->lease_until))
+        reader_set_clear(&(ext->leases));
+    //the writer's own lease is kept, and renewed by its commit
+    writable = reader_set_weight(&(ext->leases))
+        == (reader_set_test(&(ext->leases), writer) ? 1 : 0);
+    ext->lease_wait = !writable;
+    spin_unlock(&pf_entry->lock);
+
+    return writable;
+}
+
+static void lease_expired(struct comm_ctx *ctx, void *data);
+
+static void lease_timer(struct work_struct *work) {
+    struct lease_wait *wait =
+        container_of(to_delayed_work(work), struct lease_wait, dwork);
+
+    spin_lock(&lease_waits_lock);
+    list_del_init(&(wait->list));
+    spin_unlock(&lease_waits_lock);
+
+    //the grant is sent from the server thread, like every other message
+    if (!comm_defer(wait->ctx, lease_expired, wait, GFP_KERNEL))
+        return;
+
+    printk(KERN_ERR "lease: failed to defer a waiting write");
+    put_mapped_page(wait->pf_entry);
+    kfree(wait);
+}
+
+/* (Re)arm the timer of wait for the page's last lease expiry */
+static int lease_arm(struct lease_wait *wait) {
+    unsigned long until;
+
+    //only pages with leases wait, so the extension is there
+    spin_lock(&(wait->pf_entry->lock));
+    until = wait->pf_entry->ext->lease_until;
+    spin_unlock(&(wait->pf_entry->lock));
+
+    spin_lock(&lease_waits_lock);
+    if (lease_stopping) {
+        spin_unlock(&lease_waits_lock);
+        return -1;
+    }
+    list_add_tail(&(wait->list), &lease_waits);
+    queue_delayed_work(lease_wq, &(wait->dwork),
+            time_after(until, jiffies) ? until - jiffies : 0);
+    spin_unlock(&lease_waits_lock);
+
+    return 0;
+}
+
+/*
+ * Wait for the leases of a page before the write lock already taken for
+ * its writer is granted. Returns 0, or -1 if the wait cannot be set up;
+ * the caller then releases the lock.
+ */
+static int lease_wait(struct comm_ctx *ctx, struct hga_shard *shard,
+        struct mapped_page *pf_entry, pid_t token, unsigned long vaddr) {
+    struct lease_wait *wait = kmalloc(sizeof(*wait), GFP_KERNEL);
+
+    if (!wait)
+        return -1;
+
+    INIT_LIST_HEAD(&(wait->list));
+    INIT_DELAYED_WORK(&(wait->dwork), lease_timer);
+    wait->ctx = ctx;
+    wait->shard = shard;
+    wait->pf_entry = get_mapped_page(pf_entry);
+    wait->token = token;
+    wait->vaddr = vaddr;
+
+    if (lease_arm(wait) < 0) {
+        put_mapped_page(pf_entry);
+        kfree(wait);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Part of request_write_grant() in lease mode: returns 1 if ALLOW_WRITE
+ * can be sent now, 0 if the write was left waiting for the leases, or -1
+ * if it can be neither.
+ */
+int lease_write(struct comm_ctx *ctx, struct hga_shard *shard,
+        struct mapped_page *pf_entry, pid_t token, unsigned long vaddr, int node) {
+
+    if (lease_writable(pf_entry, node)) {
+        atomic_long_inc(&nr_writes_free);
+        return 1;
+    }
+
+    if (lease_wait(ctx, shard, pf_entry, token, vaddr) < 0) {
+        spin_lock(&pf_entry->lock);
+        pf_entry->ext->lease_wait = false;
+        spin_unlock(&pf_entry->lock);
+        return -1;
+    }
+    atomic_long_inc(&nr_writes_waited);
+    return 0;
+}
+
+/* Grant a write waiting on the page if its last lease is gone, on the server thread */
+void lease_serve(struct comm_ctx *ctx, struct hga_shard *shard,
+        struct mapped_page *pf_entry, pid_t token, unsigned long vaddr) {
+    int writer;
+
+    spin_lock(&pf_entry->lock);
+    writer = mapped_page_lease_wait(pf_entry) && !pf_entry->dead ? pf_entry->writer : -1;
+    spin_unlock(&pf_entry->lock);
+
+    if (writer < 0 || !lease_writable(pf_entry, writer))
+        return;
+
+    if (request_write_grant(ctx, shard, pf_entry, token, vaddr, writer) == 0)
+        return;
+
+    spin_lock(&pf_entry->lock);
+    pf_entry->locked = false;
+    pf_entry->writer = -1;
+    pf_entry->ext->lease_wait = false;
+    spin_unlock(&pf_entry->lock);
+    waitq_serve(ctx, shard, pf_entry, token, vaddr);
+}
+
+static void lease_expired(struct comm_ctx *ctx, void *data) {
+    struct lease_wait *wait = data;
+    bool waiting;
+
+    lease_serve(ctx, wait->shard, wait->pf_entry, wait->token, wait->vaddr);
+
+    //a lease was handed out after the timer was set
+    spin_lock(&(wait->pf_entry->lock));
+    waiting = mapped_page_lease_wait(wait->pf_entry) && !wait->pf_entry->dead;
+    spin_unlock(&(wait->pf_entry->lock));
+    if (waiting && lease_arm(wait) == 0)
+        return;
+
+    put_mapped_page(wait->pf_entry);
+    kfree(wait);
+}
+
+/* A reader gave its lease back early */
+void lease_return(struct comm_ctx *ctx, struct hga_shard *shard,
+        struct mapped_page *pf_entry, pid_t token, unsigned long vaddr, int node) {
+
+    spin_lock(&pf_entry->lock);
+    if (pf_entry->ext)
+        reader_set_del(&(pf_entry->ext->leases), node);
+    spin_unlock(&pf_entry->lock);
+    atomic_long_inc(&nr_returned);
+
+    lease_serve(ctx, shard, pf_entry, token, vaddr);
+}
+
+/*
+ * Cancel the timers of waiting writes, before the comm contexts they
+ * defer to are stopped. Timers that already fired have their work queued
+ * on a context, and it runs when that context's thread exits.
+ */
+void lease_stop(void) {
+    struct lease_wait *wait;
+
+    if (!lease_wq)
+        return;
+
+    spin_lock(&lease_waits_lock);
+    lease_stopping = true;
+    while (!list_empty(&lease_waits)) {
+        wait = list_first_entry(&lease_waits, struct lease_wait, list);
+        list_del_init(&(wait->list));
+        spin_unlock(&lease_waits_lock);
+
+        if (cancel_delayed_work_sync(&(wait->dwork))) {
+            put_mapped_page(wait->pf_entry);
+            kfree(wait);
+        }
+
+        spin_lock(&lease_waits_lock);
+    }
+    spin_unlock(&lease_waits_lock);
+
+    //a timer that took itself off the list may still be deferring
+    destroy_workqueue(lease_wq);
+    lease_wq = NULL;
+}
@@ -0,0 +1,212 @@
+#include <linux/module.h>
+#include "ev_handlers.h"
+#include "../stats/stats.h"
+
+/*
+ * Multiple writers.
+ *
+ * Pages of a token with multi_writer set can be written by several clients
+ * at once (see struct comm_diff_run), so writers to disjoint parts of a
+ * page stop queueing behind each other. The first write locks the other
+ * readers as usual and the page stays locked until the last writer's diff
+ * is merged; writes in between join the one under way instead of waiting
+ * on the queue. Reads still wait for the merged page.
+ *
+ * Multiple writers are off on proxies, which forward whole pages to the
+ * home server, and such tokens get no leases or owners.
+ */
+static atomic_long_t nr_writes; //shared writes started
+static atomic_long_t nr_joined;
+static atomic_long_t nr_diffs;
+
+static int mwrite_stats_show(struct seq_file *m, void *data) {
+    seq_printf(m, "writes %ld\n", atomic_long_read(&nr_writes));
+    seq_printf(m, "joined %ld\n", atomic_long_read(&nr_joined));
+    seq_printf(m, "diffs %ld\n", atomic_long_read(&nr_diffs));
+    return 0;
+}
+
+void mwrite_init(void) {
+    stats_create_file("multi_writer", mwrite_stats_show, NULL);
+}
+
+/* Whether writes to pages of token are shared, safe under a spinlock */
+bool mwrite_enabled(pid_t token) {
+    if (proxy_enabled())
+        return false;
+    return token_multi_writer(token_find(token));
+}
+
+/*
+ * Give node a write on a page with pf_entry->lock held; drops the lock.
+ * Starts a shared write on an unlocked page or joins the one under way.
+ * Returns 0, or -1 if the write could not be granted or queued.
+ */
+int mwrite_request(struct comm_ctx *ctx, struct hga_shard *shard,
+        struct mapped_page *pf_entry, pid_t token, unsigned long vaddr, int node) {
+    struct mapped_page_ext *ext;
+    struct socket *conn_sock;
+    pid_t client_pid;
+    pgd_t *pgd;
+    char *page = NULL;
+    bool first;
+    int err;
+
+    ext = mapped_page_ext_get(pf_entry, GFP_ATOMIC);
+    if (!ext) {
+        spin_unlock(&pf_entry->lock);
+        return -1;
+    }
+
+    //a repeat from a writer
+    if (reader_set_test(&(ext->writers), node)) {
+        spin_unlock(&pf_entry->lock);
+        return 0;
+    }
+
+    //written by one client before multi_writer was set, wait for its commit
+    if (pf_entry->locked && reader_set_empty(&(ext->writers))) {
+        err = waitq_add(pf_entry, node, true);
+        spin_unlock(&pf_entry->lock);
+        return err;
+    }
+
+    first = !pf_entry->locked;
+    if (!first && pf_entry->store) {
+        page = pgstore_get(pf_entry->store);
+        if (!page) {
+            //spilled, start the next shared write instead
+            err = waitq_add(pf_entry, node, true);
+            spin_unlock(&pf_entry->lock);
+            return err;
+        }
+    }
+    if (reader_set_add(&(ext->writers), node, GFP_ATOMIC) < 0) {
+        spin_unlock(&pf_entry->lock);
+        if (page)
+            pgstore_put(pf_entry->store);
+        return -1;
+    }
+    pf_entry->locked = true;
+    spin_unlock(&pf_entry->lock);
+
+    conn_sock = comm_node_socket(ctx, node);
+    if (!conn_sock || !lookup_client_entry(token, node, &client_pid, &pgd))
+        goto fail;
+
+    if (first) {
+        if (fanout_lock_read(ctx, pf_entry, token, vaddr, node) == -1)
+            goto fail;
+        atomic_long_inc(&nr_writes);
+    } else {
+        //locked with the other readers, it needs the diffs merged so far
+        if (comm_resume_read(ctx, conn_sock, vaddr, client_pid, token, pgd, page) == -1)
+            goto fail;
+        atomic_long_inc(&nr_joined);
+    }
+
+    if (comm_allow_shared_write(ctx, conn_sock, vaddr, client_pid, token, pgd) == -1)
+        goto fail;
+
+    if (page)
+        pgstore_put(pf_entry->store);
+    return 0;
+
+fail:
+    if (page)
+        pgstore_put(pf_entry->store);
+    mwrite_release(ctx, shard, pf_entry, token, vaddr, node);
+    return -1;
+}
+
+/*
+ * Merge a writer's diff of diff_len bytes into the stored page, with
+ * pf_entry->lock held and the writer still listed. scratch is a page to build the result in. Returns 0, or -1 if the diff
+ * is malformed or the page cannot be written; like a refused COMMIT_PAGE
+ * the writer then has to commit again.
+ */
+int mwrite_merge(struct mapped_page *pf_entry, struct hga_token *tok,
+        const char *diff, int diff_len, char *scratch) {
+    const char *start = diff, *end = diff + diff_len;
+    const struct comm_diff_run *run;
+    char *page;
+
+    if (diff_len <= 0 || diff_len > COMM_MAX_PAYLOAD)
+        return -1;
+
+    if (pf_entry->store) {
+        if (!(page = pgstore_get(pf_entry->store)))
+            return -1;
+        memcpy(scratch, page, PAGE_SIZE);
+        pgstore_put(pf_entry->store);
+    } else {
+        memset(scratch, 0, PAGE_SIZE);
+    }
+
+    for (;;) {
+        run = (const struct comm_diff_run*)diff;
+        if (diff + sizeof(*run) > end)
+            return -1;
+        diff += sizeof(*run);
+        if (!run->len)
+            break;
+        if (run->offset + run->len > PAGE_SIZE || diff + run->len > end)
+            return -1;
+        //overlapping writes keep the later commit's bytes
+        memcpy(scratch + run->offset, diff, run->len);
+        diff += run->len;
+    }
+
+    if (pgstore_write(&(pf_entry->store), tok, scratch) < 0)
+        return -1;
+    pf_entry->version++;
+    pf_entry->ext->dirty_blocks |= blocks_of_diff(start, blocks_size(pf_entry->token));
+    atomic_long_inc(&nr_diffs);
+    return 0;
+}
+
+/*
+ * Take node off the writers of a page. After the last one the merged page
+ * goes to every reader, the writers included, and the queue is served.
+ */
+void mwrite_release(struct comm_ctx *ctx, struct hga_shard *shard,
+        struct mapped_page *pf_entry, pid_t token, unsigned long vaddr, int node) {
+    struct mapped_page_ext *ext;
+    char *page = NULL;
+    bool spilled;
+    u64 changed;
+
+    spin_lock(&pf_entry->lock);
+    ext = pf_entry->ext;
+    if (!ext) {
+        spin_unlock(&pf_entry->lock);
+        return;
+    }
+    reader_set_del(&(ext->writers), node);
+    if (!pf_entry->locked || !reader_set_empty(&(ext->writers))) {
+        spin_unlock(&pf_entry->lock);
+        return;
+    }
+    changed = ext->dirty_blocks;
+    ext->dirty_blocks = 0;
+    //pinned, so it cannot be spilled during the fan-out
+    if (pf_entry->store)
+        page = pgstore_get(pf_entry->store);
+    spilled = pf_entry->store && !page;
+    spin_unlock(&pf_entry->lock);
+
+    //sent while the page is still locked, no reader joins meanwhile
+    if (!spilled)
+        blocks_resume_read(ctx, pf_entry, token, vaddr, page, changed, -1);
+    else
+        printk(KERN_ERR "multi-writer: merged page spilled before the fan-out");
+    if (page)
+        pgstore_put(pf_entry->store);
+
+    spin_lock(&pf_entry->lock);
+    pf_entry->locked = false;
+    pf_entry->owner = -1;
+    spin_unlock(&pf_entry->lock);
+
+    waitq_serve(ctx, shard, pf_entry, token, vaddr);
+}
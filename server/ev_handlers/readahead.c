@@ -0,0 +1,342 @@
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/jhash.h>
+#include "ev_handlers.h"
+#include "../stats/stats.h"
+
+/*
+ * Read-ahead.
+ *
+ * A reader walking through pages it has no copy of pays a fault and a
+ * round-trip for each. Every shard follows the INITIAL_READs and granted
+ * REQUEST_WRITEs of each node, and pushes the pages it expects the node
+ * to ask for next behind the reply (see struct comm_push):
+ *
+ * - Two requests the same distance apart make a stride, sequential reads
+ *   being the stride of one page. Each further request on the stride
+ *   pushes the window of pages after it; the window opens at one page and
+ *   doubles while the stride holds, up to readahead_max_pages.
+ * - Off a stride, the page that followed the requested one the last time
+ *   is pushed, so a walk that repeats is learnt after its first pass.
+ *
+ * A request for a page that was just pushed means the push went to waste,
+ * and halves the window. A node that wastes more than readahead_waste_pct
+ * of its recent pushes only gets one page at a time until it does better.
+ *
+ * Pushed pages come with a lease, so a write waits them out like any
+ * other. Only tokens in lease mode are read ahead: their readers ask for a
+ * page with INITIAL_READ again whenever a lease ran out. A push stops at
+ * the first page that is locked, spilled, never read or owned by another
+ * shard.
+ */
+#define READAHEAD_MAX_WINDOW 64
+//successors remembered per shard, direct-mapped
+#define READAHEAD_HISTORY_BITS 12
+//pushes a node's waste ratio is taken over
+#define READAHEAD_RECENT 256
+
+static unsigned int readahead_max_pages = 16;
+module_param(readahead_max_pages, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(readahead_max_pages, "Pages pushed ahead of a strided reader, 0 to disable");
+
+static unsigned int readahead_waste_pct = 50;
+module_param(readahead_waste_pct, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(readahead_waste_pct, "Share of wasted pushes beyond which a node is pushed one page at a time");
+
+/* Requests of one node, only touched on the server thread of its shard */
+struct readahead_stream {
+    pid_t token; //0 for no history
+    unsigned long last; //page last requested
+    long stride;
+    unsigned long expect; //next page on the stride, past any pushed
+    unsigned int window;
+
+    //last push: count pages stride apart from start
+    unsigned long push_start;
+    long push_stride;
+    unsigned int push_count;
+
+    unsigned int nr_pushed; //recent, for the throttle
+    unsigned int nr_wasted;
+};
+
+/* Page that followed page in a node's requests */
+struct readahead_successor {
+    pid_t token; //0 for an empty slot
+    int node;
+    unsigned long page;
+    unsigned long next;
+};
+
+static atomic_long_t nr_requests;
+static atomic_long_t nr_strided;
+static atomic_long_t nr_correlated;
+static atomic_long_t nr_throttled;
+static atomic_long_t nr_pushed;
+static atomic_long_t nr_wasted; //requests for pages already pushed
+
+static int readahead_stats_show(struct seq_file *m, void *data) {
+    long requests = atomic_long_read(&nr_requests);
+    long pushed = atomic_long_read(&nr_pushed);
+    long wasted = atomic_long_read(&nr_wasted);
+    long used = max(pushed - wasted, 0L);
+
+    seq_printf(m, "requests %ld\n", requests);
+    seq_printf(m, "strided %ld\n", atomic_long_read(&nr_strided));
+    seq_printf(m, "correlated %ld\n", atomic_long_read(&nr_correlated));
+    seq_printf(m, "throttled %ld\n", atomic_long_read(&nr_throttled));
+    seq_printf(m, "pushed %ld\n", pushed);
+    seq_printf(m, "wasted %ld\n", wasted);
+    //pushes not asked for again, of all pushes and of all pages needed
+    seq_printf(m, "accuracy_pct %ld\n", pushed ? used * 100 / pushed : 0);
+    seq_printf(m, "coverage_pct %ld\n",
+            used + requests ? used * 100 / (used + requests) : 0);
+    return 0;
+}
+
+/* A shard whose history cannot be allocated is not read ahead */
+void readahead_init(void) {
+    int i;
+
+    for (i = 0; i < shards_local_count(); i++) {
+        struct hga_shard *shard = shard_local(i);
+
+        shard->streams =
+            kcalloc(COMM_MAX_NODES, sizeof(struct readahead_stream), GFP_KERNEL);
+        shard->successors =
+            vzalloc(sizeof(struct readahead_successor) << READAHEAD_HISTORY_BITS);
+        if (!shard->streams || !shard->successors) {
+            printk(KERN_ERR "readahead: no history for shard %d", shard->id);
+            kfree(shard->streams);
+            vfree(shard->successors);
+            shard->streams = NULL;
+            shard->successors = NULL;
+        }
+    }
+    stats_create_file("readahead", readahead_stats_show, NULL);
+}
+
+void readahead_exit(void) {
+    int i;
+
+    for (i = 0; i < shards_local_count(); i++) {
+        kfree(shard_local(i)->streams);
+        vfree(shard_local(i)->successors);
+        shard_local(i)->streams = NULL;
+        shard_local(i)->successors = NULL;
+    }
+}
+
+/*
+ * Node IDs are reused, a new connection starts without a history. Its
+ * successors are told apart by token only, and are simply overwritten.
+ */
+void readahead_forget(struct hga_shard *shard, int node) {
+    if (shard->streams && node >= 0 && node < COMM_MAX_NODES)
+        shard->streams[node].token = 0;
+}
+
+static struct readahead_successor *readahead_slot(struct hga_shard *shard,
+        pid_t token, int node, unsigned long page) {
+    u32 hash = jhash_3words((u32)token, (u32)node, (u32)(page >> PAGE_SHIFT), 0);
+
+    return &shard->successors[hash >> (32 - READAHEAD_HISTORY_BITS)];
+}
+
+/* The page that followed page the last time, 0 if none is known */
+static unsigned long readahead_successor(struct hga_shard *shard,
+        pid_t token, int node, unsigned long page) {
+    struct readahead_successor *slot = readahead_slot(shard, token, node, page);
+
+    if (slot->token != token || slot->node != node || slot->page != page)
+        return 0;
+    return slot->next;
+}
+
+static void readahead_learn(struct hga_shard *shard,
+        pid_t token, int node, unsigned long page, unsigned long next) {
+    struct readahead_successor *slot = readahead_slot(shard, token, node, page);
+
+    slot->token = token;
+    slot->node = node;
+    slot->page = page;
+    slot->next = next;
+}
+
+/* Whether page was in the last push to the node */
+static bool readahead_was_pushed(struct readahead_stream *s, unsigned long page) {
+    long offset = (long)(page - s->push_start);
+
+    if (!s->push_count || offset % s->push_stride)
+        return false;
+    return offset / s->push_stride >= 0 && offset / s->push_stride < s->push_count;
+}
+
+/*
+ * Make node a reader of the page at vaddr under a lease and pin its data.
+ * Returns the referenced entry, or NULL if the page cannot be pushed.
+ */
+static struct mapped_page *readahead_take(struct hga_shard *shard, pid_t token,
+        unsigned long vaddr, int node, unsigned int lease, char **page) {
+    struct mapped_page *pf_entry;
+    int err = -1;
+
+    if (!shard_owns(shard, token, vaddr) || !(pf_entry = find_mapped_page(token, vaddr)))
+        return NULL;
+
+    *page = NULL;
+    spin_lock(&pf_entry->lock);
+    if (pf_entry->dead || pf_entry->locked)
+        goto out;
+    //not worth a read back ahead of demand
+    if (pf_entry->store && !(*page = pgstore_get(pf_entry->store)))
+        goto out;
+    if (add_page_reader(pf_entry, node) < 0 || lease_note(pf_entry, node, lease) < 0)
+        goto out;
+    err = 0;
+
+out:
+    spin_unlock(&pf_entry->lock);
+    if (!err)
+        return pf_entry;
+    if (*page)
+        pgstore_put(pf_entry->store);
+    put_mapped_page(pf_entry);
+    return NULL;
+}
+
+/* Push up to count pages stride apart from vaddr on, returns how many were sent */
+static unsigned int readahead_push(struct comm_ctx *ctx, struct hga_shard *shard,
+        pid_t token, int node, unsigned long vaddr, long stride, unsigned int count,
+        unsigned int lease) {
+    struct mapped_page **entries;
+    struct socket *conn_sock;
+    pid_t client_pid;
+    pgd_t *pgd;
+    char **pages;
+    unsigned int n, i;
+    int err = 0;
+
+    conn_sock = comm_node_socket(ctx, node);
+    if (!conn_sock || !lookup_client_entry(token, node, &client_pid, &pgd))
+        return 0;
+
+    entries = kmalloc_array(count, sizeof(*entries), GFP_KERNEL);
+    pages = kmalloc_array(count, sizeof(*pages), GFP_KERNEL);
+    if (!entries || !pages) {
+        kfree(entries);
+        kfree(pages);
+        return 0;
+    }
+
+    for (n = 0; n < count; n++) {
+        entries[n] = readahead_take(shard, token, vaddr + n * stride, node, lease, &pages[n]);
+        if (!entries[n])
+            break;
+    }
+
+    if (n)
+        err = comm_push_pages(ctx, conn_sock, vaddr, stride, client_pid, token, pgd,
+                pages, n, lease);
+    if (err == 1)
+        atomic_long_add(n, &nr_pushed);
+
+    for (i = 0; i < n; i++) {
+        if (pages[i])
+            pgstore_put(entries[i]->store);
+        put_mapped_page(entries[i]);
+    }
+    kfree(entries);
+    kfree(pages);
+    return err == 1 ? n : 0;
+}
+
+/*
+ * Follow a request of node that was answered, and push the pages it is
+ * expected to ask for next. A write of a pushed page still has to be
+ * asked for, and is not counted as waste. Called on the server thread of
+ * shard.
+ */
+void readahead_access(struct comm_ctx *ctx, struct hga_shard *shard,
+        pid_t token, unsigned long vaddr, int node, bool write) {
+    unsigned int max = min(readahead_max_pages, (unsigned int)READAHEAD_MAX_WINDOW);
+    unsigned int lease = lease_msecs(token);
+    unsigned long page = vaddr & PAGE_MASK;
+    unsigned long start = 0;
+    unsigned int count = 0;
+    long stride = 0;
+    struct readahead_stream *s;
+    bool wasted, on_stride;
+
+    if (!shard->streams || node < 0 || node >= COMM_MAX_NODES || (vaddr & COMM_HUGE_BIT))
+        return;
+    s = &shard->streams[node];
+
+    if (!max || !lease) {
+        s->token = 0;
+        return;
+    }
+    atomic_long_inc(&nr_requests);
+
+    if (s->token != token) {
+        memset(s, 0, sizeof(*s));
+        s->token = token;
+        s->last = page;
+        return;
+    }
+
+    wasted = !write && readahead_was_pushed(s, page);
+    if (wasted) {
+        s->window /= 2;
+        s->nr_wasted++;
+        atomic_long_inc(&nr_wasted);
+    }
+    if (page != s->last)
+        readahead_learn(shard, token, node, s->last, page);
+
+    //the pages pushed on a stride are not asked for, when used
+    on_stride = s->stride && (page == s->expect
+            || (wasted && s->push_stride == s->stride));
+    if (on_stride) {
+        if (!wasted)
+            s->window = s->window ? min(s->window * 2, max) : 1;
+        else if (!s->window)
+            s->window = 1;
+        start = page + s->stride;
+        stride = s->stride;
+        count = min(s->window, max);
+        atomic_long_inc(&nr_strided);
+    } else {
+        s->stride = (long)(page - s->last);
+        s->window = 0;
+        if ((start = readahead_successor(shard, token, node, page))) {
+            stride = PAGE_SIZE;
+            count = 1;
+            atomic_long_inc(&nr_correlated);
+        }
+    }
+    s->last = page;
+    s->expect = page + s->stride;
+
+    //wasteful nodes are probed one page at a time
+    if (s->nr_pushed >= READAHEAD_RECENT / 4 && count > 1
+            && s->nr_wasted * 100 > s->nr_pushed * readahead_waste_pct) {
+        count = 1;
+        atomic_long_inc(&nr_throttled);
+    }
+    if (s->nr_pushed >= READAHEAD_RECENT) {
+        s->nr_pushed /= 2;
+        s->nr_wasted /= 2;
+    }
+
+    s->push_count = 0;
+    if (!count)
+        return;
+    s->push_start = start;
+    s->push_stride = stride;
+    s->push_count = readahead_push(ctx, shard, token, node, start, stride, count, lease);
+    s->nr_pushed += s->push_count;
+    if (on_stride)
+        s->expect = start + s->push_count * stride;
+}
@@ -0,0 +1,99 @@
+#include "ev_handlers.h"
+#include "../stats/stats.h"
+
+/*
+ * Page versions.
+ *
+ * Every commit that changes a page bumps mapped_page.version (see struct
+ * comm_version), so a reader that still has the current copy of a page is
+ * told so instead of being sent the page again. That spares the page to
+ * the readers of a write that left it as it was, and to lease readers
+ * asking for a page again once their lease ran out.
+ *
+ * Only the server holding the current copy answers for it: not proxies,
+ * whose copies may trail the home server's, nor for pages left with their
+ * owner in forwarding mode. Huge units are always sent.
+ */
+
+static atomic_long_t nr_revalidated; //REVALIDATEs answered with NOT_MODIFIED
+static atomic_long_t nr_unchanged; //readers of a write that changed nothing
+
+static int version_stats_show(struct seq_file *m, void *data) {
+    seq_printf(m, "revalidated %ld\n", atomic_long_read(&nr_revalidated));
+    seq_printf(m, "unchanged %ld\n", atomic_long_read(&nr_unchanged));
+    return 0;
+}
+
+void version_init(void) {
+    stats_create_file("versions", version_stats_show, NULL);
+}
+
+/*
+ * Answer a REVALIDATE from node holding the given version of the page.
+ * Returns 1 if node was told its copy is current, 0 if the page has to be
+ * read as on INITIAL_READ, or -1 if node was lost.
+ */
+int version_revalidate(struct comm_ctx *ctx, struct socket *conn_sock,
+        pid_t token, unsigned long vaddr, pid_t client_pid, pgd_t *pgd,
+        int node, u64 version) {
+    struct mapped_page *pf_entry;
+    unsigned int lease;
+    bool current;
+
+    if (!version || (vaddr & COMM_HUGE_BIT) || proxy_enabled())
+        return 0;
+
+    pf_entry = find_mapped_page(token, comm_page_key(vaddr));
+    if (!pf_entry)
+        return 0;
+
+    //a locked page is answered once committed, like any read
+    lease = lease_msecs(token);
+    spin_lock(&pf_entry->lock);
+    current = !pf_entry->dead && !pf_entry->locked && pf_entry->owner < 0
+        && pf_entry->version == version
+        && add_page_reader(pf_entry, node) == 0
+        && (!lease || lease_note(pf_entry, node, lease) == 0);
+    spin_unlock(&pf_entry->lock);
+    put_mapped_page(pf_entry);
+
+    if (!current)
+        return 0;
+    if (comm_not_modified(ctx, conn_sock, vaddr, client_pid, token, pgd, version, lease) < 0)
+        return -1;
+    atomic_long_inc(&nr_revalidated);
+    return 1;
+}
+
+/*
+ * Unlock the readers of a page after a write that left it as it was:
+ * NOT_MODIFIED instead of the page, with a fresh lease in lease mode.
+ * Called while the page is still locked.
+ */
+void version_resume_read(struct comm_ctx *ctx, struct mapped_page *pf_entry,
+        pid_t token, unsigned long vaddr, int skip) {
+    unsigned int lease = lease_msecs(token);
+    int reader, err;
+
+    reader_set_for_each(reader, &(pf_entry->readers)) {
+        struct socket *reader_sock;
+        pid_t reader_pid;
+        pgd_t *reader_pgd;
+
+        if (reader == skip)
+            continue;
+        reader_sock = comm_node_socket(ctx, reader);
+        if (!reader_sock || !lookup_client_entry(token, reader, &reader_pid, &reader_pgd))
+            continue;
+        if (lease) {
+            spin_lock(&pf_entry->lock);
+            err = lease_note(pf_entry, reader, lease);
+            spin_unlock(&pf_entry->lock);
+            if (err < 0)
+                continue;
+        }
+        if (comm_not_modified(ctx, reader_sock, vaddr, reader_pid, token, reader_pgd,
+                    pf_entry->version, lease) == 1)
+            atomic_long_inc(&nr_unchanged);
+    }
+}
@@ -0,0 +1,121 @@
+#include <linux/module.h>
+#include "ev_handlers.h"
+#include "../stats/stats.h"
+
+/*
+ * Requests for locked pages.
+ *
+ * A read or write that finds its page locked is queued on the page instead
+ * of being refused, so clients do not retry through fault storms. When the
+ * page is unlocked the queue is served in arrival order: the readers at
+ * the head get the page, and the first writer gets the lock, which holds
+ * the rest of the queue back until its commit.
+ */
+static unsigned int page_wait_max = 64;
+module_param(page_wait_max, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(page_wait_max, "Requests queued on one locked page before more are refused");
+
+static atomic_long_t nr_queued;
+static atomic_long_t nr_served;
+static atomic_long_t nr_refused;
+
+static int waitq_stats_show(struct seq_file *m, void *data) {
+    seq_printf(m, "queued %ld\n", atomic_long_read(&nr_queued));
+    seq_printf(m, "served %ld\n", atomic_long_read(&nr_served));
+    seq_printf(m, "refused %ld\n", atomic_long_read(&nr_refused));
+    return 0;
+}
+
+void waitq_init(void) {
+    stats_create_file("waitq", waitq_stats_show, NULL);
+}
+
+/*
+ * Queue a request of node on a locked page, with pf_entry->lock held.
+ * A repeated request keeps its place. Returns 0, or -1 if the queue is
+ * full.
+ */
+int waitq_add(struct mapped_page *pf_entry, int node, bool write) {
+    struct page_waiter *waiter;
+
+    list_for_each_entry(waiter, &(pf_entry->waiters), list) {
+        if (waiter->node == node && waiter->write == write)
+            return 0;
+    }
+
+    if (pf_entry->nr_waiters >= page_wait_max) {
+        atomic_long_inc(&nr_refused);
+        return -1;
+    }
+
+    waiter = kmalloc(sizeof(*waiter), GFP_ATOMIC);
+    if (!waiter) {
+        atomic_long_inc(&nr_refused);
+        return -1;
+    }
+    waiter->node = node;
+    waiter->write = write;
+    list_add_tail(&(waiter->list), &(pf_entry->waiters));
+    pf_entry->nr_waiters++;
+
+    atomic_long_inc(&nr_queued);
+    return 0;
+}
+
+/* Serve the queue of a page that was just unlocked, on the server thread */
+void waitq_serve(struct comm_ctx *ctx, struct hga_shard *shard,
+        struct mapped_page *pf_entry, pid_t token, unsigned long vaddr) {
+
+    for (;;) {
+        struct page_waiter *waiter;
+        int node;
+        bool write;
+
+        spin_lock(&pf_entry->lock);
+        if (pf_entry->locked || pf_entry->dead || list_empty(&(pf_entry->waiters))) {
+            spin_unlock(&pf_entry->lock);
+            return;
+        }
+
+        waiter = list_first_entry(&(pf_entry->waiters), struct page_waiter, list);
+        list_del(&(waiter->list));
+        pf_entry->nr_waiters--;
+        node = waiter->node;
+        write = waiter->write;
+        kfree(waiter);
+        atomic_long_inc(&nr_served);
+
+        if (!write) {
+            if (add_page_reader(pf_entry, node) < 0) {
+                spin_unlock(&pf_entry->lock);
+                continue;
+            }
+            //drops the lock
+            initial_read_reply(ctx, shard, pf_entry, token, vaddr, node);
+            continue;
+        }
+
+        //only readers can write, it may have been dropped while waiting
+        if (!reader_set_test(&(pf_entry->readers), node)) {
+            spin_unlock(&pf_entry->lock);
+            continue;
+        }
+        if (mwrite_enabled(token)) {
+            //drops the lock
+            if (mwrite_request(ctx, shard, pf_entry, token, vaddr, node) == 0)
+                return;
+            continue;
+        }
+        pf_entry->locked = true;
+        pf_entry->writer = node;
+        spin_unlock(&pf_entry->lock);
+
+        if (request_write_grant(ctx, shard, pf_entry, token, vaddr, node) == 0)
+            return;
+
+        spin_lock(&pf_entry->lock);
+        pf_entry->locked = false;
+        pf_entry->writer = -1;
+        spin_unlock(&pf_entry->lock);
+    }
+}
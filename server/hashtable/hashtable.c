@@ -1,70 +1,537 @@
+#include <linux/jhash.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 #include "hashtable.h"
+#include "../comm/comm.h"
+#include "../stats/stats.h"
 
 /*
- * locks for hashtables
-static DEFINE_SPINLOCK(pid_lock);
-static DEFINE_SPINLOCK(vaddr_lock);
+ * Page directory.
+ *
+ * Readers never take a lock: they walk the bucket chain under RCU and pin
+ * the entry they found with a reference. Writers serialize per bucket on
+ * one of the striped locks below, so updates to unrelated pages do not
+ * contend with each other.
  */
+static DEFINE_HASHTABLE(mapped_pages, MAPPED_PAGE_HASH_BITS);
+static spinlock_t bucket_locks[1 << MAPPED_PAGE_LOCK_BITS];
 
-static struct mapped_page *pf_list;
+/* (token, node) -> client process, read under RCU */
+static DEFINE_HASHTABLE(client_entries, CLIENT_ENTRY_HASH_BITS);
+static DEFINE_SPINLOCK(client_entries_lock);
+
+/*
+ * Directory objects are allocated on every first touch and node join,
+ * so they get their own caches instead of the generic kmalloc slabs.
+ * Constructors run once per slab object; objects must be handed back to
+ * the cache in the constructed state (empty lists, unlocked).
+ */
+static struct kmem_cache *mapped_page_cache;
+static struct kmem_cache *mapped_page_ext_cache;
+static struct kmem_cache *client_entry_cache;
+
+static atomic_long_t nr_mapped_pages = ATOMIC_LONG_INIT(0);
+static atomic_long_t nr_mapped_page_exts = ATOMIC_LONG_INIT(0);
+static atomic_long_t nr_client_entries = ATOMIC_LONG_INIT(0);
+static atomic_long_t nr_alloc_failures = ATOMIC_LONG_INIT(0);
+
+static void mapped_page_ctor(void *obj) {
+    struct mapped_page *entry = obj;
+
+    INIT_HLIST_NODE(&(entry->node));
+    reader_set_init(&(entry->readers));
+    spin_lock_init(&entry->lock);
+    INIT_LIST_HEAD(&(entry->waiters));
+}
+
+static void client_entry_ctor(void *obj) {
+    struct client_entry *entry = obj;
+
+    INIT_HLIST_NODE(&(entry->node));
+}
+
+static void client_entry_free_rcu(struct rcu_head *head) {
+    struct client_entry *entry = container_of(head, struct client_entry, rcu);
+
+    INIT_HLIST_NODE(&(entry->node));
+    atomic_long_dec(&nr_client_entries);
+    kmem_cache_free(client_entry_cache, entry);
+}
+
+static int slab_stats_show(struct seq_file *m, void *data) {
+    seq_printf(m, "mapped_page_objsize %u\n", kmem_cache_size(mapped_page_cache));
+    seq_printf(m, "mapped_page_active %ld\n", atomic_long_read(&nr_mapped_pages));
+    seq_printf(m, "mapped_page_ext_objsize %u\n", kmem_cache_size(mapped_page_ext_cache));
+    seq_printf(m, "mapped_page_ext_active %ld\n", atomic_long_read(&nr_mapped_page_exts));
+    seq_printf(m, "client_entry_objsize %u\n", kmem_cache_size(client_entry_cache));
+    seq_printf(m, "client_entry_active %ld\n", atomic_long_read(&nr_client_entries));
+    seq_printf(m, "alloc_failures %ld\n", atomic_long_read(&nr_alloc_failures));
+    return 0;
+}
+
+static inline u32 mapped_page_hash(pid_t token, unsigned long pfn) {
+    return jhash_2words((u32)(pfn >> PAGE_SHIFT), (u32)token,
+            (u32)(pfn >> (PAGE_SHIFT + 32)));
+}
+
+static inline u32 client_entry_hash(pid_t token, int node) {
+    return jhash_2words((u32)token, (u32)node, 0);
+}
+
+static inline struct hlist_head* bucket_of(u32 key) {
+    return &mapped_pages[hash_min(key, HASH_BITS(mapped_pages))];
+}
+
+static inline spinlock_t* bucket_lock_of(u32 key) {
+    return &bucket_locks[hash_min(key, HASH_BITS(mapped_pages))
+        & ((1 << MAPPED_PAGE_LOCK_BITS) - 1)];
+}
 
 int hashtable_init(void) {
-    pf_list = (struct mapped_page*) kmalloc(sizeof(struct mapped_page), GFP_KERNEL);
+    int i;
+
+    hash_init(mapped_pages);
+    for (i = 0; i < (1 << MAPPED_PAGE_LOCK_BITS); i++)
+        spin_lock_init(&bucket_locks[i]);
+
+    mapped_page_cache = kmem_cache_create("hga_mapped_page",
+            sizeof(struct mapped_page), 0, SLAB_HWCACHE_ALIGN, mapped_page_ctor);
+    if (!mapped_page_cache)
+        return 0;
+
+    mapped_page_ext_cache = kmem_cache_create("hga_mapped_page_ext",
+            sizeof(struct mapped_page_ext), 0, SLAB_HWCACHE_ALIGN, NULL);
+    if (!mapped_page_ext_cache) {
+        kmem_cache_destroy(mapped_page_cache);
+        return 0;
+    }
 
-    if (!pf_list)
+    client_entry_cache = kmem_cache_create("hga_client_entry",
+            sizeof(struct client_entry), 0, SLAB_HWCACHE_ALIGN, client_entry_ctor);
+    if (!client_entry_cache) {
+        kmem_cache_destroy(mapped_page_ext_cache);
+        kmem_cache_destroy(mapped_page_cache);
         return 0;
-    memset(pf_list, 0, sizeof(struct mapped_page));
-    INIT_LIST_HEAD(&(pf_list->list));
+    }
+
+    stats_create_file("slab", slab_stats_show, NULL);
 
     return 1;
 }
 
-void add_mapped_page(struct mapped_page* entry) {
-    list_add_tail(&(entry->list), &(pf_list->list));
+void hashtable_exit(void) {
+    struct mapped_page* entry;
+    struct client_entry* client;
+    struct hlist_node* tmp;
+    int bkt;
+
+    hash_for_each_safe(mapped_pages, bkt, tmp, entry, node)
+        remove_mapped_page(entry);
+
+    spin_lock(&client_entries_lock);
+    hash_for_each_safe(client_entries, bkt, tmp, client, node) {
+        hash_del_rcu(&(client->node));
+        call_rcu(&client->rcu, client_entry_free_rcu);
+    }
+    spin_unlock(&client_entries_lock);
+
+    /* Wait for the call_rcu() callbacks queued above, and the frees they queued */
+    rcu_barrier();
+    flush_work(&mapped_page_free_work);
+
+    kmem_cache_destroy(client_entry_cache);
+    kmem_cache_destroy(mapped_page_ext_cache);
+    kmem_cache_destroy(mapped_page_cache);
 }
 
-void add_client_entry(struct client_entry* entry, struct client_entry* existing) {
-    list_add_tail(&(entry->list), &(existing->list));
-    return;
+/*
+ * Insert entry unless a page with the same (token, pfn) is already present.
+ * Returns the entry now in the directory with a reference held for the
+ * caller. If that is not the passed entry the caller still owns it.
+ */
+struct mapped_page* add_mapped_page(struct mapped_page* entry) {
+    u32 key = mapped_page_hash(entry->token, entry->pfn);
+    spinlock_t *lock = bucket_lock_of(key);
+    struct mapped_page* existing;
+
+    spin_lock(lock);
+    hlist_for_each_entry(existing, bucket_of(key), node) {
+        if (existing->pfn == entry->pfn && existing->token == entry->token) {
+            get_mapped_page(existing);
+            spin_unlock(lock);
+            return existing;
+        }
+    }
+    /* One reference for the directory, one for the caller */
+    atomic_set(&entry->refcount, 2);
+    hlist_add_head_rcu(&(entry->node), bucket_of(key));
+    spin_unlock(lock);
+
+    return entry;
+}
+
+void remove_mapped_page(struct mapped_page* entry) {
+    u32 key = mapped_page_hash(entry->token, entry->pfn);
+    spinlock_t *lock = bucket_lock_of(key);
+    bool unlinked = false;
+
+    spin_lock(lock);
+    spin_lock(&entry->lock);
+    if (!entry->dead) {
+        entry->dead = true;
+        hlist_del_rcu(&(entry->node));
+        unlinked = true;
+    }
+    spin_unlock(&entry->lock);
+    spin_unlock(lock);
+
+    /* Drop the directory's reference */
+    if (unlinked)
+        put_mapped_page(entry);
+}
+
+/*
+ * Lock-free lookup. Returns the page with a reference held, or NULL.
+ * Safe to call from softirq context.
+ */
+struct mapped_page* find_mapped_page(pid_t token, unsigned long pfn) {
+    u32 key = mapped_page_hash(token, pfn);
+    struct mapped_page* entry;
+
+    rcu_read_lock();
+    hlist_for_each_entry_rcu(entry, bucket_of(key), node) {
+        if (entry->pfn != pfn || entry->token != token)
+            continue;
+        /* Lost the race against the final put */
+        if (!atomic_inc_not_zero(&entry->refcount))
+            break;
+        rcu_read_unlock();
+        return entry;
+    }
+    rcu_read_unlock();
+
+    return NULL;
+}
+
+struct mapped_page* get_mapped_page(struct mapped_page* entry) {
+    atomic_inc(&entry->refcount);
+    return entry;
+}
+
+/*
+ * Entries whose grace period ended. RCU callbacks run in softirq, and
+ * releasing the stored page may take locks (zsmalloc's) that are not
+ * bottom-half safe, so entries are freed from a work item instead.
+ */
+static LLIST_HEAD(mapped_page_frees);
+
+static void mapped_page_free_work_fn(struct work_struct *work) {
+    struct llist_node *list = llist_del_all(&mapped_page_frees);
+    struct mapped_page *entry, *tmp;
+
+    llist_for_each_entry_safe(entry, tmp, list, free_node)
+        free_mapped_page(entry);
+}
+
+static DECLARE_WORK(mapped_page_free_work, mapped_page_free_work_fn);
+
+static void mapped_page_free_rcu(struct rcu_head *head) {
+    struct mapped_page *entry = container_of(head, struct mapped_page, rcu);
+
+    if (llist_add(&entry->free_node, &mapped_page_frees))
+        schedule_work(&mapped_page_free_work);
+}
+
+void put_mapped_page(struct mapped_page* entry) {
+    if (atomic_dec_and_test(&entry->refcount))
+        call_rcu(&entry->rcu, mapped_page_free_rcu);
+}
+
+/* Caller must hold page->lock. Returns 0 or -ENOMEM */
+int add_page_reader(struct mapped_page* page, int node) {
+    return reader_set_add(&(page->readers), node, GFP_ATOMIC);
 }
 
 void foreach_mapped_page(callBackFunc func, void* entry, void* arg) {
     struct mapped_page* temp;
-    list_for_each_entry(temp, &(pf_list->list), list) {
+    int bkt;
+
+    rcu_read_lock();
+    hash_for_each_rcu(mapped_pages, bkt, temp, node) {
         func((void*)temp, entry, arg);
     }
+    rcu_read_unlock();
 }
 
-struct client_entry* make_client_entry(struct socket *sock, pgd_t *pgd, pid_t pid_client) {
-    struct client_entry *entry = 
-        kmalloc(sizeof(struct client_entry), GFP_KERNEL);
+static struct client_entry* __find_client_entry(pid_t token, int node) {
+    struct client_entry* entry;
 
+    hash_for_each_possible_rcu(client_entries, entry, node,
+            client_entry_hash(token, node)) {
+        if (entry->token == token && entry->node_id == node)
+            return entry;
+    }
+    return NULL;
+}
+
+/*
+ * Record the process a node runs for token. A node reconnecting with a
+ * new process simply overwrites the old record.
+ */
+int update_client_entry(pid_t token, int node, pid_t pid_client, pgd_t *pgd) {
+    struct client_entry *entry;
+
+    spin_lock(&client_entries_lock);
+    entry = __find_client_entry(token, node);
+    if (entry) {
+        entry->pid = pid_client;
+        entry->pgd = pgd;
+        spin_unlock(&client_entries_lock);
+        return 1;
+    }
+    spin_unlock(&client_entries_lock);
+
+    entry = kmem_cache_alloc(client_entry_cache, GFP_KERNEL);
     if(!entry) {
+        atomic_long_inc(&nr_alloc_failures);
         printk(KERN_ERR "failed to make client entry");
-        return NULL;
+        return 0;
     }
-
-    INIT_LIST_HEAD(&(entry->list));
-    entry->socket = sock;
-    entry->pgd = pgd;
+    entry->token = token;
+    entry->node_id = node;
     entry->pid = pid_client;
-    return entry;
+    entry->pgd = pgd;
+    entry->peer_ip = 0;
+    entry->peer_port = 0;
+
+    spin_lock(&client_entries_lock);
+    if (__find_client_entry(token, node)) {
+        //raced with another insert, the record is the same
+        spin_unlock(&client_entries_lock);
+        kmem_cache_free(client_entry_cache, entry);
+        return 1;
+    }
+    atomic_long_inc(&nr_client_entries);
+    hash_add_rcu(client_entries, &(entry->node), client_entry_hash(token, node));
+    spin_unlock(&client_entries_lock);
+
+    return 1;
+}
+
+/* Returns 1 and fills pid/pgd if the node joined token, 0 otherwise */
+int lookup_client_entry(pid_t token, int node, pid_t *client_pid, pgd_t **pgd) {
+    struct client_entry *entry;
+
+    rcu_read_lock();
+    entry = __find_client_entry(token, node);
+    if (entry) {
+        *client_pid = entry->pid;
+        *pgd = entry->pgd;
+    }
+    rcu_read_unlock();
+
+    return entry ? 1 : 0;
+}
+
+/*
+ * Record where a node serves the pages it owns. The entry must exist, it
+ * is made by the node's first read. Returns 1, or 0 if there is none.
+ */
+int set_client_peer(pid_t token, int node, __be32 ip, __be16 port) {
+    struct client_entry *entry;
+
+    spin_lock(&client_entries_lock);
+    entry = __find_client_entry(token, node);
+    if (entry) {
+        entry->peer_ip = ip;
+        entry->peer_port = port;
+    }
+    spin_unlock(&client_entries_lock);
+
+    return entry ? 1 : 0;
+}
+
+/* Returns 1, or 0 if the node has no peer address for token */
+int lookup_client_peer(pid_t token, int node, __be32 *ip, __be16 *port) {
+    struct client_entry *entry;
+    int found = 0;
+
+    rcu_read_lock();
+    entry = __find_client_entry(token, node);
+    if (entry && entry->peer_port) {
+        *ip = entry->peer_ip;
+        *port = entry->peer_port;
+        found = 1;
+    }
+    rcu_read_unlock();
+
+    return found;
+}
+
+/* Remove the requests of node from the page's queue, or all for node -1 */
+static void drop_page_waiters(struct mapped_page* page, int node) {
+    struct page_waiter *waiter, *tmp;
+
+    list_for_each_entry_safe(waiter, tmp, &(page->waiters), list) {
+        if (node >= 0 && waiter->node != node)
+            continue;
+        list_del(&(waiter->list));
+        page->nr_waiters--;
+        kfree(waiter);
+    }
+}
+
+static void drop_reader_callback(void* current_entry, void* unused, void* arg) {
+    struct mapped_page* page = current_entry;
+    struct mapped_page_ext* ext;
+
+    spin_lock(&page->lock);
+    ext = page->ext;
+    reader_set_del(&(page->readers), *(int*)arg);
+    //the server's copy, possibly stale, is all that is left
+    if (page->owner == *(int*)arg)
+        page->owner = -1;
+    //its commit is never coming, the caller resumes the readers it locked
+    if (page->writer == *(int*)arg) {
+        page->writer_lost = true;
+        page->writer = -1;
+        if (ext) {
+            ext->lease_wait = false;
+            ext->home = -1;
+            ext->home_recalled = false;
+        }
+    }
+    drop_page_waiters(page, *(int*)arg);
+    if (!ext) {
+        spin_unlock(&page->lock);
+        return;
+    }
+
+    //a write waiting on its lease is granted when the lease timer runs
+    reader_set_del(&(ext->leases), *(int*)arg);
+    if (ext->last_writer == *(int*)arg)
+        ext->last_writer = -1;
+    //nor is its diff; after the last writer the caller sends the merged page
+    if (reader_set_test(&(ext->writers), *(int*)arg)) {
+        reader_set_del(&(ext->writers), *(int*)arg);
+        if (reader_set_empty(&(ext->writers)))
+            page->writer_lost = true;
+    }
+    spin_unlock(&page->lock);
 }
 
-struct mapped_page* make_mapped_page(unsigned long pfn, pid_t token, bool locked, void* page_addr) {
-    struct mapped_page* entry = 
-        kmalloc(sizeof(*entry), GFP_KERNEL);
-    memset(entry, 0, sizeof(struct mapped_page));
-    
+/*
+ * Forget everything about a node that went away, so that its ID can be
+ * handed to the next connection.
+ */
+void drop_client_node(int node) {
+    struct client_entry* entry;
+    struct hlist_node* tmp;
+    int bkt;
+
+    foreach_mapped_page(drop_reader_callback, NULL, &node);
+
+    spin_lock(&client_entries_lock);
+    hash_for_each_safe(client_entries, bkt, tmp, entry, node) {
+        if (entry->node_id != node)
+            continue;
+        hash_del_rcu(&(entry->node));
+        call_rcu(&entry->rcu, client_entry_free_rcu);
+    }
+    spin_unlock(&client_entries_lock);
+}
+
+struct mapped_page* make_mapped_page(unsigned long pfn, pid_t token, bool locked) {
+    struct mapped_page* entry =
+        kmem_cache_alloc(mapped_page_cache, GFP_KERNEL);
+
     if(!entry) {
+        atomic_long_inc(&nr_alloc_failures);
         printk(KERN_ERR "failed to make page entry");
         return NULL;
     }
 
-    INIT_LIST_HEAD(&(entry->list));
+    atomic_long_inc(&nr_mapped_pages);
+    entry->dead = false;
+    atomic_set(&entry->refcount, 1);
     entry->pfn = pfn;
     entry->locked = locked;
+    entry->writer_lost = false;
     entry->token = token;
-    entry->page_addr = page_addr;
+    entry->store = NULL;
+    entry->proxy_state = PROXY_NONE;
+    entry->writer = -1;
+    entry->owner = -1;
+    entry->nr_waiters = 0;
+    entry->version = 0;
+    entry->ext = NULL;
     return entry;
 }
+
+/*
+ * Per-mode state of entry, allocated on first use. Call with entry->lock
+ * held and an atomic gfp. Returns NULL if it cannot be allocated.
+ */
+struct mapped_page_ext* mapped_page_ext_get(struct mapped_page* entry, gfp_t gfp) {
+    struct mapped_page_ext* ext = entry->ext;
+
+    if (ext)
+        return ext;
+
+    ext = kmem_cache_alloc(mapped_page_ext_cache, gfp);
+    if (!ext) {
+        atomic_long_inc(&nr_alloc_failures);
+        return NULL;
+    }
+
+    atomic_long_inc(&nr_mapped_page_exts);
+    reader_set_init(&(ext->leases));
+    ext->lease_until = jiffies;
+    ext->lease_wait = false;
+    reader_set_init(&(ext->writers));
+    ext->dirty_blocks = 0;
+    ext->unit = NULL;
+    ext->unit_stage = NULL;
+    ext->unit_next = 0;
+    ext->home = -1;
+    ext->home_recalled = false;
+    ext->last_writer = -1;
+    ext->write_streak = 0;
+    ext->home_backoff = 0;
+    entry->ext = ext;
+    return ext;
+}
+
+static void free_mapped_page_ext(struct mapped_page* entry) {
+    struct mapped_page_ext* ext = entry->ext;
+
+    if (!ext)
+        return;
+
+    reader_set_free(&(ext->leases));
+    reader_set_free(&(ext->writers));
+    //a huge unit is charged to its token like the pages it spans
+    if (ext->unit)
+        atomic_long_sub(COMM_HUGE_CHUNKS, &token_find(entry->token)->nr_pages);
+    vfree(ext->unit);
+    vfree(ext->unit_stage);
+
+    entry->ext = NULL;
+    atomic_long_dec(&nr_mapped_page_exts);
+    kmem_cache_free(mapped_page_ext_cache, ext);
+}
+
+/* Release an entry that is not (or no longer) reachable from the directory */
+void free_mapped_page(struct mapped_page* entry) {
+    reader_set_free(&(entry->readers));
+    drop_page_waiters(entry, -1);
+
+    pgstore_release(entry->store);
+    entry->store = NULL;
+    free_mapped_page_ext(entry);
+
+    /* Back to the constructed state for the next allocation */
+    INIT_HLIST_NODE(&(entry->node));
+    atomic_long_dec(&nr_mapped_pages);
+    kmem_cache_free(mapped_page_cache, entry);
+}
@@ -4,32 +4,165 @@
 #include <linux/list.h>
 #include <linux/slab.h>
 #include <linux/hashtable.h>
+#include <linux/rculist.h>
+#include <linux/rcupdate.h>
+#include <linux/spinlock.h>
+#include <linux/atomic.h>
+#include <linux/llist.h>
 #include <linux/types.h>
+#include "reader_set.h"
+#include "../pgstore/pgstore.h"
+
+/* Number of buckets in the page directory is 1 << MAPPED_PAGE_HASH_BITS */
+#define MAPPED_PAGE_HASH_BITS 14
+/* Buckets share 1 << MAPPED_PAGE_LOCK_BITS striped update locks */
+#define MAPPED_PAGE_LOCK_BITS 8
+/* Buckets in the (token, node) client table */
+#define CLIENT_ENTRY_HASH_BITS 8
 
 typedef void (*callBackFunc)(void*, void*, void* );
 
+/*
+ * Process of a client node taking part in a shared token. Recorded once
+ * per (token, node) on the first read instead of once per page, and used
+ * to address LOCK_READ/RESUME_READ at that node.
+ */
 struct client_entry {
-    struct list_head list;
-    struct socket *socket;
+    struct hlist_node node;
+    pid_t token;
+    int node_id;
     pgd_t* pgd;
     pid_t pid;
+    __be32 peer_ip; //where the node serves pages it owns, forwarding mode only
+    __be16 peer_port;
+    struct rcu_head rcu;
 };
 
-struct mapped_page {
+/* Whether a proxy's copy of a page is current, see proxy.h */
+enum proxy_page_state {
+    PROXY_NONE, //never fetched, or dropped after an upstream failure
+    PROXY_FETCHING, //invalidated, an update from upstream is on its way
+    PROXY_VALID,
+};
+
+/*
+ * Request waiting for a locked page, queued on the page in arrival order.
+ * The client's pid and pgd are looked up from its client_entry when the
+ * request is served.
+ */
+struct page_waiter {
     struct list_head list;
+    int node;
+    bool write;
+};
+
+/*
+ * Directory entry for a shared page.
+ *
+ * Lookups walk the bucket chains under rcu_read_lock() only, so they can
+ * run from any context. Insertion and removal take the striped bucket lock.
+ * The state fields are protected by the per-entry lock. Once the last
+ * reference is dropped an entry goes through call_rcu(), whose callback
+ * hands it to a work item that frees it from process context.
+ *
+ * Entries come from a SLAB_HWCACHE_ALIGN cache. Fields are ordered so that
+ * the lookup keys and the state touched by every handler come first; the
+ * rcu_head is only used on free and goes last. State that only the lease,
+ * multiple-writer, huge unit and home migration modes use lives in a
+ * struct mapped_page_ext, so plain pages do not pay for it.
+ */
+struct mapped_page {
+    /* lookup, read under RCU */
+    struct hlist_node node;
     unsigned long pfn;
-    void *page_addr;
     pid_t token;
-    struct client_entry* clients; //list of mapped clients
+
+    /* state, under lock */
+    bool dead; //unlinked from the directory
     bool locked;
+    bool writer_lost; //still locked for a writer that went away, see handle_disconnect()
+    atomic_t refcount;
+    spinlock_t lock;
+    struct reader_set readers; //node IDs of mapped clients
+    struct pgstore_slot *store; //committed page contents, NULL until the first commit
+    enum proxy_page_state proxy_state;
+    int writer; //node holding the write lock, or -1
+    int owner; //node holding the only current copy in forwarding mode, or -1
+    struct list_head waiters; //page_waiters, only while locked
+    unsigned int nr_waiters;
+    u64 version; //of the committed contents, see struct comm_version
+    struct mapped_page_ext *ext; //per-mode state, NULL until a mode needs it
+
+    /* cold */
+    union {
+        struct rcu_head rcu;
+        struct llist_node free_node; //after the grace period, see put_mapped_page()
+    };
+};
+
+/*
+ * Per-mode state of a directory entry, allocated by mapped_page_ext_get()
+ * the first time a mode records something on the page and freed with the
+ * entry. Protected by the entry's lock, like the entry's own state; once
+ * set, mapped_page.ext does not change until the entry is freed.
+ */
+struct mapped_page_ext {
+    /* lease mode */
+    struct reader_set leases; //readers holding a lease
+    unsigned long lease_until; //jiffies, when the last lease handed out runs out
+    bool lease_wait; //the writer's ALLOW_WRITE waits for the leases
+
+    /* multiple-writer mode */
+    struct reader_set writers; //writers yet to commit a diff
+    u64 dirty_blocks; //blocks the merged diffs changed, see struct comm_blocks
+
+    /* huge units */
+    char *unit; //committed data of the unit (see struct comm_chunk), NULL until the first commit
+    char *unit_stage; //chunks of the unit commit under way
+    unsigned int unit_next; //next chunk expected in unit_stage
+
+    /* home migration, see home.c */
+    int home; //node the write lock migrated to, or -1
+    bool home_recalled; //RECALL_HOME sent to the home
+    int last_writer; //node of the last commit, or -1
+    unsigned int write_streak; //commits in a row by last_writer
+    unsigned int home_backoff; //recalls of the page so far
 };
 
+/* Node the write lock of entry migrated to, or -1. Call with entry->lock held */
+static inline int mapped_page_home(struct mapped_page *entry) {
+    return entry->ext ? entry->ext->home : -1;
+}
+
+/* Whether it migrated to a node other than node. Call with entry->lock held */
+static inline bool mapped_page_home_elsewhere(struct mapped_page *entry, int node) {
+    int home = mapped_page_home(entry);
+
+    return home >= 0 && home != node;
+}
+
+/* Whether the writer's ALLOW_WRITE waits for leases. Call with entry->lock held */
+static inline bool mapped_page_lease_wait(struct mapped_page *entry) {
+    return entry->ext && entry->ext->lease_wait;
+}
+
 int hashtable_init(void);
+void hashtable_exit(void);
 
-void add_mapped_page(struct mapped_page* entry);
-void add_client_entry(struct client_entry* entry, struct client_entry* existing);
+struct mapped_page* add_mapped_page(struct mapped_page* entry);
+void remove_mapped_page(struct mapped_page* entry);
+struct mapped_page* find_mapped_page(pid_t token, unsigned long pfn);
+struct mapped_page* get_mapped_page(struct mapped_page* entry);
+void put_mapped_page(struct mapped_page* entry);
+int add_page_reader(struct mapped_page* page, int node);
 
 void foreach_mapped_page(callBackFunc, void*, void*);
-struct mapped_page* make_mapped_page(unsigned long pfn, pid_t pid, bool locked, void *page_addr);
-struct client_entry* make_client_entry(struct socket *sock, pgd_t *pgd, pid_t client_pid);
+struct mapped_page* make_mapped_page(unsigned long pfn, pid_t pid, bool locked);
+struct mapped_page_ext* mapped_page_ext_get(struct mapped_page* entry, gfp_t gfp);
+void free_mapped_page(struct mapped_page* entry);
+int update_client_entry(pid_t token, int node, pid_t client_pid, pgd_t *pgd);
+int lookup_client_entry(pid_t token, int node, pid_t *client_pid, pgd_t **pgd);
+int set_client_peer(pid_t token, int node, __be32 ip, __be16 port);
+int lookup_client_peer(pid_t token, int node, __be32 *ip, __be16 *port);
+void drop_client_node(int node);
 #endif
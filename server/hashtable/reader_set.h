@@ -0,0 +1,94 @@
+#ifndef HGA_READER_SET
+#define HGA_READER_SET
+
+#include <linux/bitmap.h>
+#include <linux/bitops.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/types.h>
+
+/*
+ * Set of node IDs reading a page.
+ *
+ * Clusters of up to READER_SET_INLINE_NODES nodes fit in the inline word,
+ * so the common case costs no allocation at all. A set that has to hold a
+ * higher node ID switches to an out-of-line bitmap sized in
+ * READER_SET_CHUNK_NODES steps and never shrinks back.
+ */
+#define READER_SET_INLINE_NODES BITS_PER_LONG
+#define READER_SET_CHUNK_NODES 256
+
+struct reader_set {
+    union {
+        unsigned long inline_bits;
+        unsigned long *ext_bits;
+    };
+    unsigned int nr_bits; //capacity, inline while <= READER_SET_INLINE_NODES
+};
+
+static inline void reader_set_init(struct reader_set *set) {
+    set->inline_bits = 0;
+    set->nr_bits = READER_SET_INLINE_NODES;
+}
+
+static inline unsigned long* reader_set_bits(struct reader_set *set) {
+    if (set->nr_bits > READER_SET_INLINE_NODES)
+        return set->ext_bits;
+    return &set->inline_bits;
+}
+
+static inline bool reader_set_test(struct reader_set *set, int node) {
+    if (node < 0 || node >= set->nr_bits)
+        return false;
+    return test_bit(node, reader_set_bits(set));
+}
+
+/* Returns 0 or -ENOMEM if the set could not grow to hold node */
+static inline int reader_set_add(struct reader_set *set, int node, gfp_t gfp) {
+    if (node >= set->nr_bits) {
+        unsigned int nr_bits = roundup(node + 1, READER_SET_CHUNK_NODES);
+        unsigned long *bits = kcalloc(BITS_TO_LONGS(nr_bits),
+                sizeof(unsigned long), gfp);
+
+        if (!bits)
+            return -ENOMEM;
+
+        bitmap_copy(bits, reader_set_bits(set), set->nr_bits);
+        if (set->nr_bits > READER_SET_INLINE_NODES)
+            kfree(set->ext_bits);
+        set->ext_bits = bits;
+        set->nr_bits = nr_bits;
+    }
+
+    set_bit(node, reader_set_bits(set));
+    return 0;
+}
+
+static inline void reader_set_del(struct reader_set *set, int node) {
+    if (node >= 0 && node < set->nr_bits)
+        clear_bit(node, reader_set_bits(set));
+}
+
+static inline bool reader_set_empty(struct reader_set *set) {
+    return bitmap_empty(reader_set_bits(set), set->nr_bits);
+}
+
+static inline unsigned int reader_set_weight(struct reader_set *set) {
+    return bitmap_weight(reader_set_bits(set), set->nr_bits);
+}
+
+static inline void reader_set_clear(struct reader_set *set) {
+    bitmap_zero(reader_set_bits(set), set->nr_bits);
+}
+
+/* Release the out-of-line bitmap, leaving an empty inline set */
+static inline void reader_set_free(struct reader_set *set) {
+    if (set->nr_bits > READER_SET_INLINE_NODES)
+        kfree(set->ext_bits);
+    reader_set_init(set);
+}
+
+#define reader_set_for_each(node, set) \
+    for_each_set_bit(node, reader_set_bits(set), (set)->nr_bits)
+
+#endif
@@ -1,15 +1,27 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include "./hashtable/hashtable.h"
+#include "./stats/stats.h"
+#include "./tokens/tokens.h"
+#include "./pgstore/pgstore.h"
 #include "main.h"
 
 static int server_init(void){
    
     printk(KERN_INFO "megavm_server: Init.\n");
-    hashtable_init();
+    stats_init();
+    tokens_init();
+    if (!pgstore_init()) {
+        printk(KERN_INFO "failed to initialize page store");
+        goto err_stats;
+    }
+    if (!hashtable_init()) {
+        printk(KERN_INFO "failed to initialize page directory");
+        goto err_pgstore;
+    }
     if (!init_server()) {
         printk(KERN_INFO "failed to initialize server");
-        return 1;
+        goto err_hashtable;
     }
     /*
     pass = hashtable_tests();
@@ -19,10 +31,26 @@ static int server_init(void){
     }
     */
     return 0;
+
+err_hashtable:
+    hashtable_exit();
+err_pgstore:
+    pgstore_exit();
+err_stats:
+    stats_exit();
+    tokens_exit();
+    return 1;
 }
 
 
 static void server_down(void) {
+   //no spilled page read back after its server and directory entry are gone
+   pgstore_quiesce();
+   exit_server();
+   stats_exit();
+   hashtable_exit();
+   pgstore_exit();
+   tokens_exit();
    printk("megavm_server down"); 
 }
 
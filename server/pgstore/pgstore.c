@@ -0,0 +1,1225 @@
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/bitmap.h>
+#include <linux/fs.h>
+#include <linux/ktime.h>
+#include <linux/workqueue.h>
+#include <linux/shrinker.h>
+#include <linux/crypto.h>
+#include <linux/zpool.h>
+#include <linux/percpu.h>
+#include <linux/jhash.h>
+#include <linux/hashtable.h>
+#include "pgstore.h"
+#include "../stats/stats.h"
+
+static unsigned long pgstore_max_pages = 0;
+module_param(pgstore_max_pages, ulong, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(pgstore_max_pages, "Resident pages the server may hold for all tokens (0: unlimited)");
+
+static unsigned long pgstore_pool_pages = 256;
+module_param(pgstore_pool_pages, ulong, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(pgstore_pool_pages, "Free pages kept in reserve for first commits");
+
+static char *pgstore_spill_path = "";
+module_param(pgstore_spill_path, charp, S_IRUGO);
+MODULE_PARM_DESC(pgstore_spill_path, "File cold pages are spilled to (empty: no spilling)");
+
+static unsigned long pgstore_spill_pages = 1UL << 20;
+module_param(pgstore_spill_pages, ulong, S_IRUGO);
+MODULE_PARM_DESC(pgstore_spill_pages, "Capacity of the spill file in pages");
+
+static unsigned int pgstore_compress_idle_ms = 30000;
+module_param(pgstore_compress_idle_ms, uint, S_IRUGO);
+MODULE_PARM_DESC(pgstore_compress_idle_ms, "Idle time after which a page is compressed (0: never)");
+
+static char *pgstore_compressor = "lz4";
+module_param(pgstore_compressor, charp, S_IRUGO);
+MODULE_PARM_DESC(pgstore_compressor, "Crypto compressor of the compressed tier");
+
+static char *pgstore_zpool = "zsmalloc";
+module_param(pgstore_zpool, charp, S_IRUGO);
+MODULE_PARM_DESC(pgstore_zpool, "Allocator of the compressed tier");
+
+static bool pgstore_dedup = true;
+module_param(pgstore_dedup, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(pgstore_dedup, "Share one copy among stored pages with the same contents");
+
+/* Pages that do not compress below this size stay resident */
+#define PGSTORE_COMPRESS_MAX (PAGE_SIZE * 3 / 4)
+/* How often the ager looks for idle pages */
+#define PGSTORE_COMPRESS_INTERVAL HZ
+/* Buckets of the contents index */
+#define PGSTORE_DUP_HASH_BITS 14
+
+static struct kmem_cache *slot_cache;
+
+/*
+ * Contents index. An entry owns a resident page shared by users slots,
+ * which is never written while indexed. Slots are only released from
+ * process context (see pgstore_release), so the index lock needs no
+ * bottom half protection. Lock order is slot->lock, then dup_lock.
+ */
+struct pgstore_dup {
+    struct hlist_node node;
+    u32 hash;
+    unsigned int users;
+    struct page *page;
+};
+
+static struct kmem_cache *dup_cache;
+static DEFINE_HASHTABLE(dup_table, PGSTORE_DUP_HASH_BITS);
+static DEFINE_SPINLOCK(dup_lock);
+
+/* Reserve pool, only touched from process context like the index */
+static LIST_HEAD(pool);
+static unsigned long pool_size;
+static DEFINE_SPINLOCK(pool_lock);
+static struct work_struct refill_work;
+
+/*
+ * Clock over the resident slots of a store with a lower tier. The hand is
+ * the list head: slots are examined from the front and rotated to the
+ * back. Lock order is clock_lock, then slot->lock.
+ */
+static LIST_HEAD(clock);
+static unsigned long clock_size;
+static DEFINE_SPINLOCK(clock_lock);
+
+/* Spill file and its page allocation bitmap, under spill_lock */
+static struct file *spill_file;
+static unsigned long *spill_map;
+static unsigned long spill_hint;
+static DEFINE_SPINLOCK(spill_lock);
+
+/* Eviction and read-back run on separate queues so reads never wait behind a writeback batch */
+static struct workqueue_struct *evict_wq;
+static struct workqueue_struct *fetch_wq;
+/* Set by pgstore_quiesce(), under fetch_lock: no fetch is queued any more */
+static bool fetch_stopped;
+static DEFINE_SPINLOCK(fetch_lock);
+static struct work_struct evict_work;
+static atomic_long_t shrink_goal = ATOMIC_LONG_INIT(0);
+
+/*
+ * Compressed tier. Decompression runs wherever a page is accessed, so
+ * every CPU has its own transform. Compression only runs from the ager
+ * on the ordered eviction queue and has a single output buffer.
+ */
+static struct zpool *comp_pool;
+static struct crypto_comp * __percpu *comp_tfms;
+static u8 *comp_buf;
+static struct delayed_work compress_work;
+
+struct pgstore_fetch {
+    struct work_struct work;
+    struct pgstore_slot *slot;
+    pgstore_fetch_t fn;
+    void *data;
+    ktime_t start;
+};
+
+static atomic_long_t nr_store_pages = ATOMIC_LONG_INIT(0);
+static atomic_long_t nr_spilled_pages = ATOMIC_LONG_INIT(0);
+static atomic_long_t nr_pool_hits = ATOMIC_LONG_INIT(0);
+static atomic_long_t nr_pool_misses = ATOMIC_LONG_INIT(0);
+static atomic_long_t nr_limit_rejects = ATOMIC_LONG_INIT(0);
+static atomic_long_t nr_alloc_failures = ATOMIC_LONG_INIT(0);
+static atomic_long_t nr_spill_writes = ATOMIC_LONG_INIT(0);
+static atomic_long_t nr_spill_cancels = ATOMIC_LONG_INIT(0);
+static atomic_long_t nr_spill_reads = ATOMIC_LONG_INIT(0);
+static atomic_long_t nr_spill_errors = ATOMIC_LONG_INIT(0);
+static atomic64_t fetch_ns_total = ATOMIC64_INIT(0);
+static atomic64_t fetch_ns_max = ATOMIC64_INIT(0);
+static atomic_long_t nr_compressed_pages = ATOMIC_LONG_INIT(0);
+static atomic_long_t nr_compressed_bytes = ATOMIC_LONG_INIT(0);
+static atomic_long_t nr_compress_rejects = ATOMIC_LONG_INIT(0);
+static atomic_long_t nr_get_resident = ATOMIC_LONG_INIT(0);
+static atomic_long_t nr_get_decompressed = ATOMIC_LONG_INIT(0);
+static atomic_long_t nr_get_missed = ATOMIC_LONG_INIT(0);
+static atomic_long_t nr_dup_pages = ATOMIC_LONG_INIT(0);
+static atomic_long_t nr_dup_shares = ATOMIC_LONG_INIT(0); //slots using another slot's page
+
+static struct page* pool_take(void) {
+    struct page *page = NULL;
+    bool low;
+
+    spin_lock(&pool_lock);
+    if (!list_empty(&pool)) {
+        page = list_first_entry(&pool, struct page, lru);
+        list_del(&page->lru);
+        pool_size--;
+    }
+    low = pool_size < pgstore_pool_pages / 2;
+    spin_unlock(&pool_lock);
+
+    if (low)
+        schedule_work(&refill_work);
+
+    return page;
+}
+
+/* Returns false if the pool is full and the caller must free the page */
+static bool pool_give(struct page *page) {
+    bool kept = false;
+
+    spin_lock(&pool_lock);
+    if (pool_size < pgstore_pool_pages) {
+        list_add(&page->lru, &pool);
+        pool_size++;
+        kept = true;
+    }
+    spin_unlock(&pool_lock);
+
+    return kept;
+}
+
+static void pool_refill(struct work_struct *work) {
+    struct page *page;
+
+    for (;;) {
+        spin_lock(&pool_lock);
+        if (pool_size >= pgstore_pool_pages) {
+            spin_unlock(&pool_lock);
+            break;
+        }
+        spin_unlock(&pool_lock);
+
+        page = alloc_page(GFP_KERNEL | __GFP_NOWARN);
+        if (!page)
+            break;
+        if (!pool_give(page)) {
+            __free_page(page);
+            break;
+        }
+    }
+}
+
+static struct page* store_page_alloc(void) {
+    struct page *page = pool_take();
+
+    if (page) {
+        atomic_long_inc(&nr_pool_hits);
+        return page;
+    }
+
+    //the caller may hold a page lock, don't sleep
+    atomic_long_inc(&nr_pool_misses);
+    page = alloc_page(GFP_NOWAIT | __GFP_NOWARN);
+    if (!page)
+        atomic_long_inc(&nr_alloc_failures);
+    return page;
+}
+
+static void store_page_free(struct page *page) {
+    if (!pool_give(page))
+        __free_page(page);
+}
+
+/* Start the clock hand once resident pages pass 7/8 of the limit */
+static void evict_kick(void) {
+    long resident = atomic_long_read(&nr_store_pages);
+
+    if (spill_file && pgstore_max_pages
+            && resident > pgstore_max_pages - pgstore_max_pages / 8)
+        queue_work(evict_wq, &evict_work);
+}
+
+/*
+ * Charge one resident page to the global total. Without force, fails if
+ * the limit would be exceeded; a spilling store then makes room in the
+ * background and the caller retries.
+ */
+static bool mem_charge(bool force) {
+    if (atomic_long_inc_return(&nr_store_pages) > pgstore_max_pages
+            && pgstore_max_pages && !force) {
+        atomic_long_dec(&nr_store_pages);
+        atomic_long_inc(&nr_limit_rejects);
+        evict_kick();
+        return false;
+    }
+
+    evict_kick();
+    return true;
+}
+
+static void mem_uncharge(void) {
+    atomic_long_dec(&nr_store_pages);
+}
+
+/* Charge one slot to tok, unless its limit is hit */
+static bool token_charge(struct hga_token *tok) {
+    long tok_max = token_max_pages(tok);
+
+    if (atomic_long_inc_return(&tok->nr_pages) > tok_max && tok_max) {
+        atomic_long_dec(&tok->nr_pages);
+        atomic_long_inc(&nr_limit_rejects);
+        return false;
+    }
+    return true;
+}
+
+static long spill_idx_alloc(void) {
+    unsigned long idx;
+
+    spin_lock(&spill_lock);
+    idx = find_next_zero_bit(spill_map, pgstore_spill_pages, spill_hint);
+    if (idx >= pgstore_spill_pages)
+        idx = find_first_zero_bit(spill_map, pgstore_spill_pages);
+    if (idx < pgstore_spill_pages) {
+        set_bit(idx, spill_map);
+        spill_hint = idx + 1;
+    }
+    spin_unlock(&spill_lock);
+
+    return idx < pgstore_spill_pages ? (long)idx : -ENOSPC;
+}
+
+static void spill_idx_free(unsigned long idx) {
+    spin_lock(&spill_lock);
+    clear_bit(idx, spill_map);
+    spin_unlock(&spill_lock);
+}
+
+/* Put a resident slot under the clock hand */
+static void clock_add(struct pgstore_slot *slot) {
+    if (!spill_file && !comp_pool)
+        return;
+
+    spin_lock(&clock_lock);
+    if (list_empty(&slot->lru)) {
+        list_add_tail(&slot->lru, &clock);
+        clock_size++;
+    }
+    spin_unlock(&clock_lock);
+}
+
+static void clock_del(struct pgstore_slot *slot) {
+    spin_lock(&clock_lock);
+    if (!list_empty(&slot->lru)) {
+        list_del_init(&slot->lru);
+        clock_size--;
+    }
+    spin_unlock(&clock_lock);
+}
+
+/* Free the compressed copy. slot->lock must be held or the slot unreachable */
+static void comp_drop(struct pgstore_slot *slot) {
+    zpool_free(comp_pool, slot->handle);
+    atomic_long_sub(slot->clen, &nr_compressed_bytes);
+    atomic_long_dec(&nr_compressed_pages);
+}
+
+/*
+ * Turn a compressed slot back into a resident one using page. Does not
+ * sleep. Returns 0, or -EIO if the copy is corrupt and stays compressed.
+ */
+static int slot_decompress(struct pgstore_slot *slot, struct page *page) {
+    unsigned int dlen = PAGE_SIZE;
+    void *src;
+    int ret;
+
+    src = zpool_map_handle(comp_pool, slot->handle, ZPOOL_MM_RO);
+    ret = crypto_comp_decompress(*get_cpu_ptr(comp_tfms), src, slot->clen,
+            page_address(page), &dlen);
+    put_cpu_ptr(comp_tfms);
+    zpool_unmap_handle(comp_pool, slot->handle);
+
+    if (ret || dlen != PAGE_SIZE) {
+        printk(KERN_ERR "failed to decompress stored page");
+        return -EIO;
+    }
+
+    comp_drop(slot);
+    slot->page = page;
+    slot->state = PGSTORE_RESIDENT;
+    return 0;
+}
+
+static u32 dup_hash(const char *data) {
+    return jhash2((const u32*)data, PAGE_SIZE / sizeof(u32), 0);
+}
+
+/* Take a share of a stored page with the same contents, or NULL if there is none */
+static struct pgstore_dup* dup_find(const char *data, u32 hash) {
+    struct pgstore_dup *dup;
+
+    spin_lock(&dup_lock);
+    hash_for_each_possible(dup_table, dup, node, hash) {
+        if (dup->hash == hash && !memcmp(page_address(dup->page), data, PAGE_SIZE)) {
+            dup->users++;
+            atomic_long_inc(&nr_dup_shares);
+            break;
+        }
+    }
+    spin_unlock(&dup_lock);
+
+    return dup;
+}
+
+/* Index the page a slot just got to itself, NULL if there is no memory for it */
+static struct pgstore_dup* dup_index(struct page *page, u32 hash) {
+    struct pgstore_dup *dup = kmem_cache_alloc(dup_cache, GFP_ATOMIC);
+
+    if (!dup)
+        return NULL;
+
+    dup->hash = hash;
+    dup->users = 1;
+    dup->page = page;
+    spin_lock(&dup_lock);
+    hash_add(dup_table, &dup->node, hash);
+    spin_unlock(&dup_lock);
+    atomic_long_inc(&nr_dup_pages);
+    return dup;
+}
+
+/*
+ * Give up a share. The last one takes the page out of the index and
+ * returns it, for the caller to keep or free; otherwise returns NULL.
+ */
+static struct page* dup_release(struct pgstore_dup *dup) {
+    struct page *page = NULL;
+
+    spin_lock(&dup_lock);
+    if (--dup->users == 0) {
+        hash_del(&dup->node);
+        page = dup->page;
+    }
+    spin_unlock(&dup_lock);
+
+    if (!page) {
+        atomic_long_dec(&nr_dup_shares);
+        return NULL;
+    }
+    atomic_long_dec(&nr_dup_pages);
+    kmem_cache_free(dup_cache, dup);
+    return page;
+}
+
+/*
+ * Whether the clock hand may take the page of a slot, with slot->lock
+ * held. A page nobody else shares is taken out of the index first, so
+ * that no share of it is taken while it is written out.
+ */
+static bool dup_evictable(struct pgstore_slot *slot) {
+    struct pgstore_dup *dup = slot->dup;
+
+    if (!dup)
+        return true;
+
+    spin_lock(&dup_lock);
+    if (dup->users > 1) {
+        spin_unlock(&dup_lock);
+        return false;
+    }
+    hash_del(&dup->node);
+    spin_unlock(&dup_lock);
+
+    slot->dup = NULL;
+    atomic_long_dec(&nr_dup_pages);
+    kmem_cache_free(dup_cache, dup);
+    return true;
+}
+
+/*
+ * Index again the page of a slot the clock hand gave back resident, with
+ * slot->lock held.
+ */
+static void dup_reindex(struct pgstore_slot *slot) {
+    if (pgstore_dedup && slot->state == PGSTORE_RESIDENT && slot->page && !slot->dup)
+        slot->dup = dup_index(slot->page, dup_hash(page_address(slot->page)));
+}
+
+static void slot_get(struct pgstore_slot *slot) {
+    atomic_inc(&slot->refcount);
+}
+
+/* Process context only, see pgstore_release */
+static void slot_put(struct pgstore_slot *slot) {
+    if (!atomic_dec_and_test(&slot->refcount))
+        return;
+
+    clock_del(slot);
+    if (slot->dup)
+        slot->page = dup_release(slot->dup);
+    if (slot->page) {
+        store_page_free(slot->page);
+        mem_uncharge();
+    }
+    if (slot->state == PGSTORE_SPILLED) {
+        spill_idx_free(slot->file_idx);
+        atomic_long_dec(&nr_spilled_pages);
+    }
+    if (slot->state == PGSTORE_COMPRESSED)
+        comp_drop(slot);
+    atomic_long_dec(&slot->tok->nr_pages);
+    kmem_cache_free(slot_cache, slot);
+}
+
+static struct pgstore_slot* slot_alloc(struct hga_token *tok) {
+    struct pgstore_slot *slot;
+
+    if (!token_charge(tok))
+        return NULL;
+
+    slot = kmem_cache_alloc(slot_cache, GFP_ATOMIC);
+    if (!slot) {
+        atomic_long_dec(&tok->nr_pages);
+        atomic_long_inc(&nr_alloc_failures);
+        return NULL;
+    }
+
+    spin_lock_init(&slot->lock);
+    atomic_set(&slot->refcount, 1);
+    slot->state = PGSTORE_RESIDENT;
+    slot->referenced = true;
+    slot->pins = 0;
+    slot->page = NULL;
+    slot->dup = NULL;
+    slot->last_access = jiffies;
+    slot->tok = tok;
+    INIT_LIST_HEAD(&slot->lru);
+    return slot;
+}
+
+/*
+ * Store a page worth of data, creating the slot on first use and reusing
+ * its page afterwards. A compressed or spilled page is simply replaced,
+ * its old copy is stale. Contents already stored for another slot are
+ * shared with it instead of copied, see pgstore_dedup. Returns 0, -ENOSPC
+ * if a limit was hit or -ENOMEM. Does not sleep; the owner's lock must be
+ * held.
+ */
+int pgstore_write(struct pgstore_slot **slotp, struct hga_token *tok, const char *data) {
+    struct pgstore_slot *slot = *slotp;
+    struct pgstore_dup *dup = NULL, *old_dup = NULL;
+    struct page *page = NULL;
+    bool dedup = pgstore_dedup, spilled;
+    u32 hash = 0;
+
+    if (!slot) {
+        if (!(slot = slot_alloc(tok)))
+            return -ENOSPC;
+        *slotp = slot;
+    }
+
+    if (dedup) {
+        hash = dup_hash(data);
+        dup = dup_find(data, hash);
+    }
+
+    spin_lock(&slot->lock);
+    //a page being written out is not swapped from under the writer
+    if (dup && (dup == slot->dup || slot->state == PGSTORE_WRITEBACK)) {
+        if (dup == slot->dup) {
+            slot->referenced = true;
+            slot->last_access = jiffies;
+            spin_unlock(&slot->lock);
+            dup_release(dup);
+            return 0;
+        }
+        dup_release(dup);
+        dup = NULL;
+    }
+
+    if (dup) {
+        old_dup = slot->dup;
+        page = old_dup ? NULL : slot->page;
+        spilled = slot->state == PGSTORE_SPILLED;
+        if (spilled)
+            spill_idx_free(slot->file_idx);
+        if (slot->state == PGSTORE_COMPRESSED)
+            comp_drop(slot);
+        //a running read-back notices and backs off
+        slot->state = PGSTORE_RESIDENT;
+        slot->referenced = true;
+        slot->last_access = jiffies;
+        slot->dup = dup;
+        slot->page = dup->page;
+        spin_unlock(&slot->lock);
+
+        if (old_dup)
+            page = dup_release(old_dup);
+        if (spilled)
+            atomic_long_dec(&nr_spilled_pages);
+        if (page) {
+            store_page_free(page);
+            mem_uncharge();
+        }
+        clock_add(slot);
+        return 0;
+    }
+
+    //a shared page is left to the others, an unshared one taken out of the index
+    if (slot->dup) {
+        old_dup = slot->dup;
+        slot->dup = NULL;
+        slot->page = dup_release(old_dup);
+    }
+
+    if (!slot->page) {
+        spin_unlock(&slot->lock);
+        if (!mem_charge(false))
+            return -ENOSPC;
+        if (!(page = store_page_alloc())) {
+            mem_uncharge();
+            return -ENOMEM;
+        }
+        spin_lock(&slot->lock);
+    }
+
+    //attach unless a read-back finished meanwhile
+    if (page && !slot->page) {
+        slot->page = page;
+        page = NULL;
+    }
+
+    spilled = slot->state == PGSTORE_SPILLED;
+    if (spilled)
+        spill_idx_free(slot->file_idx);
+    if (slot->state == PGSTORE_COMPRESSED)
+        comp_drop(slot);
+    //a running writeback or read-back notices and backs off
+    slot->state = PGSTORE_RESIDENT;
+    slot->referenced = true;
+    slot->last_access = jiffies;
+    memcpy(page_address(slot->page), data, PAGE_SIZE);
+    if (dedup)
+        slot->dup = dup_index(slot->page, hash);
+    spin_unlock(&slot->lock);
+
+    if (spilled)
+        atomic_long_dec(&nr_spilled_pages);
+    if (page) {
+        store_page_free(page);
+        mem_uncharge();
+    }
+    clock_add(slot);
+    return 0;
+}
+
+/*
+ * Pin the resident copy and return it, or NULL if the page is spilled and
+ * has to be brought back with pgstore_fetch() first. A compressed page is
+ * decompressed on the spot; if no page can be had without sleeping that
+ * is left to pgstore_fetch() as well. Every non-NULL return must be
+ * paired with pgstore_put().
+ */
+char* pgstore_get(struct pgstore_slot *slot) {
+    struct page *page = NULL;
+    bool decompressed = false;
+    char *data = NULL;
+
+    spin_lock(&slot->lock);
+    if (slot->state == PGSTORE_WRITEBACK)
+        slot->state = PGSTORE_RESIDENT;
+    if (slot->state == PGSTORE_COMPRESSED && (page = store_page_alloc())) {
+        if (!slot_decompress(slot, page)) {
+            decompressed = true;
+            page = NULL;
+        }
+    }
+    if (slot->state == PGSTORE_RESIDENT && slot->page) {
+        slot->pins++;
+        slot->referenced = true;
+        slot->last_access = jiffies;
+        data = page_address(slot->page);
+    }
+    spin_unlock(&slot->lock);
+
+    if (page)
+        store_page_free(page);
+    if (decompressed) {
+        mem_charge(true);
+        clock_add(slot);
+        atomic_long_inc(&nr_get_decompressed);
+    } else {
+        atomic_long_inc(data ? &nr_get_resident : &nr_get_missed);
+    }
+
+    return data;
+}
+
+void pgstore_put(struct pgstore_slot *slot) {
+    spin_lock(&slot->lock);
+    slot->pins--;
+    spin_unlock(&slot->lock);
+}
+
+static void fetch_account(ktime_t start) {
+    s64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+    s64 max;
+
+    atomic64_add(ns, &fetch_ns_total);
+    while (ns > (max = atomic64_read(&fetch_ns_max))) {
+        if (atomic64_cmpxchg(&fetch_ns_max, max, ns) == max)
+            break;
+    }
+}
+
+static void fetch_work_fn(struct work_struct *work) {
+    struct pgstore_fetch *fetch = container_of(work, struct pgstore_fetch, work);
+    struct pgstore_slot *slot = fetch->slot;
+    struct page *page;
+    unsigned long idx;
+    int err = 0;
+
+    spin_lock(&slot->lock);
+    if (slot->state == PGSTORE_COMPRESSED) {
+        //pgstore_get() could not get a page without sleeping
+        spin_unlock(&slot->lock);
+        page = alloc_page(GFP_KERNEL);
+        spin_lock(&slot->lock);
+        if (page && slot->state == PGSTORE_COMPRESSED) {
+            err = slot_decompress(slot, page);
+            if (!err)
+                page = NULL;
+        }
+        spin_unlock(&slot->lock);
+        if (page)
+            __free_page(page);
+        else if (!err) {
+            mem_charge(true);
+            clock_add(slot);
+        }
+        goto done;
+    }
+    if (slot->state != PGSTORE_SPILLED) {
+        //a commit or an earlier fetch got there first
+        spin_unlock(&slot->lock);
+        goto done;
+    }
+    slot->state = PGSTORE_READING;
+    idx = slot->file_idx;
+    spin_unlock(&slot->lock);
+
+    page = alloc_page(GFP_KERNEL);
+    if (!page)
+        err = -ENOMEM;
+    else if (kernel_read(spill_file, (loff_t)idx << PAGE_SHIFT,
+                page_address(page), PAGE_SIZE) != PAGE_SIZE)
+        err = -EIO;
+
+    spin_lock(&slot->lock);
+    if (slot->state != PGSTORE_READING) {
+        //replaced by a commit while the read was in flight
+        spin_unlock(&slot->lock);
+        if (page)
+            __free_page(page);
+        goto done;
+    }
+    if (err) {
+        slot->state = PGSTORE_SPILLED;
+        spin_unlock(&slot->lock);
+        if (page)
+            __free_page(page);
+        atomic_long_inc(&nr_spill_errors);
+        goto done;
+    }
+    slot->page = page;
+    slot->state = PGSTORE_RESIDENT;
+    slot->referenced = true;
+    spin_unlock(&slot->lock);
+
+    spill_idx_free(idx);
+    atomic_long_dec(&nr_spilled_pages);
+    atomic_long_inc(&nr_spill_reads);
+    mem_charge(true);
+    clock_add(slot);
+    fetch_account(fetch->start);
+
+done:
+    fetch->fn(slot, err, fetch->data);
+    slot_put(slot);
+    kfree(fetch);
+}
+
+/*
+ * Bring a spilled page back into memory. fn is called from a workqueue
+ * once the page is resident or the read failed; it should pgstore_get()
+ * the page again, since the page may be spilled once more by the time the
+ * caller gets to it. Returns 0, -ENOMEM, or -ESHUTDOWN once the store is
+ * quiesced.
+ */
+int pgstore_fetch(struct pgstore_slot *slot, pgstore_fetch_t fn, void *data) {
+    struct pgstore_fetch *fetch = kmalloc(sizeof(*fetch), GFP_ATOMIC);
+
+    if (!fetch) {
+        atomic_long_inc(&nr_alloc_failures);
+        return -ENOMEM;
+    }
+
+    slot_get(slot);
+    fetch->slot = slot;
+    fetch->fn = fn;
+    fetch->data = data;
+    fetch->start = ktime_get();
+    INIT_WORK(&fetch->work, fetch_work_fn);
+
+    spin_lock_bh(&fetch_lock);
+    if (fetch_stopped) {
+        spin_unlock_bh(&fetch_lock);
+        slot_put(slot);
+        kfree(fetch);
+        return -ESHUTDOWN;
+    }
+    queue_work(fetch_wq, &fetch->work);
+    spin_unlock_bh(&fetch_lock);
+    return 0;
+}
+
+/*
+ * Drop the owner's slot. The directory frees its entries from a work
+ * item, not from their RCU callbacks, so this is never called with
+ * bottom halves disabled and the locks it takes are plain spinlocks.
+ */
+void pgstore_release(struct pgstore_slot *slot) {
+    if (slot)
+        slot_put(slot);
+}
+
+typedef bool (*clock_pick_t)(struct pgstore_slot *slot);
+
+/*
+ * Advance the clock hand, at most *budget slots, to the first unpinned
+ * resident slot pick() accepts. The slot is taken off the clock in the
+ * writeback state with a reference held for the caller; a commit or
+ * pgstore_get() meanwhile flips it back to resident. Returns NULL when
+ * the budget runs out.
+ */
+static struct pgstore_slot* clock_isolate(clock_pick_t pick, unsigned long *budget) {
+    struct pgstore_slot *slot, *victim = NULL;
+
+    spin_lock(&clock_lock);
+    while (!list_empty(&clock) && *budget) {
+        (*budget)--;
+        slot = list_first_entry(&clock, struct pgstore_slot, lru);
+        list_move_tail(&slot->lru, &clock);
+
+        spin_lock(&slot->lock);
+        if (slot->pins || slot->state != PGSTORE_RESIDENT || !pick(slot)
+                || !dup_evictable(slot)) {
+            spin_unlock(&slot->lock);
+            continue;
+        }
+        slot->state = PGSTORE_WRITEBACK;
+        spin_unlock(&slot->lock);
+
+        list_del_init(&slot->lru);
+        clock_size--;
+        slot_get(slot);
+        victim = slot;
+        break;
+    }
+    spin_unlock(&clock_lock);
+
+    return victim;
+}
+
+/* Second chance: skip a slot referenced since the hand last passed */
+static bool pick_unreferenced(struct pgstore_slot *slot) {
+    if (slot->referenced) {
+        slot->referenced = false;
+        return false;
+    }
+    return true;
+}
+
+static bool pick_idle(struct pgstore_slot *slot) {
+    return time_after(jiffies, slot->last_access
+            + msecs_to_jiffies(pgstore_compress_idle_ms));
+}
+
+/*
+ * Move the page of the next cold slot to the spill file. Returns 0 when
+ * no slot could be evicted.
+ */
+static int clock_evict_one(void) {
+    unsigned long budget = 2 * clock_size;
+    struct pgstore_slot *victim;
+    struct page *page;
+    long idx;
+    bool spilled = false;
+
+    victim = clock_isolate(pick_unreferenced, &budget);
+    if (!victim)
+        return 0;
+
+    /*
+     * The page stays attached during the write. A commit or pgstore_get()
+     * meanwhile flips the state back to resident and the copy is dropped.
+     */
+    page = victim->page;
+    idx = spill_idx_alloc();
+    if (idx >= 0 && kernel_write(spill_file, page_address(page), PAGE_SIZE,
+                (loff_t)idx << PAGE_SHIFT) != PAGE_SIZE) {
+        atomic_long_inc(&nr_spill_errors);
+        spill_idx_free(idx);
+        idx = -EIO;
+    }
+
+    spin_lock(&victim->lock);
+    if (victim->state == PGSTORE_WRITEBACK) {
+        if (idx >= 0) {
+            victim->state = PGSTORE_SPILLED;
+            victim->file_idx = idx;
+            victim->page = NULL;
+            spilled = true;
+        } else {
+            victim->state = PGSTORE_RESIDENT;
+        }
+    }
+    if (!spilled)
+        dup_reindex(victim);
+    spin_unlock(&victim->lock);
+
+    if (spilled) {
+        store_page_free(page);
+        mem_uncharge();
+        atomic_long_inc(&nr_spilled_pages);
+        atomic_long_inc(&nr_spill_writes);
+    } else {
+        if (idx >= 0) {
+            spill_idx_free(idx);
+            atomic_long_inc(&nr_spill_cancels);
+        }
+        clock_add(victim);
+    }
+    slot_put(victim);
+
+    return idx >= 0 ? 1 : 0;
+}
+
+/* Replace the page of an isolated slot by a compressed copy */
+static void compress_one(struct pgstore_slot *victim) {
+    struct page *page = victim->page;
+    unsigned int clen = 2 * PAGE_SIZE;
+    unsigned long handle;
+    bool compressed = false;
+    void *dst;
+    int ret;
+
+    ret = crypto_comp_compress(*get_cpu_ptr(comp_tfms), page_address(page),
+            PAGE_SIZE, comp_buf, &clen);
+    put_cpu_ptr(comp_tfms);
+
+    if (ret || clen > PGSTORE_COMPRESS_MAX) {
+        atomic_long_inc(&nr_compress_rejects);
+        goto putback;
+    }
+    if (zpool_malloc(comp_pool, clen, __GFP_NORETRY | __GFP_NOWARN, &handle)) {
+        atomic_long_inc(&nr_alloc_failures);
+        goto putback;
+    }
+    dst = zpool_map_handle(comp_pool, handle, ZPOOL_MM_WO);
+    memcpy(dst, comp_buf, clen);
+    zpool_unmap_handle(comp_pool, handle);
+
+    spin_lock(&victim->lock);
+    if (victim->state == PGSTORE_WRITEBACK) {
+        victim->state = PGSTORE_COMPRESSED;
+        victim->handle = handle;
+        victim->clen = clen;
+        victim->page = NULL;
+        compressed = true;
+    }
+    spin_unlock(&victim->lock);
+
+    if (compressed) {
+        store_page_free(page);
+        mem_uncharge();
+        atomic_long_inc(&nr_compressed_pages);
+        atomic_long_add(clen, &nr_compressed_bytes);
+        slot_put(victim);
+        return;
+    }
+    zpool_free(comp_pool, handle);
+
+putback:
+    spin_lock(&victim->lock);
+    if (victim->state == PGSTORE_WRITEBACK)
+        victim->state = PGSTORE_RESIDENT;
+    //touched during compression, or incompressible; look again later
+    victim->last_access = jiffies;
+    dup_reindex(victim);
+    spin_unlock(&victim->lock);
+    clock_add(victim);
+    slot_put(victim);
+}
+
+/* One pass of the ager over the clock, then rearm */
+static void compress_work_fn(struct work_struct *work) {
+    unsigned long budget = clock_size;
+    struct pgstore_slot *victim;
+
+    while ((victim = clock_isolate(pick_idle, &budget))) {
+        compress_one(victim);
+        cond_resched();
+    }
+
+    queue_delayed_work(evict_wq, &compress_work, PGSTORE_COMPRESS_INTERVAL);
+}
+
+/* Evict down to 3/4 of the limit, plus whatever the shrinker asked for */
+static void evict_work_fn(struct work_struct *work) {
+    long low = pgstore_max_pages - pgstore_max_pages / 4;
+
+    for (;;) {
+        bool over = pgstore_max_pages && atomic_long_read(&nr_store_pages) > low;
+
+        if (!over && atomic_long_read(&shrink_goal) <= 0)
+            break;
+        if (!clock_evict_one())
+            break;
+        if (!over)
+            atomic_long_dec(&shrink_goal);
+        cond_resched();
+    }
+    atomic_long_set(&shrink_goal, 0);
+}
+
+static unsigned long store_shrink_count(struct shrinker *shrink,
+        struct shrink_control *sc) {
+    return pool_size + (spill_file ? clock_size : 0);
+}
+
+/*
+ * The pool is freed right away. Resident pages are only evicted from the
+ * eviction worker, since writing the spill file from reclaim could
+ * recurse into the filesystem.
+ */
+static unsigned long store_shrink_scan(struct shrinker *shrink,
+        struct shrink_control *sc) {
+    unsigned long freed = 0;
+    struct page *page;
+
+    spin_lock(&pool_lock);
+    while (freed < sc->nr_to_scan && !list_empty(&pool)) {
+        page = list_first_entry(&pool, struct page, lru);
+        list_del(&page->lru);
+        pool_size--;
+        spin_unlock(&pool_lock);
+        __free_page(page);
+        freed++;
+        spin_lock(&pool_lock);
+    }
+    spin_unlock(&pool_lock);
+
+    if (spill_file && freed < sc->nr_to_scan) {
+        atomic_long_add(sc->nr_to_scan - freed, &shrink_goal);
+        queue_work(evict_wq, &evict_work);
+    }
+
+    return freed ? freed : SHRINK_STOP;
+}
+
+static struct shrinker store_shrinker = {
+    .count_objects = store_shrink_count,
+    .scan_objects = store_shrink_scan,
+    .seeks = DEFAULT_SEEKS,
+};
+
+static int pgstore_stats_show(struct seq_file *m, void *data) {
+    long reads = atomic_long_read(&nr_spill_reads);
+    long compressed = atomic_long_read(&nr_compressed_pages);
+    long comp_bytes = atomic_long_read(&nr_compressed_bytes);
+
+    seq_printf(m, "store_pages %ld\n", atomic_long_read(&nr_store_pages));
+    seq_printf(m, "max_pages %lu\n", pgstore_max_pages);
+    seq_printf(m, "pool_pages %lu\n", pool_size);
+    seq_printf(m, "pool_hits %ld\n", atomic_long_read(&nr_pool_hits));
+    seq_printf(m, "pool_misses %ld\n", atomic_long_read(&nr_pool_misses));
+    seq_printf(m, "limit_rejects %ld\n", atomic_long_read(&nr_limit_rejects));
+    seq_printf(m, "alloc_failures %ld\n", atomic_long_read(&nr_alloc_failures));
+    seq_printf(m, "spilled_pages %ld\n", atomic_long_read(&nr_spilled_pages));
+    seq_printf(m, "spill_writes %ld\n", atomic_long_read(&nr_spill_writes));
+    seq_printf(m, "spill_cancels %ld\n", atomic_long_read(&nr_spill_cancels));
+    seq_printf(m, "spill_reads %ld\n", reads);
+    seq_printf(m, "spill_errors %ld\n", atomic_long_read(&nr_spill_errors));
+    seq_printf(m, "fetch_avg_us %lld\n", reads ?
+            div64_s64(atomic64_read(&fetch_ns_total), reads * NSEC_PER_USEC) : 0);
+    seq_printf(m, "fetch_max_us %lld\n",
+            div64_s64(atomic64_read(&fetch_ns_max), NSEC_PER_USEC));
+    seq_printf(m, "compressed_pages %ld\n", compressed);
+    seq_printf(m, "compressed_bytes %ld\n", comp_bytes);
+    seq_printf(m, "compress_ratio_pct %ld\n", comp_bytes ?
+            compressed * PAGE_SIZE * 100 / comp_bytes : 0);
+    seq_printf(m, "compress_pool_bytes %llu\n",
+            comp_pool ? zpool_get_total_size(comp_pool) : 0);
+    seq_printf(m, "compress_rejects %ld\n", atomic_long_read(&nr_compress_rejects));
+    seq_printf(m, "get_resident %ld\n", atomic_long_read(&nr_get_resident));
+    seq_printf(m, "get_decompressed %ld\n", atomic_long_read(&nr_get_decompressed));
+    seq_printf(m, "get_missed %ld\n", atomic_long_read(&nr_get_missed));
+    seq_printf(m, "dedup_pages %ld\n", atomic_long_read(&nr_dup_pages));
+    seq_printf(m, "dedup_shares %ld\n", atomic_long_read(&nr_dup_shares));
+    return 0;
+}
+
+static int spill_init(void) {
+    if (!pgstore_spill_path[0])
+        return 1;
+
+    spill_map = vzalloc(BITS_TO_LONGS(pgstore_spill_pages) * sizeof(unsigned long));
+    if (!spill_map)
+        return 0;
+
+    spill_file = filp_open(pgstore_spill_path, O_RDWR | O_CREAT | O_LARGEFILE, 0600);
+    if (IS_ERR(spill_file)) {
+        printk(KERN_ERR "failed to open spill file %s: %ld",
+                pgstore_spill_path, PTR_ERR(spill_file));
+        spill_file = NULL;
+        vfree(spill_map);
+        return 0;
+    }
+
+    return 1;
+}
+
+static void spill_exit(void) {
+    if (!spill_file)
+        return;
+
+    filp_close(spill_file, NULL);
+    spill_file = NULL;
+    vfree(spill_map);
+}
+
+static void comp_exit(void) {
+    int cpu;
+
+    if (comp_tfms) {
+        for_each_possible_cpu(cpu) {
+            struct crypto_comp *tfm = *per_cpu_ptr(comp_tfms, cpu);
+
+            if (tfm && !IS_ERR(tfm))
+                crypto_free_comp(tfm);
+        }
+        free_percpu(comp_tfms);
+        comp_tfms = NULL;
+    }
+    kfree(comp_buf);
+    comp_buf = NULL;
+    if (comp_pool)
+        zpool_destroy_pool(comp_pool);
+    comp_pool = NULL;
+}
+
+/*
+ * Set up the compressed tier. The store works without it, so a missing
+ * compressor or allocator only disables compression.
+ */
+static void comp_init(void) {
+    int cpu;
+
+    if (!pgstore_compress_idle_ms)
+        return;
+
+    comp_tfms = alloc_percpu(struct crypto_comp *);
+    comp_buf = kmalloc(2 * PAGE_SIZE, GFP_KERNEL);
+    if (!comp_tfms || !comp_buf)
+        goto fail;
+
+    for_each_possible_cpu(cpu) {
+        struct crypto_comp *tfm = crypto_alloc_comp(pgstore_compressor, 0, 0);
+
+        *per_cpu_ptr(comp_tfms, cpu) = tfm;
+        if (IS_ERR(tfm))
+            goto fail;
+    }
+
+    comp_pool = zpool_create_pool(pgstore_zpool, "hga_pgstore",
+            __GFP_NORETRY | __GFP_NOWARN, NULL);
+    if (!comp_pool)
+        goto fail;
+
+    queue_delayed_work(evict_wq, &compress_work, PGSTORE_COMPRESS_INTERVAL);
+    return;
+
+fail:
+    printk(KERN_ERR "compressed page tier unavailable (%s/%s)",
+            pgstore_compressor, pgstore_zpool);
+    comp_exit();
+}
+
+int pgstore_init(void) {
+    slot_cache = kmem_cache_create("hga_pgstore_slot",
+            sizeof(struct pgstore_slot), 0, SLAB_HWCACHE_ALIGN, NULL);
+    if (!slot_cache)
+        return 0;
+    dup_cache = kmem_cache_create("hga_pgstore_dup",
+            sizeof(struct pgstore_dup), 0, 0, NULL);
+    if (!dup_cache)
+        goto fail_wq;
+
+    evict_wq = alloc_ordered_workqueue("hga_evict", WQ_MEM_RECLAIM);
+    fetch_wq = alloc_workqueue("hga_fetch", WQ_MEM_RECLAIM | WQ_HIGHPRI, 0);
+    if (!evict_wq || !fetch_wq)
+        goto fail_wq;
+
+    if (!spill_init())
+        goto fail_wq;
+
+    INIT_WORK(&evict_work, evict_work_fn);
+    INIT_DELAYED_WORK(&compress_work, compress_work_fn);
+    INIT_WORK(&refill_work, pool_refill);
+    pool_refill(&refill_work);
+
+    if (register_shrinker(&store_shrinker)) {
+        printk(KERN_ERR "failed to register page store shrinker");
+        goto fail_shrinker;
+    }
+
+    comp_init();
+
+    stats_create_file("pgstore", pgstore_stats_show, NULL);
+    return 1;
+
+fail_shrinker:
+    spill_exit();
+fail_wq:
+    if (fetch_wq)
+        destroy_workqueue(fetch_wq);
+    if (evict_wq)
+        destroy_workqueue(evict_wq);
+    kmem_cache_destroy(dup_cache);
+    kmem_cache_destroy(slot_cache);
+    return 0;
+}
+
+/*
+ * First step of unloading, while the servers and the page directory are
+ * still up: refuse new fetches and wait out the ones in flight, whose
+ * completions hand their replies to the servers and hold directory
+ * entries. pgstore_exit() tears the store down once both are gone.
+ */
+void pgstore_quiesce(void) {
+    spin_lock_bh(&fetch_lock);
+    fetch_stopped = true;
+    spin_unlock_bh(&fetch_lock);
+
+    flush_workqueue(fetch_wq);
+}
+
+/* All slots must have been released */
+void pgstore_exit(void) {
+    struct page *page, *tmp;
+
+    unregister_shrinker(&store_shrinker);
+    cancel_work_sync(&refill_work);
+    cancel_delayed_work_sync(&compress_work);
+    destroy_workqueue(evict_wq);
+    destroy_workqueue(fetch_wq);
+    spill_exit();
+    comp_exit();
+
+    list_for_each_entry_safe(page, tmp, &pool, lru) {
+        list_del(&page->lru);
+        __free_page(page);
+    }
+    pool_size = 0;
+
+    kmem_cache_destroy(dup_cache);
+    kmem_cache_destroy(slot_cache);
+}
@@ -0,0 +1,83 @@
+#ifndef HGA_PGSTORE
+#define HGA_PGSTORE
+
+#include <linux/mm.h>
+#include <linux/gfp.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/atomic.h>
+#include <linux/jiffies.h>
+#include <linux/types.h>
+#include "../tokens/tokens.h"
+
+struct pgstore_dup;
+
+/*
+ * Server-side storage of shared page contents.
+ *
+ * A mapped_page gets a slot on its first commit. The slot holds a whole
+ * struct page that is then overwritten in place, so the commit path does
+ * not allocate in steady state. First-time allocations come from a
+ * reserve pool refilled in the background; the pool is given back to the
+ * system through a shrinker under memory pressure.
+ *
+ * Resident pages of a store with a lower tier are kept on a clock. Pages
+ * idle for pgstore_compress_idle_ms are compressed into a zpool and
+ * decompressed in place by the next pgstore_get(). If a spill file is
+ * configured, once the resident total nears pgstore_max_pages (or the
+ * shrinker asks for memory) the clock hand writes cold pages out to the
+ * file and frees them. A spilled page is read back asynchronously by
+ * pgstore_fetch(), so no directory lock is ever held across file I/O.
+ * Compressed pages are already small and are not spilled.
+ *
+ * A slot is charged to its token for as long as it exists, whichever tier
+ * its page is on; a token over its limit cannot create slots. Resident
+ * pages are charged to the global total. Without a spill file, a commit
+ * that would exceed either limit fails instead of growing the store.
+ *
+ * With pgstore_dedup, resident pages are indexed by a hash of their
+ * contents, and a write of contents already stored takes a share of that
+ * page instead of a copy: the global total then counts each unique page
+ * once. A shared page is never changed in place; a write of new contents
+ * gives up the share and takes a page of its own. Shared pages are kept
+ * resident.
+ */
+enum pgstore_state {
+    PGSTORE_RESIDENT,
+    PGSTORE_WRITEBACK, //resident, being compressed or copied to the spill file
+    PGSTORE_COMPRESSED,
+    PGSTORE_SPILLED,
+    PGSTORE_READING, //spilled, being read back
+};
+
+struct pgstore_slot {
+    spinlock_t lock;
+    atomic_t refcount;
+    enum pgstore_state state;
+    bool referenced; //touched since the clock hand last passed
+    unsigned int pins; //pgstore_get() users, not evictable while nonzero
+
+    struct page *page; //resident copy
+    struct pgstore_dup *dup; //index entry of page, NULL if not indexed
+    unsigned long handle; //zpool copy, while compressed
+    unsigned int clen;
+    unsigned long file_idx; //spill file page, while spilled
+    unsigned long last_access; //jiffies
+    struct hga_token *tok;
+
+    struct list_head lru; //clock position, resident slots only
+};
+
+/* Completion of pgstore_fetch(), err is 0 if the page is now resident */
+typedef void (*pgstore_fetch_t)(struct pgstore_slot *slot, int err, void *data);
+
+int pgstore_init(void);
+void pgstore_quiesce(void);
+void pgstore_exit(void);
+
+int pgstore_write(struct pgstore_slot **slotp, struct hga_token *tok, const char *data);
+char* pgstore_get(struct pgstore_slot *slot);
+void pgstore_put(struct pgstore_slot *slot);
+int pgstore_fetch(struct pgstore_slot *slot, pgstore_fetch_t fn, void *data);
+void pgstore_release(struct pgstore_slot *slot);
+#endif
@@ -0,0 +1,321 @@
+#include <linux/module.h>
+#include <linux/slab.h>
+#include "proxy.h"
+#include "../hashtable/hashtable.h"
+#include "../ev_handlers/ev_handlers.h"
+#include "../tokens/tokens.h"
+#include "../stats/stats.h"
+
+static char *proxy_upstream_ip = "";
+module_param(proxy_upstream_ip, charp, S_IRUGO);
+MODULE_PARM_DESC(proxy_upstream_ip, "Home server to proxy for (empty: run as a home server)");
+
+static int proxy_upstream_ports[SHARD_MAX_LOCAL];
+static int nr_proxy_upstream_ports = 0;
+module_param_array(proxy_upstream_ports, int, &nr_proxy_upstream_ports, S_IRUGO);
+MODULE_PARM_DESC(proxy_upstream_ports, "Home server port of each local shard (default: server_ports)");
+
+static atomic_long_t nr_hits;
+static atomic_long_t nr_forwards;
+static atomic_long_t nr_invalidations;
+static atomic_long_t nr_updates;
+static atomic_long_t nr_failures;
+
+/* Message from the home server, copied for the shard's server thread */
+struct proxy_msg {
+    struct hga_shard *shard;
+    unsigned char code;
+    unsigned long vaddr;
+    pid_t token;
+    bool has_data;
+    char data[];
+};
+
+bool proxy_enabled(void) {
+    return proxy_upstream_ip[0] != '\0';
+}
+
+void proxy_note_hit(void) {
+    atomic_long_inc(&nr_hits);
+}
+
+/*
+ * Send a request for a local client to the home server. The proxy takes
+ * part in the home server as one client, so the client's own pid and pgd
+ * stay here. Returns 1 if the request was sent, 0 otherwise.
+ */
+int proxy_forward(struct hga_shard *shard, comm_opcode_t opcode,
+        pid_t token, unsigned long vaddr, char *pagedata) {
+    if (!shard->upstream || comm_link_request(shard->upstream, opcode,
+                vaddr, 0, token, NULL, pagedata) < 0) {
+        atomic_long_inc(&nr_failures);
+        return 0;
+    }
+    atomic_long_inc(&nr_forwards);
+    return 1;
+}
+
+/* Another node is writing: stop local reads until its RESUME_READ */
+static void proxy_lock_read(struct comm_ctx *ctx, struct mapped_page *pf_entry,
+        struct proxy_msg *msg) {
+    spin_lock(&pf_entry->lock);
+    pf_entry->locked = true;
+    pf_entry->proxy_state = PROXY_FETCHING;
+    spin_unlock(&pf_entry->lock);
+
+    atomic_long_inc(&nr_invalidations);
+    fanout_lock_read(ctx, pf_entry, msg->token, msg->vaddr, -1);
+}
+
+/*
+ * New contents, after a remote commit or in reply to a forwarded
+ * INITIAL_READ. If the page cannot be cached it is still passed on, and
+ * the next read goes upstream again.
+ */
+static void proxy_resume_read(struct comm_ctx *ctx, struct mapped_page *pf_entry,
+        struct proxy_msg *msg) {
+    struct hga_token *tok = token_get(msg->token, GFP_KERNEL);
+    char *page = NULL;
+    int skip;
+
+    spin_lock(&pf_entry->lock);
+    if (msg->has_data && tok && pgstore_write(&(pf_entry->store), tok, msg->data) == 0)
+        page = pgstore_get(pf_entry->store);
+    pf_entry->proxy_state = (msg->has_data && !page) ? PROXY_NONE : PROXY_VALID;
+    if (msg->has_data)
+        pf_entry->version++;
+    //a local writer already has its own data
+    skip = pf_entry->writer;
+    spin_unlock(&pf_entry->lock);
+
+    atomic_long_inc(&nr_updates);
+    fanout_resume_read(ctx, pf_entry, msg->token, msg->vaddr,
+            page ? page : (msg->has_data ? msg->data : NULL), skip);
+    if (page)
+        pgstore_put(pf_entry->store);
+
+    spin_lock(&pf_entry->lock);
+    pf_entry->locked = false;
+    spin_unlock(&pf_entry->lock);
+
+    waitq_serve(ctx, msg->shard, pf_entry, msg->token, msg->vaddr);
+}
+
+/*
+ * The writer went away before its write was allowed. Release the home
+ * server's lock by committing the cached copy back unchanged.
+ */
+static void proxy_abort_write(struct comm_ctx *ctx, struct mapped_page *pf_entry,
+        struct proxy_msg *msg) {
+    char *page = NULL;
+
+    spin_lock(&pf_entry->lock);
+    if (pf_entry->store)
+        page = pgstore_get(pf_entry->store);
+    spin_unlock(&pf_entry->lock);
+
+    if (!page || !proxy_forward(msg->shard, OPCODE_COMMIT_PAGE, msg->token, msg->vaddr, page))
+        printk(KERN_ERR "proxy: could not release an abandoned write");
+    fanout_resume_read(ctx, pf_entry, msg->token, msg->vaddr, page, -1);
+    if (page)
+        pgstore_put(pf_entry->store);
+
+    spin_lock(&pf_entry->lock);
+    pf_entry->locked = false;
+    pf_entry->writer = -1;
+    spin_unlock(&pf_entry->lock);
+
+    waitq_serve(ctx, msg->shard, pf_entry, msg->token, msg->vaddr);
+}
+
+/* The home server granted a forwarded REQUEST_WRITE */
+static void proxy_allow_write(struct comm_ctx *ctx, struct mapped_page *pf_entry,
+        struct proxy_msg *msg) {
+    struct socket *writer_sock;
+    pid_t writer_pid;
+    pgd_t *writer_pgd;
+    int writer;
+
+    spin_lock(&pf_entry->lock);
+    writer = pf_entry->writer;
+    spin_unlock(&pf_entry->lock);
+
+    if (writer < 0)
+        return;
+
+    writer_sock = comm_node_socket(ctx, writer);
+    if (fanout_lock_read(ctx, pf_entry, msg->token, msg->vaddr, writer) == -1
+            || !writer_sock
+            || !lookup_client_entry(msg->token, writer, &writer_pid, &writer_pgd)
+            || comm_allow_write(ctx, writer_sock, msg->vaddr, writer_pid,
+                msg->token, writer_pgd) == -1)
+        proxy_abort_write(ctx, pf_entry, msg);
+}
+
+/*
+ * The home server refused a forwarded request. Undo what the request
+ * started; the reply does not say which request it was, but a page has
+ * at most one outstanding.
+ */
+static void proxy_failed(struct comm_ctx *ctx, struct mapped_page *pf_entry,
+        struct proxy_msg *msg) {
+    atomic_long_inc(&nr_failures);
+
+    spin_lock(&pf_entry->lock);
+    if (pf_entry->writer >= 0) {
+        //REQUEST_WRITE; keep the lock if a remote writer holds it
+        pf_entry->writer = -1;
+        if (pf_entry->proxy_state != PROXY_FETCHING)
+            pf_entry->locked = false;
+    } else if (!pf_entry->locked) {
+        //INITIAL_READ or COMMIT_PAGE; stop trusting the cached copy
+        pf_entry->proxy_state = PROXY_NONE;
+    }
+    spin_unlock(&pf_entry->lock);
+
+    waitq_serve(ctx, msg->shard, pf_entry, msg->token, msg->vaddr);
+}
+
+/* Runs on the shard's server thread, which owns the client sockets */
+static void proxy_dispatch(struct comm_ctx *ctx, void *data) {
+    struct proxy_msg *msg = data;
+    struct mapped_page *pf_entry;
+
+    pf_entry = find_mapped_page(msg->token, comm_page_key(msg->vaddr));
+    if (!pf_entry) {
+        //dropped since; there is nobody to pass the message on to
+        kfree(msg);
+        return;
+    }
+
+    switch (msg->code) {
+    case OPCODE_LOCK_READ_CODE:
+        proxy_lock_read(ctx, pf_entry, msg);
+        break;
+    case OPCODE_RESUME_READ_CODE:
+        proxy_resume_read(ctx, pf_entry, msg);
+        break;
+    case OPCODE_ALLOW_WRITE_CODE:
+        proxy_allow_write(ctx, pf_entry, msg);
+        break;
+    default:
+        proxy_failed(ctx, pf_entry, msg);
+        break;
+    }
+
+    put_mapped_page(pf_entry);
+    kfree(msg);
+}
+
+/*
+ * Runs on the link thread. The home server waits for the acknowledgement
+ * of each message with a short timeout, so the ack is sent right away and
+ * the work is done later on the server thread.
+ */
+static comm_ackcode_t proxy_link_handler(struct comm_link *link, comm_code_t mcode,
+        unsigned long vaddr, pid_t client_pid, pid_t token, pgd_t *pgd,
+        char *pagedata, void *data) {
+    struct proxy_msg *msg;
+    comm_ackcode_t ack_code;
+
+    switch (mcode.code) {
+    case OPCODE_PING_ALIVE_CODE:
+        return ACKCODE_PING_ALIVE;
+    case OPCODE_LOCK_READ_CODE:
+        ack_code = ACKCODE_LOCK_READ;
+        break;
+    case OPCODE_RESUME_READ_CODE:
+        ack_code = ACKCODE_RESUME_READ;
+        break;
+    case OPCODE_ALLOW_WRITE_CODE:
+        ack_code = ACKCODE_ALLOW_WRITE;
+        break;
+    default:
+        //replies to forwarded requests, only failures need handling
+        if (mcode.code != ACKCODE_OP_FAILURE.code)
+            return ACKCODE_NO_RESPONSE;
+        ack_code = ACKCODE_NO_RESPONSE;
+        break;
+    }
+
+    msg = kmalloc(sizeof(*msg) + (pagedata ? PAGE_SIZE : 0), GFP_KERNEL);
+    if (!msg)
+        goto fail;
+    msg->shard = data;
+    msg->code = mcode.code;
+    msg->vaddr = vaddr;
+    msg->token = token;
+    msg->has_data = pagedata != NULL;
+    if (pagedata)
+        memcpy(msg->data, pagedata, PAGE_SIZE);
+
+    if (comm_defer(link->ctx, proxy_dispatch, msg, GFP_KERNEL) < 0) {
+        kfree(msg);
+        goto fail;
+    }
+    return ack_code;
+
+fail:
+    atomic_long_inc(&nr_failures);
+    return (ack_code.code == ACKCODE_NO_RESPONSE.code) ? ack_code : ACKCODE_OP_FAILURE;
+}
+
+static int proxy_stats_show(struct seq_file *m, void *data) {
+    seq_printf(m, "upstream %s\n", proxy_upstream_ip);
+    seq_printf(m, "hits %ld\n", atomic_long_read(&nr_hits));
+    seq_printf(m, "forwards %ld\n", atomic_long_read(&nr_forwards));
+    seq_printf(m, "invalidations %ld\n", atomic_long_read(&nr_invalidations));
+    seq_printf(m, "updates %ld\n", atomic_long_read(&nr_updates));
+    seq_printf(m, "failures %ld\n", atomic_long_read(&nr_failures));
+    return 0;
+}
+
+/*
+ * Link every running local shard to its home server. Returns 1 (also
+ * when not running as a proxy), or 0 if a link could not be made.
+ */
+int proxy_start(void) {
+    int i;
+
+    if (!proxy_enabled())
+        return 1;
+
+    if (nr_proxy_upstream_ports && nr_proxy_upstream_ports != shards_local_count()) {
+        printk(KERN_ERR "proxy: %d upstream ports for %d shards",
+                nr_proxy_upstream_ports, shards_local_count());
+        return 0;
+    }
+
+    for (i = 0; i < shards_local_count(); i++) {
+        struct hga_shard *shard = shard_local(i);
+        int port = nr_proxy_upstream_ports ? proxy_upstream_ports[i] : shard->port;
+
+        shard->upstream = comm_link_new(shard->ctx, proxy_upstream_ip, port,
+                proxy_link_handler, shard);
+        if (!shard->upstream)
+            return 0;
+    }
+
+    stats_create_file("proxy", proxy_stats_show, NULL);
+    return 1;
+}
+
+/* Stop taking messages from the home servers, before the shards stop */
+void proxy_stop(void) {
+    int i;
+
+    for (i = 0; i < shards_local_count(); i++)
+        comm_link_stop(shard_local(i)->upstream);
+}
+
+/* Free the links, once no server thread can forward any more */
+void proxy_exit(void) {
+    int i;
+
+    for (i = 0; i < shards_local_count(); i++) {
+        struct hga_shard *shard = shard_local(i);
+
+        comm_link_exit(shard->upstream);
+        shard->upstream = NULL;
+    }
+}
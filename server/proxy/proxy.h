@@ -0,0 +1,35 @@
+#ifndef HGA_PROXY
+#define HGA_PROXY
+
+#include <linux/types.h>
+#include "../comm/comm.h"
+#include "../shard/shard.h"
+
+/*
+ * Read-serving caching proxy.
+ *
+ * With proxy_upstream_ip set, the module serves a local group of clients
+ * in front of the home servers instead of holding the pages itself. Each
+ * local shard keeps a link to the home server of the same shard (the
+ * shard parameters must match the home cluster) and takes part in it as
+ * a single client node: the home server fans LOCK_READ/RESUME_READ out to
+ * the proxy once, and the proxy fans them out to its own readers. The
+ * home server's egress then grows with the number of proxies rather than
+ * the number of clients.
+ *
+ * Pages read through the proxy are cached with proxy_state PROXY_VALID
+ * and INITIAL_READ is answered locally until the home server invalidates
+ * them. The first read of a page is forwarded and its data arrives with
+ * the RESUME_READ the home server sends back. Writes are passed through:
+ * the writer's REQUEST_WRITE and COMMIT_PAGE are forwarded and the home
+ * server's ALLOW_WRITE is relayed back to it.
+ */
+bool proxy_enabled(void);
+int proxy_start(void);
+void proxy_stop(void);
+void proxy_exit(void);
+
+int proxy_forward(struct hga_shard *shard, comm_opcode_t opcode,
+        pid_t token, unsigned long vaddr, char *pagedata);
+void proxy_note_hit(void);
+#endif
@@ -1,21 +1,209 @@
 #include "server.h"
 
+/*
+ * Start one comm context per local shard. Returns 1, or 0 after stopping
+ * whatever was started.
+ */
 int init_server(void) {
-    struct comm_ctx *ctx = comm_ctx_new();
+    int i;
 
-    if(!ctx)
+    if (!shards_init())
         return 0;
-     
-    attach_handlers(ctx);
+    waitq_init();
+    if (!lease_init())
+        goto fail;
+    mwrite_init();
+    blocks_init();
+    huge_init();
+    readahead_init();
+    home_init();
+    version_init();
 
-    if(!comm_run(ctx))
-        return 0;
+    for (i = 0; i < shards_local_count(); i++) {
+        struct hga_shard *shard = shard_local(i);
+        struct comm_ctx *ctx = comm_ctx_new();
+
+        if (!ctx)
+            goto fail;
+
+        comm_bind_addr(ctx, shard_server_ip(), shard->port);
+        attach_handlers(ctx, shard);
+
+        if (comm_run(ctx) < 0) {
+            printk(KERN_ERR "failed to start shard %d on port %d", shard->id, shard->port);
+            comm_exit(ctx);
+            goto fail;
+        }
+        shard->ctx = ctx;
+    }
+
+    if (!proxy_start()) {
+        printk(KERN_ERR "failed to link to the home servers");
+        goto fail;
+    }
 
     return 1;
+
+fail:
+    exit_server();
+    return 0;
 }
 
-void attach_handlers(struct comm_ctx* ctx) {
-    comm_register_handler(ctx, OPCODE_INITIAL_READ, handle_initial_read, NULL);
+void exit_server(void) {
+    int i;
+
+    proxy_stop();
+    lease_stop();
+    for (i = 0; i < shards_local_count(); i++) {
+        struct hga_shard *shard = shard_local(i);
+
+        comm_exit(shard->ctx);
+        shard->ctx = NULL;
+    }
+    readahead_exit();
+    proxy_exit();
+}
+
+void attach_handlers(struct comm_ctx* ctx, struct hga_shard* shard) {
+    comm_register_handler(ctx, OPCODE_INITIAL_READ, handle_initial_read, shard);
+    comm_register_handler(ctx, OPCODE_INITIAL_READ_RANGE, handle_initial_read_range, shard);
+    comm_register_handler(ctx, OPCODE_REVALIDATE, handle_revalidate, shard);
+    comm_register_handler(ctx, OPCODE_REQUEST_WRITE, handle_request_write, shard);
+    comm_register_handler(ctx, OPCODE_COMMIT_PAGE, handle_commit_page, shard);
+    comm_register_handler(ctx, OPCODE_COMMIT_OWNER, handle_commit_owner, shard);
+    comm_register_handler(ctx, OPCODE_RETURN_LEASE, handle_return_lease, shard);
+    comm_register_handler(ctx, OPCODE_COMMIT_DIFF, handle_commit_diff, shard);
+    comm_register_handler(ctx, OPCODE_COMMIT_CHUNK, handle_commit_chunk, shard);
+    comm_register_handler(ctx, OPCODE_RETURN_HOME, handle_return_home, shard);
+    comm_register_disconnect(ctx, handle_disconnect);
+}
+
+/* Pages handle_disconnect() has to act on, taken a batch at a time */
+#define WAITING_BATCH 16
+
+struct waiting_batch {
+    struct mapped_page *pages[WAITING_BATCH];
+    int n;
+};
+
+static void collect_waiting(void *current_entry, void *found, void *arg) {
+    struct mapped_page *page = current_entry;
+    struct waiting_batch *batch = found;
+
+    if (batch->n == WAITING_BATCH || !shard_owns(arg, page->token, page->pfn))
+        return;
+
+    spin_lock(&page->lock);
+    //a live entry holds the directory's reference, so it can be taken
+    if (!page->dead && !page->locked && page->nr_waiters)
+        batch->pages[batch->n++] = get_mapped_page(page);
+    spin_unlock(&page->lock);
+}
+
+static void collect_lost_writes(void *current_entry, void *found, void *arg) {
+    struct mapped_page *page = current_entry;
+    struct waiting_batch *batch = found;
+
+    if (batch->n == WAITING_BATCH || !shard_owns(arg, page->token, page->pfn))
+        return;
+
+    spin_lock(&page->lock);
+    if (!page->dead && page->writer_lost)
+        batch->pages[batch->n++] = get_mapped_page(page);
+    spin_unlock(&page->lock);
+}
+
+/*
+ * End a write whose writer went away before committing, or the shared
+ * write it was the last writer of. The diffs merged so far go out as
+ * mwrite_release() sends them, to the writers that committed them too.
+ * With nothing merged the readers still have the last committed copy and
+ * are told it is current; a unit is sent whole. Then the page is unlocked
+ * and its queue served.
+ */
+static void finish_lost_write(struct comm_ctx *ctx, struct hga_shard *shard,
+        struct mapped_page *page) {
+    unsigned long vaddr = page->pfn;
+    char *data = NULL;
+    bool spilled;
+    u64 changed = 0;
+
+    spin_lock(&page->lock);
+    if (page->dead || !page->writer_lost) {
+        spin_unlock(&page->lock);
+        return;
+    }
+    if (page->ext) {
+        changed = page->ext->dirty_blocks;
+        page->ext->dirty_blocks = 0;
+    }
+    //pinned, so it cannot be spilled during the fan-out
+    if (changed && page->store)
+        data = pgstore_get(page->store);
+    spilled = changed && page->store && !data;
+    spin_unlock(&page->lock);
+
+    //sent while the page is still locked, like after a commit
+    if (spilled)
+        printk(KERN_ERR "disconnect: merged page spilled before the fan-out");
+    else if (changed)
+        blocks_resume_read(ctx, page, page->token, vaddr, data, changed, -1);
+    else if (!(vaddr & COMM_HUGE_BIT))
+        version_resume_read(ctx, page, page->token, vaddr, -1);
+    else if (page->ext && page->ext->unit)
+        huge_resume_read(ctx, page, page->token, vaddr, -1);
+    else
+        fanout_resume_read(ctx, page, page->token, vaddr, NULL, -1);
+    if (data)
+        pgstore_put(page->store);
+
+    spin_lock(&page->lock);
+    page->writer_lost = false;
+    page->locked = false;
+    page->owner = -1;
+    spin_unlock(&page->lock);
+
+    waitq_serve(ctx, shard, page, page->token, vaddr);
+}
+
+/*
+ * Node IDs are reused by later connections, so a node that went away must
+ * not stay in any reader set. Writes it left unfinished are ended, and the
+ * requests queued behind its pages are served here.
+ */
+void handle_disconnect(struct comm_ctx* ctx, int node) {
+    struct hga_shard *shard = NULL;
+    struct waiting_batch batch;
+    int i;
+
+    drop_client_node(node);
+
+    for (i = 0; i < shards_local_count(); i++) {
+        if (shard_local(i)->ctx == ctx)
+            shard = shard_local(i);
+    }
+    if (!shard)
+        return;
+    readahead_forget(shard, node);
+
+    do {
+        batch.n = 0;
+        foreach_mapped_page(collect_lost_writes, &batch, shard);
+        for (i = 0; i < batch.n; i++) {
+            finish_lost_write(ctx, shard, batch.pages[i]);
+            put_mapped_page(batch.pages[i]);
+        }
+    } while (batch.n == WAITING_BATCH);
+
+    do {
+        batch.n = 0;
+        foreach_mapped_page(collect_waiting, &batch, shard);
+        for (i = 0; i < batch.n; i++) {
+            waitq_serve(ctx, shard, batch.pages[i], batch.pages[i]->token,
+                    batch.pages[i]->pfn);
+            put_mapped_page(batch.pages[i]);
+        }
+    } while (batch.n == WAITING_BATCH);
 }
 
 
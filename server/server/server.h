@@ -10,9 +10,13 @@
 #include "../pgtable/pgtable.h"
 #include "../comm/comm.h"
 #include "../hashtable/hashtable.h"
+#include "../shard/shard.h"
+#include "../proxy/proxy.h"
 #include "../ev_handlers/ev_handlers.h"
 
 int init_server(void);
-void attach_handlers(struct comm_ctx*);
+void exit_server(void);
+void attach_handlers(struct comm_ctx*, struct hga_shard*);
+void handle_disconnect(struct comm_ctx*, int node);
 
 #endif
@@ -0,0 +1,92 @@
+#include <linux/module.h>
+#include "shard.h"
+#include "../stats/stats.h"
+
+static char *server_ip = "0.0.0.0";
+module_param(server_ip, charp, S_IRUGO);
+MODULE_PARM_DESC(server_ip, "Address the shards listen on");
+
+static int server_ports[SHARD_MAX_LOCAL] = { 1324 };
+static int nr_server_ports = 1;
+module_param_array(server_ports, int, &nr_server_ports, S_IRUGO);
+MODULE_PARM_DESC(server_ports, "Port of each local shard");
+
+static int shard_count = 1;
+module_param(shard_count, int, S_IRUGO);
+MODULE_PARM_DESC(shard_count, "Shards in the whole cluster");
+
+static int shard_base = 0;
+module_param(shard_base, int, S_IRUGO);
+MODULE_PARM_DESC(shard_base, "ID of the first local shard");
+
+static struct hga_shard shards[SHARD_MAX_LOCAL];
+
+static int shard_stats_show(struct seq_file *m, void *data) {
+    int i;
+
+    seq_printf(m, "shard_count %d\n", shard_count);
+    for (i = 0; i < nr_server_ports; i++) {
+        seq_printf(m, "shard %d port %d requests %ld misrouted %ld\n",
+                shards[i].id, shards[i].port,
+                atomic_long_read(&shards[i].nr_requests),
+                atomic_long_read(&shards[i].nr_misrouted));
+    }
+    return 0;
+}
+
+/* Returns 1, or 0 if the local shards do not fit the cluster */
+int shards_init(void) {
+    int i;
+
+    if (shard_count < 1 || shard_base < 0
+            || shard_base + nr_server_ports > shard_count) {
+        printk(KERN_ERR "shards %d..%d do not fit in %d shards",
+                shard_base, shard_base + nr_server_ports - 1, shard_count);
+        return 0;
+    }
+
+    for (i = 0; i < nr_server_ports; i++) {
+        shards[i].id = shard_base + i;
+        shards[i].port = server_ports[i];
+        shards[i].ctx = NULL;
+        shards[i].upstream = NULL;
+        shards[i].streams = NULL;
+        shards[i].successors = NULL;
+        atomic_long_set(&shards[i].nr_requests, 0);
+        atomic_long_set(&shards[i].nr_misrouted, 0);
+    }
+
+    stats_create_file("shards", shard_stats_show, NULL);
+    return 1;
+}
+
+int shards_local_count(void) {
+    return nr_server_ports;
+}
+
+struct hga_shard* shard_local(int i) {
+    return &shards[i];
+}
+
+const char* shard_server_ip(void) {
+    return server_ip;
+}
+
+bool shard_owns(struct hga_shard *shard, pid_t token, unsigned long vaddr) {
+    return shard_of(token, vaddr, shard_count) == shard->id;
+}
+
+/*
+ * Account a request on shard and check that it owns the page. A client
+ * with a different shard configuration would otherwise split one page's
+ * state across two instances.
+ */
+bool shard_check(struct hga_shard *shard, pid_t token, unsigned long vaddr) {
+    atomic_long_inc(&shard->nr_requests);
+
+    if (!shard_owns(shard, token, vaddr)) {
+        atomic_long_inc(&shard->nr_misrouted);
+        return false;
+    }
+    return true;
+}
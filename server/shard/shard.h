@@ -0,0 +1,53 @@
+#ifndef HGA_SHARD
+#define HGA_SHARD
+
+#include <linux/jhash.h>
+#include <linux/atomic.h>
+#include <linux/mm.h>
+#include <linux/types.h>
+
+/*
+ * Partitioning of the page space across server instances.
+ *
+ * Pages are grouped into ranges of 1 << SHARD_RANGE_SHIFT pages so that
+ * neighbouring pages share an instance, and every (token, range) hashes to
+ * one of shard_count shards. Clients route requests with the same function
+ * (hga_shard_of() in the client's hga_defs.h); the two must stay in sync.
+ *
+ * A module serves the consecutive shards shard_base, shard_base + 1, ...,
+ * one per port in server_ports, so several instances can be run on one
+ * machine for testing.
+ */
+#define SHARD_RANGE_SHIFT 6
+#define SHARD_MAX_LOCAL 16
+
+struct comm_ctx;
+struct comm_link;
+struct readahead_stream;
+struct readahead_successor;
+
+struct hga_shard {
+    int id;
+    int port;
+    struct comm_ctx *ctx;
+    struct comm_link *upstream; //home server of the shard, when running as a proxy
+    struct readahead_stream *streams; //one per node, see readahead.c
+    struct readahead_successor *successors;
+
+    atomic_long_t nr_requests;
+    atomic_long_t nr_misrouted; //requests for pages of another shard
+};
+
+static inline int shard_of(pid_t token, unsigned long vaddr, int nr_shards) {
+    u32 range = (u32)(vaddr >> (PAGE_SHIFT + SHARD_RANGE_SHIFT));
+
+    return jhash_2words((u32)token, range, 0) % nr_shards;
+}
+
+int shards_init(void);
+int shards_local_count(void);
+struct hga_shard* shard_local(int i);
+const char* shard_server_ip(void);
+bool shard_owns(struct hga_shard *shard, pid_t token, unsigned long vaddr);
+bool shard_check(struct hga_shard *shard, pid_t token, unsigned long vaddr);
+#endif
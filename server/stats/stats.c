@@ -0,0 +1,121 @@
+#include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/fs.h>
+#include <linux/uaccess.h>
+#include "stats.h"
+
+#define STATS_LINE_MAX 128
+
+struct stats_file {
+    struct list_head list;
+    stats_show_t show;
+    stats_write_t write;
+    void *data;
+};
+
+static struct dentry *stats_dir;
+static LIST_HEAD(stats_files);
+
+static int stats_seq_show(struct seq_file *m, void *unused) {
+    struct stats_file *file = m->private;
+    return file->show(m, file->data);
+}
+
+static int stats_open(struct inode *inode, struct file *filp) {
+    return single_open(filp, stats_seq_show, inode->i_private);
+}
+
+static ssize_t stats_write(struct file *filp, const char __user *ubuf,
+        size_t len, loff_t *off) {
+    struct stats_file *file = file_inode(filp)->i_private;
+    char line[STATS_LINE_MAX];
+    int err;
+
+    if (len >= STATS_LINE_MAX)
+        return -EINVAL;
+    if (copy_from_user(line, ubuf, len))
+        return -EFAULT;
+    line[len] = '\0';
+
+    err = file->write(strim(line), file->data);
+    if (err < 0)
+        return err;
+
+    return len;
+}
+
+static const struct file_operations stats_fops = {
+    .owner = THIS_MODULE,
+    .open = stats_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static const struct file_operations stats_ctl_fops = {
+    .owner = THIS_MODULE,
+    .open = stats_open,
+    .read = seq_read,
+    .write = stats_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+int stats_init(void) {
+    stats_dir = debugfs_create_dir("megavm_server", NULL);
+
+    if (IS_ERR_OR_NULL(stats_dir)) {
+        printk(KERN_ERR "failed to create stats directory");
+        stats_dir = NULL;
+        return 0;
+    }
+
+    return 1;
+}
+
+void stats_exit(void) {
+    struct stats_file *file, *tmp;
+
+    debugfs_remove_recursive(stats_dir);
+    stats_dir = NULL;
+
+    list_for_each_entry_safe(file, tmp, &stats_files, list) {
+        list_del(&(file->list));
+        kfree(file);
+    }
+}
+
+static int __stats_create(const char *name, umode_t mode, stats_show_t show,
+        stats_write_t write, void *data, const struct file_operations *fops) {
+    struct stats_file *file;
+
+    /* Stats are best effort, the server runs without debugfs */
+    if (!stats_dir)
+        return 0;
+
+    file = kmalloc(sizeof(*file), GFP_KERNEL);
+    if (!file)
+        return 0;
+
+    file->show = show;
+    file->write = write;
+    file->data = data;
+
+    if (IS_ERR_OR_NULL(debugfs_create_file(name, mode, stats_dir, file, fops))) {
+        kfree(file);
+        return 0;
+    }
+
+    list_add_tail(&(file->list), &stats_files);
+    return 1;
+}
+
+int stats_create_file(const char *name, stats_show_t show, void *data) {
+    return __stats_create(name, S_IRUGO, show, NULL, data, &stats_fops);
+}
+
+int stats_create_ctl_file(const char *name, stats_show_t show,
+        stats_write_t write, void *data) {
+    return __stats_create(name, S_IRUGO | S_IWUSR, show, write, data,
+            &stats_ctl_fops);
+}
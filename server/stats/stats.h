@@ -0,0 +1,22 @@
+#ifndef HGA_STATS
+#define HGA_STATS
+
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+/*
+ * Counters exported under <debugfs>/megavm_server/.
+ * Every subsystem registers one file with a show callback. Control files
+ * additionally accept configuration lines through a write callback.
+ */
+typedef int (*stats_show_t)(struct seq_file *m, void *data);
+/* Gets one NUL-terminated line written to a control file */
+typedef int (*stats_write_t)(char *line, void *data);
+
+int stats_init(void);
+void stats_exit(void);
+int stats_create_file(const char *name, stats_show_t show, void *data);
+int stats_create_ctl_file(const char *name, stats_show_t show,
+        stats_write_t write, void *data);
+
+#endif
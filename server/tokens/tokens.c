@@ -0,0 +1,209 @@
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/rculist.h>
+#include <linux/log2.h>
+#include "tokens.h"
+#include "../comm/comm.h"
+#include "../stats/stats.h"
+
+static unsigned long token_default_max_pages = 0;
+module_param(token_default_max_pages, ulong, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(token_default_max_pages,
+        "Page store limit of a token without its own max_pages (0: unlimited)");
+
+static unsigned int token_default_lease_ms = 0;
+module_param(token_default_lease_ms, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(token_default_lease_ms,
+        "Read lease length of a token without its own lease_ms (0: no leases)");
+
+static unsigned int token_default_block_size = 0;
+module_param(token_default_block_size, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(token_default_block_size,
+        "Coherence block of a token without its own block_size (0: whole pages)");
+
+static DEFINE_HASHTABLE(tokens, TOKEN_HASH_BITS);
+static DEFINE_SPINLOCK(tokens_lock);
+
+static struct hga_token* __token_find(pid_t token) {
+    struct hga_token *tok;
+
+    hash_for_each_possible_rcu(tokens, tok, node, token) {
+        if (tok->token == token)
+            return tok;
+    }
+    return NULL;
+}
+
+struct hga_token* token_find(pid_t token) {
+    struct hga_token *tok;
+
+    rcu_read_lock();
+    tok = __token_find(token);
+    rcu_read_unlock();
+
+    return tok;
+}
+
+/* Find or create the record of a token. Returns NULL on allocation failure */
+struct hga_token* token_get(pid_t token, gfp_t gfp) {
+    struct hga_token *tok, *raced;
+
+    if ((tok = token_find(token)))
+        return tok;
+
+    tok = kzalloc(sizeof(*tok), gfp);
+    if (!tok) {
+        printk(KERN_ERR "failed to make token entry");
+        return NULL;
+    }
+    tok->token = token;
+    atomic_long_set(&tok->nr_pages, 0);
+
+    spin_lock(&tokens_lock);
+    raced = __token_find(token);
+    if (raced) {
+        spin_unlock(&tokens_lock);
+        kfree(tok);
+        return raced;
+    }
+    hash_add_rcu(tokens, &(tok->node), token);
+    spin_unlock(&tokens_lock);
+
+    return tok;
+}
+
+long token_max_pages(struct hga_token *tok) {
+    return tok->max_pages ? tok->max_pages : (long)token_default_max_pages;
+}
+
+/*
+ * Read lease length in milliseconds, 0 if the token's readers are locked
+ * instead. tok may be NULL for a token that has no record yet.
+ */
+unsigned int token_lease_ms(struct hga_token *tok) {
+    if (tok && tok->lease_ms < 0)
+        return 0;
+    return tok && tok->lease_ms ? tok->lease_ms : token_default_lease_ms;
+}
+
+/* Whether the token's pages can have several writers, tok may be NULL */
+bool token_multi_writer(struct hga_token *tok) {
+    return tok && tok->multi_writer;
+}
+
+/* Blocks pages are split into for updates, see struct comm_blocks */
+static bool token_block_valid(long size) {
+    return size >= COMM_MIN_BLOCK && size <= PAGE_SIZE && is_power_of_2(size);
+}
+
+/*
+ * Size of the blocks the token's page updates are tracked in, PAGE_SIZE
+ * if they are sent whole. tok may be NULL.
+ */
+unsigned int token_block_size(struct hga_token *tok) {
+    unsigned int size = tok && tok->block_size ? tok->block_size
+        : token_default_block_size;
+
+    return token_block_valid(size) ? size : PAGE_SIZE;
+}
+
+static int token_set_param(struct hga_token *tok, char *key, char *val) {
+    long num;
+
+    if (kstrtol(val, 0, &num))
+        return -EINVAL;
+
+    if (!strcmp(key, "max_pages")) {
+        if (num < 0)
+            return -EINVAL;
+        tok->max_pages = num;
+        return 0;
+    }
+
+    if (!strcmp(key, "lease_ms")) {
+        if (num < -1 || num > INT_MAX)
+            return -EINVAL;
+        tok->lease_ms = num;
+        return 0;
+    }
+
+    if (!strcmp(key, "multi_writer")) {
+        if (num < 0 || num > 1)
+            return -EINVAL;
+        tok->multi_writer = num;
+        return 0;
+    }
+
+    if (!strcmp(key, "block_size")) {
+        if (num && !token_block_valid(num))
+            return -EINVAL;
+        tok->block_size = num;
+        return 0;
+    }
+
+    return -EINVAL;
+}
+
+/* "<token> key=value ..." */
+static int tokens_ctl_write(char *line, void *data) {
+    struct hga_token *tok;
+    char *field, *val;
+    int token, err;
+
+    field = strsep(&line, " ");
+    if (!field || kstrtoint(field, 0, &token))
+        return -EINVAL;
+
+    if (!(tok = token_get(token, GFP_KERNEL)))
+        return -ENOMEM;
+
+    while ((field = strsep(&line, " "))) {
+        if (!*field)
+            continue;
+        val = strchr(field, '=');
+        if (!val)
+            return -EINVAL;
+        *val++ = '\0';
+        if ((err = token_set_param(tok, field, val)) < 0)
+            return err;
+    }
+
+    return 0;
+}
+
+static int tokens_show(struct seq_file *m, void *data) {
+    struct hga_token *tok;
+    int bkt;
+
+    rcu_read_lock();
+    hash_for_each_rcu(tokens, bkt, tok, node) {
+        seq_printf(m, "%d nr_pages=%ld max_pages=%ld lease_ms=%u multi_writer=%d "
+                "block_size=%u\n", tok->token, atomic_long_read(&tok->nr_pages),
+                token_max_pages(tok), token_lease_ms(tok), tok->multi_writer,
+                token_block_size(tok));
+    }
+    rcu_read_unlock();
+
+    return 0;
+}
+
+int tokens_init(void) {
+    hash_init(tokens);
+    stats_create_ctl_file("tokens", tokens_show, tokens_ctl_write, NULL);
+    return 1;
+}
+
+void tokens_exit(void) {
+    struct hga_token *tok;
+    struct hlist_node *tmp;
+    int bkt;
+
+    /* The server is stopped, only lookups still in flight can remain */
+    synchronize_rcu();
+
+    hash_for_each_safe(tokens, bkt, tmp, tok, node) {
+        hash_del(&(tok->node));
+        kfree(tok);
+    }
+}
@@ -0,0 +1,38 @@
+#ifndef HGA_TOKENS
+#define HGA_TOKENS
+
+#include <linux/hashtable.h>
+#include <linux/atomic.h>
+#include <linux/types.h>
+
+#define TOKEN_HASH_BITS 6
+
+/*
+ * Per-token (shared region) accounting and configuration.
+ *
+ * Tokens are created on first use and live until the module is unloaded,
+ * so a pointer from token_get() stays valid without a reference. Settings
+ * are changed by writing "<token> key=value ..." lines to
+ * <debugfs>/megavm_server/tokens.
+ */
+struct hga_token {
+    struct hlist_node node;
+    pid_t token;
+
+    atomic_long_t nr_pages; //page store pages charged to this token
+    long max_pages; //page store limit, 0 for the module default
+    long lease_ms; //read lease length, 0 for the module default, -1 for none
+    bool multi_writer; //writers share pages and commit diffs, see struct comm_diff_run
+    unsigned int block_size; //coherence block, 0 for the module default
+};
+
+int tokens_init(void);
+void tokens_exit(void);
+
+struct hga_token* token_find(pid_t token);
+struct hga_token* token_get(pid_t token, gfp_t gfp);
+long token_max_pages(struct hga_token *tok);
+unsigned int token_lease_ms(struct hga_token *tok);
+bool token_multi_writer(struct hga_token *tok);
+unsigned int token_block_size(struct hga_token *tok);
+#endif